@@ -156,14 +156,21 @@ static BOOL icsdownctx_object_make_content(icsdownctx_object *pctx)
 	    !pctx->flow_list.record_node(ics_flow_func::progress))
 		return FALSE;
 	if (pctx->sync_flags & (SYNC_ASSOCIATED | SYNC_NORMAL)) {
-		for (uint64_t i_mid : *pctx->pmessages) {
-			auto type = std::find(updated_messages.begin(),
-			            updated_messages.end(), i_mid) !=
-			            updated_messages.end() ?
-			            ics_flow_func::upd_msg_id : ics_flow_func::new_msg_id;
-			if (!pctx->flow_list.record_node(type, i_mid))
-				return FALSE;	
+		/*
+		 * A single flow node for all message changes; get_buffer
+		 * emits them in buffer-sized pages from msg_cursor.
+		 */
+		try {
+			pctx->updated_messages.reserve(updated_messages.count);
+			pctx->updated_messages.insert(updated_messages.begin(), updated_messages.end());
+		} catch (const std::bad_alloc &) {
+			mlog(LV_ERR, "E-1807: ENOMEM");
+			return FALSE;
 		}
+		pctx->msg_cursor = 0;
+		if (pctx->pmessages->count > 0 &&
+		    !pctx->flow_list.record_node(ics_flow_func::msg_changes))
+			return FALSE;
 	}
 	if (!(pctx->sync_flags & SYNC_NO_DELETIONS) &&
 	    !pctx->flow_list.record_node(ics_flow_func::deletions))
@@ -1076,6 +1083,27 @@ static BOOL icsdownctx_object_write_state(icsdownctx_object *pctx)
 	return TRUE;
 }
 
+/*
+ * Emit message changes from msg_cursor onwards until the stream holds more
+ * than @limit bytes; the rest is picked up by the next get_buffer call.
+ */
+static BOOL icsdownctx_object_write_message_changes(icsdownctx_object *pctx,
+    size_t limit, int *ppartial_count)
+{
+	const auto &msgs = *pctx->pmessages;
+	while (pctx->msg_cursor < msgs.count) {
+		pctx->progress_steps = pctx->next_progress_steps;
+		auto mid = msgs.pids[pctx->msg_cursor++];
+		if (!icsdownctx_object_write_message_change(pctx, mid,
+		    pctx->updated_messages.contains(mid) ? TRUE : false,
+		    ppartial_count))
+			return FALSE;
+		if (pctx->pstream->total_length() > limit)
+			break;
+	}
+	return TRUE;
+}
+
 static BOOL icsdownctx_object_get_buffer_internal(icsdownctx_object *pctx,
     void *pbuff, uint16_t *plen, BOOL *pb_last)
 {
@@ -1105,6 +1133,7 @@ static BOOL icsdownctx_object_get_buffer_internal(icsdownctx_object *pctx,
 	partial_count = 0;
 	len1 = *plen - len;
 	size_t funcs_processed = 0;
+	bool b_paused = false;
 	for (auto [func_id, obj_id] : pctx->flow_list) {
 		pctx->progress_steps = pctx->next_progress_steps;
 		switch (func_id) {
@@ -1116,15 +1145,11 @@ static BOOL icsdownctx_object_get_buffer_internal(icsdownctx_object *pctx,
 			if (!pctx->pstream->write_progresstotal(pctx->pprogtotal))
 				return FALSE;
 			break;
-		case ics_flow_func::upd_msg_id:
-			if (!icsdownctx_object_write_message_change(pctx,
-			    obj_id, TRUE, &partial_count))
-				return FALSE;
-			break;
-		case ics_flow_func::new_msg_id:
-			if (!icsdownctx_object_write_message_change(pctx,
-			    obj_id, FALSE, &partial_count))
+		case ics_flow_func::msg_changes:
+			if (!icsdownctx_object_write_message_changes(pctx,
+			    len1, &partial_count))
 				return FALSE;
+			b_paused = pctx->msg_cursor < pctx->pmessages->count;
 			break;
 		case ics_flow_func::deletions:
 			if (!icsdownctx_object_write_deletions(pctx))
@@ -1141,6 +1166,8 @@ static BOOL icsdownctx_object_get_buffer_internal(icsdownctx_object *pctx,
 		default:
 			return FALSE;
 		}
+		if (b_paused)
+			break;
 		++funcs_processed;
 		if (pctx->pstream->total_length() > len1)
 			break;
@@ -2,6 +2,7 @@
 #include <cstdint>
 #include <memory>
 #include <string>
+#include <unordered_set>
 #include <vector>
 #include <gromox/element_data.hpp>
 #include <gromox/mapi_types.hpp>
@@ -14,8 +15,7 @@ struct logon_object;
 enum class ics_flow_func : uint8_t {
 	immed32,
 	progress,
-	upd_msg_id,
-	new_msg_id,
+	msg_changes,
 	deletions,
 	read_state_chg,
 	state,
@@ -59,6 +59,8 @@ struct icsdownctx_object final {
 	EID_ARRAY *pmessages = nullptr, *pdeleted_messages = nullptr;
 	EID_ARRAY *pnolonger_messages = nullptr, *pread_messages = nullptr;
 	EID_ARRAY *punread_messages = nullptr;
+	std::unordered_set<uint64_t> updated_messages; /* subset of pmessages */
+	uint32_t msg_cursor = 0; /* next pmessages entry to emit */
 	uint8_t send_options = 0;
 	uint16_t sync_flags = 0;
 	uint32_t extra_flags = 0, divisor = 1;
@@ -0,0 +1,124 @@
+// SPDX-License-Identifier: GPL-2.0-only WITH linking exception
+// SPDX-FileCopyrightText: 2025 grommunio GmbH
+// This file is part of Gromox.
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <libHX/io.h>
+#include <libHX/scope.hpp>
+#include <libHX/string.h>
+#include <gromox/defs.h>
+#include <gromox/util.hpp>
+#include "cidpool.hpp"
+
+using namespace std::string_literals;
+using namespace gromox;
+
+static constexpr unsigned int BLOCKUNIT = 512;
+
+/**
+ * Only SHA3 ("S-") objects may be shared between stores. The XXH3 ("Y-")
+ * names are not collision-resistant; a user who can craft a colliding
+ * attachment could otherwise have it substituted for another mailbox's
+ * content.
+ */
+bool cidpool_eligible(std::string_view cid)
+{
+	return cid.size() > 2 && cid[0] == 'S' && cid[1] == '-';
+}
+
+/**
+ * Hardlink @cid from the pool to @path. Returns false if the pool does not
+ * have it (or cannot provide it, e.g. EXDEV), in which case the caller
+ * should write its own copy.
+ */
+bool cidpool_take(const std::string &pool, const std::string &cid,
+    const std::string &path)
+{
+	if (pool.empty() || !cidpool_eligible(cid))
+		return false;
+	auto pool_path = pool + "/" + cid;
+	struct stat sb;
+	if (stat(pool_path.c_str(), &sb) != 0 || sb.st_size == 0)
+		return false;
+	/* e.g. EXDEV, ENOENT (reclaimed meanwhile) make us fail */
+	return link(pool_path.c_str(), path.c_str()) == 0 || errno == EEXIST;
+}
+
+/* Publish a freshly written content file @path as @cid in the pool. */
+void cidpool_give(const std::string &pool, const std::string &cid,
+    const std::string &path)
+{
+	if (pool.empty() || !cidpool_eligible(cid))
+		return;
+	auto pool_path = pool + "/" + cid;
+	std::unique_ptr<char[], stdlib_delete> dir(HX_dirname(pool_path.c_str()));
+	if (dir == nullptr ||
+	    HX_mkdir(dir.get(), FMODE_PRIVATE | S_IXUSR | S_IXGRP) < 0)
+		return;
+	if (link(path.c_str(), pool_path.c_str()) != 0 && errno != EEXIST)
+		mlog(LV_DEBUG, "D-1803: link %s -> %s: %s", path.c_str(),
+			pool_path.c_str(), strerror(errno));
+}
+
+static int cidpool_walk1(const std::string &dir, bool gc, bool dry_run,
+    cidpool_stat &st, unsigned int depth)
+{
+	auto dh = HXdir_open(dir.c_str());
+	if (dh == nullptr) {
+		mlog(LV_ERR, "%s: %s", dir.c_str(), strerror(errno));
+		return -errno;
+	}
+	auto cl_0 = HX::make_scope_exit([&]() { HXdir_close(dh); });
+	const char *de;
+	while ((de = HXdir_read(dh)) != nullptr) {
+		if (*de == '.')
+			continue;
+		auto path = dir + "/"s + de;
+		struct stat sb;
+		if (lstat(path.c_str(), &sb) != 0)
+			continue;
+		if (S_ISDIR(sb.st_mode)) {
+			if (depth > 0)
+				continue;
+			auto ret = cidpool_walk1(path, gc, dry_run, st, depth + 1);
+			if (ret < 0)
+				return ret;
+			continue;
+		} else if (!S_ISREG(sb.st_mode)) {
+			continue;
+		}
+		if (sb.st_nlink <= 1) {
+			++st.orphans;
+			st.orphan_size += sb.st_blocks * BLOCKUNIT;
+			if (!gc || dry_run)
+				continue;
+			if (unlink(path.c_str()) != 0) {
+				mlog(LV_ERR, "unlink %s: %s", path.c_str(), strerror(errno));
+				continue;
+			}
+			++st.reclaimed;
+			continue;
+		}
+		++st.objects;
+		st.refs       += sb.st_nlink - 1;
+		st.stored     += sb.st_size;
+		st.stored_pad += sb.st_blocks * BLOCKUNIT;
+		st.logical    += static_cast<unsigned long long>(sb.st_size) * (sb.st_nlink - 1);
+	}
+	return 0;
+}
+
+/**
+ * Gather statistics over the pool, and with @gc, delete objects that no
+ * store references anymore (link count 1).
+ */
+int cidpool_walk(const std::string &pool, bool gc, bool dry_run, cidpool_stat &st)
+{
+	return cidpool_walk1(pool, gc, dry_run, st, 0);
+}
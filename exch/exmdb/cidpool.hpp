@@ -0,0 +1,19 @@
+#pragma once
+#include <string>
+#include <string_view>
+
+/*
+ * Server-wide content file pool. It is laid out like the cid/ directories
+ * of stores ("S-xx/<hash>"), and every store referencing an object holds
+ * one more hardlink to it.
+ */
+struct cidpool_stat {
+	unsigned long long objects = 0, refs = 0, orphans = 0, reclaimed = 0;
+	/* bytes on disk (once), bytes as seen by all stores, orphan bytes */
+	unsigned long long stored = 0, stored_pad = 0, logical = 0, orphan_size = 0;
+};
+
+extern bool cidpool_eligible(std::string_view cid);
+extern bool cidpool_take(const std::string &pool, const std::string &cid, const std::string &path);
+extern void cidpool_give(const std::string &pool, const std::string &cid, const std::string &path);
+extern int cidpool_walk(const std::string &pool, bool gc, bool dry_run, cidpool_stat &);
@@ -5,6 +5,7 @@
 #	include "config.h"
 #endif
 #include <algorithm>
+#include <array>
 #include <atomic>
 #include <cassert>
 #include <cerrno>
@@ -49,6 +50,7 @@
 #include <gromox/textmaps.hpp>
 #include <gromox/usercvt.hpp>
 #include <gromox/util.hpp>
+#include "cidpool.hpp"
 #include "db_engine.hpp"
 #define S2A(x) reinterpret_cast<const char *>(x)
 
@@ -93,6 +95,7 @@ thread_local unsigned int g_inside_flush_instance;
 thread_local sqlite3 *g_sqlite_for_oxcmail;
 unsigned int g_max_rule_num, g_max_extrule_num;
 unsigned int g_cid_compression = 0; /* disabled(0), specific_level(n) */
+std::string g_cid_pool; /* server-wide content file pool, or empty */
 
 decltype(common_util_get_handle) common_util_get_handle;
 decltype(ems_send_mail) ems_send_mail;
@@ -2073,6 +2076,79 @@ static GP_RESULT gp_msgprop_synth(uint64_t msgid, uint32_t proptag,
 	return GP_UNHANDLED;
 }
 
+namespace {
+struct gp_special {
+	proptag_t tag;
+	/* message_properties is consulted, and the value synthesized if absent */
+	bool stored;
+};
+}
+
+/*
+ * Message properties whose value does not (only) come from their
+ * message_properties row: either produced by gp_msgprop, or synthesized by
+ * gp_msgprop_synth (and cu_eval_msg_restriction) when there is no row.
+ * Must be kept in sync with those functions.
+ */
+static constexpr gp_special gp_msgprop_special[] = {
+	{PR_STORE_RECORD_KEY}, {PR_ENTRYID}, {PR_PARENT_ENTRYID},
+	{PidTagFolderId}, {PidTagParentFolderId}, {PR_INSTANCE_SVREID},
+	{PR_PARENT_DISPLAY}, {PR_PARENT_DISPLAY_A}, {PR_MESSAGE_SIZE},
+	{PR_ASSOCIATED}, {PidTagChangeNumber}, {PR_READ},
+	{PR_HAS_NAMED_PROPERTIES}, {PR_HASATTACH}, {PidTagMid},
+	{PR_MESSAGE_FLAGS}, {PR_SUBJECT}, {PR_SUBJECT_A},
+	{PR_DISPLAY_TO}, {PR_DISPLAY_CC}, {PR_DISPLAY_BCC},
+	{PR_DISPLAY_TO_A}, {PR_DISPLAY_CC_A}, {PR_DISPLAY_BCC_A},
+	{PR_BODY}, {PR_BODY_A}, {PR_TRANSPORT_MESSAGE_HEADERS},
+	{PR_TRANSPORT_MESSAGE_HEADERS_A}, {PR_HTML}, {PR_RTF_COMPRESSED},
+	{PidTagMidString},
+	{PR_PARENT_SVREID, true}, {PR_MESSAGE_CLASS, true},
+	{PR_MESSAGE_CLASS_A, true}, {PR_SENDER_ADDRTYPE, true},
+	{PR_SENDER_ADDRTYPE_A, true}, {PR_SENT_REPRESENTING_ADDRTYPE, true},
+	{PR_SENT_REPRESENTING_ADDRTYPE_A, true}, {PR_ANR, true},
+	{PR_ANR_A, true},
+};
+
+static const gp_special *gp_msgprop_find(proptag_t tag)
+{
+	auto it = std::find_if(std::cbegin(gp_msgprop_special), std::cend(gp_msgprop_special),
+	          [&](const gp_special &e) { return e.tag == tag; });
+	return it != std::cend(gp_msgprop_special) ? it : nullptr;
+}
+
+static bool gp_msgprop_typed(proptag_t tag)
+{
+	switch (PROP_TYPE(tag)) {
+	case PT_UNSPECIFIED:
+	case PT_OBJECT:
+	case PT_MV_STRING8:
+		return true;
+	}
+	return false;
+}
+
+/**
+ * Whether gp_msgprop/gp_msgprop_synth (or cu_eval_msg_restriction) produce
+ * the value of @tag from something other than its message_properties row.
+ */
+static bool gp_msgprop_computed(proptag_t tag)
+{
+	return gp_msgprop_typed(tag) || gp_msgprop_find(tag) != nullptr;
+}
+
+/**
+ * Whether cu_get_property takes the value of @tag from message_properties
+ * (and gp_fallbackprop if there is no row), i.e. gp_msgprop does not handle
+ * it.
+ */
+static bool gp_msgprop_stored(proptag_t tag)
+{
+	if (gp_msgprop_typed(tag))
+		return false;
+	auto e = gp_msgprop_find(tag);
+	return e == nullptr || e->stored;
+}
+
 static GP_RESULT gp_rcptprop_synth(uint32_t proptag, TAGGED_PROPVAL &pv)
 {
 	switch (proptag) {
@@ -2883,8 +2959,11 @@ fhash::fhash(const std::string_view data)
 	 * This semi-constant global is here so that the SHA3 version always
 	 * gets a compile check at least without triggering any
 	 * unused-branch warning from compilers or static analyzers.
+	 *
+	 * With a content file pool, objects are shared across stores, and
+	 * only a collision-resistant name is acceptable then.
 	 */
-	if (g_cid_use_xxhash) {
+	if (g_cid_use_xxhash && g_cid_pool.empty()) {
 #ifdef HAVE_XXHASH
 		XXH128_canonical_t canon;
 		XXH128_canonicalFromHash(&canon, XXH3_128bits(data.data(), data.size()));
@@ -2950,6 +3029,15 @@ static errno_t cu_cid_writeout(const char *maildir, std::string_view data,
 		return 0;
 	check_fd.close_rd();
 
+	/*
+	 * The pool holds one hardlink to every content file of all stores on
+	 * the same filesystem, so st_nlink-1 is the number of stores using
+	 * the object. Objects with nlink==1 are reclaimed by gromox-cidpool.
+	 * Only SHA3-named objects take part (see cidpool_eligible).
+	 */
+	if (cidpool_take(g_cid_pool, cid, path))
+		return 0;
+
 	gromox::tmpfile tmf;
 	ret = tmf.open_linkable(maildir, O_RDWR | O_TRUNC);
 	if (ret < 0) {
@@ -2977,10 +3065,13 @@ static errno_t cu_cid_writeout(const char *maildir, std::string_view data,
 	 * instantiated @paths.
 	 */
 	err = tmf.link_to(path.c_str());
-	if (err != 0)
+	if (err != 0) {
 		mlog(LV_ERR, "E-5320: link %s -> %s: %s", tmf.m_path.c_str(),
 			path.c_str(), strerror(err));
-	return err;
+		return err;
+	}
+	cidpool_give(g_cid_pool, cid, path);
+	return 0;
 } catch (const std::bad_alloc &) {
 	mlog(LV_ERR, "E-2065: ENOMEM");
 	return ENOMEM;
@@ -4544,6 +4635,573 @@ bool cu_eval_msg_restriction(sqlite3 *psqlite,
 	return FALSE;
 }
 
+namespace {
+
+/* Scratch state for one msg_column_set::load call */
+struct msgcol_loader {
+	msgcol_loader(sqlite3 *d, cpid_t c, std::span<const uint64_t> m) :
+		db(d), cpid(c), mids(m)
+	{}
+	void init();
+	bool need_rows();
+	bool need_attach();
+	bool need_read();
+	bool computed(proptag_t, std::vector<void *> &, bool &handled);
+	bool stored(proptag_t, std::vector<void *> &);
+	bool subject(proptag_t, std::vector<void *> &);
+	bool flags(std::vector<void *> &);
+	bool single(proptag_t, std::vector<void *> &);
+	bool is_first(size_t i) const { return first[i] == i; }
+
+	struct msgrow {
+		uint64_t parent_fid = 0, size = 0, cn = 0;
+		bool found = false, assoc = false, read = false, attach = false;
+	};
+	sqlite3 *db = nullptr;
+	cpid_t cpid{};
+	std::span<const uint64_t> mids;
+	/* Index of the first occurrence of mids[i] */
+	std::vector<size_t> first;
+	std::unordered_map<uint64_t, size_t> pos;
+	std::string idlist;
+	std::vector<msgrow> rows;
+	bool have_rows = false, have_attach = false, have_read = false;
+};
+
+}
+
+void msgcol_loader::init()
+{
+	first.resize(mids.size());
+	pos.reserve(mids.size());
+	for (size_t i = 0; i < mids.size(); ++i) {
+		auto [it, added] = pos.emplace(mids[i], i);
+		first[i] = it->second;
+		if (!added)
+			continue;
+		if (!idlist.empty())
+			idlist += ',';
+		idlist += std::to_string(mids[i]);
+	}
+	rows.resize(mids.size());
+}
+
+bool msgcol_loader::need_rows()
+{
+	if (have_rows)
+		return true;
+	auto stm = gx_sql_prep(db, ("SELECT message_id, parent_fid, is_associated,"
+	           " message_size, change_number, read_state FROM messages"
+	           " WHERE message_id IN (" + idlist + ")").c_str());
+	if (stm == nullptr)
+		return false;
+	while (stm.step() == SQLITE_ROW) {
+		auto it = pos.find(stm.col_uint64(0));
+		if (it == pos.end())
+			continue;
+		auto &r = rows[it->second];
+		r.found      = true;
+		r.parent_fid = stm.col_uint64(1);
+		r.assoc      = stm.col_int64(2) != 0;
+		r.size       = stm.col_uint64(3);
+		r.cn         = stm.col_uint64(4);
+		if (exmdb_server::is_private())
+			r.read = stm.col_int64(5) != 0;
+	}
+	have_rows = true;
+	return true;
+}
+
+bool msgcol_loader::need_attach()
+{
+	if (have_attach)
+		return true;
+	auto stm = gx_sql_prep(db, ("SELECT DISTINCT message_id FROM attachments"
+	           " WHERE message_id IN (" + idlist + ")").c_str());
+	if (stm == nullptr)
+		return false;
+	while (stm.step() == SQLITE_ROW) {
+		auto it = pos.find(stm.col_uint64(0));
+		if (it != pos.end())
+			rows[it->second].attach = true;
+	}
+	have_attach = true;
+	return true;
+}
+
+/* cf. common_util_check_message_read */
+bool msgcol_loader::need_read()
+{
+	if (have_read)
+		return true;
+	if (exmdb_server::is_private()) {
+		if (!need_rows())
+			return false;
+		have_read = true;
+		return true;
+	}
+	auto username = exmdb_pf_read_per_user ? exmdb_server::get_public_username() : "";
+	if (username != nullptr) {
+		auto stm = gx_sql_prep(db, ("SELECT message_id FROM read_states"
+		           " WHERE username=? AND message_id IN (" + idlist + ")").c_str());
+		if (stm == nullptr)
+			return false;
+		stm.bind_text(1, username);
+		while (stm.step() == SQLITE_ROW) {
+			auto it = pos.find(stm.col_uint64(0));
+			if (it != pos.end())
+				rows[it->second].read = true;
+		}
+	}
+	have_read = true;
+	return true;
+}
+
+/**
+ * Set-based variants of the gp_msgprop cases that are commonly requested in
+ * content tables. @handled is cleared for everything else.
+ */
+bool msgcol_loader::computed(proptag_t tag, std::vector<void *> &col,
+    bool &handled)
+{
+	handled = true;
+	switch (tag) {
+	case PR_MESSAGE_SIZE:
+	case PR_ASSOCIATED:
+	case PidTagChangeNumber:
+	case PidTagFolderId:
+	case PidTagParentFolderId:
+	case PR_INSTANCE_SVREID:
+		if (!need_rows())
+			return false;
+		break;
+	case PR_READ:
+		if (!need_read())
+			return false;
+		break;
+	case PR_HASATTACH:
+		if (!need_attach())
+			return false;
+		break;
+	case PidTagMid:
+		break;
+	case PR_MESSAGE_FLAGS:
+		return flags(col);
+	case PR_SUBJECT:
+	case PR_SUBJECT_A:
+		return subject(tag, col);
+	default:
+		handled = false;
+		return true;
+	}
+	for (size_t i = 0; i < mids.size(); ++i) {
+		if (!is_first(i))
+			continue;
+		auto &r = rows[i];
+		switch (tag) {
+		case PR_MESSAGE_SIZE: {
+			auto v = cu_alloc<uint32_t>();
+			if (v == nullptr)
+				return false;
+			*v = r.size;
+			col[i] = v;
+			break;
+		}
+		case PR_ASSOCIATED:
+		case PR_READ:
+		case PR_HASATTACH: {
+			auto v = cu_alloc<uint8_t>();
+			if (v == nullptr)
+				return false;
+			*v = tag == PR_ASSOCIATED ? r.assoc :
+			     tag == PR_HASATTACH ? r.attach :
+			     exmdb_pf_read_states == 0 && !exmdb_server::is_private() ?
+			     true : r.read;
+			col[i] = v;
+			break;
+		}
+		case PidTagChangeNumber:
+		case PidTagMid: {
+			auto v = cu_alloc<uint64_t>();
+			if (v == nullptr)
+				return false;
+			if (tag == PidTagMid)
+				*v = rop_util_make_eid_ex(1, mids[i]);
+			else if (r.found)
+				*v = rop_util_make_eid_ex(1, r.cn);
+			else
+				*v = 0;
+			col[i] = v;
+			break;
+		}
+		case PidTagFolderId:
+		case PidTagParentFolderId: {
+			if (r.parent_fid == 0)
+				return false;
+			auto v = cu_alloc<uint64_t>();
+			if (v == nullptr)
+				return false;
+			*v = rop_util_make_eid_ex(1, r.parent_fid);
+			col[i] = v;
+			break;
+		}
+		case PR_INSTANCE_SVREID: {
+			if (r.parent_fid == 0)
+				return false;
+			auto se = cu_alloc<SVREID>();
+			if (se == nullptr)
+				return false;
+			se->pbin = nullptr;
+			se->folder_id = rop_util_make_eid_ex(1, r.parent_fid);
+			se->message_id = rop_util_make_eid_ex(1, mids[i]);
+			se->instance = 0;
+			col[i] = se;
+			break;
+		}
+		}
+	}
+	return true;
+}
+
+/* cf. common_util_get_message_flags and gp_msgprop */
+bool msgcol_loader::flags(std::vector<void *> &col)
+{
+	if (!need_rows() || !need_read() || !need_attach())
+		return false;
+	std::vector<uint32_t> mf(mids.size());
+	auto stm = gx_sql_prep(db, ("SELECT message_id, proptag, propval"
+	           " FROM message_properties WHERE proptag IN (?,?,?)"
+	           " AND message_id IN (" + idlist + ")").c_str());
+	if (stm == nullptr)
+		return false;
+	stm.bind_int64(1, PR_MESSAGE_FLAGS);
+	stm.bind_int64(2, PR_READ_RECEIPT_REQUESTED);
+	stm.bind_int64(3, PR_NON_RECEIPT_NOTIFICATION_REQUESTED);
+	while (stm.step() == SQLITE_ROW) {
+		auto it = pos.find(stm.col_uint64(0));
+		if (it == pos.end())
+			continue;
+		auto &f = mf[it->second];
+		switch (stm.col_uint64(1)) {
+		case PR_MESSAGE_FLAGS:
+			f |= stm.col_uint64(2) & ~(MSGFLAG_READ | MSGFLAG_HASATTACH |
+			     MSGFLAG_FROMME | MSGFLAG_ASSOCIATED |
+			     MSGFLAG_RN_PENDING | MSGFLAG_NRN_PENDING);
+			break;
+		case PR_READ_RECEIPT_REQUESTED:
+			if (stm.col_int64(2) != 0)
+				f |= MSGFLAG_RN_PENDING;
+			break;
+		case PR_NON_RECEIPT_NOTIFICATION_REQUESTED:
+			if (stm.col_int64(2) != 0)
+				f |= MSGFLAG_NRN_PENDING;
+			break;
+		}
+	}
+	for (size_t i = 0; i < mids.size(); ++i) {
+		if (!is_first(i))
+			continue;
+		auto v = cu_alloc<uint32_t>();
+		if (v == nullptr)
+			return false;
+		*v = mf[i];
+		if (rows[i].read || (exmdb_pf_read_states == 0 && !exmdb_server::is_private()))
+			*v |= MSGFLAG_READ;
+		if (rows[i].attach)
+			*v |= MSGFLAG_HASATTACH;
+		if (rows[i].assoc)
+			*v |= MSGFLAG_ASSOCIATED;
+		col[i] = v;
+	}
+	return true;
+}
+
+/* cf. common_util_get_message_subject */
+bool msgcol_loader::subject(proptag_t tag, std::vector<void *> &col)
+{
+	/* [0]=normalized subject, [1]=prefix; W variants take precedence */
+	std::vector<std::array<const char *, 2>> part(mids.size());
+	std::vector<std::array<bool, 2>> wide(mids.size());
+	auto stm = gx_sql_prep(db, ("SELECT message_id, proptag, propval"
+	           " FROM message_properties WHERE proptag IN (?,?,?,?)"
+	           " AND message_id IN (" + idlist + ")").c_str());
+	if (stm == nullptr)
+		return false;
+	stm.bind_int64(1, PR_NORMALIZED_SUBJECT);
+	stm.bind_int64(2, PR_NORMALIZED_SUBJECT_A);
+	stm.bind_int64(3, PR_SUBJECT_PREFIX);
+	stm.bind_int64(4, PR_SUBJECT_PREFIX_A);
+	while (stm.step() == SQLITE_ROW) {
+		auto it = pos.find(stm.col_uint64(0));
+		if (it == pos.end())
+			continue;
+		auto ptag = stm.col_uint64(1);
+		unsigned int k = PROP_ID(ptag) == PROP_ID(PR_NORMALIZED_SUBJECT) ? 0 : 1;
+		bool w = PROP_TYPE(ptag) == PT_UNICODE;
+		auto idx = it->second;
+		if (wide[idx][k] || (!w && part[idx][k] != nullptr))
+			continue;
+		auto s = znul(stm.col_text(2));
+		auto v = w ? common_util_dup(s) : common_util_convert_copy(TRUE, cpid, s);
+		if (v == nullptr && w)
+			return false;
+		part[idx][k] = v;
+		wide[idx][k] = w;
+	}
+	for (size_t i = 0; i < mids.size(); ++i) {
+		if (!is_first(i))
+			continue;
+		auto norm = znul(part[i][0]), prefix = znul(part[i][1]);
+		auto v = cu_alloc<char>(strlen(norm) + strlen(prefix) + 1);
+		if (v == nullptr)
+			return false;
+		strcpy(v, prefix);
+		strcat(v, norm);
+		col[i] = PROP_TYPE(tag) == PT_UNICODE ? common_util_dup(v) :
+		         common_util_convert_copy(false, cpid, v);
+	}
+	return true;
+}
+
+/**
+ * Stored properties: one statement for all messages, then gp_fallbackprop
+ * for those which do not have a row.
+ */
+bool msgcol_loader::stored(proptag_t tag, std::vector<void *> &col)
+{
+	auto proptype = PROP_TYPE(tag);
+	bool anystr = proptype == PT_STRING8 || proptype == PT_UNICODE;
+	/*
+	 * Column layout follows gp_prepare_anystr/gp_prepare_default, so
+	 * that gp_fetch can be used; message_id goes last.
+	 */
+	auto stm = gx_sql_prep(db, anystr ?
+	           ("SELECT proptag, propval, message_id FROM message_properties "
+	           "WHERE proptag IN (?,?) AND message_id IN (" + idlist + ")").c_str() :
+	           ("SELECT propval, message_id FROM message_properties "
+	           "WHERE proptag=? AND message_id IN (" + idlist + ")").c_str());
+	if (stm == nullptr)
+		return false;
+	if (anystr) {
+		stm.bind_int64(1, CHANGE_PROP_TYPE(tag, PT_UNICODE));
+		stm.bind_int64(2, CHANGE_PROP_TYPE(tag, PT_STRING8));
+	} else {
+		stm.bind_int64(1, tag);
+	}
+	unsigned int midcol = anystr ? 2 : 1;
+	std::vector<bool> seen(mids.size());
+	while (stm.step() == SQLITE_ROW) {
+		auto it = pos.find(stm.col_uint64(midcol));
+		if (it == pos.end() || seen[it->second])
+			continue;
+		seen[it->second] = true;
+		auto gpr = GP_ERR;
+		auto pvalue = gp_fetch(db, stm, proptype, cpid, gpr);
+		if (pvalue == nullptr && gpr == GP_ERR)
+			return false;
+		col[it->second] = pvalue;
+	}
+	for (size_t i = 0; i < mids.size(); ++i) {
+		if (!is_first(i) || seen[i])
+			continue;
+		TAGGED_PROPVAL pv{};
+		auto ret = gp_fallbackprop(MAPI_MESSAGE, mids[i], tag, pv, db);
+		if (ret == GP_ERR)
+			return false;
+		if (ret == GP_ADV)
+			col[i] = pv.pvalue;
+	}
+	return true;
+}
+
+/* Everything else is still obtained message by message. */
+bool msgcol_loader::single(proptag_t tag, std::vector<void *> &col)
+{
+	for (size_t i = 0; i < mids.size(); ++i)
+		if (is_first(i) &&
+		    !cu_get_property(MAPI_MESSAGE, mids[i], cpid, db, tag, &col[i]))
+			return false;
+	return true;
+}
+
+/**
+ * Load @tags for all of @mids. @mids may contain duplicates (e.g. multiple
+ * instances of one message in a content table).
+ */
+bool msg_column_set::load(sqlite3 *psqlite, cpid_t cpid,
+    std::span<const uint64_t> mids, std::span<const proptag_t> tags) try
+{
+	m_cols.clear();
+	if (mids.empty() || tags.empty())
+		return true;
+	msgcol_loader ld(psqlite, cpid, mids);
+	ld.init();
+	for (auto tag : tags) {
+		if (m_cols.contains(tag))
+			continue;
+		auto &col = m_cols[tag];
+		col.assign(mids.size(), nullptr);
+		bool handled = false;
+		if (!ld.computed(tag, col, handled))
+			return false;
+		if (!handled && !(gp_msgprop_stored(tag) ?
+		    ld.stored(tag, col) : ld.single(tag, col)))
+			return false;
+		for (size_t i = 0; i < mids.size(); ++i)
+			if (!ld.is_first(i))
+				col[i] = col[ld.first[i]];
+	}
+	return true;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-1711: ENOMEM");
+	return false;
+}
+
+void *msg_column_set::get(proptag_t tag, size_t idx) const
+{
+	auto it = m_cols.find(tag);
+	return it != m_cols.end() ? it->second[idx] : nullptr;
+}
+
+msg_restriction_plan::msg_restriction_plan(const RESTRICTION *res) :
+	m_res(res)
+{
+	if (res != nullptr)
+		compile(res);
+}
+
+void msg_restriction_plan::compile(const RESTRICTION *pres)
+{
+	auto want = [&](proptag_t tag) {
+		if (gp_msgprop_computed(tag) ||
+		    std::find(m_tags.cbegin(), m_tags.cend(), tag) != m_tags.cend())
+			return;
+		m_tags.push_back(tag);
+	};
+	switch (pres->rt) {
+	case RES_AND:
+	case RES_OR:
+		for (size_t i = 0; i < pres->andor->count; ++i)
+			compile(&pres->andor->pres[i]);
+		break;
+	case RES_NOT:
+		compile(&pres->xnot->res);
+		break;
+	case RES_CONTENT:
+		want(pres->cont->proptag);
+		break;
+	case RES_PROPERTY:
+		want(pres->prop->proptag);
+		break;
+	case RES_PROPCOMPARE:
+		want(pres->pcmp->proptag1);
+		want(pres->pcmp->proptag2);
+		break;
+	case RES_BITMASK:
+		want(pres->bm->proptag);
+		break;
+	case RES_SIZE:
+		want(pres->size->proptag);
+		break;
+	case RES_EXIST:
+		want(pres->exist->proptag);
+		break;
+	case RES_COMMENT:
+	case RES_ANNOTATION:
+		if (pres->comment->pres != nullptr)
+			compile(pres->comment->pres);
+		break;
+	default:
+		/* RES_SUBRESTRICTION, RES_COUNT: evaluated per message */
+		break;
+	}
+}
+
+/**
+ * Mirror of cu_eval_msg_restriction, except that the leaves take their
+ * values from the preloaded columns where possible.
+ */
+bool msg_restriction_plan::eval(sqlite3 *psqlite, cpid_t cpid,
+    const RESTRICTION *pres, size_t idx, uint64_t mid) const
+{
+	auto have = [&](proptag_t tag) { return m_cols.contains(tag); };
+	auto column = [&](proptag_t tag, size_t i) { return m_cols.get(tag, i); };
+	switch (pres->rt) {
+	case RES_OR:
+		for (size_t i = 0; i < pres->andor->count; ++i)
+			if (eval(psqlite, cpid, &pres->andor->pres[i], idx, mid))
+				return true;
+		return false;
+	case RES_AND:
+		for (size_t i = 0; i < pres->andor->count; ++i)
+			if (!eval(psqlite, cpid, &pres->andor->pres[i], idx, mid))
+				return false;
+		return true;
+	case RES_NOT:
+		return !eval(psqlite, cpid, &pres->xnot->res, idx, mid);
+	case RES_CONTENT:
+		if (!have(pres->cont->proptag))
+			break;
+		if (!pres->cont->comparable())
+			return false;
+		return pres->cont->eval(column(pres->cont->proptag, idx));
+	case RES_PROPERTY:
+		if (!have(pres->prop->proptag))
+			break;
+		if (!pres->prop->comparable())
+			return false;
+		return pres->prop->eval(column(pres->prop->proptag, idx));
+	case RES_PROPCOMPARE: {
+		auto rprop = pres->pcmp;
+		if (!have(rprop->proptag1) || !have(rprop->proptag2))
+			break;
+		if (!rprop->comparable())
+			return false;
+		return propval_compare_relop_nullok(rprop->relop,
+		       PROP_TYPE(rprop->proptag1), column(rprop->proptag1, idx),
+		       column(rprop->proptag2, idx));
+	}
+	case RES_BITMASK:
+		if (!have(pres->bm->proptag))
+			break;
+		if (!pres->bm->comparable())
+			return false;
+		return pres->bm->eval(column(pres->bm->proptag, idx));
+	case RES_SIZE:
+		if (!have(pres->size->proptag))
+			break;
+		return pres->size->eval(column(pres->size->proptag, idx));
+	case RES_EXIST:
+		if (!have(pres->exist->proptag))
+			break;
+		return column(pres->exist->proptag, idx) != nullptr;
+	case RES_COMMENT:
+	case RES_ANNOTATION:
+		if (pres->comment->pres == nullptr)
+			return true;
+		return eval(psqlite, cpid, pres->comment->pres, idx, mid);
+	default:
+		break;
+	}
+	return cu_eval_msg_restriction(psqlite, cpid, mid, pres);
+}
+
+bool msg_restriction_plan::filter(sqlite3 *psqlite, cpid_t cpid,
+    std::vector<uint64_t> &mids)
+{
+	if (m_res == nullptr)
+		return true;
+	if (!m_cols.load(psqlite, cpid, mids, m_tags))
+		return false;
+	size_t out = 0;
+	for (size_t i = 0; i < mids.size(); ++i)
+		if (eval(psqlite, cpid, m_res, i, mids[i]))
+			mids[out++] = mids[i];
+	mids.resize(out);
+	m_cols.clear();
+	return true;
+}
+
 BOOL common_util_check_search_result(sqlite3 *psqlite,
 	uint64_t folder_id, uint64_t message_id, BOOL *pb_exist)
 {
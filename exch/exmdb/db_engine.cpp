@@ -2,6 +2,8 @@
 // SPDX-FileCopyrightText: 2021-2025 grommunio GmbH
 // This file is part of Gromox.
 #include <algorithm>
+#include <array>
+#include <atomic>
 #include <cassert>
 #include <chrono>
 #include <climits>
@@ -19,6 +21,7 @@
 #include <pthread.h>
 #include <semaphore>
 #include <string>
+#include <string_view>
 #include <thread>
 #include <unistd.h>
 #include <unordered_map>
@@ -89,6 +92,18 @@ struct ROWDEL_NODE {
 	BOOL b_read;
 };
 
+/* One lock stripe of the db_base table */
+struct db_shard {
+	std::mutex lock;
+	std::unordered_map<std::string, db_base> table;
+};
+
+/* Contention counters for the db_shard locks, reset on every report */
+struct db_lock_stats {
+	std::atomic<uint64_t> acquired{0}, contended{0}, wait_ns{0}, max_ns{0};
+	std::atomic<uint64_t> expiry_busy{0};
+};
+
 }
 
 static size_t g_table_size; /* hash table size */
@@ -97,13 +112,16 @@ static gromox::atomic_bool g_notify_stop; /* stop signal for scanning thread */
 static pthread_t g_scan_tid;
 static gromox::time_duration g_cache_interval; /* maximum living interval in table */
 static std::vector<pthread_t> g_thread_ids;
-static std::mutex g_list_lock, g_hash_lock;
+static std::mutex g_list_lock;
 static std::condition_variable g_waken_cond;
-static std::unordered_map<std::string, db_base> g_hash_table;
+static std::array<db_shard, 64> g_db_shards;
+static std::atomic<size_t> g_db_count; /* entries across all shards */
+static db_lock_stats g_db_lockstat;
 /* List of queued searchcriteria, and list of searchcriteria evaluated right now */
 static std::list<POPULATING_NODE> g_populating_list, g_populating_list_active;
 static std::optional<std::counting_semaphore<1>> g_autoupg_limiter;
 unsigned int g_exmdb_schema_upgrades, g_exmdb_search_pacing;
+unsigned int g_exmdb_search_chunk = 100;
 unsigned long long g_exmdb_search_pacing_time = 2000000000;
 unsigned int g_exmdb_search_yield, g_exmdb_search_nice;
 unsigned int g_exmdb_pvt_folder_softdel, g_exmdb_max_sqlite_spares;
@@ -197,6 +215,31 @@ static int db_engine_autoupgrade(sqlite3 *db, const char *filedesc)
 	return 0;
 }
 
+static db_shard &db_shard_of(std::string_view path)
+{
+	return g_db_shards[std::hash<std::string_view>{}(path) % std::size(g_db_shards)];
+}
+
+/**
+ * Lock a shard, accounting the time spent waiting if it was contended.
+ */
+static std::unique_lock<std::mutex> db_shard_lock(db_shard &shard)
+{
+	++g_db_lockstat.acquired;
+	std::unique_lock lk(shard.lock, std::try_to_lock);
+	if (lk.owns_lock())
+		return lk;
+	auto start = tp_now();
+	lk.lock();
+	uint64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(tp_now() - start).count();
+	++g_db_lockstat.contended;
+	g_db_lockstat.wait_ns += ns;
+	auto prev = g_db_lockstat.max_ns.load();
+	while (ns > prev && !g_db_lockstat.max_ns.compare_exchange_weak(prev, ns))
+		/* retry */;
+	return lk;
+}
+
 /**
  * Query or create db_conn in hash table.
  *
@@ -209,9 +252,10 @@ db_conn_ptr db_engine_get_db(const char *path)
 	
 	if (*path == '\0')
 		return std::nullopt;
-	std::unique_lock hhold(g_hash_lock);
-	auto it = g_hash_table.find(path);
-	if (it != g_hash_table.end()) {
+	auto &shard = db_shard_of(path);
+	auto hhold = db_shard_lock(shard);
+	auto it = shard.table.find(path);
+	if (it != shard.table.end()) {
 		pdb = &it->second;
 		db_conn_ptr conn(*pdb);
 		hhold.unlock();
@@ -219,23 +263,28 @@ db_conn_ptr db_engine_get_db(const char *path)
 			return std::nullopt;
 		return conn;
 	}
-	if (g_hash_table.size() >= g_table_size) {
-		hhold.unlock();
-		mlog(LV_ERR, "E-1297: Reached the maximum number of concurrently active users/mailboxes (exmdb_provider.cfg:table_size=%zu)", g_table_size);
-		return std::nullopt;
-	}
+	/* Other shards are not locked; claim the slot atomically */
+	auto count = g_db_count.load();
+	do {
+		if (count >= g_table_size) {
+			hhold.unlock();
+			mlog(LV_ERR, "E-1297: Reached the maximum number of concurrently active users/mailboxes (exmdb_provider.cfg:table_size=%zu)", g_table_size);
+			return std::nullopt;
+		}
+	} while (!g_db_count.compare_exchange_weak(count, count + 1));
 	try {
-		auto xp = g_hash_table.try_emplace(path);
+		auto xp = shard.table.try_emplace(path);
 		pdb = &xp.first->second;
 	} catch (const std::bad_alloc &) {
+		--g_db_count;
 		hhold.unlock();
 		mlog(LV_ERR, "E-1296: ENOMEM");
 		return std::nullopt;
 	}
 
 	/*
-	 * Release central map lock (g_hash_lock) early to unblock map read
-	 * access looking for DBs of other dirs.
+	 * Release the shard lock early to unblock map read access looking
+	 * for DBs of other dirs.
 	 */
 	hhold.unlock();
 	try {
@@ -268,15 +317,18 @@ BOOL db_engine_vacuum(const char *path)
 BOOL db_engine_unload_db(const char *path)
 {
 	for (unsigned int i = 0; i < 20; ++i) {
-		std::unique_lock hhold(g_hash_lock);
-		auto it = g_hash_table.find(path);
-		if (it == g_hash_table.end())
+		auto &shard = db_shard_of(path);
+		auto hhold = db_shard_lock(shard);
+		auto it = shard.table.find(path);
+		if (it == shard.table.end())
 			return TRUE;
 		auto now = tp_now();
 		auto &dbase = it->second;
 		std::unique_lock dhold(dbase.giant_lock);
 		if (remove_from_hash(dbase, now + g_cache_interval)) {
-			g_hash_table.erase(it);
+			dhold.unlock();
+			shard.table.erase(it);
+			--g_db_count;
 			return TRUE;
 		}
 		dhold.unlock();
@@ -555,32 +607,60 @@ static bool remove_from_hash(const db_base &pdb, time_point now)
 	return true;
 }
 
+static void db_engine_report_locks()
+{
+	auto acq = g_db_lockstat.acquired.exchange(0);
+	auto cont = g_db_lockstat.contended.exchange(0);
+	auto wait = g_db_lockstat.wait_ns.exchange(0);
+	auto max = g_db_lockstat.max_ns.exchange(0);
+	auto busy = g_db_lockstat.expiry_busy.exchange(0);
+	mlog(LV_DEBUG, "db_engine: %zu stores loaded; shard locks: %llu taken, "
+	        "%llu contended, %llu µs total wait, %llu µs max wait; "
+	        "expiry skipped %llu busy stores",
+	        g_db_count.load(), LLU{acq}, LLU{cont}, LLU{wait / 1000},
+	        LLU{max / 1000}, LLU{busy});
+}
+
+/**
+ * Expire idle stores. Every second, a tenth of the shards is visited, so
+ * each store is still looked at every 10 seconds, but no lock is held for
+ * long. Stores whose giant_lock is held by someone are in use and are
+ * skipped rather than waited for.
+ */
 static void *db_expiry_thread(void *param)
 {
-	int count;
+	static constexpr size_t per_tick = (std::size(g_db_shards) + 9) / 10;
+	size_t next = 0;
+	unsigned int ticks = 0;
 
-	count = 0;
 	while (!g_notify_stop) {
 		sleep(1);
-		if (count < 10) {
-			count ++;
-			continue;
-		}
-		count = 0;
-		/* Exclusive ownership over the list is needed, obviously, since we modify it */
-		std::lock_guard hhold(g_hash_lock);
 		auto now_time = tp_now();
-		for (auto it = g_hash_table.begin(); it != g_hash_table.end(); ) {
-			auto &dbase = it->second;
-			/*
-			 * There must be no readers nor writers if we destroy it.
-			 * Hence another lock.
-			 */
-			std::unique_lock dhold(dbase.giant_lock);
-			if (remove_from_hash(dbase, now_time))
-				it = g_hash_table.erase(it);
-			else
-				++it;
+		for (size_t i = 0; i < per_tick; ++i) {
+			auto &shard = g_db_shards[next];
+			next = (next + 1) % std::size(g_db_shards);
+			auto hhold = db_shard_lock(shard);
+			for (auto it = shard.table.begin(); it != shard.table.end(); ) {
+				/*
+				 * There must be no readers nor writers if we destroy it.
+				 * Hence another lock.
+				 */
+				std::unique_lock dhold(it->second.giant_lock, std::try_to_lock);
+				if (!dhold.owns_lock()) {
+					++g_db_lockstat.expiry_busy;
+					++it;
+				} else if (remove_from_hash(it->second, now_time)) {
+					dhold.unlock();
+					it = shard.table.erase(it);
+					--g_db_count;
+				} else {
+					++it;
+				}
+			}
+		}
+		if (++ticks >= 60) {
+			ticks = 0;
+			db_engine_report_locks();
 		}
 	}
 	return nullptr;
@@ -633,51 +713,93 @@ static BOOL db_engine_search_folder(const char *dir, cpid_t cpid,
 		    sqlite3_column_int64(pstmt, 0)))
 			return FALSE;
 	pstmt.finalize();
+	sql_transact = xtransaction();
 	auto t_start = tp_now();
+	size_t done = 0;
 	auto cl_1 = HX::make_scope_exit([&]() {
 		auto t_end = tp_now();
 		auto t_diff = std::chrono::duration<double>(t_end - t_start).count();
-		if (pmessage_ids->count > 0 && t_diff >= 1)
-			mlog(LV_DEBUG, "db_eng_sf: %u messages in %.2f seconds",
-				pmessage_ids->count, t_diff);
+		if (done > 0 && t_diff >= 1)
+			mlog(LV_DEBUG, "db_eng_sf: %zu messages in %.2f seconds (%.0f msg/s)",
+				done, t_diff, done / t_diff);
 	});
-	sql_transact = xtransaction();
-	for (size_t i = 0, count = 0; i < pmessage_ids->count; ++i, ++count) {
+	std::vector<uint64_t> matches;
+	msg_restriction_plan plan(prestriction);
+	size_t chunk = std::max(g_exmdb_search_chunk, 1U);
+	try {
+		matches.reserve(std::min(static_cast<size_t>(pmessage_ids->count), chunk));
+	} catch (const std::bad_alloc &) {
+		mlog(LV_ERR, "E-1705: ENOMEM");
+		return false;
+	}
+	while (done < pmessage_ids->count) {
 		if (g_notify_stop)
 			break;
+		/*
+		 * Evaluate the restriction over one chunk under a single read
+		 * snapshot; no writer is held off during this phase.
+		 */
+		auto end = std::min(done + chunk, static_cast<size_t>(pmessage_ids->count));
+		matches.assign(&pmessage_ids->pids[done], &pmessage_ids->pids[end]);
+		done = end;
+		sql_transact = gx_sql_begin(pdb->psqlite, txn_mode::read);
+		if (!sql_transact)
+			return false;
+		if (!plan.filter(pdb->psqlite, cpid, matches))
+			return false;
+		sql_transact = xtransaction();
+		if (matches.empty())
+			continue;
+		/*
+		 * Insert all matches of the chunk with one write transaction.
+		 * Between the read snapshot and now, the search folder or any
+		 * of the messages may have been deleted; recheck both here
+		 * rather than interpreting a foreign key failure.
+		 */
 		auto sql_transact1 = gx_sql_begin(pdb->psqlite, txn_mode::write);
 		if (!sql_transact1)
 			return false;
-		if (!cu_eval_msg_restriction(pdb->psqlite,
-		    cpid, pmessage_ids->pids[i], prestriction))
-			continue;
-		snprintf(sql_string, std::size(sql_string), "REPLACE INTO search_result "
-		         "(folder_id, message_id) VALUES (%llu, %llu)",
-		         LLU{search_fid}, LLU{pmessage_ids->pids[i]});
-		auto ret = pdb->exec(sql_string, SQLEXEC_SILENT_CONSTRAINT);
-		if (ret == SQLITE_CONSTRAINT)
-			/*
-			 * Search folder is closed (deleted) already, INSERT
-			 * does not succeed, and neither will subsequent queries.
-			 */
-			break;
-		else if (ret != SQLITE_OK)
-			continue;
+		snprintf(sql_string, std::size(sql_string), "SELECT 1 FROM folders "
+		          "WHERE folder_id=%llu", LLU{search_fid});
+		pstmt = pdb->prep(sql_string);
+		if (pstmt == nullptr)
+			return false;
+		if (pstmt.step() != SQLITE_ROW)
+			/* Search folder is closed (deleted) already */
+			return TRUE;
+		pstmt.finalize();
+		auto stm = pdb->prep("REPLACE INTO search_result (folder_id, message_id) "
+		           "SELECT ?, message_id FROM messages WHERE message_id=?");
+		if (stm == nullptr)
+			return false;
+		size_t inserted = 0;
+		for (auto mid : matches) {
+			stm.bind_int64(1, search_fid);
+			stm.bind_int64(2, mid);
+			auto ret = stm.step();
+			stm.reset();
+			if (ret != SQLITE_DONE || sqlite3_changes(pdb->psqlite) == 0)
+				/* or message deleted meanwhile */
+				continue;
+			matches[inserted++] = mid;
+		}
+		stm.finalize();
+		matches.resize(inserted);
 		if (sql_transact1.commit() != SQLITE_OK)
 			return false;
 		/*
 		 * Update other search folders (seems like it is allowed to
 		 * have a search folder have a scope containing another search
-		 * folder; exmdb_provider only does a descendant check).
+		 * folder; exmdb_provider only does a descendant check), and
+		 * emit the regular notifications, as one batch per chunk.
 		 */
 		db_conn::NOTIFQ notifq;
 		auto dbase = pdb->lock_base_wr();
-		pdb->proc_dynamic_event(cpid, dynamic_event::new_msg,
-			search_fid, pmessage_ids->pids[i], 0, *dbase, notifq);
-		/*
-		 * Regular notifications
-		 */
-		pdb->notify_link_creation(search_fid, pmessage_ids->pids[i], *dbase, notifq);
+		for (auto mid : matches) {
+			pdb->proc_dynamic_event(cpid, dynamic_event::new_msg,
+				search_fid, mid, 0, *dbase, notifq);
+			pdb->notify_link_creation(search_fid, mid, *dbase, notifq);
+		}
 		dg_notify(std::move(notifq));
 		dbase.reset();
 	}
@@ -909,23 +1031,22 @@ void db_engine_stop()
 		auto t_start = tp_now();
 		size_t conc = std::min(gx_concurrency(), g_threads_num);
 		std::vector<std::future<void>> futs;
-		auto iter = g_hash_table.begin();
 		for (size_t tid = 0; tid < conc; ++tid) {
-			if (iter == g_hash_table.end())
-				break;
-			futs.emplace_back(std::async([](size_t tid, decltype(g_hash_table)::iterator iter, size_t skip) -> void {
-				std::lock_guard lk(g_hash_lock);
-				while (iter != g_hash_table.end()) {
-					iter->second.drop_all();
-					for (size_t i = 0; i < skip && iter != g_hash_table.end(); ++i)
-						++iter;
+			futs.emplace_back(std::async([](size_t tid, size_t skip) -> void {
+				for (size_t i = tid; i < std::size(g_db_shards); i += skip) {
+					auto &shard = g_db_shards[i];
+					std::lock_guard lk(shard.lock);
+					for (auto &e : shard.table)
+						e.second.drop_all();
 				}
-			}, tid, iter, conc));
-			++iter;
+			}, tid, conc));
 		}
 		futs.clear();
-		std::lock_guard lk(g_hash_lock);
-		g_hash_table.clear();
+		for (auto &shard : g_db_shards) {
+			std::lock_guard lk(shard.lock);
+			shard.table.clear();
+		}
+		g_db_count = 0;
 		mlog(LV_INFO, "Database shutdown took %llu ms",
 			LLU(std::chrono::duration_cast<std::chrono::milliseconds>(tp_now() - t_start).count()));
 	}
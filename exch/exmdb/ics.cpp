@@ -16,6 +16,7 @@
 #include <gromox/rop_util.hpp>
 #include <gromox/util.hpp>
 #include "db_engine.hpp"
+#include "ics_diff.hpp"
 
 using namespace gromox;
 
@@ -38,52 +39,18 @@ struct REPLID_ARRAY {
 static std::mutex ics_log_mtx;
 std::string g_exmdb_ics_log_file;
 
-static void ics_enum_content_idset(void *vparam, uint64_t message_id)
+static bool ics_to_eid_array(const std::vector<uint64_t> &v, EID_ARRAY *a)
 {
-	auto pparam = static_cast<ENUM_PARAM *>(vparam);
-	uint64_t mid_val;
-	
-	if (!pparam->b_result)
-		return;
-	mid_val = rop_util_get_gc_value(message_id);
-	sqlite3_reset(pparam->stm_exist);
-	sqlite3_bind_int64(pparam->stm_exist, 1, mid_val);
-	if (pparam->stm_exist.step() == SQLITE_ROW)
-		return;
-	sqlite3_reset(pparam->stm_msg);
-	sqlite3_bind_int64(pparam->stm_msg, 1, mid_val);
-	if (pparam->stm_msg.step() == SQLITE_ROW) {
-		if (!eid_array_append(pparam->pnolonger_mids, message_id))
-			pparam->b_result = FALSE;
-	} else {
-		if (!eid_array_append(pparam->pdeleted_eids, message_id))
-			pparam->b_result = FALSE;
-	}
-}
-
-/* Counterpart for simc_otherstore. */
-static ec_error_t delete_impossible_mids(const idset &given, EID_ARRAY &del)
-{
-	struct p1data {
-		const idset *given;
-		EID_ARRAY *del;
-		ec_error_t error;
-	} p1 = {&given, &del, ecSuccess};
-	const_cast<idset &>(given).enum_replist(&p1, [](void *param1, uint16_t replid) {
-		if (replid <= 1)
-			return;
-		auto p2 = static_cast<p1data *>(param1);
-		if (p2->error != ecSuccess)
-			return;
-		const_cast<idset *>(p2->given)->enum_repl(replid, p2, [](void *param2, uint64_t msgid) {
-			auto p3 = static_cast<p1data *>(param2);
-			if (p3->error != ecSuccess)
-				return;
-			if (!eid_array_append(p3->del, msgid))
-				p3->error = ecServerOOM;
-		});
-	});
-	return p1.error;
+	a->count = 0;
+	a->pids = nullptr;
+	if (v.empty())
+		return true;
+	a->pids = cu_alloc<uint64_t>(v.size());
+	if (a->pids == nullptr)
+		return false;
+	memcpy(a->pids, v.data(), sizeof(uint64_t) * v.size());
+	a->count = v.size();
+	return true;
 }
 
 /**
@@ -102,47 +69,13 @@ BOOL exmdb_server::get_content_sync(const char *dir,
 	uint64_t *pnormal_total, EID_ARRAY *pupdated_mids, EID_ARRAY *pchg_mids,
 	uint64_t *plast_cn, EID_ARRAY *pgiven_mids, EID_ARRAY *pdeleted_mids,
 	EID_ARRAY *pnolonger_mids, EID_ARRAY *pread_mids,
-	EID_ARRAY *punread_mids, uint64_t *plast_readcn)
+	EID_ARRAY *punread_mids, uint64_t *plast_readcn) try
 {
-	sqlite3 *psqlite;
-	
 	*pfai_count = 0;
 	*pfai_total = 0;
 	*pnormal_count = 0;
 	*pnormal_total = 0;
 	auto b_private = exmdb_server::is_private();
-
-	/*
-	 * Setup of scratch space db.
-	 *
-	 * All three tables are implicitly ordered by MID (due to PK)
-	 * SELECTs on those three should use ORDER BY if explicit order is desired.
-	 */
-	if (sqlite3_open_v2(":memory:", &psqlite,
-	    SQLITE_OPEN_READWRITE|SQLITE_OPEN_CREATE, nullptr) != SQLITE_OK)
-		return FALSE;
-	auto cl_0 = HX::make_scope_exit([&]() { sqlite3_close(psqlite); });
-	if (gx_sql_exec(psqlite, "CREATE TABLE existence "
-	    "(message_id INTEGER PRIMARY KEY)") != SQLITE_OK)
-		return FALSE;
-	if (pread != nullptr &&
-	    gx_sql_exec(psqlite, "CREATE TABLE reads "
-	    "(message_id INTEGER PRIMARY KEY, read_state INTEGER)") != SQLITE_OK)
-		return FALSE;
-	if (b_ordered) {
-		if (gx_sql_exec(psqlite, "CREATE TABLE changes"
-		    " (message_id INTEGER PRIMARY KEY, "
-		    "delivery_time INTEGER, mod_time INTEGER)") != SQLITE_OK)
-			return FALSE;
-		if (gx_sql_exec(psqlite, "CREATE INDEX idx_dtime ON changes (delivery_time)") != SQLITE_OK)
-			return FALSE;
-		if (gx_sql_exec(psqlite, "CREATE INDEX idx_mtime ON changes (mod_time)") != SQLITE_OK)
-			return FALSE;
-	} else {
-		if (gx_sql_exec(psqlite, "CREATE TABLE changes "
-		    "(message_id INTEGER PRIMARY KEY)") != SQLITE_OK)
-			return FALSE;
-	}
 	auto fid_val = rop_util_get_gc_value(folder_id);
 	auto pdb = db_engine_get_db(dir);
 	if (!pdb)
@@ -155,52 +88,33 @@ BOOL exmdb_server::get_content_sync(const char *dir,
 	if (!transact2)
 		return false;
 
-	/*
-	 * #1:
-	 * Determine message counts, bytesize totals, and maximum CNs.
-	 * (The result is dependent on prestriction.)
-	 */
-	{
-	auto transact1 = gx_sql_begin(psqlite, txn_mode::write);
-	if (!transact1)
-		return false;
 	char sql_string[256];
 	if (b_private)
 		snprintf(sql_string, std::size(sql_string), "SELECT message_id,"
 			" change_number, is_associated, message_size,"
-			" read_state, read_cn FROM messages WHERE "
-		         "parent_fid=%llu AND is_deleted=0",
+			" read_cn FROM messages WHERE "
+		         "parent_fid=%llu AND is_deleted=0 ORDER BY message_id",
 		         static_cast<unsigned long long>(fid_val));
 	else
 		snprintf(sql_string, std::size(sql_string), "SELECT message_id,"
 			" change_number, is_associated, message_size "
 			"FROM messages WHERE parent_fid=%llu AND "
-			"is_deleted=0", static_cast<unsigned long long>(fid_val));
+			"is_deleted=0 ORDER BY message_id", static_cast<unsigned long long>(fid_val));
 	auto stm_select_msg = pdb->prep(sql_string);
 	if (stm_select_msg == nullptr)
 		return false;
-	auto stm_insert_chg = gx_sql_prep(psqlite, b_ordered ?
-	                      "INSERT INTO changes VALUES (?, ?, ?)" :
-	                      "INSERT INTO changes VALUES (?)");
-	if (stm_insert_chg == nullptr)
-		return false;
-	auto stm_insert_exist = gx_sql_prep(psqlite, "INSERT INTO existence VALUES (?)");
-	if (stm_insert_exist == nullptr)
-		return false;
-	xstmt stm_insert_reads, stm_select_rcn, stm_select_rst;
-	if (NULL != pread) {
+	xstmt stm_select_rcn, stm_select_rst;
+	if (pread != nullptr) {
 		if (!b_private) {
 			stm_select_rcn = pdb->prep("SELECT read_cn FROM "
 			                 "read_cns WHERE message_id=? AND username=?");
 			if (stm_select_rcn == nullptr)
 				return false;
-			stm_select_rst = pdb->prep("SELECT message_id FROM "
-			                 "read_states WHERE message_id=? AND username=?");
-			if (stm_select_rst == nullptr)
-				return false;
 		}
-		stm_insert_reads = gx_sql_prep(psqlite, "INSERT INTO reads VALUES (?, ?)");
-		if (stm_insert_reads == nullptr)
+		stm_select_rst = pdb->prep(b_private ?
+		                 "SELECT read_state FROM messages WHERE message_id=?" :
+		                 "SELECT message_id FROM read_states WHERE message_id=? AND username=?");
+		if (stm_select_rst == nullptr)
 			return false;
 	}
 	xstmt stm_select_mp;
@@ -210,311 +124,105 @@ BOOL exmdb_server::get_content_sync(const char *dir,
 		if (stm_select_mp == nullptr)
 			return false;
 	}
-	*plast_cn = 0;
-	*plast_readcn = 0;
+	auto stm_select_mid = pdb->prep("SELECT message_id FROM messages "
+	                      "WHERE message_id BETWEEN ? AND ? ORDER BY message_id");
+	if (stm_select_mid == nullptr)
+		return false;
+
+	/*
+	 * #1: Collect the messages in scope (dependent on prestriction).
+	 */
+	ics_diff_source src;
 	while (stm_select_msg.step() == SQLITE_ROW) {
-		uint64_t mid_val = sqlite3_column_int64(stm_select_msg, 0);
-		uint64_t change_num = sqlite3_column_int64(stm_select_msg, 1);
-		BOOL b_fai = sqlite3_column_int64(stm_select_msg, 2) == 0 ? false : TRUE;
-		uint64_t message_size = sqlite3_column_int64(stm_select_msg, 3);
-		if (NULL == pseen && NULL == pseen_fai) {
+		ics_msg_row row;
+		row.mid  = sqlite3_column_int64(stm_select_msg, 0);
+		row.cn   = sqlite3_column_int64(stm_select_msg, 1);
+		row.fai  = sqlite3_column_int64(stm_select_msg, 2) != 0;
+		row.size = sqlite3_column_int64(stm_select_msg, 3);
+		if ((row.fai ? pseen_fai : pseen) == nullptr)
 			continue;
-		} else if (NULL != pseen && NULL == pseen_fai) {
-			if (b_fai)
-				continue;
-		} else if (NULL == pseen && NULL != pseen_fai) {
-			if (!b_fai)
-				continue;
-		}
 		if (prestriction != nullptr &&
 		    !cu_eval_msg_restriction(pdb->psqlite,
-		    cpid, mid_val, prestriction))
-			continue;	
-		sqlite3_reset(stm_insert_exist);
-		sqlite3_bind_int64(stm_insert_exist, 1, mid_val);
-		if (stm_insert_exist.step() != SQLITE_DONE)
-			return false;
-		if (change_num > *plast_cn)
-			*plast_cn = change_num;
-		uint64_t read_cn;
+		    cpid, row.mid, prestriction))
+			continue;
 		if (b_private) {
-			read_cn = sqlite3_column_type(stm_select_msg, 5) == SQLITE_NULL ? 0 :
-			          sqlite3_column_int64(stm_select_msg, 5);
-		} else {
+			row.read_cn = sqlite3_column_type(stm_select_msg, 4) == SQLITE_NULL ? 0 :
+			              sqlite3_column_int64(stm_select_msg, 4);
+		} else if (pread != nullptr) {
 			sqlite3_reset(stm_select_rcn);
-			sqlite3_bind_int64(stm_select_rcn, 1, mid_val);
+			sqlite3_bind_int64(stm_select_rcn, 1, row.mid);
 			sqlite3_bind_text(stm_select_rcn, 2,
 				username, -1, SQLITE_STATIC);
-			read_cn = stm_select_rcn.step() != SQLITE_ROW ? 0 :
-			          sqlite3_column_int64(stm_select_rcn, 0);
+			row.read_cn = stm_select_rcn.step() != SQLITE_ROW ? 0 :
+			              sqlite3_column_int64(stm_select_rcn, 0);
 		}
-		if (read_cn > *plast_readcn)
-			*plast_readcn = read_cn;
-		auto msg_eid = rop_util_make_eid_ex(1, mid_val);
-		auto chg_eid = rop_util_make_eid_ex(1, change_num);
-		if (b_fai) {
-			if (pgiven->contains(msg_eid) &&
-			    pseen_fai->contains(chg_eid))
-				continue;
-		} else if (pgiven->contains(msg_eid) &&
-		    pseen->contains(chg_eid)) {
-			if (pread == nullptr)
-				continue;
-			if (read_cn == 0 ||
-			    pread->contains(rop_util_make_eid_ex(1, read_cn)))
-				continue;
-			int read_state;
-			if (b_private) {
-				read_state = sqlite3_column_int64(stm_select_msg, 4);
-			} else {
-				sqlite3_reset(stm_select_rst);
-				sqlite3_bind_int64(stm_select_rst, 1, mid_val);
-				sqlite3_bind_text(stm_select_rst, 2,
-					username, -1 , SQLITE_STATIC);
-				read_state = stm_select_rst.step() == SQLITE_ROW;
-			}
-			sqlite3_reset(stm_insert_reads);
-			sqlite3_bind_int64(stm_insert_reads, 1, mid_val);
-			sqlite3_bind_int64(stm_insert_reads, 2, read_state);
-			if (stm_insert_reads.step() != SQLITE_DONE)
-				return false;
-			continue;
-		}
-		uint64_t dtime = 0, mtime = 0;
-		if (b_ordered) {
-			sqlite3_reset(stm_select_mp);
-			sqlite3_bind_int64(stm_select_mp, 1, PR_MESSAGE_DELIVERY_TIME);
-			sqlite3_bind_int64(stm_select_mp, 2, mid_val);
-			dtime = stm_select_mp.step() == SQLITE_ROW ?
-			        sqlite3_column_int64(stm_select_mp, 0) : 0;
-			sqlite3_reset(stm_select_mp);
-			sqlite3_bind_int64(stm_select_mp, 1, PR_LAST_MODIFICATION_TIME);
-			sqlite3_bind_int64(stm_select_mp, 2, mid_val);
-			mtime = stm_select_mp.step() == SQLITE_ROW ?
-			        sqlite3_column_int64(stm_select_mp, 0) : 0;
-		}
-		if (b_fai) {
-			(*pfai_count) ++;
-			*pfai_total += message_size;
-		} else {
-			(*pnormal_count) ++;
-			*pnormal_total += message_size;
-		}
-		sqlite3_reset(stm_insert_chg);
-		sqlite3_bind_int64(stm_insert_chg, 1, mid_val);
-		if (b_ordered) {
-			sqlite3_bind_int64(stm_insert_chg, 2, dtime);
-			sqlite3_bind_int64(stm_insert_chg, 3, mtime);
-		}
-		if (stm_insert_chg.step() != SQLITE_DONE)
-			return false;
-	}
-	stm_select_msg.finalize();
-	stm_insert_chg.finalize();
-	stm_insert_exist.finalize();
-	stm_insert_reads.finalize();
-	stm_select_rcn.finalize();
-	stm_select_rst.finalize();
-	stm_select_mp.finalize();
-	if (*plast_cn != 0)
-		*plast_cn = rop_util_make_eid_ex(1, *plast_cn);
-	if (*plast_readcn != 0)
-		*plast_readcn = rop_util_make_eid_ex(1, *plast_readcn);
-	if (transact1.commit() != SQLITE_OK)
-		return false;
-	} /* section 1 */
-
-	/*
-	 * section #2a: exact-allocate pupdated_mids, pchg_mids
-	 */
-	{
-	ssize_t count;
-	{
-	auto stm_select_chg = gx_sql_prep(psqlite, "SELECT count(*) FROM changes");
-	if (stm_select_chg == nullptr || stm_select_chg.step() != SQLITE_ROW)
-		return FALSE;
-	count = sqlite3_column_int64(stm_select_chg, 0);
-	stm_select_chg.finalize();
-	pchg_mids->count = 0;
-	pupdated_mids->count = 0;
-	if (count > 0) {
-		pupdated_mids->pids = cu_alloc<uint64_t>(count);
-		pchg_mids->pids = cu_alloc<uint64_t>(count);
-		if (pupdated_mids->pids == nullptr || pchg_mids->pids == nullptr)
-			return FALSE;
-	} else {
-		pupdated_mids->pids = NULL;
-		pchg_mids->pids = NULL;
-	}
-	} /* section 2a */
-
-	/*
-	 * #2b: compute pchg_mids, pupdated_mids
-	 */
-	{
-	auto stm_select_chg = gx_sql_prep(psqlite, b_ordered ?
-	                      "SELECT message_id FROM changes ORDER BY delivery_time DESC, mod_time DESC" :
-	                      "SELECT message_id FROM changes");
-	if (stm_select_chg == nullptr)
-		return FALSE;
-	for (ssize_t i = 0; i < count; ++i) {
-		if (stm_select_chg.step() != SQLITE_ROW)
-			return FALSE;
-		uint64_t mid_val = sqlite3_column_int64(stm_select_chg, 0);
-		auto eid = rop_util_make_eid_ex(1, mid_val);
-		pchg_mids->pids[pchg_mids->count++] = eid;
-		if (pgiven->contains(eid))
-			pupdated_mids->pids[pupdated_mids->count++] = eid;
-	}
-	} /* section 2b */
+		src.rows.push_back(row);
 	}
+	src.read_state = [&](uint64_t mid_val, bool &b_read) {
+		sqlite3_reset(stm_select_rst);
+		sqlite3_bind_int64(stm_select_rst, 1, mid_val);
+		if (!b_private)
+			sqlite3_bind_text(stm_select_rst, 2,
+				username, -1, SQLITE_STATIC);
+		auto ret = stm_select_rst.step();
+		b_read = ret == SQLITE_ROW &&
+		         (!b_private || sqlite3_column_int64(stm_select_rst, 0) != 0);
+		return ret == SQLITE_ROW || ret == SQLITE_DONE;
+	};
+	src.sort_times = [&](uint64_t mid_val, uint64_t &dtime, uint64_t &mtime) {
+		sqlite3_reset(stm_select_mp);
+		sqlite3_bind_int64(stm_select_mp, 1, PR_MESSAGE_DELIVERY_TIME);
+		sqlite3_bind_int64(stm_select_mp, 2, mid_val);
+		dtime = stm_select_mp.step() == SQLITE_ROW ?
+		        sqlite3_column_int64(stm_select_mp, 0) : 0;
+		sqlite3_reset(stm_select_mp);
+		sqlite3_bind_int64(stm_select_mp, 1, PR_LAST_MODIFICATION_TIME);
+		sqlite3_bind_int64(stm_select_mp, 2, mid_val);
+		mtime = stm_select_mp.step() == SQLITE_ROW ?
+		        sqlite3_column_int64(stm_select_mp, 0) : 0;
+		return true;
+	};
+	src.mids_in_range = [&](uint64_t lo, uint64_t hi, std::vector<uint64_t> &mids) {
+		sqlite3_reset(stm_select_mid);
+		sqlite3_bind_int64(stm_select_mid, 1, lo);
+		sqlite3_bind_int64(stm_select_mid, 2, hi);
+		int ret;
+		while ((ret = stm_select_mid.step()) == SQLITE_ROW)
+			mids.push_back(sqlite3_column_int64(stm_select_mid, 0));
+		return ret == SQLITE_DONE;
+	};
 
 	/*
-	 * #3: Build nolonger_mids, which is the set of MIDs that the client
-	 * has but the server has deleted (and server is more recent).
+	 * #2: Compare against the client state: changes, updates, read state
+	 * changes, and MIDs the client has but which are gone (or have moved
+	 * out of scope).
 	 */
-	{
-	ENUM_PARAM enum_param;
-	enum_param.stm_exist = gx_sql_prep(psqlite,
-	                       "SELECT message_id FROM existence WHERE message_id=?");
-	if (enum_param.stm_exist == nullptr)
-		return FALSE;
-	enum_param.stm_msg = gx_sql_prep(pdb->psqlite,
-	                     "SELECT message_id FROM messages WHERE message_id=?");
-	if (enum_param.stm_msg == nullptr)
-		return FALSE;
-	enum_param.b_result = TRUE;
-	enum_param.pdeleted_eids = eid_array_init();
-	if (enum_param.pdeleted_eids == nullptr)
-		return FALSE;
-	enum_param.pnolonger_mids = eid_array_init();
-	if (NULL == enum_param.pnolonger_mids) {
-		eid_array_free(enum_param.pdeleted_eids);
-		return FALSE;
-	}
-	if (delete_impossible_mids(*pgiven, *enum_param.pdeleted_eids) != ecSuccess)
-	{
-		eid_array_free(enum_param.pdeleted_eids);
-		eid_array_free(enum_param.pnolonger_mids);
+	ics_diff_result res;
+	if (!ics_content_diff(src, *pgiven, pseen, pseen_fai, pread, b_ordered, res))
 		return false;
-	}
-	if (!const_cast<idset *>(pgiven)->enum_repl(1, &enum_param,
-	    ics_enum_content_idset)) {
-		eid_array_free(enum_param.pdeleted_eids);
-		eid_array_free(enum_param.pnolonger_mids);
-		return FALSE;	
-	}
-	enum_param.stm_exist.finalize();
-	enum_param.stm_msg.finalize();
-	pdeleted_mids->count = enum_param.pdeleted_eids->count;
-	if (0 != enum_param.pdeleted_eids->count) {
-		pdeleted_mids->pids = cu_alloc<uint64_t>(pdeleted_mids->count);
-		if (NULL == pdeleted_mids->pids) {
-			pdeleted_mids->count = 0;
-			eid_array_free(enum_param.pdeleted_eids);
-			eid_array_free(enum_param.pnolonger_mids);
-			return FALSE;
-		}
-		memcpy(pdeleted_mids->pids,
-			enum_param.pdeleted_eids->pids,
-			sizeof(uint64_t)*pdeleted_mids->count);
-	} else {
-		pdeleted_mids->pids = NULL;
-	}
-	eid_array_free(enum_param.pdeleted_eids);
-	pnolonger_mids->count = enum_param.pnolonger_mids->count;
-	if (0 != enum_param.pnolonger_mids->count) {
-		pnolonger_mids->pids = cu_alloc<uint64_t>(pnolonger_mids->count);
-		if (NULL == pnolonger_mids->pids) {
-			pnolonger_mids->count = 0;
-			eid_array_free(enum_param.pnolonger_mids);
-			return FALSE;
-		}
-		memcpy(pnolonger_mids->pids,
-			enum_param.pnolonger_mids->pids,
-			sizeof(uint64_t)*pnolonger_mids->count);
-	} else {
-		pnolonger_mids->pids = NULL;
-	}
-	eid_array_free(enum_param.pnolonger_mids);
-	} /* section 3 */
-
+	stm_select_msg.finalize();
+	stm_select_rcn.finalize();
+	stm_select_rst.finalize();
+	stm_select_mp.finalize();
+	stm_select_mid.finalize();
 	/* Rollback transaction (no changes were made anyway) */
 	transact2 = xtransaction();
 	pdb.reset();
 
-	/* Query section 4 - pgiven_mids: what the server has */
-	{
-	auto stm_select_exist = gx_sql_prep(psqlite, "SELECT count(*) FROM existence");
-	if (stm_select_exist == nullptr ||
-	    stm_select_exist.step() != SQLITE_ROW)
+	*pfai_count    = res.fai_count;
+	*pfai_total    = res.fai_total;
+	*pnormal_count = res.normal_count;
+	*pnormal_total = res.normal_total;
+	*plast_cn      = res.last_cn;
+	*plast_readcn  = res.last_readcn;
+	if (!ics_to_eid_array(res.updated, pupdated_mids) ||
+	    !ics_to_eid_array(res.chg, pchg_mids) ||
+	    !ics_to_eid_array(res.given, pgiven_mids) ||
+	    !ics_to_eid_array(res.deleted, pdeleted_mids) ||
+	    !ics_to_eid_array(res.nolonger, pnolonger_mids) ||
+	    !ics_to_eid_array(res.read, pread_mids) ||
+	    !ics_to_eid_array(res.unread, punread_mids))
 		return FALSE;
-	int64_t count = sqlite3_column_int64(stm_select_exist, 0);
-	stm_select_exist.finalize();
-	pgiven_mids->count = 0;
-	if (count <= 0) {
-		pgiven_mids->pids = NULL;
-	} else {
-		pgiven_mids->pids = cu_alloc<uint64_t>(count);
-		if (pgiven_mids->pids == nullptr)
-			return FALSE;
-		auto stm_select_ex = gx_sql_prep(psqlite, "SELECT message_id"
-		                     " FROM existence ORDER BY message_id DESC");
-		if (stm_select_ex == nullptr)
-			return FALSE;
-		while (stm_select_ex.step() == SQLITE_ROW) {
-			uint64_t mid_val = sqlite3_column_int64(stm_select_ex, 0);
-			pgiven_mids->pids[pgiven_mids->count++] = rop_util_make_eid_ex(1, mid_val);
-		}
-	}
-	} /* section 4 */
-
-	/* Query section 5 - Determine MIDs for unread and read sets */
-	if (NULL != pread) {
-		auto stm_select_rd = gx_sql_prep(psqlite, "SELECT count(*) FROM reads");
-		if (stm_select_rd == nullptr ||
-		    stm_select_rd.step() != SQLITE_ROW)
-			return FALSE;
-		uint64_t count = sqlite3_column_int64(stm_select_rd, 0);
-		stm_select_rd.finalize();
-		pread_mids->count = 0;
-		punread_mids->count = 0;
-		if (count <= 0) {
-			pread_mids->pids = NULL;
-			punread_mids->pids = NULL;
-		} else {
-			pread_mids->pids = cu_alloc<uint64_t>(count);
-			if (pread_mids->pids == nullptr)
-				return FALSE;
-			punread_mids->pids = cu_alloc<uint64_t>(count);
-			if (punread_mids->pids == nullptr)
-				return FALSE;
-			stm_select_rd = gx_sql_prep(psqlite,
-					"SELECT message_id, read_state FROM reads");
-			if (stm_select_rd == nullptr)
-				return FALSE;
-			while (stm_select_rd.step() == SQLITE_ROW) {
-				uint64_t mid_val = sqlite3_column_int64(stm_select_rd, 0);
-				if (punread_mids->count == count ||
-				    pread_mids->count == count)
-					/*
-					 * This thread is holding the DB. There can't really be a
-					 * discrepance between SELECT COUNT(*) and the subsequent
-					 * SELECT. But check for it anyway to appease static checkers.
-					 */
-					break;
-				if (sqlite3_column_int64(stm_select_rd, 1) == 0)
-					punread_mids->pids[punread_mids->count++] = rop_util_make_eid_ex(1, mid_val);
-				else
-					pread_mids->pids[pread_mids->count++] = rop_util_make_eid_ex(1, mid_val);
-			}
-		}
-	} else {
-		pread_mids->count = 0;
-		pread_mids->pids = NULL;
-		punread_mids->count = 0;
-		punread_mids->pids = NULL;
-	} /* section 5 */
 
 	if (g_exmdb_ics_log_file.empty())
 		return TRUE;
@@ -551,6 +259,9 @@ BOOL exmdb_server::get_content_sync(const char *dir,
 		fprintf(fh.get(), "%llxh,", mid);
 	fprintf(fh.get(), "}\nlastcn=%llxh\n", static_cast<unsigned long long>(*plast_cn));
 	return TRUE;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-1806: ENOMEM");
+	return false;
 }
 
 static void ics_enum_hierarchy_idset(void *vparam, uint64_t folder_id)
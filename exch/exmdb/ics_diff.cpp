@@ -0,0 +1,177 @@
+// SPDX-License-Identifier: GPL-2.0-only WITH linking exception
+// SPDX-FileCopyrightText: 2025 grommunio GmbH
+// This file is part of Gromox.
+/*
+ * Set computations behind exmdb_server::get_content_sync. The client state
+ * (given MIDs, seen CNs, read CNs) is compared with the folder contents by
+ * walking the MID-sorted message list and the sorted idset ranges side by
+ * side, instead of staging everything in a scratch SQLite database.
+ */
+#include <algorithm>
+#include <cstdint>
+#include <new>
+#include <utility>
+#include <vector>
+#include <gromox/mapi_types.hpp>
+#include <gromox/rop_util.hpp>
+#include <gromox/util.hpp>
+#include "ics_diff.hpp"
+
+using namespace gromox;
+
+namespace {
+
+/* Membership test for ascending probes against a sorted range list */
+class range_cursor {
+	public:
+	range_cursor(const repl_node::range_list_t *r)
+	{
+		if (r != nullptr) {
+			m_cur = r->begin();
+			m_end = r->end();
+		}
+	}
+	bool contains(uint64_t v)
+	{
+		while (m_cur != m_end && m_cur->hi < v)
+			++m_cur;
+		return m_cur != m_end && m_cur->lo <= v;
+	}
+
+	private:
+	using iter_t = decltype(std::declval<const repl_node::range_list_t &>().begin());
+	iter_t m_cur{}, m_end{};
+};
+
+struct chg_entry {
+	uint64_t mid, dtime, mtime;
+};
+
+}
+
+/* Counterpart for simc_otherstore. */
+static bool delete_impossible_mids(const idset &given, std::vector<uint64_t> &del)
+{
+	struct p1data {
+		const idset *given;
+		std::vector<uint64_t> *del;
+		bool ok;
+	} p1 = {&given, &del, true};
+	const_cast<idset &>(given).enum_replist(&p1, [](void *param1, uint16_t replid) {
+		if (replid <= 1)
+			return;
+		auto p2 = static_cast<p1data *>(param1);
+		if (!p2->ok)
+			return;
+		const_cast<idset *>(p2->given)->enum_repl(replid, p2, [](void *param2, uint64_t msgid) {
+			auto p3 = static_cast<p1data *>(param2);
+			if (!p3->ok)
+				return;
+			try {
+				p3->del->push_back(msgid);
+			} catch (const std::bad_alloc &) {
+				p3->ok = false;
+			}
+		});
+	});
+	return p1.ok;
+}
+
+/**
+ * Classify the in-scope messages against the client state:
+ *
+ * - unchanged: MID in @given and CN in @seen (resp. @seen_fai);
+ *   additionally reported in read/unread if the read CN is not in @read
+ * - changed: everything else; reported in chg, and in updated if the MID
+ *   was given
+ * - given MIDs not in scope: nolonger if the message still exists
+ *   elsewhere in the store, deleted otherwise
+ */
+bool ics_content_diff(const ics_diff_source &src, const idset &given,
+    const idset *seen, const idset *seen_fai, const idset *read,
+    bool ordered, ics_diff_result &r) try
+{
+	std::vector<chg_entry> chg;
+	std::vector<uint64_t> exist;
+	exist.reserve(src.rows.size());
+	range_cursor in_given(given.get_ranges(1));
+	for (const auto &row : src.rows) {
+		exist.push_back(row.mid);
+		r.last_cn     = std::max(r.last_cn, row.cn);
+		r.last_readcn = std::max(r.last_readcn, row.read_cn);
+		bool b_given = in_given.contains(row.mid);
+		auto pseen = row.fai ? seen_fai : seen;
+		if (b_given && pseen != nullptr &&
+		    pseen->contains(rop_util_make_eid_ex(1, row.cn))) {
+			if (row.fai || read == nullptr || row.read_cn == 0 ||
+			    read->contains(rop_util_make_eid_ex(1, row.read_cn)))
+				continue;
+			bool b_read = false;
+			if (!src.read_state(row.mid, b_read))
+				return false;
+			(b_read ? r.read : r.unread).push_back(rop_util_make_eid_ex(1, row.mid));
+			continue;
+		}
+		if (row.fai) {
+			++r.fai_count;
+			r.fai_total += row.size;
+		} else {
+			++r.normal_count;
+			r.normal_total += row.size;
+		}
+		chg_entry e{row.mid, 0, 0};
+		if (ordered && !src.sort_times(row.mid, e.dtime, e.mtime))
+			return false;
+		chg.push_back(e);
+	}
+	if (r.last_cn != 0)
+		r.last_cn = rop_util_make_eid_ex(1, r.last_cn);
+	if (r.last_readcn != 0)
+		r.last_readcn = rop_util_make_eid_ex(1, r.last_readcn);
+
+	/* Newest first; MID order among equal timestamps */
+	if (ordered)
+		std::stable_sort(chg.begin(), chg.end(), [](const chg_entry &a, const chg_entry &b) {
+			return a.dtime != b.dtime ? a.dtime > b.dtime : a.mtime > b.mtime;
+		});
+	r.chg.reserve(chg.size());
+	for (const auto &e : chg)
+		r.chg.push_back(rop_util_make_eid_ex(1, e.mid));
+	for (auto eid : r.chg)
+		if (given.contains(eid))
+			r.updated.push_back(eid);
+
+	r.given.reserve(exist.size());
+	for (auto it = exist.rbegin(); it != exist.rend(); ++it)
+		r.given.push_back(rop_util_make_eid_ex(1, *it));
+
+	if (!delete_impossible_mids(given, r.deleted))
+		return false;
+	auto granges = given.get_ranges(1);
+	if (granges == nullptr)
+		return true;
+	std::vector<uint64_t> present;
+	for (const auto &range : *granges) {
+		present.clear();
+		if (!src.mids_in_range(range.lo, range.hi, present))
+			return false;
+		auto e = std::lower_bound(exist.cbegin(), exist.cend(), range.lo);
+		auto p = present.cbegin();
+		for (auto v = range.lo; ; ++v) {
+			while (e != exist.cend() && *e < v)
+				++e;
+			if (e == exist.cend() || *e != v) {
+				while (p != present.cend() && *p < v)
+					++p;
+				auto &dst = p != present.cend() && *p == v ? r.nolonger : r.deleted;
+				dst.push_back(rop_util_make_eid_ex(1, v));
+			}
+			if (v == range.hi)
+				break;
+		}
+	}
+	return true;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-1805: ENOMEM");
+	return false;
+}
@@ -0,0 +1,35 @@
+#pragma once
+#include <cstdint>
+#include <functional>
+#include <vector>
+#include <gromox/mapi_types.hpp>
+
+/* A message of the folder that is in scope of the content sync. */
+struct ics_msg_row {
+	uint64_t mid = 0, cn = 0, size = 0, read_cn = 0; /* GC values */
+	bool fai = false;
+};
+
+/*
+ * Input to ics_content_diff. The callbacks are only invoked for the
+ * (usually few) messages that need the information.
+ */
+struct ics_diff_source {
+	/* In-scope messages, strictly ascending by mid */
+	std::vector<ics_msg_row> rows;
+	/* Read state of a message (only invoked when the client passed a read set) */
+	std::function<bool(uint64_t mid, bool &read)> read_state;
+	/* Sort keys for ordered sync (PR_MESSAGE_DELIVERY_TIME, PR_LAST_MODIFICATION_TIME) */
+	std::function<bool(uint64_t mid, uint64_t &dtime, uint64_t &mtime)> sort_times;
+	/* All mids in [lo,hi] that exist anywhere in the store, ascending */
+	std::function<bool(uint64_t lo, uint64_t hi, std::vector<uint64_t> &)> mids_in_range;
+};
+
+/* All MIDs/CNs as replid-1 EIDs */
+struct ics_diff_result {
+	uint32_t fai_count = 0, normal_count = 0;
+	uint64_t fai_total = 0, normal_total = 0, last_cn = 0, last_readcn = 0;
+	std::vector<uint64_t> chg, updated, given, deleted, nolonger, read, unread;
+};
+
+extern bool ics_content_diff(const ics_diff_source &, const idset &given, const idset *seen, const idset *seen_fai, const idset *read, bool ordered, ics_diff_result &);
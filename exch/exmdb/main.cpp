@@ -45,16 +45,21 @@ static constexpr cfg_directive exmdb_gromox_cfg_defaults[] = {
 static constexpr cfg_directive exmdb_cfg_defaults[] = {
 	{"cache_interval", "15min", CFG_TIME, "1s"},
 	{"dbg_synthesize_content", "0"},
+	{"dispatch_threads_max", "1024", CFG_SIZE, "1"},
+	{"dispatch_threads_num", "64", CFG_SIZE, "1", "1024"},
 	{"enable_dam", "1", CFG_BOOL},
 	{"exmdb_body_autosynthesis", "1", CFG_BOOL},
+	{"exmdb_cid_pool", ""},
 	{"exmdb_file_compression", "zstd-6"},
 	{"exmdb_hosts_allow", ""}, /* ::1 default set later during startup */
 	{"exmdb_listen_port", "5000"},
 	{"exmdb_max_sqlite_spares", "3", CFG_SIZE},
+	{"exmdb_multiplex", "1", CFG_BOOL},
 	{"exmdb_pf_read_per_user", "1"},
 	{"exmdb_pf_read_states", "2"},
 	{"exmdb_private_folder_softdelete", "0", CFG_BOOL},
 	{"exmdb_schema_upgrades", "auto"},
+	{"exmdb_search_chunk", "100", CFG_SIZE, "1", "10000"},
 	{"exmdb_search_nice", "0"},
 	{"exmdb_search_pacing", "250", CFG_SIZE},
 	{"exmdb_search_pacing_time", "0.5s", CFG_TIME_NS},
@@ -107,6 +112,7 @@ static bool exmdb_provider_reload(std::shared_ptr<config_file> gxcfg = nullptr,
 	exmdb_pf_read_states = pconfig->get_ll("exmdb_pf_read_states");
 	g_exmdb_pvt_folder_softdel = pconfig->get_ll("exmdb_private_folder_softdelete");
 	g_exmdb_search_pacing = pconfig->get_ll("exmdb_search_pacing");
+	g_exmdb_search_chunk = pconfig->get_ll("exmdb_search_chunk");
 	g_exmdb_search_yield = pconfig->get_ll("exmdb_search_yield");
 	g_exmdb_search_nice = pconfig->get_ll("exmdb_search_nice");
 	g_exmdb_search_pacing_time = pconfig->get_ll("exmdb_search_pacing_time");
@@ -168,6 +174,9 @@ BOOL SVC_exmdb_provider(enum plugin_op reason, const struct dlfuncs &ppdata)
 		int threads_num = pconfig->get_ll("notify_stub_threads_num");
 		size_t max_threads = pconfig->get_ll("max_rpc_stub_threads");
 		size_t max_routers = pconfig->get_ll("max_router_connections");
+		size_t dispatch_threads = pconfig->get_ll("dispatch_threads_num");
+		size_t dispatch_max = pconfig->get_ll("dispatch_threads_max");
+		bool multiplex = pconfig->get_ll("exmdb_multiplex");
 		int table_size = pconfig->get_ll("table_size");
 		char cache_int_s[64];
 		int cache_interval = pconfig->get_ll("cache_interval");
@@ -197,14 +206,17 @@ BOOL SVC_exmdb_provider(enum plugin_op reason, const struct dlfuncs &ppdata)
 			mlog(LV_INFO, "Content File Compression: off");
 		else
 			mlog(LV_INFO, "Content File Compression: zstd-%d", g_cid_compression);
+		g_cid_pool = pconfig->get_value("exmdb_cid_pool");
+		if (!g_cid_pool.empty())
+			mlog(LV_INFO, "Content File Pool: %s", g_cid_pool.c_str());
 
 		common_util_init(org_name, max_msg_count, max_rule, max_ext_rule);
 		db_engine_init(table_size, cache_interval, populating_num);
 		uint16_t listen_port = pconfig->get_ll("exmdb_listen_port");
 		if (0 == listen_port) {
-			exmdb_parser_init(0, 0);
+			exmdb_parser_init(0, 0, 0, 0, false);
 		} else {
-			exmdb_parser_init(max_threads, max_routers);
+			exmdb_parser_init(max_threads, max_routers, dispatch_threads, dispatch_max, multiplex);
 		}
 		exmdb_client.emplace(connection_num, threads_num);
 		
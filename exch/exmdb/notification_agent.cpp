@@ -1,8 +1,10 @@
 // SPDX-License-Identifier: GPL-2.0-only WITH linking exception
 // SPDX-FileCopyrightText: 2021–2025 grommunio GmbH
 // This file is part of Gromox.
+#include <cerrno>
 #include <chrono>
 #include <cstdint>
+#include <cstdlib>
 #include <ctime>
 #include <memory>
 #include <mutex>
@@ -25,15 +27,13 @@ void notification_agent_backward_notify(const char *remote_id,
 				pnotify->id_array[i], &pnotify->db_notify);
 		return;
 	}
-	auto prouter = exmdb_parser_extract_router(remote_id);
+	auto prouter = exmdb_parser_get_router(remote_id);
 	if (NULL == prouter) {
 		return;
 	}
 	BINARY bin{};
-	if (exmdb_ext_push_db_notify(pnotify, &bin) != EXT_ERR_SUCCESS) {
-		exmdb_parser_insert_router(std::move(prouter));
-		return;	
-	}
+	if (exmdb_ext_push_db_notify(pnotify, &bin) != EXT_ERR_SUCCESS)
+		return;
 	try {
 		std::unique_lock rt_hold(prouter->lock);
 		prouter->datagram_list.push_back(bin);
@@ -41,8 +41,66 @@ void notification_agent_backward_notify(const char *remote_id,
 		free(bin.pb);
 		return;
 	}
-	prouter->waken_cond.notify_one();
-	exmdb_parser_insert_router(std::move(prouter));
+	exmdb_parser_wake_router(prouter);
+}
+
+/**
+ * Reactor side of a notification channel: transmit the next queued datagram
+ * (or, if @ping is set and nothing is queued, a ping packet) unless the
+ * previous one is still awaiting its acknowledgement. The socket is
+ * nonblocking; a partially written datagram stays in @rt.wr_cur.
+ * Returns false if the channel is to be torn down.
+ */
+bool notification_agent_ev_write(ROUTER_CONNECTION &rt, bool ping)
+{
+	if (rt.wr_cur.pb == nullptr) {
+		if (rt.wait_ack)
+			return true;
+		std::unique_lock rt_hold(rt.lock);
+		if (rt.datagram_list.size() > 0) {
+			rt.wr_cur = rt.datagram_list.front();
+			rt.datagram_list.pop_front();
+		}
+		rt_hold.unlock();
+		if (rt.wr_cur.pb == nullptr) {
+			if (!ping)
+				return true;
+			rt.wr_cur.pb = static_cast<uint8_t *>(calloc(1, sizeof(uint32_t)));
+			if (rt.wr_cur.pb == nullptr)
+				return false;
+			rt.wr_cur.cb = sizeof(uint32_t);
+		}
+		rt.wr_off = 0;
+	}
+	while (rt.wr_off < rt.wr_cur.cb) {
+		auto ret = write(rt.sockd, &rt.wr_cur.pb[rt.wr_off], rt.wr_cur.cb - rt.wr_off);
+		if (ret < 0)
+			return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+		rt.wr_off += ret;
+	}
+	free(rt.wr_cur.pb);
+	rt.wr_cur = {};
+	rt.wr_off = 0;
+	rt.wait_ack = true;
+	rt.last_time = time(nullptr);
+	return true;
+}
+
+/**
+ * Reactor side: consume the acknowledgement byte and send whatever has
+ * queued up in the meantime.
+ */
+bool notification_agent_ev_read(ROUTER_CONNECTION &rt)
+{
+	exmdb_response resp_code;
+	auto ret = read(rt.sockd, &resp_code, 1);
+	if (ret < 0)
+		return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+	if (ret != 1 || !rt.wait_ack || resp_code != exmdb_response::success)
+		return false;
+	rt.wait_ack = false;
+	rt.last_time = time(nullptr);
+	return notification_agent_ev_write(rt, false);
 }
 
 static BOOL notification_agent_read_response(std::shared_ptr<ROUTER_CONNECTION> prouter)
@@ -105,8 +163,7 @@ void notification_agent_thread_work(std::shared_ptr<ROUTER_CONNECTION> &&prouter
 		}
 	}
  EXIT_THREAD:
-	while (!exmdb_parser_erase_router(prouter))
-		sleep(1);
+	exmdb_parser_erase_router(prouter);
 	close(prouter->sockd);
 	prouter->sockd = -1;
 	{
@@ -4,3 +4,5 @@
 #include "parser.hpp"
 extern void notification_agent_backward_notify(const char *remote_id, const DB_NOTIFY_DATAGRAM *);
 extern void notification_agent_thread_work(std::shared_ptr<ROUTER_CONNECTION> &&);
+extern bool notification_agent_ev_write(ROUTER_CONNECTION &, bool ping);
+extern bool notification_agent_ev_read(ROUTER_CONNECTION &);
@@ -1,15 +1,23 @@
 // SPDX-License-Identifier: GPL-2.0-only WITH linking exception
 // SPDX-FileCopyrightText: 2021–2025 grommunio GmbH
 // This file is part of Gromox.
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
 #include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <cerrno>
 #include <climits>
+#include <condition_variable>
 #include <csignal>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
+#include <deque>
+#include <fcntl.h>
+#include <list>
 #include <memory>
 #include <mutex>
 #include <netdb.h>
@@ -17,12 +25,19 @@
 #include <pthread.h>
 #include <string>
 #include <unistd.h>
+#include <unordered_map>
 #include <unordered_set>
 #include <utility>
 #include <vector>
 #include <sys/socket.h>
 #include <sys/types.h>
+#ifdef HAVE_SYS_EPOLL_H
+#	include <sys/epoll.h>
+#	include <sys/eventfd.h>
+#endif
+#include <libHX/endian.h>
 #include <libHX/io.h>
+#include <libHX/scope.hpp>
 #include <libHX/socket.h>
 #include <libHX/string.h>
 #include <gromox/clock.hpp>
@@ -43,25 +58,78 @@
 
 using namespace gromox;
 
-static size_t g_max_threads, g_max_routers;
+namespace {
+
+/* One complete request, as handed from the reactor to the dispatch pool */
+struct rpc_job {
+	std::shared_ptr<EXMDB_CONNECTION> conn;
+	std::unique_ptr<uint8_t[], stdlib_delete> buf;
+	uint32_t len = 0;
+};
+
+}
+
+static size_t g_max_threads, g_max_routers, g_dispatch_threads, g_dispatch_max;
+static bool g_multiplex;
 static std::vector<EXMDB_ITEM> g_local_list;
-static std::unordered_set<std::shared_ptr<ROUTER_CONNECTION>> g_router_list;
+/* Rotated on every lookup to spread notifications across a client's channels */
+static std::list<std::shared_ptr<ROUTER_CONNECTION>> g_router_list;
 static std::unordered_set<std::shared_ptr<EXMDB_CONNECTION>> g_connection_list;
 static std::mutex g_router_lock, g_connection_lock;
+#ifdef HAVE_SYS_EPOLL_H
+static int g_epfd = -1, g_evfd = -1;
+static pthread_t g_reactor_id;
+static bool g_reactor_started;
+static gromox::atomic_bool g_notify_stop;
+/*
+ * Dispatch threads; beyond the first g_dispatch_threads, they are spawned on
+ * demand and exit again when idle, and their ids are then moved to
+ * g_dispatch_reap for the reactor to join. All guarded by g_dispatch_lock.
+ */
+static std::vector<pthread_t> g_dispatch_workers, g_dispatch_reap;
+static size_t g_dispatch_idle;
+static time_t g_dispatch_warned;
+static std::deque<rpc_job> g_dispatch_queue;
+static std::mutex g_dispatch_lock, g_ev_newlock;
+static std::condition_variable g_dispatch_cond;
+/*
+ * Accepted connections not yet picked up by the reactor, and routers that
+ * have datagrams queued. Both guarded by g_ev_newlock.
+ */
+static std::vector<std::shared_ptr<EXMDB_CONNECTION>> g_ev_new;
+static std::vector<std::shared_ptr<ROUTER_CONNECTION>> g_ev_ready;
+/* Sockets owned by the reactor; only touched from the reactor thread */
+static std::unordered_map<int, std::shared_ptr<EXMDB_CONNECTION>> g_ev_conns;
+static std::unordered_map<int, std::shared_ptr<ROUTER_CONNECTION>> g_ev_routers;
+#endif
+/* Requests being executed / waiting for a dispatch thread */
+static std::atomic<unsigned int> g_stat_running;
+static std::atomic<size_t> g_stat_queued;
 unsigned int g_enable_dam;
 
+EXMDB_CONNECTION::~EXMDB_CONNECTION()
+{
+	for (auto &&bin : wr_queue)
+		free(bin.pb);
+}
+
 ROUTER_CONNECTION::~ROUTER_CONNECTION()
 {
 	if (sockd >= 0)
 		close(sockd);
 	for (auto &&bin : datagram_list)
 		free(bin.pb);
+	free(wr_cur.pb);
 }
 
-void exmdb_parser_init(size_t max_threads, size_t max_routers)
+void exmdb_parser_init(size_t max_threads, size_t max_routers,
+    size_t dispatch_threads, size_t dispatch_max, bool multiplex)
 {
 	g_max_threads = max_threads;
 	g_max_routers = max_routers;
+	g_dispatch_threads = dispatch_threads;
+	g_dispatch_max = std::max(dispatch_threads, dispatch_max);
+	g_multiplex = multiplex;
 }
 
 std::unique_ptr<EXMDB_CONNECTION> exmdb_parser_make_conn()
@@ -156,10 +224,11 @@ static BOOL exmdb_parser_dispatch(const exreq *prequest, std::unique_ptr<exresp>
 		return ret;
 	auto tend = tp_now();
 	if (!ret || g_exrpc_debug == 2)
-		mlog(LV_DEBUG, "EXRPC %s %s %5luµs %s", znul(prequest->dir),
+		mlog(LV_DEBUG, "EXRPC %s %s %5luµs %s (%u running, %zu queued)", znul(prequest->dir),
 		        ret == 0 ? "ERR" : "ok ",
 		        static_cast<unsigned long>(std::chrono::duration_cast<std::chrono::microseconds>(tend - tstart).count()),
-		        exmdb_rpc_idtoname(prequest->call_id));
+		        exmdb_rpc_idtoname(prequest->call_id),
+		        g_stat_running.load(), g_stat_queued.load());
 	return ret;
 }
 
@@ -169,6 +238,653 @@ static inline void stripslash(char *s)
 		s[z-1] = '\0';
 }
 
+#ifdef HAVE_SYS_EPOLL_H
+/*
+ * Event-driven frontend. One reactor thread owns all exmdb sockets: it does
+ * the framing (length prefix, pings, the CONNECT and LISTEN_NOTIFICATION
+ * handshakes), drives the notification channels, and hands complete
+ * requests to a pool of dispatch threads. The pool grows whenever a request
+ * finds no idle thread, so that RPCs blocking on other RPCs (e.g. ones
+ * looping back through exmdb_client) cannot starve the queue. A classic connection
+ * has at most one request in flight, and reading from it is paused until
+ * the response has been queued; a mux connection may have several.
+ */
+
+static inline unsigned int ev_inflight_max(const EXMDB_CONNECTION &conn)
+{
+	return conn.phase == EXMDB_CONNECTION::phase::mux ? 4 * g_dispatch_threads : 1;
+}
+
+static void ev_wake()
+{
+	uint64_t one = 1;
+	if (write(g_evfd, &one, sizeof(one)) != sizeof(one))
+		/* counter already nonzero, reactor will wake anyway */;
+}
+
+/* Recompute the epoll interest set. Caller holds conn.wr_lock. */
+static void ev_update(EXMDB_CONNECTION &conn)
+{
+	if (conn.sockd < 0)
+		return;
+	uint32_t mask = (conn.rd_paused ? 0 : EPOLLIN) |
+	                (conn.wr_queue.empty() ? 0 : EPOLLOUT);
+	if (mask == conn.ev_mask)
+		return;
+	struct epoll_event ev{};
+	ev.events = mask;
+	ev.data.fd = conn.sockd;
+	if (epoll_ctl(g_epfd, EPOLL_CTL_MOD, conn.sockd, &ev) == 0)
+		conn.ev_mask = mask;
+}
+
+/* Write out as much queued output as the socket takes. Caller holds wr_lock. */
+static bool ev_flush(EXMDB_CONNECTION &conn)
+{
+	while (!conn.wr_queue.empty()) {
+		auto &bin = conn.wr_queue.front();
+		auto ret = write(conn.sockd, &bin.pb[conn.wr_off], bin.cb - conn.wr_off);
+		if (ret < 0)
+			return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+		conn.last_time = time(nullptr);
+		conn.wr_off += ret;
+		if (conn.wr_off < bin.cb)
+			continue;
+		free(bin.pb);
+		conn.wr_queue.pop_front();
+		conn.wr_off = 0;
+	}
+	if (conn.wr_close)
+		/* The reactor sees the hangup and closes the socket. */
+		shutdown(conn.sockd, SHUT_RDWR);
+	return true;
+}
+
+/**
+ * Queue @bin (ownership of .pb is taken) as output for @conn. With @last,
+ * no further requests are read and the connection is closed once the
+ * output has been sent.
+ */
+static bool ev_send(EXMDB_CONNECTION &conn, BINARY bin, bool last = false)
+{
+	std::lock_guard lk(conn.wr_lock);
+	if (conn.sockd < 0 || conn.wr_close) {
+		free(bin.pb);
+		return false;
+	}
+	try {
+		conn.wr_queue.push_back(bin);
+	} catch (const std::bad_alloc &) {
+		free(bin.pb);
+		shutdown(conn.sockd, SHUT_RDWR);
+		return false;
+	}
+	if (last)
+		conn.wr_close = conn.rd_paused = true;
+	if (!ev_flush(conn)) {
+		shutdown(conn.sockd, SHUT_RDWR);
+		return false;
+	}
+	ev_update(conn);
+	return true;
+}
+
+/**
+ * Send a bare status code: one byte on a classic connection (any error
+ * ends the connection, as before), a header-only frame on a mux connection.
+ */
+static bool ev_send_code(EXMDB_CONNECTION &conn, exmdb_response code,
+    uint32_t reqid)
+{
+	auto mux = conn.phase == EXMDB_CONNECTION::phase::mux;
+	BINARY bin;
+	bin.cb = mux ? 9 : 1;
+	bin.pb = static_cast<uint8_t *>(malloc(bin.cb));
+	if (bin.pb == nullptr) {
+		std::lock_guard lk(conn.wr_lock);
+		if (conn.sockd >= 0)
+			shutdown(conn.sockd, SHUT_RDWR);
+		return false;
+	}
+	bin.pb[0] = static_cast<uint8_t>(code);
+	if (mux) {
+		cpu_to_le32p(&bin.pb[1], sizeof(uint32_t));
+		cpu_to_le32p(&bin.pb[5], reqid);
+	}
+	return ev_send(conn, bin, !mux && code != exmdb_response::success);
+}
+
+/* @rsp is the output of exmdb_ext_push_response; mux frames get the reqid spliced in. */
+static bool ev_send_rsp(EXMDB_CONNECTION &conn, uint32_t reqid, BINARY &rsp)
+{
+	if (conn.phase != EXMDB_CONNECTION::phase::mux) {
+		auto bin = rsp;
+		rsp = {};
+		return ev_send(conn, bin);
+	}
+	BINARY bin;
+	bin.cb = rsp.cb + sizeof(uint32_t);
+	bin.pb = static_cast<uint8_t *>(malloc(bin.cb));
+	if (bin.pb == nullptr)
+		return ev_send_code(conn, exmdb_response::lack_memory, reqid);
+	bin.pb[0] = rsp.pb[0];
+	cpu_to_le32p(&bin.pb[1], sizeof(uint32_t) + rsp.cb - 5);
+	cpu_to_le32p(&bin.pb[5], reqid);
+	memcpy(&bin.pb[9], &rsp.pb[5], rsp.cb - 5);
+	return ev_send(conn, bin);
+}
+
+static void rpc_process(rpc_job &job)
+{
+	auto &conn = *job.conn;
+	uint32_t reqid = 0;
+	BINARY tmp_bin;
+	tmp_bin.pb = job.buf.get();
+	tmp_bin.cb = job.len;
+	if (conn.phase == EXMDB_CONNECTION::phase::mux) {
+		reqid = le32p_to_cpu(job.buf.get());
+		tmp_bin.pb += sizeof(uint32_t);
+		tmp_bin.cb -= sizeof(uint32_t);
+	}
+	exmdb_server::build_env(conn.b_private ? EM_PRIVATE : 0, nullptr);
+	exmdb_server::set_remote_id(conn.remote_id.c_str());
+	auto cl_0 = HX::make_scope_exit([]() {
+		exmdb_server::free_env();
+		exmdb_server::set_remote_id(nullptr);
+	});
+	std::unique_ptr<exreq> request;
+	auto status = exmdb_ext_pull_request(&tmp_bin, request);
+	if (status != pack_result::ok || request == nullptr) {
+		ev_send_code(conn, exmdb_response::pull_error, reqid);
+		return;
+	}
+	if (request->call_id == exmdb_callid::connect ||
+	    request->call_id == exmdb_callid::listen_notification) {
+		ev_send_code(conn, exmdb_response::dispatch_error, reqid);
+		return;
+	}
+	if (request->dir != nullptr)
+		stripslash(request->dir);
+	std::unique_ptr<exresp> response;
+	if (!exmdb_parser_dispatch(request.get(), response)) {
+		ev_send_code(conn, exmdb_response::dispatch_error, reqid);
+		return;
+	}
+	if (exmdb_ext_push_response(response.get(), &tmp_bin) != pack_result::ok) {
+		ev_send_code(conn, exmdb_response::push_error, reqid);
+		return;
+	}
+	ev_send_rsp(conn, reqid, tmp_bin);
+	free(tmp_bin.pb);
+}
+
+/* @spare: thread was started on demand and should exit when idle */
+static void dispatch_loop(bool spare)
+{
+	auto have_work = []() { return g_notify_stop || !g_dispatch_queue.empty(); };
+	std::unique_lock lk(g_dispatch_lock);
+	while (true) {
+		++g_dispatch_idle;
+		bool woken = true;
+		if (!spare)
+			g_dispatch_cond.wait(lk, have_work);
+		else
+			woken = g_dispatch_cond.wait_for(lk, std::chrono::seconds(60), have_work);
+		--g_dispatch_idle;
+		if (g_notify_stop)
+			/* exmdb_parser_stop joins us */
+			break;
+		if (!woken) {
+			auto self = pthread_self();
+			std::erase_if(g_dispatch_workers, [&](pthread_t t) { return pthread_equal(t, self); });
+			g_dispatch_reap.push_back(self);
+			break;
+		}
+		auto job = std::move(g_dispatch_queue.front());
+		g_dispatch_queue.pop_front();
+		g_stat_queued = g_dispatch_queue.size();
+		lk.unlock();
+		++g_stat_running;
+		rpc_process(job);
+		--g_stat_running;
+		auto &conn = *job.conn;
+		std::unique_lock wr_hold(conn.wr_lock);
+		--conn.inflight;
+		if (conn.rd_paused && !conn.wr_close &&
+		    conn.inflight < ev_inflight_max(conn)) {
+			conn.rd_paused = false;
+			ev_update(conn);
+		}
+		wr_hold.unlock();
+		job = {};
+		lk.lock();
+	}
+}
+
+static void *dispatch_worker(void *)
+{
+	dispatch_loop(false);
+	return nullptr;
+}
+
+static void *dispatch_spare(void *)
+{
+	dispatch_loop(true);
+	return nullptr;
+}
+
+/* Start another dispatch thread if all are busy. Caller holds g_dispatch_lock. */
+static void dispatch_grow()
+{
+	if (g_dispatch_queue.size() <= g_dispatch_idle)
+		return;
+	if (g_dispatch_workers.size() >= g_dispatch_max) {
+		auto now = time(nullptr);
+		if (now - g_dispatch_warned >= 60) {
+			g_dispatch_warned = now;
+			mlog(LV_WARN, "W-1820: exmdb_provider: all %zu dispatch threads (dispatch_threads_max) busy, %zu requests queued",
+			        g_dispatch_workers.size(), g_dispatch_queue.size());
+		}
+		return;
+	}
+	try {
+		/* so that neither the spare nor its exit path needs to allocate */
+		g_dispatch_workers.reserve(g_dispatch_workers.size() + 1);
+		g_dispatch_reap.reserve(g_dispatch_workers.size() + g_dispatch_reap.size() + 1);
+	} catch (const std::bad_alloc &) {
+		mlog(LV_ERR, "E-1822: ENOMEM");
+		return;
+	}
+	pthread_t tid;
+	auto ret = pthread_create4(&tid, nullptr, dispatch_spare);
+	if (ret != 0) {
+		mlog(LV_WARN, "W-1821: pthread_create: %s", strerror(ret));
+		return;
+	}
+	pthread_setname_np(tid, "exmdb/dispatch");
+	g_dispatch_workers.push_back(tid);
+}
+
+/*
+ * Join spares that have exited. A thread in g_dispatch_reap has already
+ * released g_dispatch_lock for the last time.
+ */
+static void dispatch_reap()
+{
+	std::lock_guard lk(g_dispatch_lock);
+	for (auto tid : g_dispatch_reap)
+		pthread_join(tid, nullptr);
+	g_dispatch_reap.clear();
+}
+
+static void dispatch_log_stats()
+{
+	std::unique_lock lk(g_dispatch_lock);
+	auto nthr = g_dispatch_workers.size();
+	auto queued = g_dispatch_queue.size();
+	lk.unlock();
+	if (nthr <= g_dispatch_threads && queued == 0)
+		return;
+	mlog(LV_NOTICE, "exmdb_provider: %zu dispatch threads (%zu resident), %u requests running, %zu queued",
+	        nthr, g_dispatch_threads, g_stat_running.load(), queued);
+}
+
+static void ev_close(std::shared_ptr<EXMDB_CONNECTION> conn)
+{
+	std::unique_lock wr_hold(conn->wr_lock);
+	auto fd = conn->sockd;
+	if (fd >= 0) {
+		epoll_ctl(g_epfd, EPOLL_CTL_DEL, fd, nullptr);
+		close(fd);
+		conn->sockd = -1;
+	}
+	for (auto &&bin : conn->wr_queue)
+		free(bin.pb);
+	conn->wr_queue.clear();
+	wr_hold.unlock();
+	g_ev_conns.erase(fd);
+	std::lock_guard chold(g_connection_lock);
+	g_connection_list.erase(conn);
+}
+
+static void ev_router_update(ROUTER_CONNECTION &rt)
+{
+	uint32_t mask = EPOLLIN | (rt.wr_cur.pb != nullptr ? EPOLLOUT : 0);
+	if (mask == rt.ev_mask)
+		return;
+	struct epoll_event ev{};
+	ev.events = mask;
+	ev.data.fd = rt.sockd;
+	if (epoll_ctl(g_epfd, EPOLL_CTL_MOD, rt.sockd, &ev) == 0)
+		rt.ev_mask = mask;
+}
+
+static void ev_router_close(std::shared_ptr<ROUTER_CONNECTION> rt)
+{
+	auto fd = rt->sockd;
+	epoll_ctl(g_epfd, EPOLL_CTL_DEL, fd, nullptr);
+	close(fd);
+	rt->sockd = -1;
+	g_ev_routers.erase(fd);
+	exmdb_parser_erase_router(rt);
+}
+
+/**
+ * Turn @conn into a notification channel. The socket stays registered with
+ * the reactor, but is now driven by notification_agent_ev_*.
+ */
+static bool ev_make_router(const std::shared_ptr<EXMDB_CONNECTION> &conn,
+    const char *remote_id)
+{
+	auto rt = std::make_shared<ROUTER_CONNECTION>();
+	rt->remote_id = remote_id;
+	std::unique_lock r_hold(g_router_lock);
+	if (g_max_routers == 0 || g_router_list.size() >= g_max_routers) {
+		r_hold.unlock();
+		return ev_send_code(*conn, exmdb_response::max_reached, 0);
+	}
+	std::unique_lock wr_hold(conn->wr_lock);
+	auto fd = conn->sockd;
+	if (!conn->wr_queue.empty())
+		/* a pong is still stuck in the send buffer */
+		return false;
+	g_router_list.push_back(rt);
+	try {
+		g_ev_routers.emplace(fd, rt);
+	} catch (const std::bad_alloc &) {
+		g_router_list.pop_back();
+		throw;
+	}
+	static constexpr uint8_t ack[5]{};
+	if (write(fd, ack, sizeof(ack)) != sizeof(ack)) {
+		g_ev_routers.erase(fd);
+		g_router_list.pop_back();
+		return false;
+	}
+	rt->sockd = fd;
+	rt->ev_mask = conn->ev_mask;
+	rt->last_time = time(nullptr);
+	conn->sockd = -1;
+	wr_hold.unlock();
+	r_hold.unlock();
+	g_ev_conns.erase(fd);
+	ev_router_update(*rt);
+	std::lock_guard chold(g_connection_lock);
+	g_connection_list.erase(conn);
+	return true;
+}
+
+/**
+ * Handle the first request on a connection, which must be CONNECT or
+ * LISTEN_NOTIFICATION. Returns false if the connection is to be closed.
+ */
+static bool ev_handshake(const std::shared_ptr<EXMDB_CONNECTION> &conn,
+    uint8_t *buf, uint32_t len) try
+{
+	exmdb_server::build_env(0, nullptr);
+	auto cl_0 = HX::make_scope_exit(exmdb_server::free_env);
+	BINARY tmp_bin;
+	tmp_bin.pb = buf;
+	tmp_bin.cb = len;
+	std::unique_ptr<exreq> request;
+	auto status = exmdb_ext_pull_request(&tmp_bin, request);
+	if (status != pack_result::ok || request == nullptr)
+		return ev_send_code(*conn, exmdb_response::pull_error, 0);
+	if (request->call_id == exmdb_callid::listen_notification)
+		return ev_make_router(conn, static_cast<const exreq_listen_notification *>(request.get())->remote_id);
+	if (request->call_id != exmdb_callid::connect)
+		return ev_send_code(*conn, exmdb_response::connect_incomplete, 0);
+	auto &q = *static_cast<const exreq_connect *>(request.get());
+	BOOL b_private = false;
+	if (!exmdb_parser_is_local(q.prefix, &b_private))
+		return ev_send_code(*conn, exmdb_response::misconfig_prefix, 0);
+	if (b_private != q.b_private)
+		return ev_send_code(*conn, exmdb_response::misconfig_mode, 0);
+	conn->remote_id = q.remote_id;
+	conn->b_private = b_private;
+	auto mux = q.proto == exmdb_proto::mux && g_multiplex;
+	BINARY ack;
+	ack.cb = mux ? 9 : 5;
+	ack.pb = static_cast<uint8_t *>(calloc(1, ack.cb));
+	if (ack.pb == nullptr)
+		return false;
+	if (mux) {
+		cpu_to_le32p(&ack.pb[1], sizeof(uint32_t));
+		cpu_to_le32p(&ack.pb[5], static_cast<uint32_t>(exmdb_proto::mux));
+	}
+	conn->phase = mux ? EXMDB_CONNECTION::phase::mux : EXMDB_CONNECTION::phase::classic;
+	return ev_send(*conn, ack);
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-1728: ENOMEM");
+	return false;
+}
+
+/* A frame has been read completely; process or enqueue it. */
+static bool ev_frame(const std::shared_ptr<EXMDB_CONNECTION> &conn) try
+{
+	auto buf = std::move(conn->rd_buf);
+	auto len = conn->rd_len;
+	conn->rd_len = conn->rd_off = 0;
+	if (conn->phase == EXMDB_CONNECTION::phase::handshake)
+		return ev_handshake(conn, buf.get(), len);
+	std::unique_lock wr_hold(conn->wr_lock);
+	if (++conn->inflight >= ev_inflight_max(*conn)) {
+		conn->rd_paused = true;
+		ev_update(*conn);
+	}
+	wr_hold.unlock();
+	std::unique_lock lk(g_dispatch_lock);
+	g_dispatch_queue.push_back(rpc_job{conn, std::move(buf), len});
+	g_stat_queued = g_dispatch_queue.size();
+	dispatch_grow();
+	lk.unlock();
+	g_dispatch_cond.notify_one();
+	return true;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-1731: ENOMEM");
+	return false;
+}
+
+/* Returns false if the connection is to be closed. */
+static bool ev_read(const std::shared_ptr<EXMDB_CONNECTION> &conn)
+{
+	while (conn->sockd >= 0) {
+		{
+			std::lock_guard wr_hold(conn->wr_lock);
+			if (conn->rd_paused)
+				return true;
+		}
+		ssize_t ret;
+		if (conn->rd_buf == nullptr)
+			ret = read(conn->sockd, &conn->rd_hdr[conn->rd_off],
+			      sizeof(conn->rd_hdr) - conn->rd_off);
+		else
+			ret = read(conn->sockd, &conn->rd_buf[conn->rd_off],
+			      conn->rd_len - conn->rd_off);
+		if (ret == 0)
+			return false;
+		else if (ret < 0)
+			return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+		conn->last_time = time(nullptr);
+		conn->rd_off += ret;
+		if (conn->rd_buf != nullptr) {
+			if (conn->rd_off == conn->rd_len && !ev_frame(conn))
+				return false;
+			continue;
+		}
+		if (conn->rd_off < sizeof(conn->rd_hdr))
+			continue;
+		conn->rd_off = 0;
+		conn->rd_len = le32p_to_cpu(conn->rd_hdr);
+		if (conn->rd_len == 0) {
+			/* ping packet */
+			if (!ev_send_code(*conn, exmdb_response::success, 0))
+				return false;
+			continue;
+		} else if (conn->rd_len >= UINT_MAX) {
+			return false;
+		} else if (conn->phase == EXMDB_CONNECTION::phase::mux &&
+		    conn->rd_len < sizeof(uint32_t)) {
+			return false;
+		}
+		conn->rd_buf.reset(static_cast<uint8_t *>(malloc(conn->rd_len)));
+		if (conn->rd_buf == nullptr)
+			return conn->phase != EXMDB_CONNECTION::phase::mux &&
+			       ev_send_code(*conn, exmdb_response::lack_memory, 0);
+	}
+	return true;
+}
+
+static void ev_conn_event(std::shared_ptr<EXMDB_CONNECTION> conn, uint32_t events)
+{
+	if (events & (EPOLLHUP | EPOLLERR) || !ev_read(conn)) {
+		ev_close(std::move(conn));
+		return;
+	}
+	if (!(events & EPOLLOUT) || conn->sockd < 0)
+		return;
+	std::unique_lock wr_hold(conn->wr_lock);
+	if (!ev_flush(*conn)) {
+		wr_hold.unlock();
+		ev_close(std::move(conn));
+		return;
+	}
+	ev_update(*conn);
+}
+
+static void ev_router_event(std::shared_ptr<ROUTER_CONNECTION> rt, uint32_t events)
+{
+	if (events & (EPOLLHUP | EPOLLERR) ||
+	    (events & EPOLLIN && !notification_agent_ev_read(*rt)) ||
+	    (events & EPOLLOUT && !notification_agent_ev_write(*rt, false))) {
+		ev_router_close(std::move(rt));
+		return;
+	}
+	ev_router_update(*rt);
+}
+
+static void ev_adopt(time_t now)
+{
+	std::vector<std::shared_ptr<EXMDB_CONNECTION>> list;
+	{
+		std::lock_guard lk(g_ev_newlock);
+		list.swap(g_ev_new);
+	}
+	for (auto &&conn : list) {
+		conn->last_time = now;
+		conn->ev_mask = EPOLLIN;
+		struct epoll_event ev{};
+		ev.events = EPOLLIN;
+		ev.data.fd = conn->sockd;
+		try {
+			g_ev_conns.emplace(conn->sockd, conn);
+		} catch (const std::bad_alloc &) {
+			ev_close(std::move(conn));
+			continue;
+		}
+		if (epoll_ctl(g_epfd, EPOLL_CTL_ADD, conn->sockd, &ev) != 0)
+			ev_close(std::move(conn));
+	}
+}
+
+/*
+ * Send datagrams that were queued by notification_agent_backward_notify.
+ * Only the routers named by exmdb_parser_wake_router are looked at.
+ */
+static void ev_kick_routers()
+{
+	std::vector<std::shared_ptr<ROUTER_CONNECTION>> list;
+	{
+		std::lock_guard lk(g_ev_newlock);
+		list.swap(g_ev_ready);
+		for (const auto &rt : list)
+			rt->ev_ready = false;
+	}
+	for (auto &&rt : list) {
+		if (rt->sockd < 0)
+			/* closed in the meantime */
+			continue;
+		if (!notification_agent_ev_write(*rt, false))
+			ev_router_close(std::move(rt));
+		else
+			ev_router_update(*rt);
+	}
+}
+
+static void ev_sweep(time_t now)
+{
+	for (auto it = g_ev_conns.begin(); it != g_ev_conns.end(); ) {
+		auto conn = it->second;
+		++it;
+		std::unique_lock wr_hold(conn->wr_lock);
+		auto idle = conn->inflight == 0 && now - conn->last_time >= SOCKET_TIMEOUT;
+		wr_hold.unlock();
+		if (idle)
+			ev_close(std::move(conn));
+	}
+	static_assert(SOCKET_TIMEOUT >= 3, "integer underflow");
+	for (auto it = g_ev_routers.begin(); it != g_ev_routers.end(); ) {
+		auto rt = it->second;
+		++it;
+		bool ok = true;
+		if (rt->wait_ack || rt->wr_cur.pb != nullptr)
+			ok = now - rt->last_time < SOCKET_TIMEOUT;
+		else if (now - rt->last_time >= SOCKET_TIMEOUT - 3)
+			ok = notification_agent_ev_write(*rt, true);
+		if (!ok)
+			ev_router_close(std::move(rt));
+		else
+			ev_router_update(*rt);
+	}
+}
+
+static void *ev_reactor(void *)
+{
+	struct epoll_event events[64];
+	auto last_sweep = time(nullptr);
+	while (!g_notify_stop) {
+		auto num = epoll_wait(g_epfd, events, std::size(events), 1000);
+		if (num < 0 && errno != EINTR) {
+			mlog(LV_ERR, "E-1733: epoll_wait: %s", strerror(errno));
+			break;
+		}
+		auto now = time(nullptr);
+		for (int i = 0; i < num; ++i) {
+			auto fd = events[i].data.fd;
+			if (fd == g_evfd) {
+				uint64_t cnt;
+				if (read(g_evfd, &cnt, sizeof(cnt)) < 0)
+					/* ignore */;
+				ev_adopt(now);
+				ev_kick_routers();
+				continue;
+			}
+			auto ci = g_ev_conns.find(fd);
+			if (ci != g_ev_conns.end()) {
+				ev_conn_event(ci->second, events[i].events);
+				continue;
+			}
+			auto ri = g_ev_routers.find(fd);
+			if (ri != g_ev_routers.end())
+				ev_router_event(ri->second, events[i].events);
+		}
+		if (now != last_sweep) {
+			last_sweep = now;
+			ev_sweep(now);
+			dispatch_reap();
+			if (now % 300 == 0)
+				dispatch_log_stats();
+		}
+	}
+	while (!g_ev_conns.empty())
+		ev_close(g_ev_conns.begin()->second);
+	while (!g_ev_routers.empty())
+		ev_router_close(g_ev_routers.begin()->second);
+	return nullptr;
+}
+
+#else /* !HAVE_SYS_EPOLL_H */
+
 static void *request_parser_thread(void *pparam)
 {
 	void *pbuff;
@@ -317,7 +1033,7 @@ static void *request_parser_thread(void *pparam)
 							pconnection->thr_id = {};
 							pconnection->sockd = -1;
 							prouter->last_time = time(nullptr);
-							g_router_list.insert(prouter);
+							g_router_list.push_back(prouter);
 							r_hold.unlock();
 							std::unique_lock chold(g_connection_lock);
 							g_connection_list.erase(pconnection);
@@ -356,41 +1072,84 @@ static void *request_parser_thread(void *pparam)
 	return nullptr;
 }
 
+#endif
+
 void exmdb_parser_insert_conn(std::unique_ptr<EXMDB_CONNECTION> &&pconnection)
 {
+#ifdef HAVE_SYS_EPOLL_H
+	std::shared_ptr<EXMDB_CONNECTION> conn;
+	try {
+		conn = std::move(pconnection);
+	} catch (const std::bad_alloc &) {
+		mlog(LV_ERR, "E-1741: ENOMEM");
+		return;
+	}
+	auto fl = fcntl(conn->sockd, F_GETFL);
+	if (fl < 0 || fcntl(conn->sockd, F_SETFL, fl | O_NONBLOCK) != 0)
+		return;
+	try {
+		std::lock_guard chold(g_connection_lock);
+		g_connection_list.insert(conn);
+	} catch (const std::bad_alloc &) {
+		mlog(LV_ERR, "E-1741: ENOMEM");
+		return;
+	}
+	try {
+		std::lock_guard lk(g_ev_newlock);
+		g_ev_new.push_back(conn);
+	} catch (const std::bad_alloc &) {
+		mlog(LV_ERR, "E-1741: ENOMEM");
+		std::lock_guard chold(g_connection_lock);
+		g_connection_list.erase(conn);
+		return;
+	}
+	ev_wake();
+#else
 	auto ret = pthread_create4(&pconnection->thr_id, nullptr,
 	           request_parser_thread, pconnection.get());
 	if (ret != 0)
 		mlog(LV_WARN, "W-1440: pthread_create: %s", strerror(ret));
 	else
 		pconnection.release(); /* thread should be vivid now */
+#endif
 }
 
-std::shared_ptr<ROUTER_CONNECTION> exmdb_parser_extract_router(const char *remote_id)
+std::shared_ptr<ROUTER_CONNECTION> exmdb_parser_get_router(const char *remote_id)
 {
 	std::lock_guard rhold(g_router_lock);
 	auto it = std::find_if(g_router_list.begin(), g_router_list.end(),
 	          [&](const auto &r) { return r->remote_id == remote_id; });
 	if (it == g_router_list.end())
 		return nullptr;
-	auto rt = *it;
-	g_router_list.erase(it);
-	return rt;
+	g_router_list.splice(g_router_list.end(), g_router_list, it);
+	return *it;
 }
 
-void exmdb_parser_insert_router(std::shared_ptr<ROUTER_CONNECTION> &&pconnection)
+/* New datagrams have been queued on @rt */
+void exmdb_parser_wake_router(const std::shared_ptr<ROUTER_CONNECTION> &rt)
 {
-	std::lock_guard rhold(g_router_lock);
+#ifdef HAVE_SYS_EPOLL_H
 	try {
-		g_router_list.insert(std::move(pconnection));
+		std::lock_guard lk(g_ev_newlock);
+		if (!rt->ev_ready) {
+			g_ev_ready.push_back(rt);
+			rt->ev_ready = true;
+		}
 	} catch (const std::bad_alloc &) {
+		/* sent along with the next ack or ping */
+		mlog(LV_ERR, "E-1829: ENOMEM");
+		return;
 	}
+	ev_wake();
+#else
+	rt->waken_cond.notify_one();
+#endif
 }
 
 BOOL exmdb_parser_erase_router(const std::shared_ptr<ROUTER_CONNECTION> &pconnection)
 {
 	std::lock_guard rhold(g_router_lock);
-	auto it = g_router_list.find(pconnection);
+	auto it = std::find(g_router_list.begin(), g_router_list.end(), pconnection);
 	if (it == g_router_list.cend())
 		return false;
 	g_router_list.erase(it);
@@ -406,13 +1165,86 @@ int exmdb_parser_run(const char *config_path)
 	}
 	std::erase_if(g_local_list,
 		[&](const EXMDB_ITEM &s) { return !HX_ipaddr_is_local(s.host.c_str(), AI_V4MAPPED); });
+#ifdef HAVE_SYS_EPOLL_H
+	if (g_dispatch_threads == 0)
+		/* not listening */
+		return 0;
+	g_notify_stop = false;
+	g_epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (g_epfd < 0) {
+		mlog(LV_ERR, "E-1756: epoll_create: %s", strerror(errno));
+		return 1;
+	}
+	g_evfd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (g_evfd < 0) {
+		mlog(LV_ERR, "E-1760: eventfd: %s", strerror(errno));
+		exmdb_parser_stop();
+		return 1;
+	}
+	struct epoll_event ev{};
+	ev.events = EPOLLIN;
+	ev.data.fd = g_evfd;
+	if (epoll_ctl(g_epfd, EPOLL_CTL_ADD, g_evfd, &ev) != 0) {
+		mlog(LV_ERR, "E-1760: epoll_ctl: %s", strerror(errno));
+		exmdb_parser_stop();
+		return 1;
+	}
+	g_dispatch_workers.reserve(g_dispatch_threads);
+	for (size_t i = 0; i < g_dispatch_threads; ++i) {
+		pthread_t tid;
+		ret = pthread_create4(&tid, nullptr, dispatch_worker, nullptr);
+		if (ret != 0) {
+			mlog(LV_ERR, "E-1714: pthread_create: %s", strerror(ret));
+			exmdb_parser_stop();
+			return 1;
+		}
+		pthread_setname_np(tid, "exmdb/dispatch");
+		g_dispatch_workers.push_back(tid);
+	}
+	ret = pthread_create4(&g_reactor_id, nullptr, ev_reactor, nullptr);
+	if (ret != 0) {
+		mlog(LV_ERR, "E-1714: pthread_create: %s", strerror(ret));
+		exmdb_parser_stop();
+		return 1;
+	}
+	pthread_setname_np(g_reactor_id, "exmdb/reactor");
+	g_reactor_started = true;
+#endif
 	return 0;
 }
 
 void exmdb_parser_stop()
 {
+#ifdef HAVE_SYS_EPOLL_H
+	g_notify_stop = true;
+	if (g_reactor_started) {
+		ev_wake();
+		pthread_join(g_reactor_id, nullptr);
+		g_reactor_started = false;
+	}
+	dispatch_reap();
+	std::unique_lock dhold(g_dispatch_lock);
+	auto tids = std::move(g_dispatch_workers);
+	g_dispatch_workers.clear();
+	dhold.unlock();
+	g_dispatch_cond.notify_all();
+	for (auto tid : tids)
+		pthread_join(tid, nullptr);
+	dhold.lock();
+	g_dispatch_queue.clear();
+	dhold.unlock();
+	g_ev_new.clear();
+	if (g_evfd >= 0) {
+		close(g_evfd);
+		g_evfd = -1;
+	}
+	if (g_epfd >= 0) {
+		close(g_epfd);
+		g_epfd = -1;
+	}
+#else
 	std::vector<pthread_t> pthr_ids;
-	
+
 	std::unique_lock chold(g_connection_lock);
 	size_t num = g_connection_list.size();
 	pthr_ids.reserve(num);
@@ -447,4 +1279,5 @@ void exmdb_parser_stop()
 		for (auto tid : pthr_ids)
 			pthread_join(tid, nullptr);
 	}
+#endif
 }
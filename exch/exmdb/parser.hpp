@@ -1,5 +1,8 @@
 #pragma once
+#include <atomic>
 #include <condition_variable>
+#include <ctime>
+#include <deque>
 #include <list>
 #include <memory>
 #include <mutex>
@@ -7,16 +10,35 @@
 #include <string>
 #include <gromox/atomic.hpp>
 #include <gromox/common_types.hpp>
+#include <gromox/defs.h>
 #include <gromox/generic_connection.hpp>
 
 class EXMDB_CONNECTION : public GENERIC_CONNECTION {
 	public:
+	enum class phase : uint8_t { handshake, classic, mux };
+
 	EXMDB_CONNECTION() = default;
 	NOMOVE(EXMDB_CONNECTION);
+	~EXMDB_CONNECTION();
 
 	gromox::atomic_bool b_stop{false};
 	pthread_t thr_id{};
 	std::string remote_id;
+	std::mutex wr_lock; /* serializes responses, event mask updates and sockd teardown */
+
+	/* Reactor state; the read side is only touched by the reactor thread */
+	enum phase phase = phase::handshake;
+	BOOL b_private = false;
+	uint8_t rd_hdr[4]{};
+	uint32_t rd_len = 0, rd_off = 0;
+	std::unique_ptr<uint8_t[], gromox::stdlib_delete> rd_buf;
+	std::atomic<time_t> last_time{0};
+	/* Protected by wr_lock */
+	bool rd_paused = false, wr_close = false;
+	unsigned int inflight = 0;
+	uint32_t ev_mask = 0;
+	std::deque<BINARY> wr_queue; /* manual (de)allocation of .pb */
+	size_t wr_off = 0;
 };
 
 struct ROUTER_CONNECTION {
@@ -32,15 +54,21 @@ struct ROUTER_CONNECTION {
 	std::mutex lock, cond_mutex;
 	std::condition_variable waken_cond;
 	std::list<BINARY> datagram_list; /* manual (de)allocation of .pb */
+	/* Reactor state (datagram being sent, awaiting acknowledgement) */
+	BINARY wr_cur{};
+	size_t wr_off = 0;
+	bool wait_ack = false;
+	bool ev_ready = false; /* on g_ev_ready (under g_ev_newlock) */
+	uint32_t ev_mask = 0;
 };
 
-extern void exmdb_parser_init(size_t max_threads, size_t max_routers);
+extern void exmdb_parser_init(size_t max_threads, size_t max_routers, size_t dispatch_threads, size_t dispatch_max, bool multiplex);
 extern int exmdb_parser_run(const char *config_path);
 extern void exmdb_parser_stop();
 extern std::unique_ptr<EXMDB_CONNECTION> exmdb_parser_make_conn();
 extern void exmdb_parser_insert_conn(std::unique_ptr<EXMDB_CONNECTION> &&);
-extern std::shared_ptr<ROUTER_CONNECTION> exmdb_parser_extract_router(const char *remote_id);
-extern void exmdb_parser_insert_router(std::shared_ptr<ROUTER_CONNECTION> &&);
+extern std::shared_ptr<ROUTER_CONNECTION> exmdb_parser_get_router(const char *remote_id);
+extern void exmdb_parser_wake_router(const std::shared_ptr<ROUTER_CONNECTION> &);
 extern BOOL exmdb_parser_erase_router(const std::shared_ptr<ROUTER_CONNECTION> &);
 
 extern unsigned int g_exrpc_debug, g_enable_dam;
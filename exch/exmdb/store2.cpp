@@ -626,6 +626,44 @@ BOOL exmdb_server::imapfile_read(const char *dir, const std::string &type,
 	return TRUE;
 }
 
+/**
+ * Read at most @length bytes starting at @offset. @size receives the total
+ * file size, so that callers can stream a file in pieces or fetch just the
+ * MIME parts they need. Reading beyond EOF yields an empty @data.
+ */
+BOOL exmdb_server::imapfile_read_range(const char *dir, const std::string &type,
+    const std::string &mid, uint64_t offset, uint32_t length, uint64_t *size,
+    std::string *data) try
+{
+	if (!imapfile_type_ok(type) || mid.find('/') != mid.npos)
+		return false;
+	wrapfd fd = open((dir + "/"s + type + "/" + mid).c_str(), O_RDONLY);
+	struct stat sb;
+	if (fd.get() < 0 || fstat(fd.get(), &sb) != 0 || !S_ISREG(sb.st_mode))
+		return false;
+	*size = sb.st_size;
+	data->clear();
+	if (offset >= *size)
+		return TRUE;
+	data->resize(std::min(static_cast<uint64_t>(length), *size - offset));
+	size_t done = 0;
+	while (done < data->size()) {
+		auto ret = pread(fd.get(), &(*data)[done], data->size() - done, offset + done);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0)
+			return false;
+		if (ret == 0)
+			break; /* truncated meanwhile */
+		done += ret;
+	}
+	data->resize(done);
+	return TRUE;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-1784: ENOMEM");
+	return false;
+}
+
 BOOL exmdb_server::imapfile_write(const char *dir, const std::string &type,
     const std::string &mid, const std::string &data)
 {
@@ -838,8 +838,27 @@ static BOOL table_load_content_table(db_conn_ptr &pdb, db_base_wr_ptr &dbase,
 	if (pstmt == nullptr)
 		return false;
 	uint64_t last_row_id = 0;
-	while (pstmt.step() == SQLITE_ROW) {
-		uint64_t mid_val = pstmt.col_uint64(0);
+	/*
+	 * Candidates are read in blocks so that the restriction can be
+	 * evaluated for the whole block at once.
+	 */
+	std::vector<uint64_t> mid_block;
+	size_t mid_pos = 0;
+	bool more = true;
+	msg_restriction_plan plan(conv_id == nullptr ? prestriction : nullptr);
+	while (true) {
+		if (mid_pos == mid_block.size()) {
+			if (!more)
+				break;
+			mid_block.clear();
+			mid_pos = 0;
+			while (mid_block.size() < 256 && (more = pstmt.step() == SQLITE_ROW))
+				mid_block.push_back(pstmt.col_uint64(0));
+			if (!plan.filter(pdb->psqlite, cpid, mid_block))
+				return false;
+			continue;
+		}
+		uint64_t mid_val = mid_block[mid_pos++];
 		if (conv_id != nullptr) {
 			uint64_t parent_fid = 0;
 			if (common_util_check_message_associated(pdb->psqlite, mid_val))
@@ -849,9 +868,6 @@ static BOOL table_load_content_table(db_conn_ptr &pdb, db_base_wr_ptr &dbase,
 				return false;
 			if (parent_fid == 0)
 				continue;
-		} else if (prestriction != nullptr &&
-		    !cu_eval_msg_restriction(pdb->psqlite, cpid, mid_val, prestriction)) {
-			continue;
 		}
 		sqlite3_bind_int64(pstmt1, 1, mid_val);
 		if (NULL != psorts) {
@@ -1641,9 +1657,35 @@ static BOOL query_hierarchy(db_conn_ptr &&pdb, cpid_t cpid, uint32_t table_id,
 	return TRUE;
 }
 
+/**
+ * The columns of message rows which table_column_content_tmptbl does not
+ * produce by itself and which thus need to come from the message.
+ */
+static std::vector<proptag_t> table_ctnt_msgcols(const PROPTAG_ARRAY *pproptags,
+    const table_node *ptnode)
+{
+	std::vector<proptag_t> tags;
+	for (unsigned int i = 0; i < pproptags->count; ++i) {
+		auto tag = pproptags->pproptag[i];
+		switch (tag) {
+		case PidTagInstID:
+		case PidTagInstanceNum:
+		case PR_ROW_TYPE:
+		case PR_DEPTH:
+		case PR_CONTENT_COUNT:
+		case PR_CONTENT_UNREAD:
+			continue;
+		}
+		if (ptnode->instance_tag != 0 && tag == ptnode->instance_tag)
+			continue;
+		tags.push_back(tag);
+	}
+	return tags;
+}
+
 static BOOL query_content(db_conn_ptr &&pdb, cpid_t cpid, uint32_t table_id,
     const PROPTAG_ARRAY *pproptags, uint32_t start_pos, int32_t row_needed,
-    const table_node *ptnode, TARRAY_SET *pset)
+    const table_node *ptnode, TARRAY_SET *pset) try
 {
 	char sql_string[1024];
 	int32_t end_pos;
@@ -1692,8 +1734,21 @@ static BOOL query_content(db_conn_ptr &&pdb, cpid_t cpid, uint32_t table_id,
 	auto optim = pdb->begin_optim();
 	if (optim == nullptr)
 		return FALSE;
+	/*
+	 * Fetch the message columns for the whole row window in one go, then
+	 * walk the window a second time to assemble the rows.
+	 */
+	std::vector<uint64_t> mids;
+	while (pstmt.step() == SQLITE_ROW)
+		if (pstmt.col_uint64(4) == CONTENT_ROW_MESSAGE)
+			mids.push_back(pstmt.col_uint64(3));
+	pstmt.reset();
+	msg_column_set cols;
+	if (!cols.load(pdb->psqlite, cpid, mids,
+	    table_ctnt_msgcols(pproptags, ptnode)))
+		return FALSE;
+	size_t msg_idx = 0;
 	while (pstmt.step() == SQLITE_ROW) {
-		auto inst_id = pstmt.col_uint64(3);
 		uint32_t row_type = pstmt.col_uint64(4);
 		auto mrow = pset->pparray[pset->count] = cu_alloc<TPROPVAL_ARRAY>();
 		if (mrow == nullptr)
@@ -1711,9 +1766,7 @@ static BOOL query_content(db_conn_ptr &&pdb, cpid_t cpid, uint32_t table_id,
 			    ptnode->extremum_tag, &pvalue)) {
 				if (row_type == CONTENT_ROW_HEADER)
 					continue;
-				if (!cu_get_property(MAPI_MESSAGE, inst_id, cpid,
-				    pdb->psqlite, tag, &pvalue))
-					return FALSE;
+				pvalue = cols.get(tag, msg_idx);
 			}
 			if (pvalue == nullptr)
 				continue;
@@ -1731,6 +1784,8 @@ static BOOL query_content(db_conn_ptr &&pdb, cpid_t cpid, uint32_t table_id,
 			}
 			mrow->emplace_back(tag, pvalue);
 		}
+		if (row_type == CONTENT_ROW_MESSAGE)
+			++msg_idx;
 		++pset->count;
 	}
 	optim.reset();
@@ -1738,6 +1793,9 @@ static BOOL query_content(db_conn_ptr &&pdb, cpid_t cpid, uint32_t table_id,
 	if (sql_transact.commit() != SQLITE_OK)
 		return false;
 	return TRUE;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-1813: ENOMEM");
+	return false;
 }
 
 static BOOL query_perm(db_conn_ptr &&pdb, cpid_t cpid, uint32_t table_id,
@@ -2455,7 +2513,7 @@ static BOOL read_tblrow_hier(cpid_t cpid, uint32_t table_id,
 
 static BOOL read_tblrow_ctnt(cpid_t cpid, uint32_t table_id,
     const PROPTAG_ARRAY *pproptags, uint64_t inst_id, uint32_t inst_num,
-    TPROPVAL_ARRAY *ppropvals, db_conn_ptr &pdb, const table_node *ptnode)
+    TPROPVAL_ARRAY *ppropvals, db_conn_ptr &pdb, const table_node *ptnode) try
 {
 	int row_type;
 	char sql_string[1024];
@@ -2499,6 +2557,11 @@ static BOOL read_tblrow_ctnt(cpid_t cpid, uint32_t table_id,
 	ppropvals->ppropval = cu_alloc<TAGGED_PROPVAL>(pproptags->count);
 	if (ppropvals->ppropval == nullptr)
 		return FALSE;
+	msg_column_set cols;
+	if (row_type == CONTENT_ROW_MESSAGE &&
+	    !cols.load(pdb->psqlite, cpid, {&inst_id, 1},
+	    table_ctnt_msgcols(pproptags, ptnode)))
+		return FALSE;
 	for (unsigned int i = 0; i < pproptags->count; ++i) {
 		void *pvalue = nullptr;
 		const auto tag = pproptags->pproptag[i];
@@ -2508,9 +2571,7 @@ static BOOL read_tblrow_ctnt(cpid_t cpid, uint32_t table_id,
 		    ptnode->extremum_tag, &pvalue)) {
 			if (row_type == CONTENT_ROW_HEADER)
 				continue;
-			if (!cu_get_property(MAPI_MESSAGE, inst_id, cpid,
-			    pdb->psqlite, tag, &pvalue))
-				return FALSE;
+			pvalue = cols.get(tag, 0);
 		}
 		if (pvalue == nullptr)
 			continue;
@@ -2530,6 +2591,9 @@ static BOOL read_tblrow_ctnt(cpid_t cpid, uint32_t table_id,
 	}
 	sql_transact_eph = xtransaction();
 	return sql_transact.commit() == SQLITE_OK ? TRUE : false;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-1823: ENOMEM");
+	return false;
 }
 
 /**
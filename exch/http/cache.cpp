@@ -1,6 +1,9 @@
 // SPDX-License-Identifier: GPL-2.0-only WITH linking exception
 // SPDX-FileCopyrightText: 2021-2023 grommunio GmbH
 // This file is part of Gromox.
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
 #include <algorithm>
 #include <cerrno>
 #include <climits>
@@ -13,17 +16,26 @@
 #include <list>
 #include <memory>
 #include <mutex>
+#include <poll.h>
 #include <pthread.h>
 #include <string>
+#include <string_view>
 #include <unistd.h>
 #include <unordered_map>
 #include <utility>
 #include <vector>
 #include <fmt/core.h>
+#include <libHX/ctype_helper.h>
 #include <libHX/string.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#ifdef HAVE_SYS_INOTIFY_H
+#	include <sys/inotify.h>
+#endif
+#ifdef HAVE_SYS_SENDFILE_H
+#	include <sys/sendfile.h>
+#endif
 #include <gromox/atomic.hpp>
 #include <gromox/config_file.hpp>
 #include <gromox/fileio.h>
@@ -49,6 +61,7 @@ struct cache_item {
 	~cache_item();
 
 	const char *content_type = nullptr;
+	const char *content_encoding = nullptr; /* precompressed variant */
 	void *mblk = nullptr;
 	struct stat sb{};
 };
@@ -62,9 +75,12 @@ struct RANGE {
 struct cache_context {
 	std::shared_ptr<cache_item> pitem;
 	bool b_header = false;
+	bool b_vary = false; /* response depends on Accept-Encoding */
+	bool b_sendfile = false; /* body goes out via mod_cache_sendfile */
 	uint32_t offset = 0, until = 0;
 	ssize_t range_pos = -1;
 	std::vector<RANGE> range;
+	wrapfd fd; /* file being served, for sendfile */
 };
 using CACHE_CONTEXT = cache_context;
 
@@ -81,6 +97,23 @@ static std::mutex g_hash_lock;
 static std::vector<DIRECTORY_NODE> g_directory_list;
 static std::unordered_map<std::string, std::shared_ptr<cache_item>> g_cache_hash;
 static std::unique_ptr<CACHE_CONTEXT[]> g_context_list;
+static int g_inotify_fd = -1;
+/*
+ * Directories with cached files that are watched for changes; protected by
+ * g_hash_lock. If a watch could not be set up, the periodic sweep of the
+ * cache is kept on.
+ */
+static std::unordered_map<std::string, int> g_dir_watch;
+static std::unordered_map<int, std::string> g_watch_dir;
+static bool g_sweep_needed = true;
+
+/* Precompressed siblings, in order of preference */
+static constexpr struct {
+	const char *coding, *suffix;
+} g_variants[] = {
+	{"br", ".br"},
+	{"gzip", ".gz"},
+};
 
 cache_item::~cache_item()
 {
@@ -94,28 +127,126 @@ static bool stat4_eq(const struct stat &a, const struct stat &b)
 	       a.st_mtime == b.st_mtime && a.st_size == b.st_size;
 }
 
-static void *mod_cache_scanwork(void *pparam)
+/* Drop cache entries whose file has changed. Caller holds g_hash_lock. */
+static void mod_cache_sweep()
 {
-	int count;
 	struct stat node_stat;
-	
-	count = 0;
-	while (!g_notify_stop) {
-		count ++;
-		if (count < 600) {
-			sleep(1);
+
+	for (auto iter = g_cache_hash.begin(); iter != g_cache_hash.end(); ) {
+		auto &pitem = iter->second;
+		if (stat(iter->first.c_str(), &node_stat) == 0 &&
+		    S_ISREG(node_stat.st_mode) && stat4_eq(node_stat, pitem->sb)) {
+			++iter;
 			continue;
 		}
+		iter = g_cache_hash.erase(iter);
+	}
+}
+
+/* Watch the directory of @path. Caller holds g_hash_lock. */
+static void mod_cache_watch(const std::string &path) try
+{
+#ifdef HAVE_SYS_INOTIFY_H
+	if (g_inotify_fd < 0)
+		return;
+	auto pos = path.rfind('/');
+	if (pos == path.npos)
+		return;
+	auto dir = path.substr(0, pos);
+	if (g_dir_watch.contains(dir))
+		return;
+	auto wd = inotify_add_watch(g_inotify_fd, dir.c_str(), IN_ONLYDIR |
+	          IN_ATTRIB | IN_MODIFY | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE |
+	          IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF);
+	if (wd < 0) {
+		if (!g_sweep_needed)
+			mlog(LV_WARN, "W-1782: mod_cache: inotify_add_watch %s: %s; "
+			        "falling back to periodic checks", dir.c_str(), strerror(errno));
+		g_sweep_needed = true;
+		return;
+	}
+	g_watch_dir.emplace(wd, dir);
+	g_dir_watch.emplace(std::move(dir), wd);
+#endif
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-1824: ENOMEM");
+	g_sweep_needed = true;
+}
+
+#ifdef HAVE_SYS_INOTIFY_H
+/* Caller holds g_hash_lock */
+static void mod_cache_inotify_event(const struct inotify_event &ev)
+{
+	if (ev.mask & IN_Q_OVERFLOW) {
+		/* Events were lost; start over */
+		g_cache_hash.clear();
+		return;
+	}
+	auto wit = g_watch_dir.find(ev.wd);
+	if (wit == g_watch_dir.end())
+		return;
+	const auto &dir = wit->second;
+	if (ev.mask & IN_IGNORED) {
+		g_dir_watch.erase(dir);
+		g_watch_dir.erase(wit);
+		return;
+	}
+	if (ev.mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+		std::erase_if(g_cache_hash, [&](const auto &e) {
+			return e.first.size() > dir.size() && e.first[dir.size()] == '/' &&
+			       e.first.compare(0, dir.size(), dir) == 0;
+		});
+		/* The path no longer leads there; IN_IGNORED will follow. */
+		inotify_rm_watch(g_inotify_fd, ev.wd);
+		return;
+	}
+	if (ev.len == 0)
+		return;
+	g_cache_hash.erase(dir + "/" + ev.name);
+}
+
+static void mod_cache_inotify_read()
+{
+	alignas(struct inotify_event) char buf[4096];
+	ssize_t len;
+	while ((len = read(g_inotify_fd, buf, sizeof(buf))) > 0) {
 		std::lock_guard hhold(g_hash_lock);
-		for (auto iter = g_cache_hash.begin(); iter != g_cache_hash.end(); ) {
-			auto &pitem = iter->second;
-			if (stat(iter->first.c_str(), &node_stat) == 0 &&
-			    S_ISREG(node_stat.st_mode) && stat4_eq(node_stat, pitem->sb)) {
-				++iter;
-				continue;
-			}
-			iter = g_cache_hash.erase(iter);
+		for (ssize_t pos = 0; pos < len; ) {
+			auto ev = reinterpret_cast<const struct inotify_event *>(&buf[pos]);
+			mod_cache_inotify_event(*ev);
+			pos += sizeof(*ev) + ev->len;
 		}
+	}
+}
+#endif
+
+/**
+ * Evicts cache entries of files that changed. Requests always compare the
+ * file against the cached entry, so this is about releasing stale mappings
+ * rather than correctness. Changes are learned from inotify, and only if
+ * that is unavailable is the cache checked every 10 minutes.
+ */
+static void *mod_cache_scanwork(void *pparam)
+{
+	int count = 0;
+
+	while (!g_notify_stop) {
+#ifdef HAVE_SYS_INOTIFY_H
+		if (g_inotify_fd >= 0) {
+			struct pollfd pfd{};
+			pfd.fd = g_inotify_fd;
+			pfd.events = POLLIN;
+			if (poll(&pfd, 1, 1000) > 0)
+				mod_cache_inotify_read();
+		} else
+#endif
+		{
+			sleep(1);
+		}
+		std::unique_lock hhold(g_hash_lock);
+		if (!g_sweep_needed || ++count < 600)
+			continue;
+		mod_cache_sweep();
 		count = 0;
 	}
 	return nullptr;
@@ -175,6 +306,14 @@ int mod_cache_run() try
 	if (ret < 0)
 		return ret;
 	g_context_list = std::make_unique<cache_context[]>(g_context_num);
+#ifdef HAVE_SYS_INOTIFY_H
+	g_inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (g_inotify_fd < 0)
+		mlog(LV_WARN, "W-1783: mod_cache: inotify_init: %s; "
+		        "falling back to periodic checks", strerror(errno));
+	else
+		g_sweep_needed = false;
+#endif
 	g_notify_stop = false;
 	ret = pthread_create4(&g_scan_tid, nullptr, mod_cache_scanwork, nullptr);
 	if (ret != 0) {
@@ -203,6 +342,13 @@ void mod_cache_stop()
 	// CID 1558707 Coverity Scan found tha
 	std::unique_lock lock(g_hash_lock);
 	g_cache_hash.clear();
+	g_dir_watch.clear();
+	g_watch_dir.clear();
+	if (g_inotify_fd >= 0) {
+		close(g_inotify_fd);
+		g_inotify_fd = -1;
+	}
+	g_sweep_needed = true;
 }
 
 static CACHE_CONTEXT* mod_cache_get_cache_context(HTTP_CONTEXT *phttp)
@@ -220,9 +366,13 @@ bool mod_cache_is_in_charge(HTTP_CONTEXT *phttp)
 
 static bool mod_cache_retrieve_etag(const char *etag, struct stat &sb)
 {
-	unsigned int dev, ino;
-	unsigned long long size, mtim;
-	if (sscanf(etag, "%x-%x-%llx-%llx", &dev, &ino, &size, &mtim) != 4)
+	unsigned int dev;
+	unsigned long long ino, size, mtim;
+	if (strncmp(etag, "W/", 2) == 0)
+		etag += 2;
+	if (*etag == '"')
+		++etag;
+	if (sscanf(etag, "%x-%llx-%llx-%llx", &dev, &ino, &size, &mtim) != 4)
 		return false;
 	sb.st_dev = dev;
 	sb.st_ino = ino;
@@ -294,6 +444,10 @@ static BOOL mod_cache_response_single_header(http_context *phttp) try
 		rsp += fmt::format("Accept: GET,POST,OPTIONS,HEAD\r\n");
 	if (pcontent_type != nullptr)
 		rsp += fmt::format("Content-Type: {}\r\n", pcontent_type);
+	if (pcontext->pitem->content_encoding != nullptr)
+		rsp += fmt::format("Content-Encoding: {}\r\n", pcontext->pitem->content_encoding);
+	if (pcontext->b_vary)
+		rsp += "Vary: Accept-Encoding\r\n";
 	if (emit_206)
 		rsp += fmt::format("Content-Range: bytes {}-{}/{}\r\n\r\n",
 		       pcontext->offset, pcontext->until - 1,
@@ -359,6 +513,10 @@ static BOOL mod_cache_response_multiple_header(http_context *phttp) try
 	           date_string, BOUNDARY_STRING, content_length, modified_string);
 	if (mod_cache_serialize_etag(pcontext->pitem->sb, etag, std::size(etag)))
 		rsp += fmt::format("ETag: \"{}\"\r\n", etag);
+	if (pcontext->pitem->content_encoding != nullptr)
+		rsp += fmt::format("Content-Encoding: {}\r\n", pcontext->pitem->content_encoding);
+	if (pcontext->b_vary)
+		rsp += "Vary: Accept-Encoding\r\n";
 	return phttp->stream_out.write(rsp.c_str(), rsp.size()) == STREAM_WRITE_OK ? TRUE : false;
 } catch (const std::bad_alloc &) {
 	mlog(LV_ERR, "E-1736: ENOMEM");
@@ -443,6 +601,66 @@ static http_status mod_cache_parse_range_value(char *value,
 	return http_status::service_unavailable;
 }
 
+/* Whether Accept-Encoding value @hdr admits @coding */
+static bool mod_cache_accepts(const char *hdr, const char *coding)
+{
+	double star_q = 0;
+	for (auto &&tok : gx_split(hdr, ',')) {
+		auto semi = tok.find(';');
+		std::string_view name(tok.c_str(), std::min(semi, tok.size()));
+		while (!name.empty() && HX_isspace(name.front()))
+			name.remove_prefix(1);
+		while (!name.empty() && HX_isspace(name.back()))
+			name.remove_suffix(1);
+		double q = 1;
+		auto qp = semi != tok.npos ? tok.find("q=", semi) : tok.npos;
+		if (qp != tok.npos)
+			q = strtod(&tok[qp+2], nullptr);
+		if (name.size() == strlen(coding) &&
+		    strncasecmp(name.data(), coding, name.size()) == 0)
+			return q > 0;
+		if (name == "*")
+			star_q = q;
+	}
+	return star_q > 0;
+}
+
+/**
+ * Look for a precompressed sibling of @path (e.g. foo.js.br) that the client
+ * accepts, and switch @path, @fd and @sb over to it. Returns the content
+ * coding of the variant, or nullptr to serve the file as-is. @b_vary is set
+ * if any variant exists, since the response then depends on Accept-Encoding.
+ */
+static const char *mod_cache_select_variant(http_context *phttp,
+    std::string &path, wrapfd &fd, struct stat &sb, bool &b_vary) try
+{
+	auto ae = mod_cache_get_others_field(phttp->request.f_others, "Accept-Encoding");
+	struct stat vsb;
+	for (const auto &v : g_variants) {
+		auto vpath = path + v.suffix;
+		if (ae == nullptr || !mod_cache_accepts(ae, v.coding)) {
+			if (!b_vary && stat(vpath.c_str(), &vsb) == 0 && S_ISREG(vsb.st_mode))
+				b_vary = true;
+			continue;
+		}
+		wrapfd vfd(open(vpath.c_str(), O_RDONLY));
+		if (vfd.get() < 0 || fstat(vfd.get(), &vsb) != 0 || !S_ISREG(vsb.st_mode))
+			continue;
+		b_vary = true;
+		if (vsb.st_mtime < sb.st_mtime ||
+		    static_cast<unsigned long long>(vsb.st_size) >= UINT32_MAX)
+			/* older than the original, i.e. stale */
+			continue;
+		path = std::move(vpath);
+		fd = std::move(vfd);
+		sb = vsb;
+		return v.coding;
+	}
+	return nullptr;
+} catch (const std::bad_alloc &) {
+	return nullptr;
+}
+
 http_status mod_cache_take_request(http_context *phttp)
 {
 	char *ptoken;
@@ -451,6 +669,7 @@ http_status mod_cache_take_request(http_context *phttp)
 	struct stat node_stat{};
 	char request_uri[http_request::uri_limit];
 	CACHE_CONTEXT *pcontext;
+	const char *encoding = nullptr;
 	
 	if (!parse_uri(phttp->request.f_request_uri.c_str(), request_uri)) {
 		phttp->log(LV_DEBUG, "request"
@@ -500,6 +719,10 @@ http_status mod_cache_take_request(http_context *phttp)
 		else if (static_cast<unsigned long long>(node_stat.st_size) >= UINT32_MAX)
 			return http_status::server_error;
 		static_assert(UINT32_MAX <= SIZE_MAX);
+		if (phttp->request.imethod == http_method::get ||
+		    phttp->request.imethod == http_method::head)
+			encoding = mod_cache_select_variant(phttp, tmp_path, fd,
+			           node_stat, pcontext->b_vary);
 	}
 	switch (phttp->request.imethod) {
 	case http_method::options:
@@ -543,6 +766,22 @@ http_status mod_cache_take_request(http_context *phttp)
 		pcontext->offset = 0;
 		pcontext->until = node_stat.st_size;
 	}
+#ifdef HAVE_SYS_SENDFILE_H
+	/*
+	 * Plain-HTTP bodies with at most one range are handed to the kernel
+	 * instead of being copied through stream_out.
+	 */
+	pcontext->b_sendfile = !opstar && phttp->connection.ssl == nullptr &&
+		g_http_debug == 0 && pcontext->range.empty() &&
+		pcontext->until > pcontext->offset &&
+		(phttp->request.imethod == http_method::get ||
+		phttp->request.imethod == http_method::post);
+#endif
+	auto done = [&]() {
+		if (pcontext->b_sendfile)
+			pcontext->fd = std::move(fd);
+		return http_status::ok;
+	};
 	std::unique_lock hhold(g_hash_lock);
 	auto iter = g_cache_hash.find(tmp_path);
 	if (iter != g_cache_hash.end()) {
@@ -551,7 +790,7 @@ http_status mod_cache_take_request(http_context *phttp)
 			g_cache_hash.erase(iter);
 		} else {
 			pcontext->pitem = std::move(pitem);
-			return http_status::ok;
+			return done();
 		}
 	}
 	hhold.unlock();
@@ -559,6 +798,7 @@ http_status mod_cache_take_request(http_context *phttp)
 	try {
 	auto pitem = std::make_shared<cache_item>();
 	pitem->content_type = extension_to_mime(suffix);
+	pitem->content_encoding = encoding;
 	pitem->sb = node_stat;
 	hhold.lock();
 	iter = g_cache_hash.find(tmp_path);
@@ -572,15 +812,18 @@ http_status mod_cache_take_request(http_context *phttp)
 			}
 			posix_madvise(pitem->mblk, static_cast<size_t>(node_stat.st_size), POSIX_MADV_SEQUENTIAL);
 		}
+		mod_cache_watch(tmp_path);
 		g_cache_hash.emplace(std::move(tmp_path), pitem);
 		pcontext->pitem = std::move(pitem);
-		return http_status::ok;
+		return done();
 	}
+	/* Someone else was quicker to populate the entry */
+	pcontext->pitem = iter->second;
 	} catch (const std::bad_alloc &) {
 		pcontext->range.clear();
 		return http_status::service_unavailable;
 	}
-	return http_status::ok;
+	return done();
 }
 
 void mod_cache_insert_ctx(HTTP_CONTEXT *phttp)
@@ -591,6 +834,8 @@ void mod_cache_insert_ctx(HTTP_CONTEXT *phttp)
 	pcontext = mod_cache_get_cache_context(phttp);
 	pcontext->pitem.reset();
 	pcontext->range.clear();
+	pcontext->b_sendfile = false;
+	pcontext->fd.close_rd();
 	rq.b_end = false;
 	rq.chunk_size = rq.chunk_offset = 0;
 	rq.content_len = rq.posted_size = 0;
@@ -629,6 +874,9 @@ BOOL mod_cache_read_response(HTTP_CONTEXT *phttp)
 			mod_cache_insert_ctx(phttp);
 			return FALSE;
 		}
+		if (pcontext->b_sendfile)
+			/* body follows by way of mod_cache_sendfile */
+			return TRUE;
 	}
 	auto &item = *pcontext->pitem;
 	uint32_t writeout_size = std::min(pcontext->until - pcontext->offset, static_cast<uint32_t>(STREAM_BLOCK_SIZE) - 1);
@@ -688,6 +936,43 @@ BOOL mod_cache_read_response(HTTP_CONTEXT *phttp)
 	return TRUE;
 }
 
+bool mod_cache_use_sendfile(http_context *phttp)
+{
+	auto pcontext = mod_cache_get_cache_context(phttp);
+	return pcontext->pitem != nullptr && pcontext->b_header &&
+	       pcontext->b_sendfile;
+}
+
+/**
+ * Send the next part of the response body straight from the file to the
+ * socket. Returns the number of bytes sent, 0 once the body is complete
+ * (the context is then released), or -1 with errno set.
+ */
+ssize_t mod_cache_sendfile(http_context *phttp)
+{
+#ifdef HAVE_SYS_SENDFILE_H
+	auto pcontext = mod_cache_get_cache_context(phttp);
+	if (pcontext->offset >= pcontext->until) {
+		mod_cache_insert_ctx(phttp);
+		return 0;
+	}
+	off_t off = pcontext->offset;
+	auto ret = sendfile(phttp->connection.sockd, pcontext->fd.get(), &off,
+	           pcontext->until - pcontext->offset);
+	if (ret == 0) {
+		/* file was truncated under us */
+		errno = EIO;
+		return -1;
+	} else if (ret > 0) {
+		pcontext->offset += ret;
+	}
+	return ret;
+#else
+	errno = ENOSYS;
+	return -1;
+#endif
+}
+
 bool mod_cache_discard_content(http_context *hc)
 {
 	if (hc->request.body_fd < 0)
@@ -13,3 +13,5 @@ extern void mod_cache_insert_ctx(http_context *);
 BOOL mod_cache_check_responded(HTTP_CONTEXT *phttp);
 BOOL mod_cache_read_response(HTTP_CONTEXT *phttp);
 extern bool mod_cache_discard_content(http_context *);
+extern bool mod_cache_use_sendfile(http_context *);
+extern ssize_t mod_cache_sendfile(http_context *);
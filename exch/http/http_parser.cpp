@@ -1534,8 +1534,38 @@ static tproc_status htparse_wrrep_nobuf(http_context *pcontext)
 	return tproc_status::runoff;
 }
 
+/* Body of a mod_cache response, sent by the kernel from the file */
+static tproc_status htparse_wrfile(http_context *pcontext)
+{
+	auto written_len = mod_cache_sendfile(pcontext);
+	auto current_time = tp_now();
+	if (written_len == 0) {
+		if (pcontext->b_close)
+			return tproc_status::runoff;
+		pcontext->request.clear();
+		pcontext->sched_stat = hsched_stat::rdhead;
+		pcontext->stream_out.clear();
+		return tproc_status::cont;
+	} else if (written_len < 0) {
+		if (EAGAIN != errno) {
+			pcontext->log(LV_DEBUG, "connection lost");
+			return tproc_status::runoff;
+		}
+		/* check if context is timed out */
+		if (current_time - pcontext->connection.last_timestamp < g_timeout)
+			return tproc_status::polling_wronly;
+		pcontext->log(LV_DEBUG, "timeout");
+		return tproc_status::runoff;
+	}
+	pcontext->connection.last_timestamp = current_time;
+	pcontext->bytes_rw += written_len;
+	return tproc_status::cont;
+}
+
 static tproc_status htparse_wrrep(http_context *pcontext)
 {
+	if (pcontext->write_buff == nullptr && mod_cache_use_sendfile(pcontext))
+		return htparse_wrfile(pcontext);
 	if (NULL == pcontext->write_buff) {
 		auto ret = htparse_wrrep_nobuf(pcontext);
 		if (ret != tproc_status::runoff)
@@ -24,8 +24,10 @@
 #include <string>
 #include <unistd.h>
 #include <unordered_map>
+#include <unordered_set>
 #include <vector>
 #include <fmt/core.h>
+#include <libHX/ctype_helper.h>
 #include <libHX/io.h>
 #include <libHX/scope.hpp>
 #include <libHX/string.h>
@@ -53,6 +55,7 @@
 #include "common_util.hpp"
 #include "exmdb_client.hpp"
 #include "mail_engine.hpp"
+#include "modseq.hpp"
 #include "system_services.hpp"
 #define MAX_DIGLEN						256*1024
 #define RELOAD_INTERVAL					3600
@@ -83,6 +86,9 @@ enum class midb_cond {
 	/* ct_size */
 	larger, smaller,
 
+	/* ct_modseq */
+	modseq,
+
 	/* ct_seq */
 	id, uid,
 };
@@ -125,6 +131,7 @@ struct ct_node {
 		char *ct_keyword;
 		time_t ct_time;
 		size_t ct_size;
+		uint64_t ct_modseq;
 		imap_seq_list *ct_seq;
 	};
 };
@@ -146,6 +153,14 @@ struct IDB_ITEM {
 	std::string username;
 	time_t last_time = 0, load_time = 0;
 	uint32_t sub_id = 0;
+	bool has_modseq = false; /* schema EM-4 or later */
+	bool has_fts = false; /* midb_fts.sqlite3 is attached as "fts" */
+	bool has_rendered = false; /* schema EM-5 or later */
+	bool has_modseq_floor = false; /* schema EM-6 or later */
+	/* midbme_ftswork has messages to index */
+	std::atomic<bool> fts_pending{false};
+	/* messages the indexer gave up on (they take the slow path) */
+	std::unordered_set<uint64_t> fts_failed;
 	/* client reference count, item can be flushed into file system only count is 0 */
 	std::atomic<int> reference{0};
 	std::timed_mutex giant_lock;
@@ -155,6 +170,23 @@ struct idb_item_del {
 	void operator()(IDB_ITEM *);
 };
 
+/**
+ * Search conditions answered from the full-text index.
+ * @hits:	matching message_ids per condition node
+ * @missing:	messages that could not be indexed (use the slow path)
+ */
+struct fts_state {
+	std::unordered_map<const ct_node *, std::unordered_set<uint64_t>> hits;
+	std::unordered_set<uint64_t> missing;
+};
+
+/* One fts.msg_text row in the making */
+struct fts_row {
+	uint64_t message_id = 0;
+	std::string mid_string, subject, sender, rcpt, cc, body;
+	bool ok = false;
+};
+
 }
 
 using IDB_REF = std::unique_ptr<IDB_ITEM, idb_item_del>;
@@ -166,18 +198,22 @@ enum {
 
 unsigned int g_midb_schema_upgrades;
 unsigned int g_midb_cache_interval, g_midb_reload_interval;
+bool g_midb_fts_index = true;
 
 static constexpr time_duration DB_LOCK_TIMEOUT = std::chrono::seconds(60);
+/* midbme_ftswork: messages per transaction, transactions per mailbox visit */
+static constexpr size_t FTS_BATCH = 64, FTS_ROUNDS = 16;
 static size_t g_table_size;
 static std::atomic<unsigned int> g_sequence_id;
 static gromox::atomic_bool g_notify_stop; /* stop signal for scanning thread */
-static pthread_t g_scan_tid;
+static pthread_t g_scan_tid, g_fts_tid;
 static char g_org_name[256];
 static char g_default_charset[32];
 static std::mutex g_hash_lock;
 static std::unordered_map<std::string, IDB_ITEM> g_hash_table;
 
 static bool ct_hint_seq(const imap_seq_list &plist, unsigned int num, unsigned int max_uid);
+static IDB_REF me_peek_idb(const char *path);
 
 template<typename T> static inline bool
 array_find_str(const T &kwlist, const char *s)
@@ -202,6 +238,11 @@ static std::string make_midb_path(const char *d)
 	return d + "/exmdb/midb.sqlite3"s;
 }
 
+static std::string make_midb_fts_path(const char *d)
+{
+	return d + "/exmdb/midb_fts.sqlite3"s;
+}
+
 static std::unique_ptr<char[]> me_ct_to_utf8(const char *charset,
     const char *string) try
 {
@@ -435,473 +476,563 @@ static bool me_ct_search_head(const char *charset, const char *mid_string,
 	return false;
 }
 
-enum ctm_field {
-	CTM_MSGID, CTM_MODTIME, CTM_UID, CTM_RECENT, CTM_READ, CTM_UNSENT,
-	CTM_FLAGGED, CTM_REPLIED, CTM_FWD, CTM_DELETED, CTM_RCVDTIME,
-	CTM_FOLDERID, CTM_SIZE,
-};
+/**
+ * The full-text index lives in a separate file so that it can be thrown away
+ * (and is rebuilt on demand) without touching midb.sqlite3. The trigram
+ * tokenizer gives substring matching, and hits are verified with
+ * strcasestr afterwards, so results are the same as with the decode-on-
+ * every-search path.
+ */
+static bool me_fts_attach(sqlite3 *db, const char *maildir) try
+{
+	auto stm = gx_sql_prep(db, "ATTACH DATABASE ? AS fts");
+	if (stm == nullptr)
+		return false;
+	auto path = make_midb_fts_path(maildir);
+	stm.bind_text(1, path);
+	if (stm.step() != SQLITE_DONE)
+		return false;
+	stm.finalize();
+	if (gx_sql_exec(db, "CREATE VIRTUAL TABLE IF NOT EXISTS fts.msg_text "
+	    "USING fts5(subject, sender, rcpt, cc, body, tokenize='trigram')") != SQLITE_OK ||
+	    /* (unqualified name required in triggers) */
+	    gx_sql_exec(db, "CREATE TEMP TRIGGER IF NOT EXISTS msg_text_del "
+	    "AFTER DELETE ON main.messages FOR EACH ROW BEGIN "
+	    "DELETE FROM msg_text WHERE rowid=OLD.message_id; END") != SQLITE_OK) {
+		mlog(LV_WARN, "W-1789: %s: FTS5/trigram unavailable, "
+		        "BODY/TEXT searches will not be indexed", path.c_str());
+		gx_sql_exec(db, "DETACH DATABASE fts");
+		return false;
+	}
+	gx_sql_exec(db, "PRAGMA fts.journal_mode=WAL");
+	return true;
+} catch (const std::bad_alloc &) {
+	return false;
+}
 
-static bool me_ct_match_mail(sqlite3 *psqlite, const char *charset,
-    sqlite3_stmt *pstmt_message, const char *mid_string, int id, int total_mail,
-    uint32_t uidnext, const CONDITION_TREE *ptree) try
+static std::string me_fts_header(const Json::Value &digest, const char *key)
 {
-	int sp = 0;
-	bool b_loaded, b_result, b_result1, results[1024];
-	midb_conj conjunction;
-	time_t tmp_time;
-	size_t temp_len;
-	char temp_buff[1024];
-	char temp_buff1[1024];
-	midb_conj conjunctions[1024];
-	KEYWORD_ENUM keyword_enum;
-	const CONDITION_TREE *trees[1024];
-	CONDITION_TREE::const_iterator pnode, nodes[1024];
+	char temp_buff[1024], temp_buff1[1024];
+	size_t temp_len = 0;
+	if (!get_digest(digest, key, temp_buff, std::size(temp_buff)) ||
+	    decode64(temp_buff, strlen(temp_buff), temp_buff1,
+	    std::size(temp_buff1), &temp_len) != 0)
+		return {};
+	temp_buff1[temp_len] = '\0';
+	auto rs = me_ct_decode_mime(g_default_charset, temp_buff1);
+	return rs != nullptr ? rs.get() : "";
+}
+
+/**
+ * Extract the text of one message. This is the same as what me_ct_enum_mime
+ * looks at, but with a single read of the eml file, and the default charset
+ * in place of the search charset. Only exmdb is consulted, not midb.sqlite3.
+ */
+static bool me_fts_extract(fts_row &row) try
+{
+	auto dir = cu_get_maildir();
+	std::string eml, djson, body;
+	if (!exmdb_client->imapfile_read(dir, "eml", row.mid_string, &eml))
+		return false;
 	Json::Value digest;
-	
-#define PUSH_MATCH(TREE, NODE, CONJUNCTION, RESULT) \
-		{trees[sp]=TREE;nodes[sp]=NODE;conjunctions[sp]=CONJUNCTION;results[sp]=RESULT;sp++;}
-	
-#define POP_MATCH(TREE, NODE, CONJUNCTION, RESULT) \
-		{sp--;TREE=trees[sp];NODE=nodes[sp];CONJUNCTION=conjunctions[sp];RESULT=results[sp];}
+	if (exmdb_client->imapfile_read(dir, "ext", row.mid_string, &djson)) {
+		if (!json_from_str(djson.c_str(), digest))
+			return false;
+	} else {
+		MAIL imail;
+		size_t size = 0;
+		if (!imail.load_from_str(eml.c_str(), eml.size()) ||
+		    imail.make_digest(&size, digest) <= 0)
+			return false;
+	}
+	MJSON mjson;
+	if (!mjson.load_from_json(digest))
+		return false;
+	mjson.enum_mime([&](MJSON_MIME *pmime) {
+		if (pmime->get_mtype() != mime_type::single &&
+		    pmime->get_mtype() != mime_type::single_obj)
+			return;
+		bool is_text = strncmp(pmime->get_ctype(), "text/", 5) == 0 ||
+		               strncmp(pmime->get_ctype(), "message/", 8) == 0;
+		if (!is_text) {
+			/* Attachments are only findable by name */
+			if (*pmime->get_filename() == '\0')
+				return;
+			auto rs = me_ct_decode_mime(g_default_charset, pmime->get_filename());
+			if (rs != nullptr)
+				body += rs.get() + "\n"s;
+			return;
+		}
+		if (pmime->get_content_offset() >= eml.size())
+			return;
+		std::string_view ctview(&eml[pmime->get_content_offset()],
+			std::min(eml.size() - pmime->get_content_offset(),
+			pmime->get_content_length()));
+		std::string content;
+		if (strcasecmp(pmime->get_encoding(), "base64") == 0) {
+			content = base64_decode(ctview);
+		} else if (strcasecmp(pmime->get_encoding(), "quoted-printable") == 0) {
+			content.resize(ctview.size());
+			auto xl = qp_decode_ex(content.data(), content.size(),
+			          ctview.data(), ctview.size());
+			if (xl < 0)
+				return;
+			content.resize(xl);
+		} else {
+			content = ctview;
+		}
+		auto charset = pmime->get_charset();
+		auto rs = me_ct_to_utf8(*charset != '\0' ? charset :
+		          g_default_charset, content.c_str());
+		if (rs != nullptr)
+			body += rs.get() + "\n"s;
+	});
+	row.subject = me_fts_header(digest, "subject");
+	row.sender  = me_fts_header(digest, "from");
+	row.rcpt    = me_fts_header(digest, "to");
+	row.cc      = me_fts_header(digest, "cc");
+	row.body    = std::move(body);
+	return true;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-1790: ENOMEM");
+	return false;
+}
 
-/* begin of recursion procedure */
-	while (true) {
- PROC_BEGIN:
-	b_result = true;
-	b_loaded = false;
-	for (pnode = ptree->begin(); pnode != ptree->end(); ++pnode) {
-		{
-		auto ptree_node = &*pnode;
-		conjunction = ptree_node->conjunction;
-		if ((b_result && conjunction == midb_conj::c_or) ||
-		    (!b_result && conjunction == midb_conj::c_and))
+/**
+ * Save a batch of extracted rows. BEGIN (not BEGIN IMMEDIATE) and writes to
+ * the fts schema only mean that midb.sqlite3 itself is never write-locked
+ * here. Rows whose message was expunged or resynced in the meantime are
+ * dropped by the EXISTS clause.
+ */
+static void me_fts_store(IDB_ITEM *pidb, const std::vector<fts_row> &rows)
+{
+	auto db = pidb->psqlite;
+	auto xact = gx_sql_begin(db, txn_mode::read);
+	if (!xact)
+		return;
+	auto stm_del = gx_sql_prep(db, "DELETE FROM fts.msg_text WHERE rowid=?");
+	if (stm_del == nullptr)
+		return;
+	auto stm_ins = gx_sql_prep(db, "INSERT INTO fts.msg_text (rowid, "
+	               "subject, sender, rcpt, cc, body) SELECT ?1, ?2, ?3, ?4, ?5, ?6 "
+	               "WHERE EXISTS (SELECT 1 FROM main.messages "
+	               "WHERE message_id=?1 AND mid_string=?7)");
+	if (stm_ins == nullptr)
+		return;
+	for (const auto &r : rows) {
+		if (!r.ok) {
+			pidb->fts_failed.insert(r.message_id);
 			continue;
-		b_result1 = false;
-		if (NULL != ptree_node->pbranch) {
-			PUSH_MATCH(ptree, pnode, conjunction, b_result)
-			ptree = ptree_node->pbranch;
-			goto PROC_BEGIN;
-		} else {
-			switch (ptree_node->condition) {
-			case midb_cond::all:
-			case midb_cond::keyword:
-			case midb_cond::unkeyword:
-				b_result1 = true;
-				break;
-			case midb_cond::answered:
-				sqlite3_reset(pstmt_message);
-				sqlite3_bind_text(pstmt_message,
-					1, mid_string, -1, SQLITE_STATIC);
-				if (gx_sql_step(pstmt_message) != SQLITE_ROW)
-					break;
-				if (sqlite3_column_int64(pstmt_message, CTM_REPLIED) != 0)
-					b_result1 = true;
-				break;
-			case midb_cond::bcc:
-				/* we do not support BCC field in mail digest,
-					BCC should not recorded in mail head */
-				break;
-			case midb_cond::before:
-				sqlite3_reset(pstmt_message);
-				sqlite3_bind_text(pstmt_message,
-					1, mid_string, -1, SQLITE_STATIC);
-				if (gx_sql_step(pstmt_message) != SQLITE_ROW)
-					break;
-				tmp_time = rop_util_nttime_to_unix(
-					sqlite3_column_int64(pstmt_message, CTM_RCVDTIME));
-				if (tmp_time < ptree_node->ct_time)
-					b_result1 = true;
-				break;
-			case midb_cond::body: {
-				if (!b_loaded) {
-					if (me_get_digest(psqlite, mid_string, digest) == 0)
-						break;
-					b_loaded = true;
-				}
-				MJSON temp_mjson;
-				snprintf(temp_buff, 256, "%s/eml",
-						cu_get_maildir());
-				if (!temp_mjson.load_from_json(digest))
-					break;
-				temp_mjson.path = temp_buff;
-				keyword_enum.pjson = &temp_mjson;
-				keyword_enum.b_result = FALSE;
-				keyword_enum.charset = charset;
-				keyword_enum.keyword = ptree_node->ct_keyword;
-				temp_mjson.enum_mime(me_ct_enum_mime, &keyword_enum);
-				if (keyword_enum.b_result)
-					b_result1 = true;
-				break;
-			}
-			case midb_cond::cc: {
-				if (!b_loaded) {
-					if (me_get_digest(psqlite, mid_string, digest) == 0)
-						break;
-					b_loaded = true;
-				}
-				if (!get_digest(digest, "cc", temp_buff, std::size(temp_buff)) ||
-				    decode64(temp_buff, strlen(temp_buff),
-				    temp_buff1, std::size(temp_buff1), &temp_len) != 0)
-					break;
-				temp_buff1[temp_len] = '\0';
-				auto rs = me_ct_decode_mime(charset, temp_buff1);
-				if (rs != nullptr && strcasestr(rs.get(),
-				    ptree_node->ct_keyword) != nullptr)
-					b_result1 = true;
-				break;
+		}
+		stm_del.reset();
+		stm_del.bind_int64(1, r.message_id);
+		stm_ins.reset();
+		stm_ins.bind_int64(1, r.message_id);
+		stm_ins.bind_text(2, r.subject);
+		stm_ins.bind_text(3, r.sender);
+		stm_ins.bind_text(4, r.rcpt);
+		stm_ins.bind_text(5, r.cc);
+		stm_ins.bind_text(6, r.body);
+		stm_ins.bind_text(7, r.mid_string);
+		if (stm_del.step() != SQLITE_DONE || stm_ins.step() != SQLITE_DONE)
+			pidb->fts_failed.insert(r.message_id);
+	}
+	xact.commit();
+}
+
+/**
+ * Index up to FTS_ROUNDS batches of @path's messages. The giant lock is
+ * only held for picking a batch and for storing it, not while the eml
+ * files are read and decoded.
+ */
+static void me_fts_work(const std::string &path) try
+{
+	for (size_t round = 0; round < FTS_ROUNDS && !g_notify_stop; ++round) {
+		std::vector<fts_row> rows;
+		{
+			auto pidb = me_peek_idb(path.c_str());
+			if (pidb == nullptr || !pidb->has_fts)
+				return;
+			auto stm = gx_sql_prep(pidb->psqlite, "SELECT m.message_id, "
+			           "m.mid_string FROM messages AS m WHERE NOT EXISTS "
+			           "(SELECT 1 FROM fts.msg_text WHERE rowid=m.message_id)");
+			if (stm == nullptr)
+				return;
+			while (rows.size() < FTS_BATCH && stm.step() == SQLITE_ROW) {
+				auto message_id = stm.col_uint64(0);
+				if (pidb->fts_failed.contains(message_id))
+					continue;
+				auto &r = rows.emplace_back();
+				r.message_id = message_id;
+				r.mid_string = znul(stm.col_text(1));
 			}
-			case midb_cond::deleted:
-				sqlite3_reset(pstmt_message);
-				sqlite3_bind_text(pstmt_message,
-					1, mid_string, -1, SQLITE_STATIC);
-				if (gx_sql_step(pstmt_message) != SQLITE_ROW)
-					break;
-				if (sqlite3_column_int64(pstmt_message, CTM_DELETED) != 0)
-					b_result1 = true;
-				break;
-			case midb_cond::draft:
-				sqlite3_reset(pstmt_message);
-				sqlite3_bind_text(pstmt_message,
-					1, mid_string, -1, SQLITE_STATIC);
-				if (gx_sql_step(pstmt_message) != SQLITE_ROW)
-					break;
-				if (sqlite3_column_int64(pstmt_message, CTM_UNSENT) != 0)
-					b_result1 = true;
-				break;
-			case midb_cond::flagged:
-				sqlite3_reset(pstmt_message);
-				sqlite3_bind_text(pstmt_message,
-					1, mid_string, -1, SQLITE_STATIC);
-				if (gx_sql_step(pstmt_message) != SQLITE_ROW)
-					break;
-				if (sqlite3_column_int64(pstmt_message, CTM_FLAGGED) != 0)
-					b_result1 = true;
-				break;
-			case midb_cond::from: {
-				if (!b_loaded) {
-					if (me_get_digest(psqlite, mid_string, digest) == 0)
-						break;
-					b_loaded = true;
-				}
-				if (!get_digest(digest, "from", temp_buff, std::size(temp_buff)) ||
-				    decode64(temp_buff, strlen(temp_buff),
-				    temp_buff1, std::size(temp_buff1), &temp_len) != 0)
-					break;
-				temp_buff1[temp_len] = '\0';
-				auto rs = me_ct_decode_mime(charset, temp_buff1);
-				if (rs != nullptr && strcasestr(rs.get(),
-				    ptree_node->ct_keyword) != nullptr)
-					b_result1 = true;
-				break;
+			if (rows.empty()) {
+				pidb->fts_pending = false;
+				return;
 			}
-			case midb_cond::header:
-				b_result1 = me_ct_search_head(charset, mid_string,
-					ptree_node->ct_headers[0],
-					ptree_node->ct_headers[1]);
-				break;
-			case midb_cond::id:
-				b_result1 = ct_hint_seq(*ptree_node->ct_seq, id, total_mail);
-				break;
-			case midb_cond::larger:
-				sqlite3_reset(pstmt_message);
-				sqlite3_bind_text(pstmt_message,
-					1, mid_string, -1, SQLITE_STATIC);
-				if (gx_sql_step(pstmt_message) != SQLITE_ROW)
-					break;
-				if (gx_sql_col_uint64(pstmt_message, 12) >
-				    ptree_node->ct_size)
-					b_result1 = true;
-				break;
-			case midb_cond::is_new:
-				sqlite3_reset(pstmt_message);
-				sqlite3_bind_text(pstmt_message,
-					1, mid_string, -1, SQLITE_STATIC);
-				if (gx_sql_step(pstmt_message) != SQLITE_ROW)
-					break;
-				if (sqlite3_column_int64(pstmt_message, CTM_RECENT) != 0 &&
-				    sqlite3_column_int64(pstmt_message, CTM_READ) == 0)
-					b_result1 = true;
-				break;
-			case midb_cond::old:
-				sqlite3_reset(pstmt_message);
-				sqlite3_bind_text(pstmt_message,
-					1, mid_string, -1, SQLITE_STATIC);
-				if (gx_sql_step(pstmt_message) != SQLITE_ROW)
-					break;
-				if (sqlite3_column_int64(pstmt_message, CTM_RECENT) == 0)
-					b_result1 = true;
-				break;
-			case midb_cond::on:
-				sqlite3_reset(pstmt_message);
-				sqlite3_bind_text(pstmt_message,
-					1, mid_string, -1, SQLITE_STATIC);
-				if (gx_sql_step(pstmt_message) != SQLITE_ROW)
-					break;
-				tmp_time = rop_util_nttime_to_unix(
-					sqlite3_column_int64(pstmt_message, CTM_RCVDTIME));
-				if (tmp_time >= ptree_node->ct_time &&
-				    tmp_time < ptree_node->ct_time + 86400)
-					b_result1 = true;
-				break;
-			case midb_cond::recent:
-				sqlite3_reset(pstmt_message);
-				sqlite3_bind_text(pstmt_message,
-					1, mid_string, -1, SQLITE_STATIC);
-				if (gx_sql_step(pstmt_message) != SQLITE_ROW)
-					break;
-				if (sqlite3_column_int64(pstmt_message, CTM_RECENT) != 0)
-					b_result1 = true;
-				break;
-			case midb_cond::seen:
-				sqlite3_reset(pstmt_message);
-				sqlite3_bind_text(pstmt_message,
-					1, mid_string, -1, SQLITE_STATIC);
-				if (gx_sql_step(pstmt_message) != SQLITE_ROW)
-					break;
-				if (sqlite3_column_int64(pstmt_message, CTM_READ) != 0)
-					b_result1 = true;
-				break;
-			case midb_cond::sent_before:
-				sqlite3_reset(pstmt_message);
-				sqlite3_bind_text(pstmt_message,
-					1, mid_string, -1, SQLITE_STATIC);
-				if (gx_sql_step(pstmt_message) != SQLITE_ROW)
-					break;
-				tmp_time = rop_util_nttime_to_unix(
-					sqlite3_column_int64(pstmt_message, CTM_MODTIME));
-				if (tmp_time < ptree_node->ct_time)
-					b_result1 = true;
-				break;
-			case midb_cond::sent_on:
-				sqlite3_reset(pstmt_message);
-				sqlite3_bind_text(pstmt_message,
-					1, mid_string, -1, SQLITE_STATIC);
-				if (gx_sql_step(pstmt_message) != SQLITE_ROW)
-					break;
-				tmp_time = rop_util_nttime_to_unix(
-					sqlite3_column_int64(pstmt_message, CTM_MODTIME));
-				if (tmp_time >= ptree_node->ct_time &&
-				    tmp_time < ptree_node->ct_time + 86400)
-					b_result1 = true;
-				break;
-			case midb_cond::sent_since:
-				sqlite3_reset(pstmt_message);
-				sqlite3_bind_text(pstmt_message,
-					1, mid_string, -1, SQLITE_STATIC);
-				if (gx_sql_step(pstmt_message) != SQLITE_ROW)
-					break;
-				tmp_time = rop_util_nttime_to_unix(
-					sqlite3_column_int64(pstmt_message, CTM_MODTIME));
-				if (tmp_time >= ptree_node->ct_time)
-					b_result1 = true;
-				break;
-			case midb_cond::since:
-				sqlite3_reset(pstmt_message);
-				sqlite3_bind_text(pstmt_message,
-					1, mid_string, -1, SQLITE_STATIC);
-				if (gx_sql_step(pstmt_message) != SQLITE_ROW)
-					break;
-				tmp_time = rop_util_nttime_to_unix(
-					sqlite3_column_int64(pstmt_message, CTM_RCVDTIME));
-				if (tmp_time >= ptree_node->ct_time)
-					b_result1 = true;
-				break;
-			case midb_cond::smaller:
-				sqlite3_reset(pstmt_message);
-				sqlite3_bind_text(pstmt_message,
-					1, mid_string, -1, SQLITE_STATIC);
-				if (gx_sql_step(pstmt_message) != SQLITE_ROW)
-					break;
-				if (gx_sql_col_uint64(pstmt_message, 12) < ptree_node->ct_size)
-					b_result1 = true;
-				break;
-			case midb_cond::subject: {
-				if (!b_loaded) {
-					if (me_get_digest(psqlite, mid_string, digest) == 0)
-						break;
-					b_loaded = true;
-				}
-				if (!get_digest(digest, "subject", temp_buff, std::size(temp_buff)) ||
-				    decode64(temp_buff, strlen(temp_buff),
-				    temp_buff1, std::size(temp_buff1), &temp_len) != 0)
-					break;
-				temp_buff1[temp_len] = '\0';
-				auto rs = me_ct_decode_mime(charset, temp_buff1);
-				if (rs != nullptr && strcasestr(rs.get(),
-				    ptree_node->ct_keyword) != nullptr)
-					b_result1 = true;
-				break;
+		}
+		if (!cu_build_environment(path.c_str()))
+			return;
+		for (auto &r : rows)
+			r.ok = !r.mid_string.empty() && me_fts_extract(r);
+		cu_free_environment();
+		auto pidb = me_peek_idb(path.c_str());
+		if (pidb == nullptr)
+			return;
+		me_fts_store(pidb.get(), rows);
+	}
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-1825: ENOMEM");
+}
+
+/*
+ * Messages of the folder that are not in the index (yet). midbme_ftswork
+ * catches up with them in the background; until then, searches decode them.
+ */
+static bool me_fts_unindexed(sqlite3 *db, uint64_t folder_id,
+    std::unordered_set<uint64_t> &missing) try
+{
+	auto stm = gx_sql_prep(db, "SELECT m.message_id "
+	           "FROM messages AS m WHERE m.folder_id=? AND NOT EXISTS "
+	           "(SELECT 1 FROM fts.msg_text WHERE rowid=m.message_id)");
+	if (stm == nullptr)
+		return false;
+	stm.bind_int64(1, folder_id);
+	int ret;
+	while ((ret = stm.step()) == SQLITE_ROW)
+		missing.insert(stm.col_uint64(0));
+	return ret == SQLITE_DONE;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-1826: ENOMEM");
+	return false;
+}
+
+static const char *me_fts_column(enum midb_cond c)
+{
+	switch (c) {
+	case midb_cond::body: return "body";
+	case midb_cond::cc: return "cc";
+	case midb_cond::from: return "sender";
+	case midb_cond::subject: return "subject";
+	case midb_cond::to: return "rcpt";
+	case midb_cond::text: return "subject, sender, rcpt, cc, body";
+	default: return nullptr;
+	}
+}
+
+/**
+ * Evaluate all string conditions in @ptree (recursively) against the index.
+ * Keywords with less than three characters cannot use the trigram index
+ * and just scan the stored text, which is still much cheaper than decoding
+ * the mails.
+ */
+static bool me_fts_prepare(sqlite3 *db, uint64_t folder_id,
+    const CONDITION_TREE *ptree, fts_state &fts) try
+{
+	for (const auto &node : *ptree) {
+		if (node.pbranch != nullptr) {
+			if (!me_fts_prepare(db, folder_id, node.pbranch, fts))
+				return false;
+			continue;
+		}
+		auto cols = me_fts_column(node.condition);
+		if (cols == nullptr || node.ct_keyword == nullptr)
+			continue;
+		auto kw = node.ct_keyword;
+		size_t nchars = 0;
+		for (auto p = kw; *p != '\0'; ++p)
+			if ((static_cast<unsigned char>(*p) & 0xC0) != 0x80)
+				++nchars;
+		auto qstr = fmt::format("SELECT rowid, {} FROM fts.msg_text WHERE "
+		            "rowid IN (SELECT message_id FROM messages WHERE folder_id=?)",
+		            cols);
+		std::string match;
+		if (nchars >= 3) {
+			match = "\"";
+			for (auto p = kw; *p != '\0'; ++p) {
+				if (*p == '"')
+					match += '"';
+				match += *p;
 			}
-			case midb_cond::text: {
-				if (!b_loaded) {
-					if (me_get_digest(psqlite, mid_string, digest) == 0)
-						break;
-					b_loaded = true;
-				}
-				if (get_digest(digest, "cc", temp_buff, std::size(temp_buff)) &&
-				    decode64(temp_buff, strlen(temp_buff),
-				    temp_buff1, std::size(temp_buff1), &temp_len) == 0) {
-					temp_buff1[temp_len] = '\0';
-					auto rs = me_ct_decode_mime(charset, temp_buff1);
-					if (rs != nullptr && strcasestr(rs.get(),
-					    ptree_node->ct_keyword) != nullptr)
-						b_result1 = true;
-				}
-				if (b_result1)
-					break;
-				if (get_digest(digest, "from", temp_buff, std::size(temp_buff)) &&
-				    decode64(temp_buff, strlen(temp_buff),
-				    temp_buff1, std::size(temp_buff1), &temp_len) == 0) {
-					temp_buff1[temp_len] = '\0';
-					auto rs = me_ct_decode_mime(charset, temp_buff1);
-					if (rs != nullptr && strcasestr(rs.get(),
-					    ptree_node->ct_keyword) != nullptr)
-						b_result1 = true;
-				}
-				if (b_result1)
-					break;
-				if (get_digest(digest, "subject", temp_buff, std::size(temp_buff)) &&
-				    decode64(temp_buff, strlen(temp_buff),
-				    temp_buff1, std::size(temp_buff1), &temp_len) == 0) {
-					temp_buff1[temp_len] = '\0';
-					auto rs = me_ct_decode_mime(charset, temp_buff1);
-					if (rs != nullptr && strcasestr(rs.get(),
-					    ptree_node->ct_keyword) != nullptr)
-						b_result1 = true;
-				}
-				if (b_result1)
+			match += '"';
+			if (node.condition != midb_cond::text)
+				match = "{"s + cols + "} : " + match;
+			qstr += " AND msg_text MATCH ?";
+		}
+		auto stm = gx_sql_prep(db, qstr.c_str());
+		if (stm == nullptr)
+			return false;
+		stm.bind_int64(1, folder_id);
+		if (!match.empty())
+			stm.bind_text(2, match);
+		auto &hits = fts.hits[&node];
+		auto ncols = sqlite3_column_count(stm);
+		int ret;
+		while ((ret = stm.step()) == SQLITE_ROW) {
+			for (int i = 1; i < ncols; ++i) {
+				auto text = stm.col_text(i);
+				if (text != nullptr && strcasestr(text, kw) != nullptr) {
+					hits.insert(stm.col_uint64(0));
 					break;
-				if (get_digest(digest, "to", temp_buff, std::size(temp_buff)) &&
-				    decode64(temp_buff, strlen(temp_buff),
-				    temp_buff1, std::size(temp_buff1), &temp_len) == 0) {
-					temp_buff1[temp_len] = '\0';
-					auto rs = me_ct_decode_mime(charset, temp_buff1);
-					if (rs != nullptr && strcasestr(rs.get(),
-					    ptree_node->ct_keyword) != nullptr)
-						b_result1 = true;
 				}
-				if (b_result1)
-					break;
-				MJSON temp_mjson;
-				snprintf(temp_buff, 256, "%s/eml",
-						cu_get_maildir());
-				if (!temp_mjson.load_from_json(digest))
-					break;
-				temp_mjson.path = temp_buff;
-				keyword_enum.pjson = &temp_mjson;
-				keyword_enum.b_result = FALSE;
-				keyword_enum.charset = charset;
-				keyword_enum.keyword = ptree_node->ct_keyword;
-				temp_mjson.enum_mime(me_ct_enum_mime, &keyword_enum);
-				if (keyword_enum.b_result)
-					b_result1 = true;
-				break;
-			}
-			case midb_cond::to: {
-				if (!b_loaded) {
-					if (me_get_digest(psqlite, mid_string, digest) == 0)
-						break;
-					b_loaded = true;
-				}
-				if (!get_digest(digest, "to", temp_buff, std::size(temp_buff)) ||
-				    decode64(temp_buff, strlen(temp_buff),
-				    temp_buff1, std::size(temp_buff1), &temp_len) != 0)
-					break;
-				temp_buff1[temp_len] = '\0';
-				auto rs = me_ct_decode_mime(charset, temp_buff1);
-				if (rs != nullptr && strcasestr(rs.get(),
-				    ptree_node->ct_keyword) != nullptr)
-					b_result1 = true;
-				break;
-			}
-			case midb_cond::unanswered:
-				sqlite3_reset(pstmt_message);
-				sqlite3_bind_text(pstmt_message,
-					1, mid_string, -1, SQLITE_STATIC);
-				if (gx_sql_step(pstmt_message) != SQLITE_ROW)
-					break;
-				if (sqlite3_column_int64(pstmt_message, CTM_REPLIED) == 0)
-					b_result1 = true;
-				break;
-			case midb_cond::uid:
-				sqlite3_reset(pstmt_message);
-				sqlite3_bind_text(pstmt_message,
-					1, mid_string, -1, SQLITE_STATIC);
-				if (gx_sql_step(pstmt_message) != SQLITE_ROW)
-					break;
-				b_result1 = ct_hint_seq(*ptree_node->ct_seq,
-					sqlite3_column_int64(pstmt_message, CTM_UID),
-					uidnext);
-				break;
-			case midb_cond::undeleted:
-				sqlite3_reset(pstmt_message);
-				sqlite3_bind_text(pstmt_message,
-					1, mid_string, -1, SQLITE_STATIC);
-				if (gx_sql_step(pstmt_message) != SQLITE_ROW)
-					break;
-				if (sqlite3_column_int64(pstmt_message, CTM_DELETED) == 0)
-					b_result1 = true;
-				break;
-			case midb_cond::undraft:
-				sqlite3_reset(pstmt_message);
-				sqlite3_bind_text(pstmt_message,
-					1, mid_string, -1, SQLITE_STATIC);
-				if (gx_sql_step(pstmt_message) != SQLITE_ROW)
-					break;
-				if (sqlite3_column_int64(pstmt_message, CTM_UNSENT) == 0)
-					b_result1 = true;
-				break;
-			case midb_cond::unflagged:
-				sqlite3_reset(pstmt_message);
-				sqlite3_bind_text(pstmt_message,
-					1, mid_string, -1, SQLITE_STATIC);
-				if (gx_sql_step(pstmt_message) != SQLITE_ROW)
-					break;
-				if (sqlite3_column_int64(pstmt_message, CTM_FLAGGED) == 0)
-					b_result1 = true;
-				break;
-			case midb_cond::unseen:
-				sqlite3_reset(pstmt_message);
-				sqlite3_bind_text(pstmt_message,
-					1, mid_string, -1, SQLITE_STATIC);
-				if (gx_sql_step(pstmt_message) != SQLITE_ROW)
-					break;
-				if (sqlite3_column_int64(pstmt_message, CTM_READ) == 0)
-					b_result1 = true;
-				break;
-			default:
-				mlog(LV_DEBUG, "mail_engine: condition stat %u unknown!",
-					static_cast<unsigned int>(ptree_node->condition));
-				break;
 			}
 		}
+		if (ret != SQLITE_DONE)
+			return false;
+	}
+	return true;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-1791: ENOMEM");
+	return false;
+}
+
+enum ctm_field {
+	CTM_MSGID, CTM_MODTIME, CTM_UID, CTM_RECENT, CTM_READ, CTM_UNSENT,
+	CTM_FLAGGED, CTM_REPLIED, CTM_FWD, CTM_DELETED, CTM_RCVDTIME,
+	CTM_FOLDERID, CTM_SIZE,
+};
+
+namespace {
+
+/* Per-message metadata of one folder, column-wise, in uid order */
+struct ct_columns {
+	enum {
+		F_RECENT = 0x1U, F_READ = 0x2U, F_UNSENT = 0x4U, F_FLAGGED = 0x8U,
+		F_REPLIED = 0x10U, F_DELETED = 0x20U,
+	};
+	std::vector<std::string> mid_string;
+	std::vector<uint64_t> message_id, size, modseq;
+	std::vector<uint32_t> uid;
+	std::vector<time_t> mod_time, received;
+	std::vector<uint8_t> flags;
+
+	inline size_t count() const { return uid.size(); }
+};
+
+using ct_bitmap = std::vector<uint64_t>;
+
+struct ct_eval {
+	sqlite3 *psqlite;
+	const char *charset;
+	const ct_columns &col;
+	const fts_state *fts;
+	uint32_t uidnext;
+	/* only kept if more than one condition needs the digest */
+	bool cache_digests;
+	std::unordered_map<size_t, Json::Value> digests;
+
+	ct_bitmap run(const CONDITION_TREE &, const ct_bitmap &want);
+	bool leaf_meta(const ct_node &, size_t idx) const;
+	bool leaf_text(const ct_node &, size_t idx);
+};
+
+}
+
+static inline bool bm_test(const ct_bitmap &b, size_t i)
+{
+	return (b[i / 64] >> (i % 64)) & 1;
+}
+
+static inline void bm_set(ct_bitmap &b, size_t i)
+{
+	b[i / 64] |= 1ULL << (i % 64);
+}
+
+static bool me_ct_needs_text(enum midb_cond c)
+{
+	switch (c) {
+	case midb_cond::bcc:
+	case midb_cond::body:
+	case midb_cond::cc:
+	case midb_cond::from:
+	case midb_cond::header:
+	case midb_cond::subject:
+	case midb_cond::text:
+	case midb_cond::to:
+		return true;
+	default:
+		return false;
+	}
+}
+
+static unsigned int me_ct_count_text(const CONDITION_TREE &tree)
+{
+	unsigned int n = 0;
+	for (const auto &node : tree)
+		n += node.pbranch != nullptr ? me_ct_count_text(*node.pbranch) :
+		     me_ct_needs_text(node.condition);
+	return n;
+}
+
+/* Evaluate a condition that only needs the messages table */
+bool ct_eval::leaf_meta(const ct_node &node, size_t i) const
+{
+	auto fl = col.flags[i];
+	switch (node.condition) {
+	case midb_cond::all:
+	case midb_cond::keyword:
+	case midb_cond::unkeyword:
+		return true;
+	case midb_cond::answered: return fl & ct_columns::F_REPLIED;
+	case midb_cond::unanswered: return !(fl & ct_columns::F_REPLIED);
+	case midb_cond::deleted: return fl & ct_columns::F_DELETED;
+	case midb_cond::undeleted: return !(fl & ct_columns::F_DELETED);
+	case midb_cond::draft: return fl & ct_columns::F_UNSENT;
+	case midb_cond::undraft: return !(fl & ct_columns::F_UNSENT);
+	case midb_cond::flagged: return fl & ct_columns::F_FLAGGED;
+	case midb_cond::unflagged: return !(fl & ct_columns::F_FLAGGED);
+	case midb_cond::seen: return fl & ct_columns::F_READ;
+	case midb_cond::unseen: return !(fl & ct_columns::F_READ);
+	case midb_cond::recent: return fl & ct_columns::F_RECENT;
+	case midb_cond::old: return !(fl & ct_columns::F_RECENT);
+	case midb_cond::is_new:
+		return (fl & ct_columns::F_RECENT) && !(fl & ct_columns::F_READ);
+	case midb_cond::before: return col.received[i] < node.ct_time;
+	case midb_cond::on:
+		return col.received[i] >= node.ct_time &&
+		       col.received[i] < node.ct_time + 86400;
+	case midb_cond::since: return col.received[i] >= node.ct_time;
+	case midb_cond::sent_before: return col.mod_time[i] < node.ct_time;
+	case midb_cond::sent_on:
+		return col.mod_time[i] >= node.ct_time &&
+		       col.mod_time[i] < node.ct_time + 86400;
+	case midb_cond::sent_since: return col.mod_time[i] >= node.ct_time;
+	case midb_cond::larger: return col.size[i] > node.ct_size;
+	case midb_cond::smaller: return col.size[i] < node.ct_size;
+	case midb_cond::modseq: return col.modseq[i] >= node.ct_modseq;
+	case midb_cond::id:
+		return ct_hint_seq(*node.ct_seq, i + 1, col.count());
+	case midb_cond::uid:
+		return ct_hint_seq(*node.ct_seq, col.uid[i], uidnext);
+	default:
+		mlog(LV_DEBUG, "mail_engine: condition stat %u unknown!",
+			static_cast<unsigned int>(node.condition));
+		return false;
+	}
+}
+
+static bool me_ct_digest_has(const Json::Value &digest, const char *key,
+    const char *charset, const char *keyword)
+{
+	char temp_buff[1024], temp_buff1[1024];
+	size_t temp_len = 0;
+	if (!get_digest(digest, key, temp_buff, std::size(temp_buff)) ||
+	    decode64(temp_buff, strlen(temp_buff),
+	    temp_buff1, std::size(temp_buff1), &temp_len) != 0)
+		return false;
+	temp_buff1[temp_len] = '\0';
+	auto rs = me_ct_decode_mime(charset, temp_buff1);
+	return rs != nullptr && strcasestr(rs.get(), keyword) != nullptr;
+}
+
+/* Evaluate a condition that needs the digest and/or the mail itself */
+bool ct_eval::leaf_text(const ct_node &node, size_t i)
+{
+	auto mid_string = col.mid_string[i].c_str();
+	if (node.condition == midb_cond::header)
+		return me_ct_search_head(charset, mid_string,
+		       node.ct_headers[0], node.ct_headers[1]);
+	if (node.condition == midb_cond::bcc)
+		/* we do not support BCC field in mail digest,
+			BCC should not recorded in mail head */
+		return false;
+	Json::Value local, *digest = &local;
+	if (cache_digests) {
+		auto [it, fresh] = digests.try_emplace(i);
+		digest = &it->second;
+		if (fresh && me_get_digest(psqlite, mid_string, *digest) == 0) {
+			digests.erase(it);
+			return false;
 		}
-		
- RECURSION_POINT:
-		switch (conjunction) {
-		case midb_conj::c_and:
-			b_result &= b_result1;
-			break;
-		case midb_conj::c_or:
-			b_result |= b_result1;
-			break;
-		case midb_conj::c_not:
-			b_result &= !b_result1;
-			break;
-		}
+	} else if (me_get_digest(psqlite, mid_string, local) == 0) {
+		return false;
+	}
+	auto kw = node.ct_keyword;
+	switch (node.condition) {
+	case midb_cond::cc: return me_ct_digest_has(*digest, "cc", charset, kw);
+	case midb_cond::from: return me_ct_digest_has(*digest, "from", charset, kw);
+	case midb_cond::subject: return me_ct_digest_has(*digest, "subject", charset, kw);
+	case midb_cond::to: return me_ct_digest_has(*digest, "to", charset, kw);
+	case midb_cond::text:
+		if (me_ct_digest_has(*digest, "cc", charset, kw) ||
+		    me_ct_digest_has(*digest, "from", charset, kw) ||
+		    me_ct_digest_has(*digest, "subject", charset, kw) ||
+		    me_ct_digest_has(*digest, "to", charset, kw))
+			return true;
+		[[fallthrough]];
+	case midb_cond::body: {
+		MJSON temp_mjson;
+		if (!temp_mjson.load_from_json(*digest))
+			return false;
+		temp_mjson.path = cu_get_maildir() + "/eml"s;
+		KEYWORD_ENUM keyword_enum;
+		keyword_enum.pjson = &temp_mjson;
+		keyword_enum.b_result = FALSE;
+		keyword_enum.charset = charset;
+		keyword_enum.keyword = kw;
+		temp_mjson.enum_mime(me_ct_enum_mime, &keyword_enum);
+		return keyword_enum.b_result;
 	}
-	if (sp > 0) {
-		b_result1 = b_result;
-		POP_MATCH(ptree, pnode, conjunction, b_result)
-		goto RECURSION_POINT;
+	default:
+		return false;
 	}
-	return b_result;
 }
-/* end of recursion procedure */
 
-} catch (const std::bad_alloc &) {
-	mlog(LV_ERR, "E-1133: ENOMEM");
-	return false;
+/**
+ * Evaluate @tree for all messages in @want (a bitmap over ct_columns
+ * indices). Bits outside @want in the result are unspecified. A node is
+ * only evaluated for the messages whose outcome it can still change, so
+ * the expensive text conditions only see what the cheap ones let through.
+ */
+ct_bitmap ct_eval::run(const CONDITION_TREE &tree, const ct_bitmap &want)
+{
+	auto nwords = want.size();
+	ct_bitmap res(nwords, ~0ULL), cand(nwords);
+	for (const auto &node : tree) {
+		bool any = false;
+		for (size_t w = 0; w < nwords; ++w) {
+			cand[w] = (node.conjunction == midb_conj::c_or ? ~res[w] : res[w]) & want[w];
+			any |= cand[w] != 0;
+		}
+		if (!any)
+			continue;
+		ct_bitmap hit;
+		if (node.pbranch != nullptr) {
+			hit = run(*node.pbranch, cand);
+		} else {
+			hit.assign(nwords, 0);
+			const std::unordered_set<uint64_t> *fts_hits = nullptr;
+			if (fts != nullptr) {
+				auto it = fts->hits.find(&node);
+				if (it != fts->hits.end())
+					fts_hits = &it->second;
+			}
+			bool text = me_ct_needs_text(node.condition);
+			for (size_t w = 0; w < nwords; ++w) {
+				for (auto bits = cand[w]; bits != 0; bits &= bits - 1) {
+					auto i = w * 64 + __builtin_ctzll(bits);
+					bool r;
+					if (!text)
+						r = leaf_meta(node, i);
+					else if (fts_hits != nullptr &&
+					    !fts->missing.contains(col.message_id[i]))
+						r = fts_hits->contains(col.message_id[i]);
+					else
+						r = leaf_text(node, i);
+					if (r)
+						bm_set(hit, i);
+				}
+			}
+		}
+		for (size_t w = 0; w < nwords; ++w) {
+			switch (node.conjunction) {
+			case midb_conj::c_and: res[w] &= hit[w]; break;
+			case midb_conj::c_or: res[w] |= hit[w]; break;
+			case midb_conj::c_not: res[w] &= ~hit[w]; break;
+			}
+		}
+	}
+	return res;
 }
 
 static int me_ct_compile_criteria(int argc,
@@ -955,6 +1086,19 @@ static int me_ct_compile_criteria(int argc,
 			return -1;
 		argv_out[2] = argv[i];
 		return 3;
+	} else if (0 == strcasecmp(argv[i], "MODSEQ")) {
+		/* MODSEQ [<entry-name> <entry-type-req>] <mod-sequence-valzer> */
+		i ++;
+		if (argc < i + 1)
+			return -1;
+		argv_out[1] = argv[i];
+		if (HX_isdigit(*argv[i]))
+			return 2;
+		if (argc < i + 3)
+			return -1;
+		argv_out[2] = argv[i+1];
+		argv_out[3] = argv[i+2];
+		return 4;
 	} else if (0 == strcasecmp(argv[i], "NOT")) {
 		i ++;
 		if (argc < i + 1)
@@ -993,6 +1137,9 @@ ct_node::ct_node(ct_node &&o) :
 	case midb_cond::larger ... midb_cond::smaller:
 		ct_size = o.ct_size;
 		break;
+	case midb_cond::modseq:
+		ct_modseq = o.ct_modseq;
+		break;
 	default:
 		break;
 	}
@@ -1037,6 +1184,7 @@ static enum midb_cond cond_str_to_cond(const char *s)
 	E(id);
 	E(keyword);
 	E(larger);
+	E(modseq);
 	E2(new, is_new);
 	E(old);
 	E(on);
@@ -1164,6 +1312,18 @@ static std::unique_ptr<CONDITION_TREE> me_ct_build_internal(const char *charset,
 			if (i + 1 > argc)
 				return {};
 			ptree_node->ct_size = strtol(argv[i], nullptr, 0);
+		} else if (0 == strcasecmp(argv[i], "MODSEQ")) {
+			ptree_node->condition = midb_cond::modseq;
+			i ++;
+			if (i + 1 > argc)
+				return {};
+			/* Only a single flag store exists; ignore the entry name */
+			if (!HX_isdigit(*argv[i])) {
+				i += 2;
+				if (i + 1 > argc)
+					return {};
+			}
+			ptree_node->ct_modseq = strtoull(argv[i], nullptr, 0);
 		} else if (0 == strcasecmp(argv[i], "UID")) {
 			ptree_node->condition = midb_cond::uid;
 			i ++;
@@ -1219,49 +1379,68 @@ static bool ct_hint_seq(const imap_seq_list &list,
 
 static std::optional<std::vector<int>> me_ct_match(const char *charset,
     sqlite3 *psqlite, uint64_t folder_id, const CONDITION_TREE *ptree,
-    BOOL b_uid) try
+    BOOL b_uid, bool has_modseq, bool has_fts) try
 {
-	uint32_t uid;
-	uint32_t uidnext;
-	char sql_string[1024];
-
-	snprintf(sql_string, std::size(sql_string), "SELECT count(message_id) "
-	          "FROM messages WHERE folder_id=%llu", LLU{folder_id});
-	auto pstmt = gx_sql_prep(psqlite, sql_string);
-	if (pstmt == nullptr || pstmt.step() != SQLITE_ROW)
+	auto pstmt = gx_sql_prep(psqlite, "SELECT uidnext FROM folders WHERE folder_id=?");
+	if (pstmt == nullptr)
 		return {};
-	auto total_mail = pstmt.col_uint64(0);
-	pstmt.finalize();
-	snprintf(sql_string, std::size(sql_string), "SELECT uidnext FROM"
-	          " folders WHERE folder_id=%llu", LLU{folder_id});
-	pstmt = gx_sql_prep(psqlite, sql_string);
-	if (pstmt == nullptr || pstmt.step() != SQLITE_ROW)
+	pstmt.bind_int64(1, folder_id);
+	if (pstmt.step() != SQLITE_ROW)
 		return {};
-	uidnext = sqlite3_column_int64(pstmt, 0);
+	uint32_t uidnext = pstmt.col_uint64(0);
 	pstmt.finalize();
-	/* Match this column list to ctm_field */
-	auto pstmt_message = gx_sql_prep(psqlite, "SELECT message_id, mod_time, "
-	                     "uid, recent, read, unsent, flagged, replied, forwarded,"
-	                     "deleted, received, folder_id, size FROM messages "
-	                     "WHERE mid_string=?");
-	if (pstmt_message == nullptr)
-		return {};
-	snprintf(sql_string, std::size(sql_string), "SELECT mid_string, uid FROM "
-	          "messages WHERE folder_id=%llu ORDER BY uid", LLU{folder_id});
-	pstmt = gx_sql_prep(psqlite, sql_string);
+	/* One pass over the folder instead of a lookup per condition and mail */
+	pstmt = gx_sql_prep(psqlite, has_modseq ?
+	        "SELECT mid_string, message_id, uid, mod_time, received, size, "
+	        "recent, read, unsent, flagged, replied, deleted, modseq "
+	        "FROM messages WHERE folder_id=? ORDER BY uid" :
+	        "SELECT mid_string, message_id, uid, mod_time, received, size, "
+	        "recent, read, unsent, flagged, replied, deleted, 0 "
+	        "FROM messages WHERE folder_id=? ORDER BY uid");
 	if (pstmt == nullptr)
 		return {};
+	pstmt.bind_int64(1, folder_id);
+	ct_columns col;
+	while (pstmt.step() == SQLITE_ROW) {
+		col.mid_string.emplace_back(znul(pstmt.col_text(0)));
+		col.message_id.push_back(pstmt.col_uint64(1));
+		col.uid.push_back(pstmt.col_uint64(2));
+		col.mod_time.push_back(rop_util_nttime_to_unix(pstmt.col_uint64(3)));
+		col.received.push_back(rop_util_nttime_to_unix(pstmt.col_uint64(4)));
+		col.size.push_back(pstmt.col_uint64(5));
+		uint8_t fl = 0;
+		for (unsigned int f = 0; f < 6; ++f)
+			if (pstmt.col_int64(6 + f) != 0)
+				fl |= 1U << f;
+		col.flags.push_back(fl);
+		col.modseq.push_back(pstmt.col_uint64(12));
+	}
+	pstmt.finalize();
 	std::optional<std::vector<int>> presult;
 	presult.emplace();
-	for (size_t i = 1; pstmt.step() == SQLITE_ROW; ++i) {
-		auto mid_string = pstmt.col_text(0);
-		uid = sqlite3_column_int64(pstmt, 1);
-		if (me_ct_match_mail(psqlite, charset, pstmt_message,
-		    mid_string, i, total_mail, uidnext, ptree))
-			presult->push_back(b_uid ? uid : i);
+	auto total = col.count();
+	if (total == 0)
+		return presult;
+
+	std::optional<fts_state> fts;
+	if (has_fts) {
+		fts.emplace();
+		if (!me_fts_unindexed(psqlite, folder_id, fts->missing) ||
+		    !me_fts_prepare(psqlite, folder_id, ptree, *fts))
+			fts.reset();
 	}
+	ct_eval ev{psqlite, charset, col, fts.has_value() ? &*fts : nullptr,
+	           uidnext, me_ct_count_text(*ptree) > 1};
+	ct_bitmap want((total + 63) / 64);
+	for (size_t i = 0; i < total; ++i)
+		bm_set(want, i);
+	auto res = ev.run(*ptree, want);
+	for (size_t i = 0; i < total; ++i)
+		if (bm_test(res, i))
+			presult->push_back(b_uid ? col.uid[i] : i + 1);
 	return presult;
 } catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-1133: ENOMEM");
 	return {};
 }
 
@@ -1281,6 +1460,103 @@ static uint64_t me_get_folder_id(IDB_ITEM *pidb, std::string_view name)
 	return me_get_folder_id_raw(pidb, base64_decode(name));
 }
 
+/**
+ * Produce the IMAP ENVELOPE, BODY and BODYSTRUCTURE strings for one message
+ * exactly like imapd's FETCH would. message/rfc822 parts are expanded in
+ * memory; @eml may supply the eml file if the caller already has it.
+ */
+static bool me_render_imap(const Json::Value &digest, const char *charset,
+    const std::string *eml, std::string (&out)[3]) try
+{
+	MJSON mjson;
+	if (!mjson.load_from_json(digest))
+		return false;
+	mjson.path = "eml";
+	mjson_io io;
+	bool rfc = mjson.has_rfc822_part();
+	if (rfc) {
+		auto path = mjson.path + "/" + mjson.get_mail_filename();
+		std::string content;
+		if (eml != nullptr)
+			io.place(path, std::string(*eml));
+		else if (exmdb_client->imapfile_read(cu_get_maildir(), "eml",
+		    mjson.get_mail_filename(), &content))
+			io.place(path, std::move(content));
+		rfc = mjson.rfc822_build(io, "tmp");
+	}
+	for (unsigned int i = 0; i < 2; ++i) {
+		auto &b = out[1+i];
+		b.clear();
+		if (rfc && mjson.rfc822_fetch(io, "tmp", charset, i, b) != -1)
+			continue;
+		b.clear();
+		if (mjson.fetch_structure(io, charset, i, b) == -1)
+			b = "NIL";
+	}
+	out[0].clear();
+	if (mjson.fetch_envelope(charset, out[0]) == -1)
+		out[0] = "NIL";
+	return true;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-1792: ENOMEM");
+	return false;
+}
+
+static void me_save_rendered(sqlite3 *db, uint64_t message_id,
+    const char *charset, const std::string (&r)[3])
+{
+	auto stm = gx_sql_prep(db, "REPLACE INTO rendered (message_id, charset,"
+	           " envelope, body, bodystructure) VALUES (?,?,?,?,?)");
+	if (stm == nullptr)
+		return;
+	stm.bind_int64(1, message_id);
+	stm.bind_text(2, charset);
+	stm.bind_text(3, r[0]);
+	stm.bind_text(4, r[1]);
+	stm.bind_text(5, r[2]);
+	if (stm.step() != SQLITE_DONE)
+		mlog(LV_WARN, "W-1793: cannot save rendered structure of message %llu",
+			LLU{message_id});
+}
+
+/**
+ * Attach the rendered IMAP strings for @charset to a digest as
+ * digest["imap"], rendering and saving them first if not yet cached.
+ */
+static void me_attach_rendered(sqlite3 *db, const char *mid_string,
+    const char *charset, Json::Value &digest) try
+{
+	auto stm = gx_sql_prep(db, "SELECT m.message_id, r.envelope, r.body,"
+	           " r.bodystructure FROM messages AS m LEFT JOIN rendered AS r"
+	           " ON r.message_id=m.message_id AND r.charset=?"
+	           " WHERE m.mid_string=?");
+	if (stm == nullptr)
+		return;
+	stm.bind_text(1, charset);
+	stm.bind_text(2, mid_string);
+	if (stm.step() != SQLITE_ROW)
+		return;
+	auto message_id = stm.col_uint64(0);
+	std::string r[3];
+	if (sqlite3_column_type(stm, 1) != SQLITE_NULL) {
+		for (unsigned int i = 0; i < 3; ++i)
+			r[i] = stm.col_text(1 + i);
+		stm.finalize();
+	} else {
+		stm.finalize();
+		if (!me_render_imap(digest, charset, nullptr, r))
+			return;
+		me_save_rendered(db, message_id, charset, r);
+	}
+	auto &j = digest["imap"];
+	j["charset"]       = charset;
+	j["envelope"]      = std::move(r[0]);
+	j["body"]          = std::move(r[1]);
+	j["bodystructure"] = std::move(r[2]);
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-1794: ENOMEM");
+}
+
 static void me_extract_digest_fields(const Json::Value &digest, char *subject,
     size_t subjsize, char *from, size_t fromsize, char *rcpt, size_t rcptsize,
     size_t *psize)
@@ -1322,7 +1598,7 @@ static void me_extract_digest_fields(const Json::Value &digest, char *subject,
 }
 
 static void me_insert_message(xstmt &stm_insert, uint32_t *puidnext,
-    uint64_t message_id, sqlite3 *db, syncmessage_entry e) try
+    uint64_t message_id, sqlite3 *db, syncmessage_entry e, bool render) try
 {
 	size_t size;
 	char from[UADDR_SIZE], rcpt[UADDR_SIZE];
@@ -1330,7 +1606,7 @@ static void me_insert_message(xstmt &stm_insert, uint32_t *puidnext,
 	MESSAGE_CONTENT *pmsgctnt;
 	
 	auto dir = cu_get_maildir();
-	std::string djson;
+	std::string djson, emlcontent;
 	if (e.midstr.size() > 0 &&
 	    !exmdb_client->imapfile_read(dir, "ext", e.midstr, &djson))
 		e.midstr.clear();
@@ -1370,7 +1646,6 @@ static void me_insert_message(xstmt &stm_insert, uint32_t *puidnext,
 			mlog(LV_ERR, "E-1770: imapfile_write %s/ext/%s incomplete", dir, e.midstr.c_str());
 			return;
 		}
-		std::string emlcontent;
 		auto err = imail.to_str(emlcontent);
 		if (err != 0) {
 			mlog(LV_ERR, "E-1771: imail.to_string failed: %s", strerror(err));
@@ -1405,6 +1680,14 @@ static void me_insert_message(xstmt &stm_insert, uint32_t *puidnext,
 	stm_insert.bind_int64(11, e.recv_time);
 	if (stm_insert.step() != SQLITE_DONE)
 		mlog(LV_ERR, "E-2075: sqlite_step not finished");
+	if (render) {
+		/* Other charsets are rendered on first P-DTLU */
+		std::string r[3];
+		digest["file"] = e.midstr;
+		if (me_render_imap(digest, g_default_charset,
+		    emlcontent.empty() ? nullptr : &emlcontent, r))
+			me_save_rendered(db, message_id, g_default_charset, r);
+	}
 	auto qstr = "UPDATE messages SET flagged=" + std::to_string(e.flagged);
 	if (e.answered)
 		qstr += ", replied=1";
@@ -1449,7 +1732,9 @@ static void me_sync_message(IDB_ITEM *pidb, xstmt &stm_insert,
 	if (gx_sql_exec(pidb->psqlite, qstr.c_str()) != SQLITE_OK)
 		return;	
 	/* e.midstr is known to be empty */
-	me_insert_message(stm_insert, puidnext, message_id, pidb->psqlite, e);
+	me_insert_message(stm_insert, puidnext, message_id, pidb->psqlite, e,
+		pidb->has_rendered);
+	pidb->fts_pending = true;
 }
 
 static BOOL me_sync_contents(IDB_ITEM *pidb, uint64_t folder_id) try
@@ -1538,7 +1823,8 @@ static BOOL me_sync_contents(IDB_ITEM *pidb, uint64_t folder_id) try
 		stm_select_msg.bind_int64(1, message_id);
 		if (stm_select_msg.step() != SQLITE_ROW) {
 			me_insert_message(stm_insert_msg, &uidnext, message_id,
-				pidb->psqlite, entry);
+				pidb->psqlite, entry, pidb->has_rendered);
+			pidb->fts_pending = true;
 		} else {
 			auto old_mtime  = stm_select_msg.col_int64(2);
 			bool old_unsent = stm_select_msg.col_int64(3);
@@ -1929,9 +2215,21 @@ static IDB_REF me_get_idb(const char *path, bool force_resync = false)
 			pidb->psqlite = nullptr;
 			return {};
 		}
+		auto schema = dbop_sqlite_schemaversion(pidb->psqlite, sqlite_kind::midb);
+		pidb->has_modseq   = schema >= 4;
+		pidb->has_rendered = schema >= 5;
+		pidb->has_modseq_floor = schema >= 6;
 		gx_sql_exec(pidb->psqlite, "PRAGMA foreign_keys=ON");
 		gx_sql_exec(pidb->psqlite, "PRAGMA journal_mode=WAL");
 		gx_sql_exec(pidb->psqlite, "DELETE FROM mapping");
+		if (pidb->has_modseq_floor) {
+			auto err = me_modseq_prune(pidb->psqlite);
+			if (err != 0)
+				mlog(LV_WARN, "W-1817: %s: pruning expunge records failed (%d)",
+				        midb_path.c_str(), err);
+		}
+		pidb->has_fts = g_midb_fts_index && me_fts_attach(pidb->psqlite, path);
+		pidb->fts_pending = pidb->has_fts;
 		/* Delete obsolete field (old midb versions cannot use the db then however) */
 		// gx_sql_exec(pidb->psqlite, "DELETE FROM configurations WHERE config_id=1");
 
@@ -2046,6 +2344,30 @@ static void *midbme_scanwork(void *param)
 	return nullptr;
 }
 
+/* Add messages to the full-text index off the insert and search paths */
+static void *midbme_ftswork(void *param)
+{
+	while (!g_notify_stop) {
+		sleep(1);
+		std::vector<std::string> paths;
+		try {
+			std::lock_guard hhold(g_hash_lock);
+			for (const auto &[path, idb] : g_hash_table)
+				if (idb.has_fts && idb.fts_pending)
+					paths.push_back(path);
+		} catch (const std::bad_alloc &) {
+			mlog(LV_ERR, "E-1827: ENOMEM");
+			continue;
+		}
+		for (const auto &path : paths) {
+			if (g_notify_stop)
+				break;
+			me_fts_work(path);
+		}
+	}
+	return nullptr;
+}
+
 /**
  * Reset the inactivity timer on midb.sqlite.
  *
@@ -2583,7 +2905,9 @@ static int me_punid(int argc, char **argv, int sockd)
  * Request:
  * 	P-FDDT <store-dir> <folder-name>
  * Response:
- * 	TRUE <#messages> <#recents> <#unreads> <uidvalidity> <uidnext>
+ * 	TRUE <#messages> <#recents> <#unreads> <uidvalidity> <uidnext> [<highestmodseq>]
+ *
+ * highestmodseq is absent if the database has not been upgraded to EM-4 yet.
  */
 static int me_pfddt(int argc, char **argv, int sockd)
 {
@@ -2596,8 +2920,9 @@ static int me_pfddt(int argc, char **argv, int sockd)
 	auto pidb = me_get_idb(argv[1]);
 	if (pidb == nullptr)
 		return MIDB_E_HASHTABLE_FULL;
-	auto pstmt = gx_sql_prep(pidb->psqlite, "SELECT folder_id,"
-	             " uidnext FROM folders WHERE name=?");
+	auto pstmt = gx_sql_prep(pidb->psqlite, pidb->has_modseq ?
+	             "SELECT folder_id, uidnext, highest_modseq FROM folders WHERE name=?" :
+	             "SELECT folder_id, uidnext, 0 FROM folders WHERE name=?");
 	if (pstmt == nullptr)
 		return MIDB_E_SQLPREP;
 	pstmt.bind_text(1, decoded_name);
@@ -2605,6 +2930,7 @@ static int me_pfddt(int argc, char **argv, int sockd)
 		return MIDB_E_NO_FOLDER_TRYCREATE;
 	auto folder_id = pstmt.col_uint64(0);
 	auto uidnext = pstmt.col_uint64(1);
+	auto highest_modseq = pstmt.col_uint64(2);
 	pstmt.finalize();
 	snprintf(sql_string, std::size(sql_string), "SELECT count(message_id) "
 	          "FROM messages WHERE folder_id=%llu", LLU{folder_id});
@@ -2630,9 +2956,13 @@ static int me_pfddt(int argc, char **argv, int sockd)
 	size_t recents = pstmt.step() == SQLITE_ROW ? pstmt.col_uint64(0) : 0;
 	pstmt.finalize();
 	pidb.reset();
-	auto temp_len = sprintf(temp_buff, "TRUE %zu %zu %zu %llu %llu\r\n",
+	auto temp_len = highest_modseq == 0 ?
+	                sprintf(temp_buff, "TRUE %zu %zu %zu %llu %llu\r\n",
+	                total, recents, unreads, LLU{folder_id},
+	                LLU{uidnext + 1}) :
+	                sprintf(temp_buff, "TRUE %zu %zu %zu %llu %llu %llu\r\n",
 	                total, recents, unreads, LLU{folder_id},
-	                LLU{uidnext + 1});
+	                LLU{uidnext + 1}, LLU{highest_modseq});
 	return cmd_write(sockd, temp_buff, temp_len);
 }
 
@@ -2723,6 +3053,7 @@ namespace {
 struct simu_node {
 	uint32_t uid;
 	unsigned int size;
+	uint64_t modseq = 0;
 	std::string flags, mid_string;
 };
 
@@ -2755,6 +3086,8 @@ static int simu_query(IDB_ITEM *pidb, const char *sql_string,
 			sn.flags += midb_flag::forwarded;
 		sn.flags += ')';
 		sn.size = pstmt.col_uint64(10);
+		if (sqlite3_column_count(pstmt) > 11)
+			sn.modseq = pstmt.col_uint64(11);
 		temp_list.push_back(std::move(sn));
 	}
 	return 0;
@@ -2857,6 +3190,91 @@ static int me_psimu(int argc, char **argv, int sockd) try
 	return MIDB_E_NO_MEMORY;
 }
 
+/**
+ * Give the changes in a folder since a modification sequence (RFC 7162)
+ *
+ * Request:
+ * 	P-SIMD <store-dir> <folder-name> <modseq>
+ * Response:
+ * 	TRUE <#lines> <highestmodseq>
+ * 	- <midstr> <uid> <flags> <size> <modseq>  // added/reflagged, by UID
+ * 	V <uid>                                   // expunged
+ *
+ * With modseq 0, this lists the entire folder (and no expunges). Databases
+ * not yet at schema EM-4 answer with MIDB_E_UNKNOWN_COMMAND, like a midb
+ * which does not know P-SIMD at all. If the expunge records after <modseq>
+ * have been pruned, the answer is MIDB_E_MODSEQ_PRUNED, and the client has
+ * to start over with modseq 0.
+ */
+static int me_psimd(int argc, char **argv, int sockd) try
+{
+	uint64_t since = strtoull(argv[3], nullptr, 0);
+	auto pidb = me_get_idb(argv[1]);
+	if (pidb == nullptr)
+		return MIDB_E_HASHTABLE_FULL;
+	if (!pidb->has_modseq)
+		/*
+		 * MIDB_E_UNKNOWN_COMMAND is 0, which midcp_exec would take as
+		 * "already replied"; send the reply ourselves.
+		 */
+		return cmd_write(sockd, "FALSE 0\r\n");
+	auto folder_id = me_get_folder_id(pidb.get(), argv[2]);
+	if (folder_id == 0)
+		return MIDB_E_NO_FOLDER_TRYCREATE;
+	auto qstr = fmt::format("SELECT highest_modseq FROM folders "
+	            "WHERE folder_id={}", folder_id);
+	auto pstmt = gx_sql_prep(pidb->psqlite, qstr.c_str());
+	if (pstmt == nullptr)
+		return MIDB_E_SQLPREP;
+	if (pstmt.step() != SQLITE_ROW)
+		return MIDB_E_NO_FOLDER;
+	auto highest_modseq = pstmt.col_uint64(0);
+	pstmt.finalize();
+
+	std::vector<uint32_t> vanished;
+	auto iret = me_modseq_vanished(pidb->psqlite, folder_id, since,
+	            pidb->has_modseq_floor, vanished);
+	if (iret != 0)
+		return iret;
+	qstr = fmt::format("SELECT 0, mid_string, uid, replied, unsent, "
+	       "flagged, deleted, read, recent, forwarded, size, modseq "
+	       "FROM messages WHERE folder_id={} AND modseq>{} ORDER BY uid",
+	       folder_id, since);
+	std::vector<simu_node> temp_list;
+	iret = simu_query(pidb.get(), qstr.c_str(), 0, temp_list);
+	if (iret != 0)
+		return iret;
+	pidb.reset();
+
+	std::string rsp;
+	rsp.reserve(65536);
+	rsp += fmt::format("TRUE {} {}\r\n", temp_list.size() + vanished.size(),
+	       highest_modseq);
+	for (const auto &sn : temp_list) {
+		rsp += fmt::format("- {} {} {} {} {}\r\n", sn.mid_string, sn.uid,
+		       sn.flags, sn.size, sn.modseq);
+		if (rsp.size() < rsp.capacity() / 2)
+			continue;
+		auto ret = cmd_write(sockd, rsp.c_str(), rsp.size());
+		if (ret != 0)
+			return ret;
+		rsp.clear();
+	}
+	for (auto uid : vanished) {
+		rsp += fmt::format("V {}\r\n", uid);
+		if (rsp.size() < rsp.capacity() / 2)
+			continue;
+		auto ret = cmd_write(sockd, rsp.c_str(), rsp.size());
+		if (ret != 0)
+			return ret;
+		rsp.clear();
+	}
+	return cmd_write(sockd, rsp.c_str(), rsp.size());
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-1787: ENOMEM");
+	return MIDB_E_NO_MEMORY;
+}
+
 /**
  * List \Deleted-flagged mails
  *
@@ -2926,10 +3344,13 @@ static int dtlu_query(IDB_ITEM *pidb, const char *sql_string,
  * Fetch detail (via IMAP UID)
  *
  * Request:
- * 	P-DTLU <store-dir> <folder-name> <1-based imapuid(min)> <1-based imapuid(max)>
+ * 	P-DTLU <store-dir> <folder-name> <1-based imapuid(min)> <1-based imapuid(max)> [charset]
  * Response:
  * 	TRUE <#messages>
  * 	- <digest>  // repeat x #messages
+ *
+ * With a charset, each digest additionally carries an "imap" object with
+ * the rendered ENVELOPE, BODY and BODYSTRUCTURE for that charset.
  */
 static int me_pdtlu(int argc, char **argv, int sockd) try
 {
@@ -2996,6 +3417,8 @@ static int me_pdtlu(int argc, char **argv, int sockd) try
 		Json::Value digest;
 		if (me_get_digest(pidb->psqlite, dt.c_str(), digest) == 0)
 			digest = Json::objectValue;
+		else if (argc > 5 && pidb->has_rendered)
+			me_attach_rendered(pidb->psqlite, dt.c_str(), argv[5], digest);
 		auto djson = json_to_str(digest);
 		djson.insert(0, temp_buff);
 		djson.append("\r\n");
@@ -3030,51 +3453,26 @@ static std::string flags_rn(sqlite3 *db, uint64_t gcv)
 	return out;
 }
 
-/**
- * Set flags on message. For (S)een and (U)nsent, exmdb is contacted(!), which
- * is different from GFLG.
- *
- * Request:
- * 	P-SFLG <store-dir> <folder-name> <mid> <flags>
- * Response:
- * 	TRUE
- */
-static int me_psflg(int argc, char **argv, int sockd) try
+/* Flag updates of P-SFLG for one message */
+static int me_set_flags(IDB_ITEM *pidb, const char *dir,
+    uint64_t message_id, const char *flags)
 {
 	uint64_t read_cn;
-	uint64_t message_id;
 	PROBLEM_ARRAY problems;
 	TPROPVAL_ARRAY propvals;
 
-	auto pidb = me_get_idb(argv[1]);
-	if (pidb == nullptr)
-		return MIDB_E_HASHTABLE_FULL;
-	auto folder_id = me_get_folder_id(pidb.get(), argv[2]);
-	if (folder_id == 0)
-		return MIDB_E_NO_FOLDER;
-	auto pstmt = gx_sql_prep(pidb->psqlite, "SELECT message_id,"
-	             " folder_id FROM messages WHERE mid_string=?");
-	if (pstmt == nullptr)
-		return MIDB_E_SQLPREP;
-	sqlite3_bind_text(pstmt, 1, argv[3], -1, SQLITE_STATIC);
-	if (SQLITE_ROW != pstmt.step() ||
-	    gx_sql_col_uint64(pstmt, 1) != folder_id)
-		return MIDB_E_NO_MESSAGE;
-	message_id = sqlite3_column_int64(pstmt, 0);
-	pstmt.finalize();
-
 	/*
 	 * The backnotification (msg_modified) arrives belatedly, so we UPDATE
 	 * the table here already.
 	 */
 	std::string qstr = "UPDATE messages SET ";
-	bool set_answered  = strchr(argv[4], midb_flag::answered)  != nullptr;
-	bool set_unsent    = strchr(argv[4], midb_flag::unsent)    != nullptr;
-	bool set_flagged   = strchr(argv[4], midb_flag::flagged)   != nullptr;
-	bool set_forwarded = strchr(argv[4], midb_flag::forwarded) != nullptr;
-	bool set_deleted   = strchr(argv[4], midb_flag::deleted)   != nullptr;
-	bool set_seen      = strchr(argv[4], midb_flag::seen)      != nullptr;
-	bool set_recent    = strchr(argv[4], midb_flag::recent)    != nullptr;
+	bool set_answered  = strchr(flags, midb_flag::answered)  != nullptr;
+	bool set_unsent    = strchr(flags, midb_flag::unsent)    != nullptr;
+	bool set_flagged   = strchr(flags, midb_flag::flagged)   != nullptr;
+	bool set_forwarded = strchr(flags, midb_flag::forwarded) != nullptr;
+	bool set_deleted   = strchr(flags, midb_flag::deleted)   != nullptr;
+	bool set_seen      = strchr(flags, midb_flag::seen)      != nullptr;
+	bool set_recent    = strchr(flags, midb_flag::recent)    != nullptr;
 	if (set_answered)  qstr += "replied=1,";
 	if (set_unsent)    qstr += "unsent=1,";
 	if (set_flagged)   qstr += "flagged=1,";
@@ -3091,7 +3489,7 @@ static int me_psflg(int argc, char **argv, int sockd) try
 	if (set_unsent) {
 		static constexpr proptag_t tmp_proptag[] = {PR_MESSAGE_FLAGS};
 		static constexpr PROPTAG_ARRAY proptags = {std::size(tmp_proptag), deconst(tmp_proptag)};
-		if (!exmdb_client->get_message_properties(argv[1], NULL,
+		if (!exmdb_client->get_message_properties(dir, NULL,
 		    CP_ACP, rop_util_make_eid_ex(1, message_id),
 		    &proptags, &propvals) || propvals.count == 0)
 			return MIDB_E_MDB_GETMSGPROPS;
@@ -3099,7 +3497,7 @@ static int me_psflg(int argc, char **argv, int sockd) try
 		if (!(message_flags & MSGFLAG_UNSENT)) {
 			message_flags |= MSGFLAG_UNSENT;
 			propvals.ppropval[0].pvalue = &message_flags;
-			if (!exmdb_client->set_message_properties(argv[1],
+			if (!exmdb_client->set_message_properties(dir,
 			    nullptr, CP_ACP, rop_util_make_eid_ex(1, message_id),
 			    &propvals, &problems))
 				return MIDB_E_MDB_SETMSGPROPS;
@@ -3109,7 +3507,7 @@ static int me_psflg(int argc, char **argv, int sockd) try
 		const uint32_t val = set_answered ? MAIL_ICON_REPLIED : MAIL_ICON_FORWARDED;
 		const TAGGED_PROPVAL tp[] = {{PR_ICON_INDEX, deconst(&val)}};
 		const TPROPVAL_ARRAY ta = {std::size(tp), deconst(tp)};
-		if (!exmdb_client->set_message_properties(argv[1],
+		if (!exmdb_client->set_message_properties(dir,
 		    nullptr, CP_ACP, rop_util_make_eid_ex(1, message_id),
 		    &ta, &problems))
 			return MIDB_E_MDB_SETMSGPROPS;
@@ -3121,36 +3519,29 @@ static int me_psflg(int argc, char **argv, int sockd) try
 			{PR_FOLLOWUP_ICON, deconst(&icon)},
 		};
 		static constexpr TPROPVAL_ARRAY ta = {std::size(tp), deconst(tp)};
-		if (!exmdb_client->set_message_properties(argv[1],
+		if (!exmdb_client->set_message_properties(dir,
 		    nullptr, CP_ACP, rop_util_make_eid_ex(1, message_id),
 		    &ta, &problems))
 			return MIDB_E_MDB_SETMSGPROPS;
 	}
-	if (set_seen && !exmdb_client->set_message_read_state(argv[1], nullptr,
+	if (set_seen && !exmdb_client->set_message_read_state(dir, nullptr,
 	    rop_util_make_eid_ex(1, message_id), 1, &read_cn))
 		return MIDB_E_MDB_SETMSGRD;
-	auto new_flags = flags_rn(pidb->psqlite, message_id);
-	pidb.reset();
-	return cmd_write(sockd, new_flags.c_str(), new_flags.size());
-} catch (const std::bad_alloc &) {
-	mlog(LV_ERR, "E-1751: ENOMEM");
-	return MIDB_E_NO_MEMORY;
+	return 0;
 }
 
 /**
- * Remove flags on message. Flags (S)een and (U)nsent trigger contact to exmdb.
+ * Set flags on message. For (S)een and (U)nsent, exmdb is contacted(!), which
+ * is different from GFLG.
  *
  * Request:
- * 	P-RFLG <store-dir> <folder-name> <mid> <flags>
+ * 	P-SFLG <store-dir> <folder-name> <mid> <flags>
  * Response:
  * 	TRUE
  */
-static int me_prflg(int argc, char **argv, int sockd) try
+static int me_psflg(int argc, char **argv, int sockd) try
 {
-	uint64_t read_cn;
 	uint64_t message_id;
-	PROBLEM_ARRAY problems;
-	TPROPVAL_ARRAY propvals;
 
 	auto pidb = me_get_idb(argv[1]);
 	if (pidb == nullptr)
@@ -3169,14 +3560,33 @@ static int me_prflg(int argc, char **argv, int sockd) try
 	message_id = sqlite3_column_int64(pstmt, 0);
 	pstmt.finalize();
 
+	auto err = me_set_flags(pidb.get(), argv[1], message_id, argv[4]);
+	if (err != 0)
+		return err;
+	auto new_flags = flags_rn(pidb->psqlite, message_id);
+	pidb.reset();
+	return cmd_write(sockd, new_flags.c_str(), new_flags.size());
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-1751: ENOMEM");
+	return MIDB_E_NO_MEMORY;
+}
+
+/* Flag updates of P-RFLG for one message */
+static int me_unset_flags(IDB_ITEM *pidb, const char *dir,
+    uint64_t message_id, const char *flags)
+{
+	uint64_t read_cn;
+	PROBLEM_ARRAY problems;
+	TPROPVAL_ARRAY propvals;
+
 	std::string qstr = "UPDATE messages SET ";
-	bool set_answered  = strchr(argv[4], midb_flag::answered)  != nullptr;
-	bool set_unsent    = strchr(argv[4], midb_flag::unsent)    != nullptr;
-	bool set_flagged   = strchr(argv[4], midb_flag::flagged)   != nullptr;
-	bool set_forwarded = strchr(argv[4], midb_flag::forwarded) != nullptr;
-	bool set_deleted   = strchr(argv[4], midb_flag::deleted)   != nullptr;
-	bool set_seen      = strchr(argv[4], midb_flag::seen)      != nullptr;
-	bool set_recent    = strchr(argv[4], midb_flag::recent)    != nullptr;
+	bool set_answered  = strchr(flags, midb_flag::answered)  != nullptr;
+	bool set_unsent    = strchr(flags, midb_flag::unsent)    != nullptr;
+	bool set_flagged   = strchr(flags, midb_flag::flagged)   != nullptr;
+	bool set_forwarded = strchr(flags, midb_flag::forwarded) != nullptr;
+	bool set_deleted   = strchr(flags, midb_flag::deleted)   != nullptr;
+	bool set_seen      = strchr(flags, midb_flag::seen)      != nullptr;
+	bool set_recent    = strchr(flags, midb_flag::recent)    != nullptr;
 	if (set_answered)  qstr += "replied=0,";
 	if (set_unsent)    qstr += "unsent=0,";
 	if (set_flagged)   qstr += "flagged=0,";
@@ -3193,7 +3603,7 @@ static int me_prflg(int argc, char **argv, int sockd) try
 	if (set_unsent) {
 		static constexpr proptag_t tmp_proptag[] = {PR_MESSAGE_FLAGS};
 		static constexpr PROPTAG_ARRAY proptags = {std::size(tmp_proptag), deconst(tmp_proptag)};
-		if (!exmdb_client->get_message_properties(argv[1], nullptr,
+		if (!exmdb_client->get_message_properties(dir, nullptr,
 		    CP_ACP, rop_util_make_eid_ex(1, message_id),
 		    &proptags, &propvals) || propvals.count == 0)
 			return MIDB_E_MDB_GETMSGPROPS;
@@ -3201,7 +3611,7 @@ static int me_prflg(int argc, char **argv, int sockd) try
 		if (message_flags & MSGFLAG_UNSENT) {
 			message_flags &= ~MSGFLAG_UNSENT;
 			propvals.ppropval[0].pvalue = &message_flags;
-			if (!exmdb_client->set_message_properties(argv[1],
+			if (!exmdb_client->set_message_properties(dir,
 			    nullptr, CP_ACP, rop_util_make_eid_ex(1, message_id),
 			    &propvals, &problems))
 				return MIDB_E_MDB_SETMSGPROPS;
@@ -3211,13 +3621,13 @@ static int me_prflg(int argc, char **argv, int sockd) try
 		static constexpr proptag_t proptags_1[] = {PR_ICON_INDEX};
 		static constexpr PROPTAG_ARRAY proptags = {std::size(proptags_1), deconst(proptags_1)};
 		TPROPVAL_ARRAY propvals{};
-		if (exmdb_client->get_message_properties(argv[1], nullptr,
+		if (exmdb_client->get_message_properties(dir, nullptr,
 		    CP_ACP, rop_util_make_eid_ex(1, message_id),
 		    &proptags, &propvals)) {
 			uint32_t testfor = set_answered ? MAIL_ICON_REPLIED : MAIL_ICON_FORWARDED;
 			auto icon = propvals.get<const uint32_t>(PR_ICON_INDEX);
 			if (icon != nullptr && *icon == testfor)
-				if (!exmdb_client->remove_message_properties(argv[1], CP_ACP,
+				if (!exmdb_client->remove_message_properties(dir, CP_ACP,
 				    rop_util_make_eid_ex(1, message_id), &proptags))
 					/* ignore */;
 		}
@@ -3227,13 +3637,48 @@ static int me_prflg(int argc, char **argv, int sockd) try
 			PR_FLAG_STATUS, PR_FOLLOWUP_ICON, PR_TODO_ITEM_FLAGS,
 		};
 		static constexpr PROPTAG_ARRAY ta = {std::size(tags), deconst(tags)};
-		if (!exmdb_client->remove_message_properties(argv[1], CP_ACP,
+		if (!exmdb_client->remove_message_properties(dir, CP_ACP,
 		    rop_util_make_eid_ex(1, message_id), &ta))
 			return MIDB_E_MDB_SETMSGPROPS;
 	}
-	if (set_seen && !exmdb_client->set_message_read_state(argv[1], nullptr,
+	if (set_seen && !exmdb_client->set_message_read_state(dir, nullptr,
 	    rop_util_make_eid_ex(1, message_id), 0, &read_cn))
 		return MIDB_E_MDB_SETMSGRD;
+	return 0;
+}
+
+/**
+ * Remove flags on message. Flags (S)een and (U)nsent trigger contact to exmdb.
+ *
+ * Request:
+ * 	P-RFLG <store-dir> <folder-name> <mid> <flags>
+ * Response:
+ * 	TRUE
+ */
+static int me_prflg(int argc, char **argv, int sockd) try
+{
+	uint64_t message_id;
+
+	auto pidb = me_get_idb(argv[1]);
+	if (pidb == nullptr)
+		return MIDB_E_HASHTABLE_FULL;
+	auto folder_id = me_get_folder_id(pidb.get(), argv[2]);
+	if (folder_id == 0)
+		return MIDB_E_NO_FOLDER;
+	auto pstmt = gx_sql_prep(pidb->psqlite, "SELECT message_id,"
+	             " folder_id FROM messages WHERE mid_string=?");
+	if (pstmt == nullptr)
+		return MIDB_E_SQLPREP;
+	sqlite3_bind_text(pstmt, 1, argv[3], -1, SQLITE_STATIC);
+	if (SQLITE_ROW != pstmt.step() ||
+	    gx_sql_col_uint64(pstmt, 1) != folder_id)
+		return MIDB_E_NO_MESSAGE;
+	message_id = sqlite3_column_int64(pstmt, 0);
+	pstmt.finalize();
+
+	auto err = me_unset_flags(pidb.get(), argv[1], message_id, argv[4]);
+	if (err != 0)
+		return err;
 	auto new_flags = flags_rn(pidb->psqlite, message_id);
 	pidb.reset();
 	return cmd_write(sockd, new_flags.c_str(), new_flags.size());
@@ -3242,6 +3687,80 @@ static int me_prflg(int argc, char **argv, int sockd) try
 	return MIDB_E_NO_MEMORY;
 }
 
+/**
+ * Conditional STORE (RFC 7162 §3.1.3): change the flags of the messages whose
+ * modseq is not above <unchangedsince>. The comparison and the update happen
+ * under the same giant lock hold, so no other session can get in between.
+ * <op> is "=" (replace), "+" (add) or "-" (remove). Messages no longer in
+ * the folder are skipped.
+ *
+ * Request:
+ * 	P-CSFL <store-dir> <folder-name> <unchangedsince> <op> <flags> <mid>...
+ * Response:
+ * 	TRUE [<uid>...]  // modified since <unchangedsince> and left alone
+ */
+static int me_pcsfl(int argc, char **argv, int sockd) try
+{
+	uint64_t since = strtoull(argv[3], nullptr, 0);
+	char op = argv[4][0];
+	if ((op != '=' && op != '+' && op != '-') || argv[4][1] != '\0')
+		return MIDB_E_PARAMETER_ERROR;
+	auto pidb = me_get_idb(argv[1]);
+	if (pidb == nullptr)
+		return MIDB_E_HASHTABLE_FULL;
+	if (!pidb->has_modseq)
+		/* like me_psimd */
+		return cmd_write(sockd, "FALSE 0\r\n");
+	auto folder_id = me_get_folder_id(pidb.get(), argv[2]);
+	if (folder_id == 0)
+		return MIDB_E_NO_FOLDER;
+	std::string clear;
+	if (op == '=')
+		for (auto f : {midb_flag::answered, midb_flag::unsent,
+		    midb_flag::flagged, midb_flag::deleted, midb_flag::seen,
+		    midb_flag::recent})
+			if (strchr(argv[5], f) == nullptr)
+				clear += f;
+	auto pstmt = gx_sql_prep(pidb->psqlite, "SELECT message_id, "
+	             "folder_id, uid, modseq FROM messages WHERE mid_string=?");
+	if (pstmt == nullptr)
+		return MIDB_E_SQLPREP;
+	std::string rsp = "TRUE";
+	for (int i = 6; i < argc; ++i) {
+		pstmt.reset();
+		pstmt.bind_text(1, argv[i]);
+		if (pstmt.step() != SQLITE_ROW ||
+		    pstmt.col_uint64(1) != folder_id)
+			continue;
+		auto message_id = pstmt.col_uint64(0);
+		auto uid = pstmt.col_uint64(2);
+		auto modseq = pstmt.col_uint64(3);
+		pstmt.reset();
+		if (modseq > since) {
+			rsp += " " + std::to_string(uid);
+			continue;
+		}
+		int err = 0;
+		if (op == '-') {
+			err = me_unset_flags(pidb.get(), argv[1], message_id, argv[5]);
+		} else {
+			if (!clear.empty())
+				err = me_unset_flags(pidb.get(), argv[1], message_id, clear.c_str());
+			if (err == 0)
+				err = me_set_flags(pidb.get(), argv[1], message_id, argv[5]);
+		}
+		if (err != 0)
+			return err;
+	}
+	pstmt.finalize();
+	pidb.reset();
+	rsp += "\r\n";
+	return cmd_write(sockd, rsp.c_str(), rsp.size());
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-1828: ENOMEM");
+	return MIDB_E_NO_MEMORY;
+}
+
 /**
  * Get flags on message from midb.sqlite without contacting exmdb.
  * You better hope that the change notification socket is working,
@@ -3333,6 +3852,7 @@ static int me_psrhl(int argc, char **argv, int sockd) try
 	auto folder_id = me_get_folder_id(pidb.get(), argv[2]);
 	if (folder_id == 0)
 		return MIDB_E_NO_FOLDER;
+	auto has_modseq = pidb->has_modseq, has_fts = pidb->has_fts;
 	pidb.reset();
 	auto midb_path = make_midb_path(argv[1]);
 	auto ret = sqlite3_open_v2(midb_path.c_str(), &psqlite, SQLITE_OPEN_READWRITE, nullptr);
@@ -3340,7 +3860,7 @@ static int me_psrhl(int argc, char **argv, int sockd) try
 		mlog(LV_ERR, "E-1439: sqlite3_open %s: %s", midb_path.c_str(), sqlite3_errstr(ret));
 		return MIDB_E_HASHTABLE_FULL;
 	}
-	auto presult = me_ct_match(argv[3], psqlite, folder_id, ptree.get(), false);
+	auto presult = me_ct_match(argv[3], psqlite, folder_id, ptree.get(), false, has_modseq, has_fts);
 	if (!presult.has_value()) {
 		sqlite3_close(psqlite);
 		return MIDB_E_MNG_CTMATCH;
@@ -3410,6 +3930,7 @@ static int me_psrhu(int argc, char **argv, int sockd) try
 	auto folder_id = me_get_folder_id(pidb.get(), argv[2]);
 	if (folder_id == 0)
 		return MIDB_E_NO_FOLDER;
+	auto has_modseq = pidb->has_modseq, has_fts = pidb->has_fts;
 	pidb.reset();
 	auto midb_path = make_midb_path(argv[1]);
 	auto ret = sqlite3_open_v2(midb_path.c_str(), &psqlite, SQLITE_OPEN_READWRITE, nullptr);
@@ -3417,7 +3938,7 @@ static int me_psrhu(int argc, char **argv, int sockd) try
 		mlog(LV_ERR, "E-1505: sqlite3_open %s: %s", midb_path.c_str(), sqlite3_errstr(ret));
 		return MIDB_E_HASHTABLE_FULL;
 	}
-	auto presult = me_ct_match(argv[3], psqlite, folder_id, ptree.get(), TRUE);
+	auto presult = me_ct_match(argv[3], psqlite, folder_id, ptree.get(), TRUE, has_modseq, has_fts);
 	if (!presult.has_value()) {
 		sqlite3_close(psqlite);
 		return MIDB_E_MNG_CTMATCH;
@@ -3575,7 +4096,9 @@ static void notif_msg_added(IDB_ITEM *pidb,
 		return;	
 	me_insert_message(pstmt, &uidnext, message_id, pidb->psqlite,
 		syncmessage_entry{mod_time, received_time, message_flags,
-		znul(str), set_answered, set_forwarded, b_flagged});
+		znul(str), set_answered, set_forwarded, b_flagged},
+		pidb->has_rendered);
+	pidb->fts_pending = true;
 } catch (const std::bad_alloc &) {
 	mlog(LV_ERR, "E-2418: ENOMEM");
 }
@@ -4079,10 +4602,12 @@ static constexpr struct {
 	{"P-UNSF", {me_punsf, 3}},
 	{"P-SUBL", {me_psubl, 2}},
 	{"P-SIMU", {me_psimu, 5}},
+	{"P-SIMD", {me_psimd, 4}},
 	{"P-DELL", {me_pdell, 3}},
-	{"P-DTLU", {me_pdtlu, 5}},
+	{"P-DTLU", {me_pdtlu, 5, 6}},
 	{"P-SFLG", {me_psflg, 5}},
 	{"P-RFLG", {me_prflg, 5}},
+	{"P-CSFL", {me_pcsfl, 6, INT_MAX}},
 	{"P-GFLG", {me_pgflg, 4}},
 	{"P-SRHL", {me_psrhl, 5}},
 	{"P-SRHU", {me_psrhu, 5}},
@@ -4111,6 +4636,14 @@ int me_run()
 		return -5;
 	}
 	pthread_setname_np(g_scan_tid, "mail_engine");
+	if (g_midb_fts_index) {
+		ret = pthread_create4(&g_fts_tid, nullptr, midbme_ftswork, nullptr);
+		if (ret != 0) {
+			mlog(LV_ERR, "mail_engine: failed to create fts thread: %s", strerror(ret));
+			return -5;
+		}
+		pthread_setname_np(g_fts_tid, "midb_fts");
+	}
 	for (const auto &e : me_commands)
 		cmd_parser_register_command(e.key, e.value);
 	exmdb_client_register_proc(reinterpret_cast<void *>(notif_handler));
@@ -4124,6 +4657,10 @@ void me_stop()
 		pthread_kill(g_scan_tid, SIGALRM);
 		pthread_join(g_scan_tid, NULL);
 	}
+	if (!pthread_equal(g_fts_tid, {})) {
+		pthread_kill(g_fts_tid, SIGALRM);
+		pthread_join(g_fts_tid, NULL);
+	}
 	{ /* silence cov-scan, take locks even in single-thread scenarios */
 		std::lock_guard lk(g_hash_lock);
 		g_hash_table.clear();
@@ -12,3 +12,4 @@ extern void me_stop();
 
 extern unsigned int g_midb_schema_upgrades;
 extern unsigned int g_midb_cache_interval, g_midb_reload_interval;
+extern bool g_midb_fts_index;
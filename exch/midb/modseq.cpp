@@ -0,0 +1,106 @@
+// SPDX-License-Identifier: GPL-2.0-only WITH linking exception
+// SPDX-FileCopyrightText: 2025 grommunio GmbH
+// This file is part of Gromox.
+/*
+ * Bookkeeping of the `expunged` table (schema EM-4). Every message removal
+ * leaves a (folder_id, uid, modseq) record there; me_modseq_prune trims
+ * each folder to its most recent records and remembers the modseq up to
+ * which records are gone in folders.modseq_floor (schema EM-6).
+ */
+#include <cstdint>
+#include <new>
+#include <vector>
+#include <sqlite3.h>
+#include <gromox/database.h>
+#include <gromox/midb.hpp>
+#include <gromox/util.hpp>
+#include "modseq.hpp"
+
+using namespace gromox;
+
+/**
+ * UIDs expunged from @folder_id after modseq @since. Fails with
+ * MIDB_E_MODSEQ_PRUNED if records newer than @since have already been
+ * pruned; the caller then has to resort to a full listing.
+ */
+int me_modseq_vanished(sqlite3 *db, uint64_t folder_id, uint64_t since,
+    bool has_floor, std::vector<uint32_t> &vanished) try
+{
+	if (since == 0)
+		return 0;
+	if (has_floor) {
+		auto stm = gx_sql_prep(db, "SELECT modseq_floor FROM folders WHERE folder_id=?");
+		if (stm == nullptr)
+			return MIDB_E_SQLPREP;
+		stm.bind_int64(1, folder_id);
+		if (stm.step() != SQLITE_ROW)
+			return MIDB_E_NO_FOLDER;
+		if (since < stm.col_uint64(0))
+			return MIDB_E_MODSEQ_PRUNED;
+	}
+	auto stm = gx_sql_prep(db, "SELECT uid FROM expunged WHERE folder_id=? "
+	           "AND modseq>? ORDER BY uid");
+	if (stm == nullptr)
+		return MIDB_E_SQLPREP;
+	stm.bind_int64(1, folder_id);
+	stm.bind_int64(2, since);
+	while (stm.step() == SQLITE_ROW)
+		vanished.push_back(stm.col_uint64(0));
+	return 0;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-1808: ENOMEM");
+	return MIDB_E_NO_MEMORY;
+}
+
+/**
+ * Trim every folder's expunge records to the @keep most recent ones and
+ * raise its modseq_floor to the highest modseq dropped.
+ */
+int me_modseq_prune(sqlite3 *db, unsigned int keep) try
+{
+	std::vector<uint64_t> folders;
+	auto stm = gx_sql_prep(db, "SELECT folder_id FROM expunged "
+	           "GROUP BY folder_id HAVING COUNT(*)>?");
+	if (stm == nullptr)
+		return MIDB_E_SQLPREP;
+	stm.bind_int64(1, keep);
+	while (stm.step() == SQLITE_ROW)
+		folders.push_back(stm.col_uint64(0));
+	stm.finalize();
+	if (folders.empty())
+		return 0;
+
+	auto xact = gx_sql_begin(db, txn_mode::write);
+	if (!xact)
+		return MIDB_E_SQLUNEXP;
+	auto stm_floor = gx_sql_prep(db, "SELECT modseq FROM expunged "
+	                 "WHERE folder_id=? ORDER BY modseq DESC LIMIT 1 OFFSET ?");
+	auto stm_del = gx_sql_prep(db, "DELETE FROM expunged "
+	               "WHERE folder_id=? AND modseq<=?");
+	auto stm_upd = gx_sql_prep(db, "UPDATE folders SET "
+	               "modseq_floor=MAX(modseq_floor,?) WHERE folder_id=?");
+	if (stm_floor == nullptr || stm_del == nullptr || stm_upd == nullptr)
+		return MIDB_E_SQLPREP;
+	for (auto folder_id : folders) {
+		stm_floor.reset();
+		stm_floor.bind_int64(1, folder_id);
+		stm_floor.bind_int64(2, keep);
+		if (stm_floor.step() != SQLITE_ROW)
+			continue;
+		auto floor = stm_floor.col_uint64(0);
+		stm_del.reset();
+		stm_del.bind_int64(1, folder_id);
+		stm_del.bind_int64(2, floor);
+		if (stm_del.step() != SQLITE_DONE)
+			return MIDB_E_SQLUNEXP;
+		stm_upd.reset();
+		stm_upd.bind_int64(1, floor);
+		stm_upd.bind_int64(2, folder_id);
+		if (stm_upd.step() != SQLITE_DONE)
+			return MIDB_E_SQLUNEXP;
+	}
+	return xact.commit() == SQLITE_OK ? 0 : MIDB_E_SQLUNEXP;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-1809: ENOMEM");
+	return MIDB_E_NO_MEMORY;
+}
@@ -0,0 +1,10 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+#include <sqlite3.h>
+
+/* Expunge records kept per folder for QRESYNC/P-SIMD */
+static constexpr unsigned int MODSEQ_EXPUNGED_KEEP = 4096;
+
+extern int me_modseq_vanished(sqlite3 *, uint64_t folder_id, uint64_t since, bool has_floor, std::vector<uint32_t> &);
+extern int me_modseq_prune(sqlite3 *, unsigned int keep = MODSEQ_EXPUNGED_KEEP);
@@ -59,8 +59,19 @@ int mysql_plugin::run()
 	return 0;
 }
 
-errno_t mysql_plugin::meta(const char *username, unsigned int wantpriv,
-    sql_meta_result &mres) try
+static std::string cache_key(const char *name)
+{
+	std::string k = name;
+	HX_strlower(k.data());
+	return k;
+}
+
+/**
+ * Look up the user's row for meta(). Returns 0 with @ent filled in (which
+ * may record an ambiguous login name), ENOENT if there is no such user, or
+ * another error code if the lookup failed.
+ */
+errno_t mysql_plugin::meta_query(const char *username, sql_meta_entry &ent) try
 {
 	auto conn = g_sqlconn_pool.get_wait();
 	if (!conn)
@@ -100,51 +111,26 @@ errno_t mysql_plugin::meta(const char *username, unsigned int wantpriv,
 	if (!conn->query(qstr))
 		return EIO;
 	auto pmyres = conn->store_result();
-	if (pmyres == nullptr) {
-		mres.errstr = "Could not store SQL result";
+	if (pmyres == nullptr)
 		return ENOMEM;
-	}
 	conn.finish();
 	if (pmyres.num_rows() > 1) {
-		mres.errstr = fmt::format("Login name is ambiguous", username);
-		return ENOENT;
+		ent.ambiguous = true;
+		return 0;
 	} else if (pmyres.num_rows() != 1) {
-		mres.errstr = fmt::format("No such user", username);
 		return ENOENT;
 	}
 
 	auto myrow = pmyres.fetch_row();
-	uint32_t dtypx;
-	if (myrow[1] == nullptr) {
-		mres.errstr = "PR_DISPLAY_TYPE_EX is missing for this user";
-		return EINVAL;
-	}
-	dtypx = static_cast<enum display_type>(strtoul(myrow[1], nullptr, 0));
-	if (dtypx != DT_MAILUSER && !(wantpriv & WANTPRIV_METAONLY)) {
-		mres.errstr = "Object is not a DT_MAILUSER";
-		return EACCES;
-	}
-	auto address_status = strtoul(myrow[2], nullptr, 0);
-	if (!afuser_login_allowed(address_status) && !(wantpriv & WANTPRIV_METAONLY)) {
-		auto uval = address_status & AF_USER__MASK;
-		if (address_status & AF_DOMAIN__MASK)
-			mres.errstr = "User's domain is disabled";
-		else if (uval == AF_USER_SHAREDMBOX)
-			mres.errstr = "Login operation disabled for shared mailboxes";
-		else if (uval != 0)
-			mres.errstr = "User account is disabled";
-		return EACCES;
-	}
-	wantpriv &= ~WANTPRIV_METAONLY;
-
+	auto &mres = ent.mres;
+	ent.have_dtypx = myrow[1] != nullptr;
+	if (ent.have_dtypx)
+		ent.dtypx = static_cast<enum display_type>(strtoul(myrow[1], nullptr, 0));
+	ent.address_status = strtoul(myrow[2], nullptr, 0);
 	mres.privbits = strtoul(myrow[3], nullptr, 0);
 	if (!(mres.privbits & USER_PRIVILEGE_DETAIL1))
 		mres.privbits |= USER_PRIVILEGE_DETAIL1 | USER_PRIVILEGE_WEB |
 		                 USER_PRIVILEGE_EAS | USER_PRIVILEGE_DAV;
-	if (wantpriv != 0 && !(mres.privbits & wantpriv)) {
-		mres.errstr = fmt::format("Not authorized to use service(s) {:x}h", wantpriv);
-		return EACCES;
-	}
 	mres.maildir    = myrow[4];
 	mres.lang       = znul(myrow[5]);
 	mres.enc_passwd = myrow[0];
@@ -167,6 +153,60 @@ errno_t mysql_plugin::meta(const char *username, unsigned int wantpriv,
 	return EIO;
 }
 
+errno_t mysql_plugin::meta(const char *username, unsigned int wantpriv,
+    sql_meta_result &mres) try
+{
+	/*
+	 * Not cached: password hash, address status and privilege bits
+	 * must take effect immediately when changed outside of Gromox.
+	 */
+	sql_meta_entry e;
+	auto err = meta_query(username, e);
+	if (err == ENOENT) {
+		mres.errstr = "No such user";
+		return ENOENT;
+	} else if (err == ENOMEM) {
+		mres.errstr = "Could not store SQL result";
+		return err;
+	} else if (err != 0) {
+		return err;
+	}
+
+	if (e.ambiguous) {
+		mres.errstr = "Login name is ambiguous";
+		return ENOENT;
+	}
+	if (!e.have_dtypx) {
+		mres.errstr = "PR_DISPLAY_TYPE_EX is missing for this user";
+		return EINVAL;
+	}
+	if (e.dtypx != DT_MAILUSER && !(wantpriv & WANTPRIV_METAONLY)) {
+		mres.errstr = "Object is not a DT_MAILUSER";
+		return EACCES;
+	}
+	auto address_status = e.address_status;
+	if (!afuser_login_allowed(address_status) && !(wantpriv & WANTPRIV_METAONLY)) {
+		auto uval = address_status & AF_USER__MASK;
+		if (address_status & AF_DOMAIN__MASK)
+			mres.errstr = "User's domain is disabled";
+		else if (uval == AF_USER_SHAREDMBOX)
+			mres.errstr = "Login operation disabled for shared mailboxes";
+		else if (uval != 0)
+			mres.errstr = "User account is disabled";
+		return EACCES;
+	}
+	wantpriv &= ~WANTPRIV_METAONLY;
+	if (wantpriv != 0 && !(e.mres.privbits & wantpriv)) {
+		mres.errstr = fmt::format("Not authorized to use service(s) {:x}h", wantpriv);
+		return EACCES;
+	}
+	mres = std::move(e.mres);
+	return 0;
+} catch (const std::bad_alloc &e) {
+	mlog(LV_ERR, "E-1800: ENOMEM");
+	return ENOMEM;
+}
+
 /*
  * @password:       just-entered password, plain
  * @encrypt_passwd: the previously stored password, encoded
@@ -238,6 +278,7 @@ bool mysql_plugin::setpasswd(const char *username,
 	       "' WHERE username='" + q_user + "'";
 	if (!conn->query(qstr))
 		return false;
+	cache_invalidate(username);
 	return true;
 } catch (const std::exception &e) {
 	mlog(LV_ERR, "%s: %s", "E-1703", e.what());
@@ -299,6 +340,11 @@ bool mysql_plugin::get_user_displayname(const char *username, std::string &out)
 {
 	if (!str_isascii(username))
 		return false;
+	auto key = cache_key(username);
+	auto cr = m_dispname_cache.get(key, out);
+	if (cr != cache_result::miss)
+		return cr == cache_result::hit;
+	auto gen = m_dispname_cache.generation();
 	auto conn = g_sqlconn_pool.get_wait();
 	if (!conn)
 		return false;
@@ -325,8 +371,10 @@ bool mysql_plugin::get_user_displayname(const char *username, std::string &out)
 	if (pmyres == nullptr)
 		return false;
 	conn.finish();
-	if (pmyres.num_rows() != 1)
+	if (pmyres.num_rows() != 1) {
+		m_dispname_cache.put_negative(gen, key);
 		return false;
+	}
 	auto myrow = pmyres.fetch_row();
 	auto dtypx = DT_MAILUSER;
 	if (myrow[2] != nullptr)
@@ -335,6 +383,7 @@ bool mysql_plugin::get_user_displayname(const char *username, std::string &out)
 	       myrow[0] != nullptr && *myrow[0] != '\0' ? myrow[0] :
 	       myrow[1] != nullptr && *myrow[1] != '\0' ? myrow[1] :
 	       username;
+	m_dispname_cache.put(gen, key, out);
 	return true;
 } catch (const std::exception &e) {
 	mlog(LV_ERR, "%s: %s", "E-1707", e.what());
@@ -385,6 +434,7 @@ bool mysql_plugin::set_user_lang(const char *username, const char *lang) try
 		    "' WHERE username='" + conn->quote(username) + "'";
 	if (!conn->query(qstr))
 		return false;
+	cache_invalidate(username);
 	return true;
 } catch (const std::exception &e) {
 	mlog(LV_ERR, "%s: %s", "E-1710", e.what());
@@ -402,6 +452,7 @@ bool mysql_plugin::set_timezone(const char *username, const char *zone) try
 	            "' WHERE username='" + conn->quote(username) + "'";
 	if (!conn->query(qstr))
 		return false;
+	cache_invalidate(username);
 	return true;
 } catch (const std::exception &e) {
 	mlog(LV_ERR, "%s: %s", "E-1713", e.what());
@@ -412,6 +463,16 @@ bool mysql_plugin::get_homedir(const char *domainname, char *homedir, size_t dsi
 {
 	if (!str_isascii(domainname))
 		return false;
+	auto key = cache_key(domainname);
+	std::string dir;
+	auto cr = m_homedir_cache.get(key, dir);
+	if (cr == cache_result::negative)
+		return false;
+	if (cr == cache_result::hit) {
+		gx_strlcpy(homedir, dir.c_str(), dsize);
+		return true;
+	}
+	auto gen = m_homedir_cache.generation();
 	auto conn = g_sqlconn_pool.get_wait();
 	if (!conn)
 		return false;
@@ -423,10 +484,13 @@ bool mysql_plugin::get_homedir(const char *domainname, char *homedir, size_t dsi
 	if (pmyres == nullptr)
 		return false;
 	conn.finish();
-	if (pmyres.num_rows() != 1)
+	if (pmyres.num_rows() != 1) {
+		m_homedir_cache.put_negative(gen, key);
 		return false;
+	}
 	auto myrow = pmyres.fetch_row();
 	gx_strlcpy(homedir, myrow[0], dsize);
+	m_homedir_cache.put(gen, key, myrow[0]);
 	return true;
 } catch (const std::exception &e) {
 	mlog(LV_ERR, "%s: %s", "E-1716", e.what());
@@ -484,6 +548,21 @@ bool mysql_plugin::get_user_ids(const char *username, unsigned int *puser_id,
 {
 	if (!str_isascii(username))
 		return false;
+	auto key = cache_key(username);
+	sql_user_ids ids;
+	auto cr = m_uid_cache.get(key, ids);
+	if (cr == cache_result::negative)
+		return false;
+	if (cr == cache_result::hit) {
+		if (puser_id != nullptr)
+			*puser_id = ids.user_id;
+		if (pdomain_id != nullptr)
+			*pdomain_id = ids.domain_id;
+		if (dtypx != nullptr)
+			*dtypx = ids.dtypx;
+		return true;
+	}
+	auto gen = m_uid_cache.generation();
 	auto conn = g_sqlconn_pool.get_wait();
 	if (!conn)
 		return false;
@@ -502,18 +581,22 @@ bool mysql_plugin::get_user_ids(const char *username, unsigned int *puser_id,
 	if (pmyres == nullptr)
 		return false;
 	conn.finish();
-	if (pmyres.num_rows() != 1)
+	if (pmyres.num_rows() != 1) {
+		m_uid_cache.put_negative(gen, key);
 		return false;
+	}
 	auto myrow = pmyres.fetch_row();
+	ids.user_id   = strtoul(myrow[0], nullptr, 0);
+	ids.domain_id = strtoul(myrow[1], nullptr, 0);
+	if (myrow[2] != nullptr)
+		ids.dtypx = static_cast<enum display_type>(strtoul(myrow[2], nullptr, 0));
+	m_uid_cache.put(gen, key, ids);
 	if (puser_id != nullptr)
-		*puser_id = strtoul(myrow[0], nullptr, 0);
+		*puser_id = ids.user_id;
 	if (pdomain_id != nullptr)
-		*pdomain_id = strtoul(myrow[1], nullptr, 0);
-	if (dtypx != nullptr) {
-		*dtypx = DT_MAILUSER;
-		if (myrow[2] != nullptr)
-			*dtypx = static_cast<enum display_type>(strtoul(myrow[2], nullptr, 0));
-	}
+		*pdomain_id = ids.domain_id;
+	if (dtypx != nullptr)
+		*dtypx = ids.dtypx;
 	return true;
 } catch (const std::exception &e) {
 	mlog(LV_ERR, "%s: %s", "E-1719", e.what());
@@ -525,6 +608,19 @@ bool mysql_plugin::get_domain_ids(const char *domainname,
 {
 	if (!str_isascii(domainname))
 		return false;
+	auto key = cache_key(domainname);
+	std::pair<unsigned int, unsigned int> ids;
+	auto cr = m_domid_cache.get(key, ids);
+	if (cr == cache_result::negative)
+		return false;
+	if (cr == cache_result::hit) {
+		if (pdomain_id != nullptr)
+			*pdomain_id = ids.first;
+		if (porg_id != nullptr)
+			*porg_id = ids.second;
+		return true;
+	}
+	auto gen = m_domid_cache.generation();
 	auto conn = g_sqlconn_pool.get_wait();
 	if (!conn)
 		return false;
@@ -538,13 +634,18 @@ bool mysql_plugin::get_domain_ids(const char *domainname,
 	if (pmyres == nullptr)
 		return false;
 	conn.finish();
-	if (pmyres.num_rows() != 1)
+	if (pmyres.num_rows() != 1) {
+		m_domid_cache.put_negative(gen, key);
 		return false;
+	}
 	auto myrow = pmyres.fetch_row();
+	ids.first  = strtoul(myrow[0], nullptr, 0);
+	ids.second = strtoul(myrow[1], nullptr, 0);
+	m_domid_cache.put(gen, key, ids);
 	if (pdomain_id != nullptr)
-		*pdomain_id = strtoul(myrow[0], nullptr, 0);
+		*pdomain_id = ids.first;
 	if (porg_id != nullptr)
-		*porg_id = strtoul(myrow[1], nullptr, 0);
+		*porg_id = ids.second;
 	return true;
 } catch (const std::exception &e) {
 	mlog(LV_ERR, "%s: %s", "E-1720", e.what());
@@ -662,99 +763,118 @@ bool mysql_plugin::get_domain_groups(unsigned int domain_id,
 	return false;
 }
 
-bool mysql_plugin::check_mlist_include(const char *mlist_name,
+/**
+ * Returns 1 if @account is a member of @mlist_name, 0 if not, or -1 if the
+ * lookup failed.
+ */
+int mysql_plugin::mlist_include_query(const char *mlist_name,
     const char *account) try
 {
-	if (!str_isascii(mlist_name) || !str_isascii(account))
-		return false;
 	auto conn = g_sqlconn_pool.get_wait();
 	if (!conn)
-		return false;
+		return -1;
 	auto q_mlist = conn->quote(mlist_name);
 	const char *pencode_domain = strchr(q_mlist.c_str(), '@');
 	if (pencode_domain == nullptr)
-		return false;
+		return 0;
 	++pencode_domain;
 	auto qstr = "SELECT id, list_type FROM mlists WHERE listname='" + q_mlist + "'";
 	if (!conn->query(qstr))
-		return false;
+		return -1;
 	auto pmyres = conn->store_result();
 	if (pmyres == nullptr)
-		return false;
+		return -1;
 	if (pmyres.num_rows() != 1)
-		return false;
+		return 0;
 
 	auto myrow = pmyres.fetch_row();
 	unsigned int id = strtoul(myrow[0], nullptr, 0);
 	auto type = static_cast<mlist_type>(strtoul(myrow[1], nullptr, 0));
-	bool b_result = false;
 	switch (type) {
 	case mlist_type::normal:
 		qstr = "SELECT username FROM associations WHERE list_id=" +
 		       std::to_string(id) + " AND username='" +
 		       conn->quote(account) + "'";
 		if (!conn->query(qstr))
-			return false;
+			return -1;
 		pmyres = conn->store_result();
 		if (pmyres == nullptr)
-			return false;
-		if (pmyres.num_rows() > 0)
-			b_result = true;
-		return b_result;
+			return -1;
+		return pmyres.num_rows() > 0;
 	case mlist_type::group: {
 		qstr = "SELECT `id` FROM `groups` WHERE `groupname`='" + q_mlist + "'";
 		if (!conn->query(qstr))
-			return false;
+			return -1;
 		pmyres = conn->store_result();
 		if (pmyres == nullptr)
-			return false;
+			return -1;
 		if (pmyres.num_rows() != 1)
-			return false;
+			return 0;
 		myrow = pmyres.fetch_row();
 		unsigned int group_id = strtoul(myrow[0], nullptr, 0);
 		qstr = "SELECT username FROM users WHERE group_id=" +
 		       std::to_string(group_id) + " AND username='" +
 		       conn->quote(account) + "'";
 		if (!conn->query(qstr))
-			return false;
+			return -1;
 		pmyres = conn->store_result();
 		if (pmyres == nullptr)
-			return false;
-		if (pmyres.num_rows() > 0)
-			b_result = true;
-		return b_result;
+			return -1;
+		return pmyres.num_rows() > 0;
 	}
 	case mlist_type::domain: {
 		qstr = "SELECT id FROM domains WHERE domainname='"s + pencode_domain + "'";
 		if (!conn->query(qstr))
-			return false;
+			return -1;
 		pmyres = conn->store_result();
 		if (pmyres == nullptr)
-			return false;
+			return -1;
 		if (pmyres.num_rows() != 1)
-			return false;
+			return 0;
 		myrow = pmyres.fetch_row();
 		unsigned int domain_id = strtoul(myrow[0], nullptr, 0);
 		qstr = "SELECT username FROM users WHERE domain_id=" +
 		       std::to_string(domain_id) + " AND username='" +
 		       conn->quote(account) + "'";
 		if (!conn->query(qstr))
-			return false;
+			return -1;
 		pmyres = conn->store_result();
 		if (pmyres == nullptr)
-			return false;
-		if (pmyres.num_rows() > 0)
-			b_result = true;
-		return b_result;
+			return -1;
+		return pmyres.num_rows() > 0;
 	}
 	case mlist_type::dyngroup: {
-		return false;
+		return 0;
 	}
 	default:
-		return false;
+		return 0;
 	}
 } catch (const std::exception &e) {
 	mlog(LV_ERR, "%s: %s", "E-1729", e.what());
+	return -1;
+}
+
+bool mysql_plugin::check_mlist_include(const char *mlist_name,
+    const char *account) try
+{
+	if (!str_isascii(mlist_name) || !str_isascii(account))
+		return false;
+	auto key = cache_key(mlist_name);
+	key += '\n';
+	key += cache_key(account);
+	bool dummy;
+	auto cr = m_mlist_cache.get(key, dummy);
+	if (cr != cache_result::miss)
+		return cr == cache_result::hit;
+	auto gen = m_mlist_cache.generation();
+	auto ret = mlist_include_query(mlist_name, account);
+	if (ret > 0)
+		m_mlist_cache.put(gen, key, true);
+	else if (ret == 0)
+		m_mlist_cache.put_negative(gen, key);
+	return ret > 0;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-1801: ENOMEM");
 	return false;
 }
 
@@ -7,6 +7,7 @@
 #include <algorithm>
 #include <cctype>
 #include <cerrno>
+#include <chrono>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
@@ -26,6 +27,7 @@
 #	include <pwd.h>
 #endif
 #include <fmt/core.h>
+#include <libHX/string.h>
 #include <gromox/config_file.hpp>
 #include <gromox/database_mysql.hpp>
 #include <gromox/dbop.h>
@@ -375,6 +377,97 @@ int mysql_plugin::get_domain_users(unsigned int domain_id,
 	return false;
 }
 
+/**
+ * Like get_domain_users, but only return the users whose row, properties or
+ * aliases were modified at or after @since (server clock, see the `modified`
+ * columns), plus the IDs of all users presently in the domain, so that the
+ * caller can tell deletions apart. @now receives the server's clock from
+ * before the queries, to be used as @since for the next call.
+ *
+ * Removal of a property or alias row leaves no timestamp behind; such
+ * changes are only picked up by the caller's periodic full reload.
+ */
+bool mysql_plugin::get_domain_users_since(unsigned int domain_id, time_t since,
+    time_t &now, std::vector<sql_user> &changed,
+    std::vector<unsigned int> &ids) try
+{
+	char query[512];
+
+	if (m_user_mtime == 0)
+		return false;
+	auto conn = g_sqlconn_pool.get_wait();
+	if (!conn)
+		return false;
+	if (m_user_mtime < 0) {
+		/* the `modified` columns appeared in gx-132..137 */
+		auto ver = dbop_mysql_schemaversion(conn->get());
+		if (ver < 0)
+			return false;
+		m_user_mtime = ver >= 137;
+		if (ver < 137)
+			mlog(LV_INFO, "mysql_adaptor: schema n%d does not track user modifications; address book reloads will be full", ver);
+		if (m_user_mtime == 0)
+			return false;
+	}
+	if (!conn->query("SELECT UNIX_TIMESTAMP()"))
+		return false;
+	{
+		auto res = conn->store_result();
+		if (res == nullptr)
+			return false;
+		auto row = res.fetch_row();
+		if (row == nullptr || row[0] == nullptr)
+			return false;
+		now = strtoll(row[0], nullptr, 0);
+	}
+	gx_snprintf(query, std::size(query),
+	         "SELECT id FROM users WHERE domain_id=%u AND group_id=0", domain_id);
+	if (!conn->query(query))
+		return false;
+	{
+		auto res = conn->store_result();
+		if (res == nullptr)
+			return false;
+		DB_ROW row;
+		while ((row = res.fetch_row()) != nullptr)
+			ids.push_back(strtoul(row[0], nullptr, 0));
+	}
+
+	/* a user counts as changed if its row, a property or an alias is newer */
+	auto changed_since = fmt::format("(u.modified>=FROM_UNIXTIME({0}) OR "
+	         "u.id IN (SELECT user_id FROM user_properties WHERE modified>=FROM_UNIXTIME({0})) OR "
+	         "u.username IN (SELECT mainname FROM aliases WHERE modified>=FROM_UNIXTIME({0})))",
+	         static_cast<long long>(since));
+	auto qstr = fmt::format("SELECT u.username, a.aliasname FROM users AS u "
+	         "INNER JOIN aliases AS a ON u.domain_id={} AND u.username=a.mainname "
+	         "WHERE {}", domain_id, changed_since);
+	aliasmap_t amap;
+	if (!aliasmap_load(*conn, qstr.c_str(), amap))
+		return false;
+
+	qstr = fmt::format("SELECT u.id, p.proptag, p.propval_bin, p.propval_str FROM users AS u "
+	         "INNER JOIN user_properties AS p ON u.domain_id={} AND u.id=p.user_id "
+	         "WHERE {} "
+	         "ORDER BY p.user_id, p.proptag, p.order_id", domain_id, changed_since);
+	propmap_t pmap;
+	if (!propmap_load(*conn, qstr.c_str(), pmap))
+		return false;
+
+	qstr = fmt::format("SELECT u.id, u.username, dt.propval_str AS dtypx, u.address_status, "
+	         "u.maildir, z.list_type, z.list_privilege, "
+	         "cl.classname, gr.title FROM users AS u "
+	         JOIN_WITH_DISPLAYTYPE
+	         "LEFT JOIN mlists AS z ON u.username=z.listname "
+	         "LEFT JOIN classes AS cl ON u.username=cl.listname "
+	         "LEFT JOIN `groups` AS `gr` ON `u`.`username`=`gr`.`groupname` "
+	         "WHERE u.domain_id={} AND u.group_id=0 AND {}",
+	         domain_id, changed_since);
+	return userlist_parse(*conn, qstr.c_str(), amap, pmap, changed, domain_id) >= 0;
+} catch (const std::exception &e) {
+	mlog(LV_ERR, "mysql_adaptor: %s %s", __func__, e.what());
+	return false;
+}
+
 errno_t mysql_plugin::scndstore_hints(unsigned int pri,
     std::vector<sql_user> &hints) try
 {
@@ -409,6 +502,13 @@ errno_t mysql_plugin::scndstore_hints(unsigned int pri,
 
 int mysql_plugin::domain_list_query(const char *domain) try
 {
+	std::string key = domain;
+	HX_strlower(key.data());
+	bool dummy;
+	auto cr = m_domlist_cache.get(key, dummy);
+	if (cr != cache_result::miss)
+		return cr == cache_result::hit;
+	auto gen = m_domlist_cache.generation();
 	auto conn = g_sqlconn_pool.get_wait();
 	if (!conn)
 		return -EIO;
@@ -419,7 +519,12 @@ int mysql_plugin::domain_list_query(const char *domain) try
 	auto res = conn->store_result();
 	if (res == nullptr)
 		return -ENOMEM;
-	return res.fetch_row() != nullptr;
+	if (res.fetch_row() == nullptr) {
+		m_domlist_cache.put_negative(gen, key);
+		return 0;
+	}
+	m_domlist_cache.put(gen, key, true);
+	return 1;
 } catch (const std::bad_alloc &) {
 	mlog(LV_ERR, "E-1647: ENOMEM");
 	return -ENOMEM;
@@ -459,11 +564,72 @@ errno_t mysql_plugin::get_homeserver(const char *entity, bool is_pvt,
 	return -ENOMEM;
 }
 
+void mysql_plugin::cache_configure()
+{
+	auto ttl = std::chrono::seconds(g_parm.cache_ttl);
+	auto neg = std::chrono::seconds(g_parm.cache_neg_ttl);
+	m_uid_cache.configure(g_parm.cache_size, ttl, neg);
+	m_dispname_cache.configure(g_parm.cache_size, ttl, neg);
+	m_homedir_cache.configure(g_parm.cache_size, ttl, neg);
+	m_domid_cache.configure(g_parm.cache_size, ttl, neg);
+	m_mlist_cache.configure(g_parm.cache_size, ttl, neg);
+	m_domlist_cache.configure(g_parm.cache_size, ttl, neg);
+}
+
+void mysql_plugin::cache_stats(std::map<std::string, sql_cache_stats> &out) const
+{
+	auto add = [&](const char *name, const auto &cache) {
+		auto st = cache.get_stats();
+		auto &o = out[name];
+		o.hits     = st.hits;
+		o.neg_hits = st.neg_hits;
+		o.misses   = st.misses;
+		o.entries  = st.entries;
+	};
+	add("user_ids", m_uid_cache);
+	add("user_displayname", m_dispname_cache);
+	add("homedir", m_homedir_cache);
+	add("domain_ids", m_domid_cache);
+	add("mlist_include", m_mlist_cache);
+	add("domain_list", m_domlist_cache);
+}
+
+/**
+ * Forget cached lookups for a user or domain name (all caches if @name is
+ * nullptr). Queries already in flight will not repopulate the caches with
+ * what they read.
+ */
+void mysql_plugin::cache_invalidate(const char *name)
+{
+	if (name == nullptr) {
+		m_uid_cache.clear();
+		m_dispname_cache.clear();
+		m_homedir_cache.clear();
+		m_domid_cache.clear();
+		m_mlist_cache.clear();
+		m_domlist_cache.clear();
+		return;
+	}
+	std::string key = name;
+	HX_strlower(key.data());
+	m_uid_cache.erase(key);
+	m_dispname_cache.erase(key);
+	m_homedir_cache.erase(key);
+	m_domid_cache.erase(key);
+	m_domlist_cache.erase(key);
+	/* keyed by "mlist\naccount" */
+	m_mlist_cache.erase_if([&](const std::string &k, const bool *) {
+		auto nl = k.find('\n');
+		return k.compare(0, nl, key) == 0 || k.compare(nl + 1, k.npos, key) == 0;
+	});
+}
+
 void mysql_plugin::init(mysql_adaptor_init_param &&parm)
 {
 	g_parm = std::move(parm);
 	g_sqlconn_pool.resize(g_parm.conn_num);
 	g_sqlconn_pool.bump();
+	cache_configure();
 
 	auto qstr = "SELECT u.id FROM users AS u LEFT JOIN user_properties "
 	            "AS up ON u.id=up.user_id AND up.proptag=0x39050003 "
@@ -484,6 +650,9 @@ void mysql_plugin::init(mysql_adaptor_init_param &&parm)
 }
 
 static constexpr cfg_directive mysql_adaptor_cfg_defaults[] = {
+	{"cache_negative_ttl", "0", CFG_TIME},
+	{"cache_size", "0", CFG_SIZE},
+	{"cache_ttl", "1min", CFG_TIME},
 	{"connection_num", "8", CFG_SIZE},
 	{"enable_firsttime_password", "no", CFG_BOOL},
 	{"mysql_dbname", "email"},
@@ -539,6 +708,9 @@ bool mysql_plugin::reload_config(std::shared_ptr<config_file> &&cfg)
 		par.schema_upgrade = SSU_AUTOUPGRADE;
 
 	par.enable_firsttimepw = cfg->get_ll("enable_firsttime_password");
+	par.cache_size    = cfg->get_ll("cache_size");
+	par.cache_ttl     = cfg->get_ll("cache_ttl");
+	par.cache_neg_ttl = cfg->get_ll("cache_negative_ttl");
 	init(std::move(par));
 	return true;
 }
@@ -929,6 +1101,12 @@ int mysql_adaptor_get_domain_users(unsigned int id, std::vector<sql_user> &v)
 	return le_mysql_plugin->get_domain_users(id, v);
 }
 
+bool mysql_adaptor_get_domain_users_since(unsigned int id, time_t since,
+    time_t &now, std::vector<sql_user> &v, std::vector<unsigned int> &ids)
+{
+	return le_mysql_plugin->get_domain_users_since(id, since, now, v, ids);
+}
+
 bool mysql_adaptor_check_mlist_include(const char *m, const char *a)
 {
 	return le_mysql_plugin->check_mlist_include(m, a);
@@ -971,6 +1149,16 @@ errno_t mysql_adaptor_mda_alias_list(sql_alias_map &v, size_t &a)
 	return le_mysql_plugin->mda_alias_list(v, a);
 }
 
+void mysql_adaptor_cache_stats(std::map<std::string, sql_cache_stats> &v)
+{
+	le_mysql_plugin->cache_stats(v);
+}
+
+void mysql_adaptor_cache_invalidate(const char *name)
+{
+	le_mysql_plugin->cache_invalidate(name);
+}
+
 errno_t mysql_adaptor_mda_domain_list(sql_domain_set &v)
 {
 	return le_mysql_plugin->mda_domain_list(v);
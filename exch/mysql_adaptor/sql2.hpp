@@ -1,9 +1,13 @@
 #pragma once
+#include <atomic>
 #include <cstring>
+#include <ctime>
+#include <map>
 #include <mysql.h>
 #include <string>
 #include <vector>
 #include <gromox/database_mysql.hpp>
+#include <gromox/lru_cache.hpp>
 #include <gromox/mysql_adaptor.hpp>
 #include <gromox/resource_pool.hpp>
 
@@ -42,6 +46,19 @@ struct sqlconnpool final : public gromox::resource_pool<sqlconn> {
 	resource_pool::token get_wait();
 };
 
+/* Outcome of the meta() query, before evaluating wantpriv */
+struct sql_meta_entry {
+	sql_meta_result mres;
+	bool ambiguous = false, have_dtypx = false;
+	uint32_t dtypx = 0;
+	unsigned long address_status = 0;
+};
+
+struct sql_user_ids {
+	unsigned int user_id = 0, domain_id = 0;
+	enum display_type dtypx = DT_MAILUSER;
+};
+
 struct mysql_plugin final {
 	public:
 	void init(mysql_adaptor_init_param &&);
@@ -72,6 +89,7 @@ struct mysql_plugin final {
 	bool check_same_org(unsigned int domain_id1, unsigned int domain_id2);
 	bool get_domain_groups(unsigned int domain_id, std::vector<sql_group> &);
 	int get_domain_users(unsigned int domain_id, std::vector<sql_user> &);
+	bool get_domain_users_since(unsigned int domain_id, time_t since, time_t &now, std::vector<sql_user> &, std::vector<unsigned int> &ids);
 	bool check_mlist_include(const char *mlist_name, const char *account);
 	bool check_same_org2(const char *domainname1, const char *domainname2);
 	bool get_mlist_memb(const char *username, const char *from, int *presult, std::vector<std::string> &);
@@ -81,10 +99,22 @@ struct mysql_plugin final {
 	int mbop_userlist(std::vector<sql_user> &);
 	gromox::errno_t mda_alias_list(gromox::sql_alias_map &, size_t &);
 	gromox::errno_t mda_domain_list(gromox::sql_domain_set &);
+	void cache_stats(std::map<std::string, sql_cache_stats> &) const;
+	void cache_invalidate(const char *name);
 
 	protected:
+	gromox::errno_t meta_query(const char *username, sql_meta_entry &);
+	int mlist_include_query(const char *mlist_name, const char *account);
+	void cache_configure();
+
 	mysql_adaptor_init_param g_parm;
 	sqlconnpool g_sqlconn_pool;
+	std::atomic<int> m_user_mtime{-1}; /* users.modified available? -1: not yet known */
+	/* Keyed by lowercased name as passed in by the caller */
+	gromox::sharded_lru<std::string, sql_user_ids> m_uid_cache;
+	gromox::sharded_lru<std::string, std::string> m_dispname_cache, m_homedir_cache;
+	gromox::sharded_lru<std::string, std::pair<unsigned int, unsigned int>> m_domid_cache;
+	gromox::sharded_lru<std::string, bool> m_mlist_cache, m_domlist_cache;
 };
 
 }
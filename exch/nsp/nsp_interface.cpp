@@ -993,9 +993,7 @@ ec_error_t nsp_interface_seek_entries(NSPI_HANDLE handle, uint32_t reserved,
 
 	start_pos = 0;
 	if (0 == pstat->container_id) {
-		auto it = std::lower_bound(pbase->ubegin(), pbase->uend(), ptarget->value.pstr,
-		                           [&](ab_tree::minid m1, const char *val)
-		                           { return strcasecmp(pbase->displayname(m1).c_str(), val) < 0; });
+		auto it = pbase->seek(ptarget->value.pstr);
 		if (it == pbase->uend())
 			return ecNotFound;
 		prow = common_util_proprowset_enlarge(rowset);
@@ -1009,9 +1007,10 @@ ec_error_t nsp_interface_seek_entries(NSPI_HANDLE handle, uint32_t reserved,
 		ab_tree::ab_node node(pbase, pstat->container_id);
 		if (start_pos >= node.children())
 			return ecNotFound;
-		auto it = std::lower_bound(node.begin()+start_pos, node.end(), ptarget->value.pstr,
-		                           [&](ab_tree::minid m1, const char *val)
-		                           {return strcasecmp(pbase->displayname(m1).c_str(), val) < 0;});
+		auto key = ab_tree::name_index::fold(ptarget->value.pstr);
+		auto it = std::lower_bound(node.begin()+start_pos, node.end(), key,
+		                           [&](ab_tree::minid m1, const std::string &val)
+		                           { return pbase->sortkey(m1) < val; });
 		if (it == node.end())
 			return ecNotFound;
 		prow = common_util_proprowset_enlarge(rowset);
@@ -1028,6 +1027,86 @@ ec_error_t nsp_interface_seek_entries(NSPI_HANDLE handle, uint32_t reserved,
 	return ecSuccess;
 }
 
+using mid_cand = std::optional<std::vector<ab_tree::minid>>;
+
+/* Put candidates (back) into address book order */
+static void nsp_interface_cand_order(const ab_tree::ab_base &base,
+    std::vector<ab_tree::minid> &v)
+{
+	std::sort(v.begin(), v.end(), [&](ab_tree::minid a, ab_tree::minid b) {
+		return base.find(a).pos() < base.find(b).pos();
+	});
+	v.erase(std::unique(v.begin(), v.end()), v.end());
+}
+
+/**
+ * Narrow down the nodes that nsp_interface_match_node could accept for
+ * @pfilter by way of the name index. Only ANR restrictions (and AND/OR
+ * thereof) are understood; std::nullopt means "could be any node".
+ */
+static mid_cand nsp_interface_match_cand(const ab_tree::ab_base &base,
+    const NSPRES *pfilter) try
+{
+	switch (pfilter->res_type) {
+	case RES_AND: {
+		mid_cand out;
+		for (size_t i = 0; i < pfilter->res.res_andor.cres; ++i) {
+			auto c = nsp_interface_match_cand(base, &pfilter->res.res_andor.pres[i]);
+			if (!c.has_value())
+				continue;
+			if (!out.has_value()) {
+				out = std::move(c);
+				continue;
+			}
+			std::unordered_set<uint32_t> keep(c->cbegin(), c->cend());
+			std::erase_if(*out, [&](ab_tree::minid m) { return keep.count(m) == 0; });
+		}
+		return out;
+	}
+	case RES_OR: {
+		std::vector<ab_tree::minid> out;
+		for (size_t i = 0; i < pfilter->res.res_andor.cres; ++i) {
+			auto c = nsp_interface_match_cand(base, &pfilter->res.res_andor.pres[i]);
+			if (!c.has_value())
+				return std::nullopt;
+			out.insert(out.end(), c->cbegin(), c->cend());
+		}
+		nsp_interface_cand_order(base, out);
+		return out;
+	}
+	case RES_PROPERTY: {
+		auto &rprop = pfilter->res.res_property;
+		if (rprop.pprop == nullptr ||
+		    (rprop.proptag != PR_ANR && rprop.proptag != PR_ANR_A))
+			return std::nullopt;
+		/*
+		 * The index holds UTF-8; PR_ANR_A values are in the client's
+		 * codepage and can only be looked up when they are plain ASCII.
+		 */
+		if (rprop.proptag == PR_ANR_A && !str_isascii(rprop.pprop->value.pstr))
+			return std::nullopt;
+		/* Every test in the ANR branch implies a substring hit on the value, or on its part after ':' */
+		auto out = base.lookup(rprop.pprop->value.pstr);
+		if (!out.has_value())
+			return std::nullopt;
+		auto colon = strchr(rprop.pprop->value.pstr, ':');
+		if (colon != nullptr) {
+			auto c = base.lookup(&colon[1]);
+			if (!c.has_value())
+				return std::nullopt;
+			out->insert(out->end(), c->cbegin(), c->cend());
+			nsp_interface_cand_order(base, *out);
+		}
+		return out;
+	}
+	default:
+		return std::nullopt;
+	}
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-1797: ENOMEM");
+	return std::nullopt;
+}
+
 static BOOL nsp_interface_match_node(const ab_tree::ab_node &node,
     cpid_t codepage, const NSPRES *pfilter)
 {
@@ -1265,6 +1344,21 @@ ec_error_t nsp_interface_get_matches(NSPI_HANDLE handle, uint32_t reserved1,
 	} else if (pstat->container_id == 0) {
 		uint32_t start_pos, total;
 		nsp_interface_position_in_list(pstat, base.get(), &start_pos, &total);
+		auto cand = nsp_interface_match_cand(*base, pfilter);
+		if (cand.has_value()) {
+			for (auto mid : *cand) {
+				if (mid.type() != ab_tree::minid::address)
+					continue;
+				auto upos = base->find(mid) - base->ubegin();
+				if (upos < start_pos || upos >= total ||
+				    !nsp_interface_match_node({base, mid}, pstat->codepage, pfilter))
+					continue;
+				auto pproptag = common_util_proptagarray_enlarge(outmids);
+				if (pproptag == nullptr)
+					return ecServerOOM;
+				*pproptag = mid;
+			}
+		} else {
 		for (auto it = base->ubegin() + start_pos; it != base->uend() && it-base->ubegin() < total; ++it)
 			if (nsp_interface_match_node({base, *it}, pstat->codepage, pfilter)) {
 				auto pproptag = common_util_proptagarray_enlarge(outmids);
@@ -1272,6 +1366,7 @@ ec_error_t nsp_interface_get_matches(NSPI_HANDLE handle, uint32_t reserved1,
 					return ecServerOOM;
 				*pproptag = *it;
 			}
+		}
 	} else {
 		ab_tree::ab_node node(base, pstat->container_id);
 		if (!node.exists())
@@ -1285,8 +1380,14 @@ ec_error_t nsp_interface_get_matches(NSPI_HANDLE handle, uint32_t reserved1,
 			nsp_trace(__func__, 1, pstat, nullptr, rowset);
 			return ecSuccess;
 		}
+		auto cand = nsp_interface_match_cand(*base, pfilter);
+		std::unordered_set<uint32_t> cset;
+		if (cand.has_value())
+			cset.insert(cand->cbegin(), cand->cend());
 		for (auto it = node.begin() + start_pos; it != node.end(); ++it)
-			if (!(node.hidden() & AB_HIDE_FROM_AL) && nsp_interface_match_node({base, *it}, pstat->codepage, pfilter)) {
+			if (!(node.hidden() & AB_HIDE_FROM_AL) &&
+			    (!cand.has_value() || cset.count(*it) > 0) &&
+			    nsp_interface_match_node({base, *it}, pstat->codepage, pfilter)) {
 				auto pproptag = common_util_proptagarray_enlarge(outmids);
 				if (pproptag == nullptr)
 					return ecServerOOM;
@@ -2064,20 +2165,42 @@ static bool nsp_interface_resolve_node(const ab_tree::ab_node &node, const char
 	return FALSE;
 }
 
+/*
+ * Nodes that nsp_interface_resolve_node may accept for @pstr. DN
+ * comparisons are not covered by the name index, so those need a scan.
+ */
+static mid_cand nsp_interface_resolve_cand(const ab_tree::ab_base &base,
+    const char *pstr)
+{
+	return *pstr != '/' ? base.lookup(pstr) : std::nullopt;
+}
+
 static ab_tree::minid nsp_interface_resolve_gal(const ab_tree::ab::const_base_ref &base,
     const char *pstr, bool& b_ambiguous)
 {
 	ab_tree::minid res;
-
-	for (ab_tree::minid mid : *base) {
+	auto cand = nsp_interface_resolve_cand(*base, pstr);
+	auto visit = [&](ab_tree::minid mid) {
 		ab_tree::ab_node node(base, mid);
 		if (node.hidden() & AB_HIDE_RESOLVE || !nsp_interface_resolve_node(node, pstr))
-			continue;
+			return true;
 		if (res.valid()) {
 			b_ambiguous = true;
-			return ab_tree::minid{};
+			res = ab_tree::minid{};
+			return false;
 		}
 		res = mid;
+		return true;
+	};
+
+	if (cand.has_value()) {
+		for (auto mid : *cand)
+			if (!visit(mid))
+				return res;
+	} else {
+		for (ab_tree::minid mid : *base)
+			if (!visit(mid))
+				return res;
 	}
 	b_ambiguous = !res.valid();
 	return res;
@@ -2194,10 +2317,16 @@ ec_error_t nsp_interface_resolve_namesw(NSPI_HANDLE handle, uint32_t reserved,
 		ptoken = idn_deco.c_str();
 		*pproptag = MID_UNRESOLVED;
 		ab_tree::minid found;
+		auto cand = nsp_interface_resolve_cand(*base, ptoken);
+		std::unordered_set<uint32_t> cset;
+		if (cand.has_value())
+			cset.insert(cand->cbegin(), cand->cend());
 		for (ab_tree::minid mid : node) {
+			if (cand.has_value() && cset.count(mid) == 0)
+				continue;
 			ab_tree::ab_node node1(base, mid);
 			// Removed container check as there are currently no recursive containers
-			if (nsp_interface_resolve_node(node, ptoken)) {
+			if (nsp_interface_resolve_node(node1, ptoken)) {
 				if (*pproptag == ab_tree::minid::RESOLVED) {
 					*pproptag = ab_tree::minid::AMBIGUOUS;
 					break;
@@ -1,6 +1,10 @@
 // SPDX-License-Identifier: GPL-2.0-only WITH linking exception
 // SPDX-FileCopyrightText: 2021-2024 grommunio GmbH
 // This file is part of Gromox.
+#include <algorithm>
+#include <optional>
+#include <unordered_set>
+#include <vector>
 #include <libHX/endian.h>
 #include <libHX/string.h>
 #include <gromox/util.hpp>
@@ -452,6 +456,19 @@ bool ab_tree_resolvename(const ab_tree::ab_base* base, const char *pstr,
     std::vector<ab_tree::minid> &result_list) try
 {
 	result_list.clear();
+	/* DN comparisons are not covered by the name index */
+	auto cand = *pstr != '/' ? base->lookup(pstr) : std::nullopt;
+	if (cand.has_value()) {
+		for (auto mid : *cand) {
+			ab_tree::ab_node node(base, mid);
+			if (mid.type() != ab_tree::minid::address ||
+			    node.hidden() & AB_HIDE_RESOLVE ||
+			    !ab_tree_resolve_node(node, pstr))
+				continue;
+			result_list.push_back(mid);
+		}
+		return TRUE;
+	}
 	for (auto it = base->ubegin(); it != base->uend(); ++it) {
 		ab_tree::ab_node node(it);
 		if (node.hidden() & AB_HIDE_RESOLVE ||
@@ -539,12 +556,90 @@ static bool ab_tree_match_node(const ab_tree::ab_node& node, const RESTRICTION *
 	return false;
 }
 
+using mid_cand = std::optional<std::vector<ab_tree::minid>>;
+
+/*
+ * Narrow down the nodes that ab_tree_match_node could accept for @pfilter
+ * by way of the name index. Only PR_ANR (and AND/OR thereof) is
+ * understood; std::nullopt means "could be any node".
+ */
+static mid_cand ab_tree_match_cand(const ab_tree::ab_base *pbase,
+    const RESTRICTION *pfilter)
+{
+	auto order = [&](std::vector<ab_tree::minid> &v) {
+		std::sort(v.begin(), v.end(), [&](ab_tree::minid a, ab_tree::minid b) {
+			return pbase->find(a).pos() < pbase->find(b).pos();
+		});
+		v.erase(std::unique(v.begin(), v.end()), v.end());
+	};
+	switch (pfilter->rt) {
+	case RES_AND: {
+		mid_cand out;
+		for (unsigned int i = 0; i < pfilter->andor->count; ++i) {
+			auto c = ab_tree_match_cand(pbase, &pfilter->andor->pres[i]);
+			if (!c.has_value())
+				continue;
+			if (!out.has_value()) {
+				out = std::move(c);
+				continue;
+			}
+			std::unordered_set<uint32_t> keep(c->cbegin(), c->cend());
+			std::erase_if(*out, [&](ab_tree::minid m) { return keep.count(m) == 0; });
+		}
+		return out;
+	}
+	case RES_OR: {
+		std::vector<ab_tree::minid> out;
+		for (unsigned int i = 0; i < pfilter->andor->count; ++i) {
+			auto c = ab_tree_match_cand(pbase, &pfilter->andor->pres[i]);
+			if (!c.has_value())
+				return std::nullopt;
+			out.insert(out.end(), c->cbegin(), c->cend());
+		}
+		order(out);
+		return out;
+	}
+	case RES_PROPERTY: {
+		auto rprop = pfilter->prop;
+		if (!rprop->comparable() || rprop->proptag != PR_ANR)
+			return std::nullopt;
+		auto str = static_cast<const char *>(rprop->propval.pvalue);
+		auto out = pbase->lookup(str);
+		if (!out.has_value())
+			return std::nullopt;
+		auto colon = strchr(str, ':');
+		if (colon != nullptr) {
+			auto c = pbase->lookup(&colon[1]);
+			if (!c.has_value())
+				return std::nullopt;
+			out->insert(out->end(), c->cbegin(), c->cend());
+			order(*out);
+		}
+		return out;
+	}
+	default:
+		return std::nullopt;
+	}
+}
+
 BOOL ab_tree_match_minids(const ab_tree::ab_base *pbase, uint32_t container_id,
     const RESTRICTION *pfilter, LONG_ARRAY *pminids) try
 {
 	std::vector<ab_tree::minid> tlist;
+	auto cand = ab_tree_match_cand(pbase, pfilter);
+	std::unordered_set<uint32_t> cset;
+	if (cand.has_value())
+		cset.insert(cand->cbegin(), cand->cend());
 	
-	if (container_id == ab_tree::minid::SC_GAL) {
+	if (container_id == ab_tree::minid::SC_GAL && cand.has_value()) {
+		for (auto mid : *cand) {
+			ab_tree::ab_node node(pbase, mid);
+			if (mid.type() != ab_tree::minid::address ||
+			    node.hidden() & AB_HIDE_FROM_GAL || !ab_tree_match_node(node, pfilter))
+				continue;
+			tlist.push_back(mid);
+		}
+	} else if (container_id == ab_tree::minid::SC_GAL) {
 		for (auto it = pbase->ubegin(); it != pbase->uend(); ++it) {
 			ab_tree::ab_node node(it);
 			if (node.hidden() & AB_HIDE_FROM_GAL || !ab_tree_match_node(node, pfilter))
@@ -560,6 +655,8 @@ BOOL ab_tree_match_minids(const ab_tree::ab_base *pbase, uint32_t container_id,
 		}
 		for(ab_tree::minid mid : node) {
 			ab_tree::ab_node child(pbase, mid);
+			if (cand.has_value() && cset.count(mid) == 0)
+				continue;
 			if(child.type() >= ab_tree::abnode_type::containers ||
 			    child.hidden() & AB_HIDE_FROM_AL ||
 			    !ab_tree_match_node(child, pfilter))
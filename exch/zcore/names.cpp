@@ -103,6 +103,7 @@ static constexpr const char *zcore_rpc_names[] = {
 	E(logon_token),
 	E(getuserfreebusy),
 	E(getuserfreebusyical),
+	E(batch),
 };
 #undef E
 #undef EXP
@@ -110,7 +111,7 @@ static constexpr const char *zcore_rpc_names[] = {
 const char *zcore_rpc_idtoname(zcore_callid i)
 {
 	auto j = static_cast<uint8_t>(i);
-	static_assert(std::size(zcore_rpc_names) == static_cast<uint8_t>(zcore_callid::getuserfreebusyical) + 1);
+	static_assert(std::size(zcore_rpc_names) == static_cast<uint8_t>(zcore_callid::batch) + 1);
 	auto s = j < std::size(zcore_rpc_names) ? zcore_rpc_names[j] : nullptr;
 	return znul(s);
 }
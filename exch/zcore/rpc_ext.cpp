@@ -1610,6 +1610,26 @@ static pack_result zrpc_pull(EXT_PULL &x, zcreq_essdn_to_username &d)
 	return pack_result::ok;
 }
 
+static pack_result zrpc_pull(EXT_PULL &x, zcreq_batch &d)
+{
+	uint32_t count;
+	QRF(x.g_uint32(&count));
+	for (uint32_t i = 0; i < count; ++i) {
+		BINARY b;
+		QRF(x.g_bin_ex(&b));
+		d.reqs.push_back(b);
+	}
+	return pack_result::ok;
+}
+
+static pack_result zrpc_push(EXT_PUSH &x, const zcresp_batch &d)
+{
+	QRF(x.p_uint32(d.resps.size()));
+	for (const auto &b : d.resps)
+		QRF(x.p_bin_ex(b));
+	return pack_result::ok;
+}
+
 pack_result rpc_ext_pull_request(const BINARY *pbin_in,
     std::unique_ptr<zcreq> &prequest) try
 {
@@ -1714,6 +1734,7 @@ pack_result rpc_ext_pull_request(const BINARY *pbin_in,
 	E(logon_token)
 	E(getuserfreebusy)
 	E(getuserfreebusyical)
+	E(batch)
 #undef E
 	default:
 		return pack_result::bad_switch;
@@ -1833,6 +1854,7 @@ pack_result rpc_ext_push_response(const zcresp *presponse, BINARY *pbin_out)
 	E(logon_token)
 	E(getuserfreebusy)
 	E(getuserfreebusyical)
+	E(batch)
 #undef E
 	default:
 		return pack_result::bad_switch;
@@ -1,6 +1,7 @@
 // SPDX-License-Identifier: GPL-2.0-only WITH linking exception
 // SPDX-FileCopyrightText: 2021–2025 grommunio GmbH
 // This file is part of Gromox.
+#include <cerrno>
 #include <chrono>
 #include <climits>
 #include <condition_variable>
@@ -13,7 +14,10 @@
 #include <poll.h>
 #include <pthread.h>
 #include <unistd.h>
+#include <unordered_map>
 #include <vector>
+#include <libHX/io.h>
+#include <sys/epoll.h>
 #include <sys/socket.h>
 #include <gromox/atomic.hpp>
 #include <gromox/clock.hpp>
@@ -48,6 +52,16 @@ static std::vector<pthread_t> g_thread_ids;
 static DOUBLE_LIST g_conn_list;
 static std::condition_variable g_waken_cond;
 static std::mutex g_conn_lock, g_cond_mutex;
+/*
+ * Connections are kept open after a response. While idle, they are watched
+ * by a single thread rather than blocking a worker.
+ */
+static int g_idle_epfd = -1;
+static pthread_t g_idle_tid;
+static bool g_idle_started;
+static std::mutex g_idle_lock;
+static std::unordered_map<int, time_point> g_idle_conns; /* fd -> parked since */
+static constexpr auto IDLE_TIMEOUT = std::chrono::seconds(60);
 unsigned int g_zrpc_debug;
 
 void rpc_parser_init(unsigned int thread_num)
@@ -100,6 +114,103 @@ static int rpc_parser_dispatch(const zcreq *q0, std::unique_ptr<zcresp> &r0) try
 	return DISPATCH_FALSE;
 }
 
+/**
+ * Run the elements of a batch one after another. Every element yields
+ * either a full response frame or a lone status byte, as single calls do.
+ */
+static int rpc_parser_batch(const zcreq_batch &q, std::unique_ptr<zcresp> &r0) try
+{
+	auto r1 = std::make_unique<zcresp_batch>();
+	r1->call_id = zcore_callid::batch;
+	r1->result  = ecSuccess;
+	r1->resps.reserve(q.reqs.size());
+	for (const auto &in : q.reqs) {
+		std::unique_ptr<zcreq> sub;
+		std::unique_ptr<zcresp> subr;
+		BINARY out{};
+		auto status = zcore_response::success;
+		if (rpc_ext_pull_request(&in, sub) != pack_result::ok)
+			status = zcore_response::pull_error;
+		else if (sub->call_id == zcore_callid::batch ||
+		    sub->call_id == zcore_callid::notifdequeue ||
+		    rpc_parser_dispatch(sub.get(), subr) != DISPATCH_TRUE)
+			status = zcore_response::dispatch_error;
+		else if (rpc_ext_push_response(subr.get(), &out) != pack_result::ok)
+			status = zcore_response::push_error;
+		BINARY elem{};
+		elem.cb = status == zcore_response::success ? out.cb : 1;
+		elem.pv = common_util_alloc(elem.cb);
+		if (elem.pv == nullptr) {
+			free(out.pb);
+			return DISPATCH_FALSE;
+		}
+		if (status == zcore_response::success)
+			memcpy(elem.pv, out.pv, out.cb);
+		else
+			elem.pb[0] = static_cast<uint8_t>(status);
+		free(out.pb);
+		r1->resps.push_back(elem);
+	}
+	r0 = std::move(r1);
+	return DISPATCH_TRUE;
+} catch (const std::bad_alloc &) {
+	return DISPATCH_FALSE;
+}
+
+static void rpc_parser_park(int clifd)
+{
+	std::unique_lock lk(g_idle_lock);
+	if (g_idle_epfd < 0 || g_notify_stop) {
+		lk.unlock();
+		close(clifd);
+		return;
+	}
+	struct epoll_event ev{};
+	ev.events  = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+	ev.data.fd = clifd;
+	try {
+		g_idle_conns[clifd] = tp_now();
+	} catch (const std::bad_alloc &) {
+		lk.unlock();
+		close(clifd);
+		return;
+	}
+	if (epoll_ctl(g_idle_epfd, EPOLL_CTL_ADD, clifd, &ev) != 0) {
+		g_idle_conns.erase(clifd);
+		lk.unlock();
+		close(clifd);
+	}
+}
+
+static void *zcrp_idlework(void *param)
+{
+	struct epoll_event ev[64];
+	while (!g_notify_stop) {
+		auto n = epoll_wait(g_idle_epfd, ev, std::size(ev), 1000);
+		auto now = tp_now();
+		std::lock_guard lk(g_idle_lock);
+		for (int i = 0; i < n; ++i) {
+			auto fd = ev[i].data.fd;
+			if (g_idle_conns.erase(fd) == 0)
+				continue;
+			epoll_ctl(g_idle_epfd, EPOLL_CTL_DEL, fd, nullptr);
+			/* next request (or EOF) arrived; a worker handles either */
+			if (!rpc_parser_activate_connection(fd))
+				close(fd);
+		}
+		for (auto it = g_idle_conns.begin(); it != g_idle_conns.end(); ) {
+			if (now - it->second < IDLE_TIMEOUT) {
+				++it;
+				continue;
+			}
+			epoll_ctl(g_idle_epfd, EPOLL_CTL_DEL, it->first, nullptr);
+			close(it->first);
+			it = g_idle_conns.erase(it);
+		}
+	}
+	return nullptr;
+}
+
 static void *zcrp_thrwork(void *param)
 {
 	void *pbuff;
@@ -185,7 +296,10 @@ static void *zcrp_thrwork(void *param)
 	if (request->call_id == zcore_callid::notifdequeue)
 		common_util_set_clifd(clifd);
 	std::unique_ptr<zcresp> response;
-	switch (rpc_parser_dispatch(request.get(), response)) {
+	auto dsp = request->call_id == zcore_callid::batch ?
+	           rpc_parser_batch(*static_cast<const zcreq_batch *>(request.get()), response) :
+	           rpc_parser_dispatch(request.get(), response);
+	switch (dsp) {
 	case DISPATCH_FALSE: {
 		common_util_free_environment();
 		auto tmp_byte = zcore_response::dispatch_error;
@@ -213,14 +327,12 @@ static void *zcrp_thrwork(void *param)
 	}
 	common_util_free_environment();
 	fdpoll.events = POLLOUT|POLLWRBAND;
-	if (poll(&fdpoll, 1, SOCKET_TIMEOUT_MS) == 1)
-		if (write(clifd, tmp_bin.pb, tmp_bin.cb) < 0)
-			/* ignore */;
-	shutdown(clifd, SHUT_WR);
-	uint8_t tmp_byte;
-	if (read(clifd, &tmp_byte, 1))
-		/* ignore */;
-	close(clifd);
+	if (poll(&fdpoll, 1, SOCKET_TIMEOUT_MS) != 1 ||
+	    HXio_fullwrite(clifd, tmp_bin.pb, tmp_bin.cb) != static_cast<ssize_t>(tmp_bin.cb))
+		close(clifd);
+	else
+		/* The client may send another request, or close the socket */
+		rpc_parser_park(clifd);
 	free(tmp_bin.pb);
 	tmp_bin.pb = nullptr;
 	goto NEXT_CLIFD;
@@ -229,7 +341,19 @@ static void *zcrp_thrwork(void *param)
 int rpc_parser_run()
 {
 	g_notify_stop = false;
-	int ret = 0;
+	g_idle_epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (g_idle_epfd < 0) {
+		mlog(LV_ERR, "rpc_parser: epoll_create: %s", strerror(errno));
+		return -1;
+	}
+	auto ret = pthread_create4(&g_idle_tid, nullptr, zcrp_idlework, nullptr);
+	if (ret != 0) {
+		mlog(LV_ERR, "rpc_parser: failed to create idle thread: %s", strerror(ret));
+		rpc_parser_stop();
+		return -2;
+	}
+	g_idle_started = true;
+	pthread_setname_np(g_idle_tid, "rpc/idle");
 	for (unsigned int i = 0; i < g_thread_num; ++i) {
 		pthread_t tid;
 		ret = pthread_create4(&tid, nullptr, zcrp_thrwork, nullptr);
@@ -255,4 +379,16 @@ void rpc_parser_stop()
 		pthread_join(tid, nullptr);
 	}
 	g_thread_ids.clear();
+	if (g_idle_started) {
+		pthread_join(g_idle_tid, nullptr);
+		g_idle_started = false;
+	}
+	std::lock_guard lk(g_idle_lock);
+	for (const auto &e : g_idle_conns)
+		close(e.first);
+	g_idle_conns.clear();
+	if (g_idle_epfd >= 0) {
+		close(g_idle_epfd);
+		g_idle_epfd = -1;
+	}
 }
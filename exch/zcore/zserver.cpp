@@ -1,19 +1,25 @@
 // SPDX-License-Identifier: GPL-2.0-only WITH linking exception
 // SPDX-FileCopyrightText: 2020–2025 grommunio GmbH
 // This file is part of Gromox.
+#include <algorithm>
+#include <atomic>
 #include <cassert>
 #include <climits>
 #include <csignal>
 #include <cstdint>
 #include <cstdio>
 #include <cstring>
+#include <functional>
+#include <iterator>
 #include <memory>
 #include <mutex>
 #include <poll.h>
+#include <queue>
 #include <string>
 #include <unistd.h>
 #include <unordered_map>
 #include <utility>
+#include <vector>
 #include <libHX/io.h>
 #include <libHX/scope.hpp>
 #include <libHX/string.h>
@@ -66,18 +72,42 @@ struct NOTIFY_ITEM {
 	time_t last_time = 0;
 };
 
+/*
+ * Sessions are spread over shards by user_id, each with its own lock, so
+ * that lookups for different users do not contend. Instead of walking all
+ * sessions, the scanner pops due entries off each shard's min-heap. Entries
+ * are (due time, user_id); an entry whose time differs from the session's
+ * sched_time is stale and skipped. Accesses only bump last_time, the
+ * scanner reschedules the session when its old entry comes due.
+ */
+using sched_entry = std::pair<time_t, int>;
+
+struct session_shard {
+	std::mutex lock;
+	std::unordered_map<int, USER_INFO> sessions;
+	std::priority_queue<sched_entry, std::vector<sched_entry>, std::greater<>> sched;
+};
+
+/* username -> user_id; lock order: session_shard before user_shard */
+struct user_shard {
+	std::mutex lock;
+	std::unordered_map<std::string, int> users;
+};
+
 }
 
+static constexpr unsigned int ZS_SHARDS = 16;
 static size_t g_table_size;
 static gromox::atomic_bool g_notify_stop;
 static int g_ping_interval;
 static pthread_t g_scan_id;
 static int g_cache_interval;
 static thread_local USER_INFO *g_info_key;
-static std::mutex g_table_lock, g_notify_lock;
-static std::unordered_map<std::string, int> g_user_table;
+static std::mutex g_notify_lock;
+static std::atomic<size_t> g_session_count;
+static session_shard g_session_shards[ZS_SHARDS];
+static user_shard g_user_shards[ZS_SHARDS];
 static std::unordered_map<std::string, NOTIFY_ITEM> g_notify_table;
-static std::unordered_map<int, USER_INFO> g_session_table;
 
 sink_node::~sink_node()
 {
@@ -93,7 +123,7 @@ USER_INFO::USER_INFO(USER_INFO &&o) noexcept :
 	lang(std::move(o.lang)), maildir(std::move(o.maildir)),
 	homedir(std::move(o.homedir)), cpid(o.cpid),
 	last_time(o.last_time), reload_time(o.reload_time),
-	ptree(std::move(o.ptree)), sink_list(std::move(o.sink_list))
+	ping_time(o.ping_time), sched_time(o.sched_time), ptree(std::move(o.ptree)), sink_list(std::move(o.sink_list))
 {}
 
 USER_INFO::~USER_INFO()
@@ -115,19 +145,57 @@ static int zs_get_user_id(GUID hsession)
 	return user_id;
 }
 
+static session_shard &zs_shard(int user_id)
+{
+	return g_session_shards[static_cast<unsigned int>(user_id) % std::size(g_session_shards)];
+}
+
+static user_shard &zs_user_shard(const std::string &name)
+{
+	return g_user_shards[std::hash<std::string>{}(name) % std::size(g_user_shards)];
+}
+
+/**
+ * The earliest time at which the scanner has something to do for the
+ * session: expire it, reload its object tree, ping its store, or time out
+ * a pending notification sink.
+ */
+static time_t zs_next_due(const USER_INFO &info)
+{
+	auto due = std::min({info.last_time + g_cache_interval,
+	           info.reload_time + g_cache_interval, info.ping_time});
+	for (const auto &sn : info.sink_list)
+		due = std::min(due, sn.until_time);
+	return due;
+}
+
+/* Caller holds the shard lock. */
+static void zs_schedule(session_shard &sh, USER_INFO &info, time_t due)
+{
+	if (info.sched_time != 0 && info.sched_time <= due)
+		return;
+	try {
+		sh.sched.emplace(due, info.user_id);
+		info.sched_time = due;
+	} catch (const std::bad_alloc &) {
+		mlog(LV_ERR, "E-1804: ENOMEM");
+	}
+}
+
 USER_INFO_REF zs_query_session(GUID hsession)
 {
 	auto user_id = zs_get_user_id(hsession);
-	std::unique_lock tl_hold(g_table_lock);
-	auto iter = g_session_table.find(user_id);
-	if (iter == g_session_table.end())
+	auto &sh = zs_shard(user_id);
+	std::unique_lock sh_hold(sh.lock);
+	auto iter = sh.sessions.find(user_id);
+	if (iter == sh.sessions.end())
 		return nullptr;
 	auto pinfo = &iter->second;
 	if (hsession != pinfo->hsession)
 		return nullptr;
 	pinfo->reference ++;
 	pinfo->last_time = time(nullptr);
-	tl_hold.unlock();
+	sh_hold.unlock();
 	g_info_key = pinfo;
 	pinfo->lock.lock();
 	return USER_INFO_REF(pinfo);
@@ -141,9 +209,12 @@ USER_INFO *zs_get_info()
 void user_info_del::operator()(USER_INFO *pinfo)
 {
 	pinfo->lock.unlock();
-	std::unique_lock tl_hold(g_table_lock);
-	pinfo->reference --;
-	tl_hold.unlock();
+	auto &sh = zs_shard(pinfo->user_id);
+	std::unique_lock sh_hold(sh.lock);
+	/* zs_notifdequeue may have added a sink that expires before the next wakeup */
+	if (--pinfo->reference == 0 && pinfo->sink_list.size() > 0)
+		zs_schedule(sh, *pinfo, zs_next_due(*pinfo));
+	sh_hold.unlock();
 	g_info_key = nullptr;
 }
 
@@ -163,6 +234,68 @@ NOTIFY_ITEM::~NOTIFY_ITEM()
 	double_list_free(&notify_list);
 }
 
+/**
+ * Process the sessions of one shard whose scheduled time has come. Only
+ * due heap entries are visited, so the lock is held for a time
+ * proportional to the number of sessions needing attention.
+ */
+static void zs_sweep_shard(session_shard &sh, time_t cur_time,
+    std::vector<std::string> &maildir_list, std::list<sink_node> &expired_list)
+{
+	std::unique_lock sh_hold(sh.lock);
+	while (sh.sched.size() > 0 && sh.sched.top().first <= cur_time) {
+		auto [due, user_id] = sh.sched.top();
+		sh.sched.pop();
+		auto iter = sh.sessions.find(user_id);
+		if (iter == sh.sessions.end() || iter->second.sched_time != due)
+			continue;
+		auto pinfo = &iter->second;
+		pinfo->sched_time = 0;
+		if (pinfo->reference != 0) {
+			zs_schedule(sh, *pinfo, cur_time + 1);
+			continue;
+		}
+		for (auto sn = pinfo->sink_list.begin(); sn != pinfo->sink_list.end(); ) {
+			auto next = std::next(sn);
+			if (cur_time >= sn->until_time)
+				expired_list.splice(expired_list.end(), pinfo->sink_list, sn);
+			sn = next;
+		}
+		if (cur_time - pinfo->last_time >= g_cache_interval) {
+			if (pinfo->sink_list.size() == 0) {
+				auto &us = zs_user_shard(pinfo->username);
+				std::unique_lock us_hold(us.lock);
+				auto uiter = us.users.find(pinfo->username);
+				if (uiter != us.users.end() && uiter->second == user_id)
+					us.users.erase(uiter);
+				us_hold.unlock();
+				common_util_build_environment();
+				pinfo->ptree.reset();
+				common_util_free_environment();
+				sh.sessions.erase(iter);
+				--g_session_count;
+				continue;
+			}
+		} else if (cur_time - pinfo->reload_time >= g_cache_interval) {
+			common_util_build_environment();
+			auto ptree = object_tree_create(pinfo->get_maildir());
+			if (NULL != ptree) {
+				pinfo->ptree = std::move(ptree);
+				pinfo->reload_time = cur_time;
+			}
+			common_util_free_environment();
+		} else if (cur_time >= pinfo->ping_time) {
+			try {
+				maildir_list.push_back(pinfo->get_maildir());
+			} catch (const std::bad_alloc &) {
+				mlog(LV_ERR, "E-2178: ENOMEM");
+			}
+			pinfo->ping_time = cur_time + g_ping_interval;
+		}
+		zs_schedule(sh, *pinfo, std::max(zs_next_due(*pinfo), cur_time + 1));
+	}
+}
+
 static void *zcorezs_scanwork(void *param)
 {
 	int count;
@@ -181,62 +314,9 @@ static void *zcorezs_scanwork(void *param)
 			count = 0;
 		std::vector<std::string> maildir_list;
 		std::list<sink_node> expired_list;
-		std::unique_lock tl_hold(g_table_lock);
 		auto cur_time = time(nullptr);
-		for (auto iter = g_session_table.begin(); iter != g_session_table.end(); ) {
-			auto pinfo = &iter->second;
-			if (0 != pinfo->reference) {
-				++iter;
-				continue;
-			}
-			auto ptail = pinfo->sink_list.size() > 0 ? &pinfo->sink_list.back() : nullptr;
-			while (pinfo->sink_list.size() > 0) {
-				auto psink_node = &pinfo->sink_list.front();
-				if (cur_time >= psink_node->until_time)
-					expired_list.splice(expired_list.end(), pinfo->sink_list, pinfo->sink_list.begin());
-				else
-					pinfo->sink_list.splice(pinfo->sink_list.end(), pinfo->sink_list, pinfo->sink_list.begin());
-				if (psink_node == ptail)
-					break;
-			}
-			if (cur_time - pinfo->reload_time >= g_cache_interval) {
-				common_util_build_environment();
-				auto ptree = object_tree_create(pinfo->get_maildir());
-				if (NULL != ptree) {
-					pinfo->ptree = std::move(ptree);
-					pinfo->reload_time = cur_time;
-				}
-				common_util_free_environment();
-				++iter;
-				continue;
-			}
-			if (cur_time - pinfo->last_time < g_cache_interval) {
-				if (0 != count) {
-					++iter;
-					continue;
-				}
-				try {
-					maildir_list.push_back(pinfo->get_maildir());
-				} catch (const std::bad_alloc &) {
-					mlog(LV_ERR, "E-2178: ENOMEM");
-					++iter;
-					continue;
-				}
-				++iter;
-			} else {
-				if (pinfo->sink_list.size() != 0) {
-					++iter;
-					continue;
-				}
-				common_util_build_environment();
-				pinfo->ptree.reset();
-				common_util_free_environment();
-				pinfo->sink_list.clear();
-				g_user_table.erase(pinfo->username);
-				iter = g_session_table.erase(iter);
-			}
-		}
-		tl_hold.unlock();
+		for (auto &sh : g_session_shards)
+			zs_sweep_shard(sh, cur_time, maildir_list, expired_list);
 		for (const auto &dir : maildir_list) {
 			common_util_build_environment();
 			exmdb_client->ping_store(dir.c_str());
@@ -631,9 +711,16 @@ void zserver_stop()
 		pthread_join(g_scan_id, NULL);
 	}
 	{ /* silence cov-scan, take locks even in single-thread scenarios */
-		std::lock_guard lk(g_table_lock);
-		g_session_table.clear();
-		g_user_table.clear();
+		for (auto &sh : g_session_shards) {
+			std::lock_guard lk(sh.lock);
+			sh.sessions.clear();
+			sh.sched = {};
+		}
+		for (auto &us : g_user_shards) {
+			std::lock_guard lk(us.lock);
+			us.users.clear();
+		}
+		g_session_count = 0;
 	}
 	{
 		std::lock_guard lk(g_notify_lock);
@@ -652,21 +739,28 @@ static ec_error_t zs_logon_phase2(sql_meta_result &&mres, GUID *phsession)
 	pdomain ++;
 	gx_strlcpy(tmp_name, username, std::size(tmp_name));
 	HX_strlower(tmp_name);
-	std::unique_lock tl_hold(g_table_lock);
 	unsigned int user_id = 0, domain_id = 0, org_id = 0;
-	auto iter = g_user_table.find(tmp_name);
-	if (iter != g_user_table.end()) {
+	auto &us = zs_user_shard(tmp_name);
+	std::unique_lock us_hold(us.lock);
+	auto iter = us.users.find(tmp_name);
+	if (iter != us.users.end()) {
 		user_id = iter->second;
-		auto st_iter = g_session_table.find(user_id);
-		if (st_iter != g_session_table.end()) {
+		us_hold.unlock();
+		auto &sh = zs_shard(user_id);
+		std::unique_lock sh_hold(sh.lock);
+		auto st_iter = sh.sessions.find(user_id);
+		if (st_iter != sh.sessions.end()) {
 			auto pinfo = &st_iter->second;
 			pinfo->last_time = time(nullptr);
 			*phsession = pinfo->hsession;
 			return ecSuccess;
 		}
-		g_user_table.erase(iter);
+		us_hold.lock();
+		iter = us.users.find(tmp_name);
+		if (iter != us.users.end() && iter->second == static_cast<int>(user_id))
+			us.users.erase(iter);
 	}
-	tl_hold.unlock();
+	us_hold.unlock();
 	if (!mysql_adaptor_get_user_ids(username, &user_id, nullptr, nullptr) ||
 	    !mysql_adaptor_get_homedir(pdomain, homedir, std::size(homedir)) ||
 	    !mysql_adaptor_get_domain_ids(pdomain, &domain_id, &org_id))
@@ -696,31 +790,38 @@ static ec_error_t zs_logon_phase2(sql_meta_result &&mres, GUID *phsession)
 	tmp_info.ptree = object_tree_create(tmp_info.maildir.c_str());
 	if (tmp_info.ptree == nullptr)
 		return ecError;
-	tl_hold.lock();
-	auto st_iter = g_session_table.find(user_id);
-	if (st_iter != g_session_table.end()) {
+	tmp_info.ping_time = tmp_info.last_time + g_ping_interval;
+	auto &sh = zs_shard(user_id);
+	std::unique_lock sh_hold(sh.lock);
+	auto st_iter = sh.sessions.find(user_id);
+	if (st_iter != sh.sessions.end()) {
 		auto pinfo = &st_iter->second;
 		*phsession = pinfo->hsession;
 		return ecSuccess;
 	}
-	if (g_session_table.size() >= g_table_size)
-		return ecError;
+	/* Other shards are not locked; claim the slot atomically */
+	auto count = g_session_count.load();
+	do {
+		if (count >= g_table_size)
+			return ecError;
+	} while (!g_session_count.compare_exchange_weak(count, count + 1));
 	try {
-		st_iter = g_session_table.try_emplace(user_id, std::move(tmp_info)).first;
+		st_iter = sh.sessions.try_emplace(user_id, std::move(tmp_info)).first;
 	} catch (const std::bad_alloc &) {
-		return ecError;
-	}
-	if (g_user_table.size() >= g_table_size) {
-		g_session_table.erase(user_id);
+		--g_session_count;
 		return ecError;
 	}
 	try {
-		g_user_table.try_emplace(tmp_name, user_id);
+		std::lock_guard us_lk(us.lock);
+		us.users.insert_or_assign(tmp_name, user_id);
 	} catch (const std::bad_alloc &) {
-		g_session_table.erase(user_id);
+		sh.sessions.erase(st_iter);
+		--g_session_count;
 		return ecError;
 	}
-	*phsession = st_iter->second.hsession;
+	auto pinfo = &st_iter->second;
+	zs_schedule(sh, *pinfo, zs_next_due(*pinfo));
+	*phsession = pinfo->hsession;
 	return ecSuccess;
 }
 
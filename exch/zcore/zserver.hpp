@@ -39,7 +39,8 @@ struct USER_INFO {
 	uint32_t privbits = 0;
 	std::string username, lang, maildir, homedir;
 	cpid_t cpid = CP_ACP;
-	time_t last_time = 0, reload_time = 0;
+	time_t last_time = 0, reload_time = 0, ping_time = 0;
+	time_t sched_time = 0; /* guarded by the session shard lock */
 	std::unique_ptr<OBJECT_TREE> ptree;
 	std::list<sink_node> sink_list;
 	std::unordered_map<int, long> extra_owner;
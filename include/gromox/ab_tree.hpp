@@ -3,13 +3,19 @@
 #include <atomic>
 #include <condition_variable>
 #include <cstdint>
+#include <ctime>
 #include <deque>
+#include <mutex>
+#include <optional>
 #include <shared_mutex>
 #include <string>
+#include <string_view>
 #include <thread>
 #include <type_traits>
 #include <unordered_map>
+#include <unordered_set>
 #include <variant>
+#include <vector>
 #include <gromox/mysql_adaptor.hpp>
 #include <gromox/clock.hpp>
 
@@ -144,6 +150,26 @@ struct ab_domain {
 	std::vector<minid> userref; ///< List of minids of contained objects
 };
 
+/**
+ * @brief      Case-insensitive substring index
+ *
+ * Maps every trigram of the (ASCII case-folded) strings added for an entry
+ * to the list of entries containing it. Entries are plain positions; they
+ * must be added in ascending order so that posting lists come out sorted.
+ */
+class name_index {
+	public:
+	static constexpr size_t min_length = 3; ///< shortest needle the index can answer
+
+	void add(uint32_t pos, std::string_view);
+	void clear() { m_grams.clear(); }
+	std::optional<std::vector<uint32_t>> lookup(std::string_view needle) const;
+	static std::string fold(std::string_view);
+
+	private:
+	std::unordered_map<uint32_t, std::vector<uint32_t>> m_grams;
+};
+
 /**
  * @brief      Address book base
  *
@@ -223,6 +249,8 @@ class ab_base {
 
 	bool await_load() const;
 	bool load();
+	bool load(std::vector<ab_domain> &&, std::vector<sql_user> &&);
+	bool reload(const ab_base &);
 	/// Get time since the base was loaded
 	inline std::chrono::seconds age() const { return std::chrono::duration_cast<std::chrono::seconds>(gromox::tp_now() - m_load_time); }
 
@@ -249,6 +277,9 @@ class ab_base {
 	bool mlist_info(minid, std::string *, std::string *, int *) const;
 	ec_error_t proplist(minid, std::vector<uint32_t> &) const;
 	minid resolve(const char *) const;
+	std::optional<std::vector<minid>> lookup(const char *) const;
+	iterator seek(const char *) const;
+	std::string_view sortkey(minid) const;
 	inline size_t size() const { return m_users.size() + domains.size(); }
 	abnode_type type(minid) const;
 	inline size_t users() const { return m_users.size(); }
@@ -265,12 +296,19 @@ class ab_base {
 	static display_type dtypx_to_etyp(display_type);
 
 	private:
+	bool domain_ids(std::vector<unsigned int> &) const;
+	bool load_full();
+	bool load_delta(const ab_base &);
+	bool finish_load();
+	void build_index();
 	const ab_domain *find_domain(uint32_t) const;
 
 	static const std::vector<std::string> vs_empty; ///< used to return empty alias list in case of invalid minid
 
 	GUID m_guid; ///< GUID of the base
 	gromox::time_point m_load_time{}; ///< Load time
+	time_t m_stamp = 0; ///< Database clock at the last (full or delta) load, 0 if deltas are unavailable
+	unsigned int m_deltas = 0; ///< Number of delta loads since the last full load
 	/**
 	 * base_id==0: not permitted (contains e.g. the AAPI administrator)
 	 * base_id >0: Base is for an organization (multiple domains)
@@ -281,6 +319,8 @@ class ab_base {
 	std::vector<ab_domain> domains; ///< list of domains belonging to the base
 	std::vector<sql_user> m_users; ///< list of users from all domains, sorted by displayname
 	std::unordered_map<minid, uint32_t> minid_idx_map; ///< map from minid to index in domain/user list
+	name_index m_index; ///< names and addresses of all nodes, by iterator position
+	std::vector<std::string> m_sortkey; ///< case-folded sort key of each user
 	mutable std::mutex m_lock;
 	std::atomic<Status> m_status{Status::CONSTRUCTING};
 };
@@ -319,11 +359,19 @@ class ab {
 	std::unordered_map<int32_t, std::shared_ptr<ab_base>> m_base_hash;
 	bool m_initialized = false;
 
-	std::thread worker; ///< Worker thread removing expired bases
-	std::deque<int> worker_queue; ///< Queue of base IDs to be flushed
+	std::thread worker; ///< Worker thread refreshing expired bases
+	std::mutex worker_lock; ///< Protects worker_queue and m_refreshing
+	std::deque<int32_t> worker_queue; ///< Queue of base IDs to be refreshed
+	std::unordered_set<int32_t> m_refreshing; ///< Base IDs queued or being refreshed
+	struct retry_state {
+		gromox::time_point after{};
+		unsigned int fails = 0;
+	};
+	std::unordered_map<int32_t, retry_state> m_retry; ///< Backoff after failed refreshes
 	std::condition_variable worker_signal; ///< Wake-up signal for the worker thread
 	std::atomic<int> running = 0; ///< Number of plugins that are using the address book
 
+	bool refresh(int32_t base_id);
 	void work();
 };
 extern class ab AB;
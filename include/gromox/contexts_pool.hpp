@@ -11,6 +11,7 @@ enum{
 	CUR_VALID_CONTEXTS,
 	CUR_SLEEPING_CONTEXTS,
 	CUR_SCHEDULING_CONTEXTS,
+	RUN_QUEUE_NUM,
 };
 
 #define POLLING_READ						0x1
@@ -32,10 +33,14 @@ enum class sctx_status {
 
 struct schedule_context {
 	DOUBLE_LIST_NODE node{};
+	DOUBLE_LIST_NODE timer_node{}; /* membership in the polling timeout wheel */
 	sctx_status type = sctx_status::free;
 	BOOL b_waiting = false; /* is still in epoll queue */
 	int polling_mask = 0;
 	unsigned int context_id = 0;
+	unsigned int run_queue = 0; /* run queue the context was last served from */
+	/* polling: I/O timeout; idling: next re-run of the context */
+	gromox::time_point deadline{};
 };
 using SCHEDULE_CONTEXT = schedule_context;
 
@@ -43,6 +48,7 @@ extern GX_EXPORT void contexts_pool_init(schedule_context **, unsigned int conte
 extern GX_EXPORT int contexts_pool_run();
 extern GX_EXPORT void contexts_pool_stop();
 extern GX_EXPORT schedule_context *contexts_pool_get_context(sctx_status);
+extern GX_EXPORT schedule_context *contexts_pool_get_turning(unsigned int home);
 extern GX_EXPORT void contexts_pool_insert(schedule_context *, sctx_status);
 extern GX_EXPORT BOOL contexts_pool_wakeup_context(schedule_context *, sctx_status);
 extern GX_EXPORT void context_pool_activate_context(schedule_context *);
@@ -3,6 +3,7 @@
 #include <condition_variable>
 #include <ctime>
 #include <list>
+#include <memory>
 #include <mutex>
 #include <optional>
 #include <pthread.h>
@@ -19,6 +20,7 @@
 struct DB_NOTIFY;
 struct exreq;
 struct exresp;
+enum class exmdb_response : uint8_t;
 
 namespace gromox {
 
@@ -38,6 +40,7 @@ enum {
 	EXMDB_CLIENT_ASYNC_CONNECT = 0x8U,
 };
 
+struct mux_conn;
 struct remote_svr;
 
 struct agent_thread {
@@ -62,6 +65,9 @@ struct GX_EXPORT remote_svr : public EXMDB_ITEM {
 	remote_svr(EXMDB_ITEM &&o) noexcept : EXMDB_ITEM(std::move(o)) {}
 	std::list<remote_conn> conn_list;
 	std::atomic<unsigned int> active_handles{0};
+	/* Shared connection if the server speaks exmdb_proto::mux */
+	std::shared_ptr<mux_conn> mux;
+	bool mux_refused = false;
 };
 
 struct GX_EXPORT remote_conn_ref {
@@ -85,6 +91,7 @@ using REMOTE_CONN_floating = remote_conn_ref;
 extern GX_EXPORT int exmdb_client_run(const char *dir, unsigned int fl = EXMDB_CLIENT_NO_FLAGS, void (*)(const remote_svr &) = nullptr, void (*)() = nullptr, void (*)(const char *, BOOL, uint32_t, const DB_NOTIFY *) = nullptr);
 extern GX_EXPORT bool exmdb_client_is_local(const char *pfx, BOOL *pvt);
 extern GX_EXPORT BOOL exmdb_client_do_rpc(const exreq *, exresp *);
+extern GX_EXPORT exmdb_response exmdb_client_last_response();
 
 class GX_EXPORT exmdb_client_remote {
 	public:
@@ -2,8 +2,10 @@
 #include <cstdint>
 #include <cstdlib>
 #include <sqlite3.h>
+#include <span>
 #include <string>
 #include <type_traits>
+#include <unordered_map>
 #include <vector>
 #include <vmime/message.hpp>
 #include <gromox/common_types.hpp>
@@ -124,6 +126,47 @@ BOOL common_util_load_search_scopes(sqlite3 *psqlite,
 	uint64_t folder_id, LONGLONG_ARRAY *pfolder_ids);
 extern bool cu_eval_folder_restriction(sqlite3 *, uint64_t folder_id, const RESTRICTION *);
 extern bool cu_eval_msg_restriction(sqlite3 *, cpid_t, uint64_t msgid, const RESTRICTION *);
+
+/*
+ * Property values of a group of messages, loaded column by column: the
+ * number of statements depends on the number of proptags, not on the number
+ * of messages. Values are the same as cu_get_property would produce.
+ */
+class msg_column_set {
+	public:
+	bool load(sqlite3 *, cpid_t, std::span<const uint64_t> mids, std::span<const gromox::proptag_t> tags);
+	bool contains(gromox::proptag_t tag) const { return m_cols.contains(tag); }
+	/* Value of @tag for mids[idx], or nullptr if the message has none. */
+	void *get(gromox::proptag_t, size_t idx) const;
+	void clear() { m_cols.clear(); }
+
+	private:
+	std::unordered_map<gromox::proptag_t, std::vector<void *>> m_cols;
+};
+
+/**
+ * Compiled form of a message restriction for evaluating a whole block of
+ * messages at once. Plainly stored properties referenced by the restriction
+ * are bulk-loaded with one query per proptag for the block; the tree is then
+ * evaluated over those columns in memory. Nodes that need computed
+ * properties or subobjects fall back to cu_eval_msg_restriction.
+ */
+class msg_restriction_plan {
+	public:
+	msg_restriction_plan(const RESTRICTION *);
+	/* Remove all messages from @mids that do not match the restriction. */
+	bool filter(sqlite3 *, cpid_t, std::vector<uint64_t> &mids);
+	size_t column_count() const { return m_tags.size(); }
+
+	private:
+	void compile(const RESTRICTION *);
+	bool eval(sqlite3 *, cpid_t, const RESTRICTION *, size_t idx, uint64_t mid) const;
+
+	const RESTRICTION *m_res = nullptr;
+	std::vector<gromox::proptag_t> m_tags;
+	msg_column_set m_cols;
+};
+
 BOOL common_util_check_search_result(sqlite3 *psqlite,
 	uint64_t folder_id, uint64_t message_id, BOOL *pb_exist);
 BOOL common_util_get_mid_string(sqlite3 *psqlite,
@@ -159,6 +202,7 @@ extern int have_delete_perm(sqlite3 *, const char *user, uint64_t fid, uint64_t
 extern ec_error_t cu_id2user(int, std::string &);
 
 extern unsigned int g_max_rule_num, g_max_extrule_num, g_cid_compression;
+extern std::string g_cid_pool;
 extern thread_local unsigned int g_inside_flush_instance;
 extern thread_local sqlite3 *g_sqlite_for_oxcmail;
 extern char g_exmdb_org_name[];
@@ -140,3 +140,4 @@ EXMIDL(recalc_store_size, (const char *dir, uint32_t flags))
 EXMIDL(imapfile_read, (const char *dir, const std::string &type, const std::string &mid, IDLOUT std::string *data))
 EXMIDL(imapfile_write, (const char *dir, const std::string &type, const std::string &mid, const std::string &data))
 EXMIDL(imapfile_delete, (const char *dir, const std::string &type, const std::string &mid))
+EXMIDL(imapfile_read_range, (const char *dir, const std::string &type, const std::string &mid, uint64_t offset, uint32_t length, IDLOUT uint64_t *size, std::string *data))
@@ -24,6 +24,20 @@ enum class exmdb_response : uint8_t {
 	invalid = 0xff,
 };
 
+/*
+ * Framing variants, negotiated with exmdb_callid::connect.
+ *
+ * classic: one request, then one response, per connection at a time.
+ * mux: request frames are [u32 length][u32 reqid][payload], response frames
+ * are [u8 status][u32 length][u32 reqid][payload], where length includes the
+ * reqid. Many requests can be in flight and responses may come in any order.
+ * A ping (length 0) is answered with a status-only frame with reqid 0.
+ */
+enum class exmdb_proto : uint32_t {
+	classic = 0,
+	mux = 1,
+};
+
 enum class exmdb_callid : uint8_t {
 	connect = 0x00,
 	listen_notification = 0x01,
@@ -170,6 +184,7 @@ enum class exmdb_callid : uint8_t {
 	imapfile_read = 0x8e,
 	imapfile_write = 0x8f,
 	imapfile_delete = 0x90,
+	imapfile_read_range = 0x91,
 	/* update exch/exmdb_provider/names.cpp:exmdb_rpc_idtoname! */
 };
 
@@ -184,6 +199,8 @@ struct exreq_connect final : public exreq {
 	char *prefix;
 	char *remote_id;
 	BOOL b_private;
+	/* Only transmitted if not classic; old servers ignore it */
+	exmdb_proto proto = exmdb_proto::classic;
 };
 
 struct exreq_listen_notification final : public exreq {
@@ -865,6 +882,12 @@ struct exreq_imapfile_write final : public exreq {
 
 using exreq_imapfile_delete = exreq_imapfile_read;
 
+struct exreq_imapfile_read_range final : public exreq {
+	std::string type, mid;
+	uint64_t offset = 0;
+	uint32_t length = 0;
+};
+
 struct exresp {
 	exresp() = default; /* Prevent use of direct-init-list */
 	virtual ~exresp() = default;
@@ -1312,6 +1335,11 @@ struct exresp_imapfile_read final : public exresp {
 	std::string data;
 };
 
+struct exresp_imapfile_read_range final : public exresp {
+	uint64_t size = 0;
+	std::string data;
+};
+
 using exreq_ping_store = exreq;
 using exreq_get_all_named_propids = exreq;
 using exreq_get_store_all_proptags = exreq;
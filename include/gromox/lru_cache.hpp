@@ -0,0 +1,211 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+#include <gromox/clock.hpp>
+
+namespace gromox {
+
+enum class cache_result { miss, negative, hit };
+
+/**
+ * Thread-safe LRU cache with per-entry expiry, split into independently
+ * locked shards. Besides values, it can remember that a key has no value
+ * ("negative" entries), usually with a shorter lifetime. A capacity or TTL
+ * of zero disables the respective kind of caching.
+ *
+ * To avoid re-inserting stale data when an erase/clear races a lookup in
+ * progress, take generation() before querying the backing store and pass
+ * it to put/put_negative; the insert is dropped if any erasure happened
+ * in between.
+ */
+template<typename K, typename V, typename H = std::hash<K>> class sharded_lru {
+	public:
+	using result = cache_result;
+	struct stats {
+		uint64_t hits = 0, neg_hits = 0, misses = 0;
+		size_t entries = 0;
+	};
+
+	explicit sharded_lru(size_t nshards = 16) :
+		m_shard(nshards > 0 ? nshards : 1)
+	{}
+
+	/* Drops all entries */
+	void configure(size_t capacity, time_duration ttl, time_duration neg_ttl)
+	{
+		clear();
+		m_per_shard = (capacity + m_shard.size() - 1) / m_shard.size();
+		m_ttl = ttl;
+		m_neg_ttl = neg_ttl;
+	}
+
+	result get(const K &key, V &out, time_point now = tp_now())
+	{
+		auto &s = shard(key);
+		std::lock_guard lk(s.lock);
+		auto it = s.map.find(key);
+		if (it == s.map.end()) {
+			++m_misses;
+			return result::miss;
+		}
+		auto node = it->second;
+		if (node->expiry <= now) {
+			s.map.erase(it);
+			s.lru.erase(node);
+			++m_misses;
+			return result::miss;
+		}
+		s.lru.splice(s.lru.begin(), s.lru, node);
+		if (!node->value.has_value()) {
+			++m_neg_hits;
+			return result::negative;
+		}
+		out = *node->value;
+		++m_hits;
+		return result::hit;
+	}
+
+	uint64_t generation() const { return m_gen.load(); }
+
+	void put(const K &key, V value, time_point now = tp_now())
+	{
+		put(m_gen.load(), key, std::move(value), now);
+	}
+
+	void put(uint64_t gen, const K &key, V value, time_point now = tp_now())
+	{
+		auto ttl = m_ttl.load();
+		if (ttl.count() > 0)
+			emplace(gen, key, std::move(value), now + ttl);
+	}
+
+	void put_negative(const K &key, time_point now = tp_now())
+	{
+		put_negative(m_gen.load(), key, now);
+	}
+
+	void put_negative(uint64_t gen, const K &key, time_point now = tp_now())
+	{
+		auto ttl = m_neg_ttl.load();
+		if (ttl.count() > 0)
+			emplace(gen, key, std::nullopt, now + ttl);
+	}
+
+	void erase(const K &key)
+	{
+		++m_gen;
+		auto &s = shard(key);
+		std::lock_guard lk(s.lock);
+		auto it = s.map.find(key);
+		if (it == s.map.end())
+			return;
+		s.lru.erase(it->second);
+		s.map.erase(it);
+	}
+
+	/* @pred(const K &, const V *) is called with nullptr for negative entries */
+	template<typename F> void erase_if(F &&pred)
+	{
+		++m_gen;
+		for (auto &s : m_shard) {
+			std::lock_guard lk(s.lock);
+			for (auto it = s.lru.begin(); it != s.lru.end(); ) {
+				if (!pred(it->key, it->value.has_value() ? &*it->value : nullptr)) {
+					++it;
+					continue;
+				}
+				s.map.erase(it->key);
+				it = s.lru.erase(it);
+			}
+		}
+	}
+
+	void clear()
+	{
+		++m_gen;
+		for (auto &s : m_shard) {
+			std::lock_guard lk(s.lock);
+			s.map.clear();
+			s.lru.clear();
+		}
+	}
+
+	stats get_stats() const
+	{
+		stats st;
+		st.hits     = m_hits;
+		st.neg_hits = m_neg_hits;
+		st.misses   = m_misses;
+		for (auto &s : m_shard) {
+			std::lock_guard lk(s.lock);
+			st.entries += s.map.size();
+		}
+		return st;
+	}
+
+	private:
+	struct node {
+		K key;
+		std::optional<V> value;
+		time_point expiry;
+	};
+	struct shard_t {
+		mutable std::mutex lock;
+		std::list<node> lru; /* most recently used first */
+		std::unordered_map<K, typename std::list<node>::iterator, H> map;
+	};
+
+	shard_t &shard(const K &key) { return m_shard[H{}(key) % m_shard.size()]; }
+
+	void emplace(uint64_t gen, const K &key, std::optional<V> &&value,
+	    time_point expiry)
+	{
+		size_t limit = m_per_shard;
+		if (limit == 0)
+			return;
+		auto &s = shard(key);
+		std::lock_guard lk(s.lock);
+		/*
+		 * Erasers bump m_gen before taking the shard locks, so checking
+		 * under the lock means we either see the new generation or
+		 * insert early enough for the eraser to remove the entry.
+		 */
+		if (m_gen.load() != gen)
+			return;
+		auto it = s.map.find(key);
+		if (it != s.map.end()) {
+			it->second->value  = std::move(value);
+			it->second->expiry = expiry;
+			s.lru.splice(s.lru.begin(), s.lru, it->second);
+			return;
+		}
+		s.lru.emplace_front(key, std::move(value), expiry);
+		try {
+			s.map.emplace(key, s.lru.begin());
+		} catch (...) {
+			s.lru.pop_front();
+			throw;
+		}
+		while (s.map.size() > limit) {
+			s.map.erase(s.lru.back().key);
+			s.lru.pop_back();
+		}
+	}
+
+	std::vector<shard_t> m_shard;
+	/* may be reconfigured while in use */
+	std::atomic<size_t> m_per_shard{0};
+	std::atomic<time_duration> m_ttl{}, m_neg_ttl{};
+	std::atomic<uint64_t> m_hits{0}, m_neg_hits{0}, m_misses{0};
+	std::atomic<uint64_t> m_gen{0}; /* bumped on every erasure */
+};
+
+}
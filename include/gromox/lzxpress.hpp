@@ -1,5 +1,9 @@
 #pragma once
 #include <cstdint>
 #include <gromox/defs.h>
-extern GX_EXPORT uint32_t lzxpress_compress(const void *uncompressed, uint32_t uncompressed_size, void *compressed);
+enum {
+	LZXPRESS_EFFORT_DEFAULT = 5,
+	LZXPRESS_EFFORT_MAX = 9,
+};
+extern GX_EXPORT uint32_t lzxpress_compress(const void *uncompressed, uint32_t uncompressed_size, void *compressed, uint32_t max_compressed_size, unsigned int effort = LZXPRESS_EFFORT_DEFAULT);
 extern GX_EXPORT uint32_t lzxpress_decompress(const void *input, uint32_t input_size, void *output, uint32_t max_output_size);
@@ -766,6 +766,8 @@ class GX_EXPORT idset {
 	BOOL enum_replist(void *param, REPLIST_ENUM);
 	BOOL enum_repl(uint16_t replid, void *param, REPLICA_ENUM);
 	inline const std::vector<repl_node> &get_repl_list() const { return repl_list; }
+	/* GC value ranges for @replid; nullptr if there are none or the set is GUID-based */
+	const repl_node::range_list_t *get_ranges(uint16_t replid) const;
 	void dump(FILE * = nullptr) const;
 #ifdef COMPILE_DIAG
 	inline size_t nelem() const {
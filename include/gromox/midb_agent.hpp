@@ -1,5 +1,6 @@
 #pragma once
 #include <string>
+#include <vector>
 #include <gromox/range_set.hpp>
 #include <gromox/xarray2.hpp>
 
@@ -36,7 +37,7 @@ namespace midb_agent {
 extern GX_EXPORT int list_mail(const char *path, const std::string &folder, std::vector<MSG_UNIT> &, int *num, uint64_t *size);
 extern GX_EXPORT int delete_mail(const char *path, const std::string &folder, const std::vector<MSG_UNIT *> &);
 extern GX_EXPORT int get_uid(const char *path, const std::string &folder, const std::string &mid, unsigned int *uid);
-extern GX_EXPORT int summary_folder(const char *path, const std::string &folder, size_t *exists, size_t *recent, size_t *unseen, uint32_t *uidvalid, uint32_t *uidnext, int *perrno);
+extern GX_EXPORT int summary_folder(const char *path, const std::string &folder, size_t *exists, size_t *recent, size_t *unseen, uint32_t *uidvalid, uint32_t *uidnext, uint64_t *highest_modseq, int *perrno);
 extern GX_EXPORT int make_folder(const char *path, const std::string &folder, int *perrno);
 extern GX_EXPORT int remove_folder(const char *path, const std::string &folder, int *perrno);
 extern GX_EXPORT int ping_mailbox(const char *path, int *perrno);
@@ -49,9 +50,11 @@ extern GX_EXPORT int insert_mail(const char *path, const std::string &folder, co
 extern GX_EXPORT int remove_mail(const char *path, const std::string &folder, const std::vector<MITEM *> &, int *perrno);
 extern GX_EXPORT int list_deleted(const char *path, const std::string &folder, XARRAY *, int *perrno);
 extern GX_EXPORT int fetch_simple_uid(const char *path, const std::string &folder, const gromox::imap_seq_list &, XARRAY *, int *perrno);
-extern GX_EXPORT int fetch_detail_uid(const char *path, const std::string &folder, const gromox::imap_seq_list &, XARRAY *, int *perrno);
+extern GX_EXPORT int fetch_changed_uid(const char *path, const std::string &folder, uint64_t modseq, XARRAY *, std::vector<uint32_t> *vanished, uint64_t *highest_modseq, int *perrno);
+extern GX_EXPORT int fetch_detail_uid(const char *path, const std::string &folder, const gromox::imap_seq_list &, XARRAY *, int *perrno, const char *charset = nullptr);
 extern GX_EXPORT int set_flags(const char *path, const std::string &folder, const std::string &mid, unsigned int flag_bits, unsigned int *new_bits, int *perrno);
 extern GX_EXPORT int unset_flags(const char *path, const std::string &folder, const std::string &mid, unsigned int flag_bits, unsigned int *new_bits, int *perrno);
+extern GX_EXPORT int store_flags_unchanged(const char *path, const std::string &folder, const std::vector<std::string> &mids, char op, unsigned int flag_bits, uint64_t unchangedsince, std::vector<uint32_t> &failed, int *perrno);
 extern GX_EXPORT int get_flags(const char *path, const std::string &folder, const std::string &mid, unsigned int *pflag_bits, int *perrno);
 extern GX_EXPORT int copy_mail(const char *path, const std::string &src_folder, const std::string &src_mid, const std::string &dst_folder, std::string &dst_mid, int *perrno);
 extern GX_EXPORT int search(const char *path, const std::string &folder, const char *charset, int argc, char **argv, std::string &ret_buff, int *perrno);
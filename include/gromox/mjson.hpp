@@ -1,4 +1,7 @@
 #pragma once
+#include <cstdint>
+#include <functional>
+#include <map>
 #include <memory>
 #include <optional>
 #include <string>
@@ -11,15 +14,29 @@ struct MJSON_MIME;
 using MJSON_MIME_ENUM = void (*)(MJSON_MIME *, void *);
 
 struct GX_EXPORT mjson_io {
+	/* (offset, length, OUT total size, OUT data) */
+	using range_fn = std::function<bool(uint64_t, uint32_t, uint64_t *, std::string *)>;
+	/*
+	 * A file that is fetched piecewise. Only the byte ranges that were
+	 * asked for (e.g. the MJSON_MIME head/begin/length spans) get pulled.
+	 */
+	struct ranged_file {
+		range_fn fetch;
+		uint64_t size = UINT64_MAX; /* unknown until the first fetch */
+		std::map<uint64_t, std::string> extents;
+	};
+
 	std::unordered_map<std::string, std::string> m_cache;
+	std::unordered_map<std::string, ranged_file> m_ranged;
 	using c_iter = decltype(m_cache)::const_iterator;
 
 	bool exists(const std::string &path) const;
-	const std::string *get_full(const std::string &path) const;
-	std::optional<std::string> get_substr(const std::string &path, size_t of, size_t ln) const;
-	ssize_t get_size(const std::string &path) const;
+	const std::string *get_full(const std::string &path);
+	std::optional<std::string> get_substr(const std::string &path, size_t of, size_t ln);
+	ssize_t get_size(const std::string &path);
 	void place(const std::string &path, std::string &&ctnt);
-	void clear() { m_cache.clear(); }
+	void place_ranged(const std::string &path, range_fn &&);
+	void clear() { m_cache.clear(); m_ranged.clear(); }
 	bool valid(c_iter it) const { return it != m_cache.cend(); }
 	bool invalid(c_iter it) const { return it == m_cache.cend(); }
 };
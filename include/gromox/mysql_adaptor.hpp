@@ -1,5 +1,6 @@
 #pragma once
 #include <cstdint>
+#include <ctime>
 #include <map>
 #include <set>
 #include <string>
@@ -47,6 +48,17 @@ struct mysql_adaptor_init_param {
 	int port = 0, conn_num = 0, timeout = 0;
 	enum sql_schema_upgrade schema_upgrade = SSU_NOT_ENABLED;
 	bool enable_firsttimepw = false;
+	size_t cache_size = 0;
+	unsigned int cache_ttl = 0, cache_neg_ttl = 0;
+};
+
+/**
+ * Counters of one of mysql_adaptor's lookup caches.
+ * @neg_hits:	lookups answered by a cached "no such object"
+ */
+struct sql_cache_stats {
+	uint64_t hits = 0, neg_hits = 0, misses = 0;
+	size_t entries = 0;
 };
 
 struct sql_domain {
@@ -135,6 +147,7 @@ extern GX_EXPORT bool mysql_adaptor_get_domain_info(unsigned int domain_id, sql_
 extern GX_EXPORT bool mysql_adaptor_check_same_org(unsigned int domain_id1, unsigned int domain_id2);
 extern GX_EXPORT bool mysql_adaptor_get_domain_groups(unsigned int domain_id, std::vector<sql_group> &);
 extern GX_EXPORT int mysql_adaptor_get_domain_users(unsigned int domain_id, std::vector<sql_user> &);
+extern GX_EXPORT bool mysql_adaptor_get_domain_users_since(unsigned int domain_id, time_t since, time_t &now, std::vector<sql_user> &, std::vector<unsigned int> &ids);
 extern GX_EXPORT bool mysql_adaptor_check_mlist_include(const char *mlist_name, const char *account);
 extern GX_EXPORT bool mysql_adaptor_check_same_org2(const char *domainname1, const char *domainname2);
 extern GX_EXPORT bool mysql_adaptor_get_mlist_memb(const char *username, const char *from, int *presult, std::vector<std::string> &);
@@ -144,6 +157,8 @@ extern GX_EXPORT int mysql_adaptor_domain_list_query(const char *dom);
 extern GX_EXPORT int mysql_adaptor_mbop_userlist(std::vector<sql_user> &);
 extern GX_EXPORT gromox::errno_t mysql_adaptor_mda_alias_list(gromox::sql_alias_map &, size_t &);
 extern GX_EXPORT gromox::errno_t mysql_adaptor_mda_domain_list(gromox::sql_domain_set &);
+extern GX_EXPORT void mysql_adaptor_cache_stats(std::map<std::string, sql_cache_stats> &);
+extern GX_EXPORT void mysql_adaptor_cache_invalidate(const char *name);
 
 /**
  * Determines whether an arbitrary actor can generally open/read the primary
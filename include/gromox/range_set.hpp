@@ -92,14 +92,15 @@ template<typename T> class GX_EXPORT range_set : private std::vector<gromox::ran
 		 * When a merge to @i happened, new adjacencies/overlaps could
 		 * have formed. Because of the property that no left
 		 * adjacencies could have been introduced (see above), we only
-		 * need to check to the right of @i (in other words, @j), and
-		 * also only on the high side.
+		 * need to check to the right of @i (in other words, @j). Every
+		 * @j that overlaps or touches @i is absorbed, including those
+		 * that @i now covers entirely.
 		 */
 		for (auto j = std::next(i); j != end(); j = base::erase(j)) {
-			auto x = j->hi > i->hi && j->lo <= i->hi + 1;
-			if (!x)
+			if (j->lo > i->hi && j->lo - i->hi > 1)
 				break;
-			i->hi = j->hi;
+			if (j->hi > i->hi)
+				i->hi = j->hi;
 		}
 	}
 
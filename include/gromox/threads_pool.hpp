@@ -43,4 +43,5 @@ extern GX_EXPORT void threads_pool_stop();
 extern GX_EXPORT int threads_pool_get_param(int type);
 extern GX_EXPORT THREADS_EVENT_PROC threads_pool_register_event_proc(THREADS_EVENT_PROC proc);
 extern GX_EXPORT void threads_pool_wakeup_thread();
+extern GX_EXPORT void threads_pool_wakeup_queue(unsigned int run_queue);
 extern GX_EXPORT void threads_pool_wakeup_all_threads();
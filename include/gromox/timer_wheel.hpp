@@ -0,0 +1,79 @@
+#pragma once
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+#include <gromox/double_list.hpp>
+
+namespace gromox {
+
+/**
+ * Hashed timing wheel over intrusive DOUBLE_LIST nodes. An element due at
+ * tick T lives in slot T % size; elements more than one revolution away
+ * just stay in their slot for further rounds, so the visitor passed to
+ * advance() is responsible for telling those apart. Not thread-safe.
+ */
+class timer_wheel {
+	public:
+	explicit timer_wheel(size_t nslots) : m_slot(nslots)
+	{
+		for (auto &l : m_slot)
+			double_list_init(&l);
+	}
+	~timer_wheel() { clear(); }
+	NOMOVE(timer_wheel);
+
+	void add(DOUBLE_LIST_NODE *node, uint64_t tick)
+	{
+		double_list_append_as_tail(&m_slot[tick % m_slot.size()], node);
+		++m_count;
+	}
+	/* @tick must be the value that was used with add() */
+	void remove(DOUBLE_LIST_NODE *node, uint64_t tick)
+	{
+		double_list_remove(&m_slot[tick % m_slot.size()], node);
+		--m_count;
+	}
+
+	/**
+	 * Visit all slots for the ticks after the previous call up to and
+	 * including @now. @fn(node) returns true if the element has been
+	 * taken off the wheel (it may be re-added right away), or false to
+	 * leave it in place.
+	 */
+	template<typename F> void advance(uint64_t now, F &&fn)
+	{
+		if (now < m_cursor)
+			return;
+		auto steps = std::min<uint64_t>(now - m_cursor + 1, m_slot.size());
+		for (uint64_t t = now + 1 - steps; t <= now; ++t) {
+			auto &list = m_slot[t % m_slot.size()];
+			auto ptail = double_list_get_tail(&list);
+			DOUBLE_LIST_NODE *pnode;
+			while ((pnode = double_list_pop_front(&list)) != nullptr) {
+				--m_count;
+				if (!fn(pnode)) {
+					double_list_append_as_tail(&list, pnode);
+					++m_count;
+				}
+				if (pnode == ptail)
+					break;
+			}
+		}
+		m_cursor = now + 1;
+	}
+
+	void clear()
+	{
+		for (auto &l : m_slot)
+			double_list_free(&l);
+		m_count = 0;
+	}
+	size_t count() const { return m_count; }
+
+	private:
+	std::vector<DOUBLE_LIST> m_slot;
+	uint64_t m_cursor = 0;
+	size_t m_count = 0;
+};
+
+}
@@ -2,6 +2,7 @@
 // SPDX-FileCopyrightText: 2022 grommunio GmbH
 // This file is part of Gromox.
 #pragma once
+#include <cstdint>
 #include <string>
 #include <unordered_map>
 #include <vector>
@@ -12,6 +13,7 @@ struct MITEM {
 	std::string mid;
 	int id = 0, uid = 0;
 	char flag_bits = 0;
+	uint64_t modseq = 0;
 	Json::Value digest;
 };
 
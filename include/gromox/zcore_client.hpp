@@ -14,6 +14,7 @@
 struct zcreq;
 struct zcresp;
 extern zend_bool zclient_do_rpc(const zcreq *, zcresp *);
+extern zend_bool zclient_do_batch(size_t n, const zcreq *const *, zcresp *const *, zend_bool *ok);
 extern ec_error_t zclient_setpropval(GUID ses, uint32_t obj, gromox::proptag_t, const void *);
 extern ec_error_t zclient_getpropval(GUID ses, uint32_t obj, gromox::proptag_t, void **);
 
@@ -103,6 +103,7 @@ enum class zcore_callid : uint8_t {
 	logon_token = 0x5a,
 	getuserfreebusy = 0x5b,
 	getuserfreebusyical = 0x5c,
+	batch = 0x5d,
 	/* update exch/zcore/names.cpp! */
 };
 
@@ -649,6 +650,15 @@ struct zcreq_getuserfreebusyical final : public zcreq {
 	int64_t endtime;
 };
 
+/*
+ * Several calls in one frame. Each element is a complete request (call_id
+ * and arguments, without the length prefix) or a complete response
+ * (status byte, length, result, arguments), as used for single calls.
+ */
+struct zcreq_batch final : public zcreq {
+	std::vector<BINARY> reqs;
+};
+
 struct zcresp {
 	zcresp() = default; /* Prevent use of direct-init-list */
 	virtual ~zcresp() = default;
@@ -893,6 +903,10 @@ struct zcresp_getuserfreebusyical final : public zcresp {
 	BINARY ical_bin;
 };
 
+struct zcresp_batch final : public zcresp {
+	std::vector<BINARY> resps;
+};
+
 using zcresp_checksession = zcresp;
 using zcresp_configimport = zcresp;
 using zcresp_copyfolder = zcresp;
@@ -1,6 +1,7 @@
 // SPDX-License-Identifier: AGPL-3.0-or-later
 // SPDX-FileCopyrightText: 2025 grommunio GmbH
 // This file is part of Gromox.
+#include <algorithm>
 #include <chrono>
 #include <cstdint>
 #include <mutex>
@@ -68,34 +69,62 @@ void ab::invalidate_cache()
 /**
  * @brief      Get base with given ID, load if necessary
  *
+ * A base that has outlived the cache interval is still handed out; it is
+ * queued for the worker, which loads a replacement off to the side and
+ * swaps it in once complete. Only the very first load of a base blocks.
+ *
  * @param      base_id   Base ID (negative for domains, positive for organizations)
  *
  * @return     Pointer to address book object
  */
 ab::const_base_ref ab::get(int32_t base_id)
 {
-	std::unique_lock lock(m_lock);
+	std::shared_lock sl(m_lock);
 	auto it = m_base_hash.find(base_id);
 	if (it != m_base_hash.end()) {
 		base_ref base = it->second;
-		lock.unlock();
-		return base->await_load() ? base : nullptr;
+		sl.unlock();
+		if (!base->await_load())
+			return nullptr;
+		if (m_cache_interval.count() > 0 && base->age() >= m_cache_interval &&
+		    running > 0) try {
+			std::lock_guard wl(worker_lock);
+			/* after a failed refresh, do not hammer the database */
+			auto rt = m_retry.find(base_id);
+			if ((rt == m_retry.end() || tp_now() >= rt->second.after) &&
+			    m_refreshing.emplace(base_id).second) {
+				worker_queue.push_back(base_id);
+				worker_signal.notify_one();
+			}
+		} catch (const std::bad_alloc &) {
+			/* try again on next access */
+		}
+		return base;
 	}
+	sl.unlock();
+	std::unique_lock lock(m_lock);
 	try {
 		auto res = m_base_hash.try_emplace(base_id, std::make_shared<ab_base>(base_id));
-		if (!res.second)
-			return nullptr;
+		if (!res.second) {
+			/* someone else got there first */
+			base_ref base = res.first->second;
+			lock.unlock();
+			return base->await_load() ? base : nullptr;
+		}
 		it = res.first;
 	} catch (std::bad_alloc &) {
 		return nullptr;
 	}
+	base_ref base = it->second;
 	lock.unlock();
-	if (!it->second->load()) {
+	if (!base->load()) {
 		lock.lock();
-		m_base_hash.erase(it);
+		it = m_base_hash.find(base_id);
+		if (it != m_base_hash.end() && it->second == base)
+			m_base_hash.erase(it);
 		return nullptr;
 	}
-	return std::const_pointer_cast<const ab_base>(it->second);
+	return base;
 }
 
 /**
@@ -119,37 +148,90 @@ bool ab::run() try
  */
 void ab::stop()
 {
-	if (--running)
+	if (--running > 0)
 		return;
-	worker_signal.notify_all();
-	worker.join();
+	{
+		std::lock_guard wl(worker_lock);
+		worker_signal.notify_all();
+	}
+	if (worker.joinable())
+		worker.join();
+}
+
+/**
+ * @brief      Replace a base by a freshly loaded copy
+ *
+ * The new base is loaded (incrementally if possible) while the old one
+ * keeps serving requests, and then swapped into the registry. Holders of
+ * the old base keep it alive until they are done with it.
+ *
+ * @return     false if loading failed (and the old base stays in place)
+ */
+bool ab::refresh(int32_t base_id)
+{
+	base_ref old;
+	{
+		std::shared_lock sl(m_lock);
+		auto it = m_base_hash.find(base_id);
+		if (it == m_base_hash.end())
+			return true;
+		old = it->second;
+	}
+	if (!old->await_load())
+		return true;
+	base_ref fresh;
+	try {
+		fresh = std::make_shared<ab_base>(base_id);
+	} catch (const std::bad_alloc &) {
+		mlog(LV_ERR, "E-1798: ENOMEM");
+		return false;
+	}
+	if (!fresh->reload(*old)) {
+		mlog(LV_WARN, "W-1799: ab_tree: could not refresh base %d, keeping the old one", base_id);
+		return false;
+	}
+	std::unique_lock lock(m_lock);
+	auto it = m_base_hash.find(base_id);
+	/* Not if dropped or invalidated in the meantime */
+	if (it != m_base_hash.end() && it->second == old)
+		it->second = std::move(fresh);
+	return true;
 }
 
 /**
  * @brief      Worker thread
  *
- * Cleans up expired address books
+ * Refreshes expired address books queued by get(). After a failed refresh,
+ * the base is not queued again for a while, doubling the wait with every
+ * consecutive failure (30s up to 10min).
  */
 void ab::work()
 {
-	std::chrono::seconds wait_time;
-	std::mutex notify_lock;
-	std::unique_lock notify_guard(notify_lock);
-	while (running) {
-		std::unique_lock lock_guard(m_lock);
-		if (worker_queue.empty())
-			wait_time = m_cache_interval;
-		else {
-			auto base = get(worker_queue.front());
-			if (!base || base->age() >= m_cache_interval) {
-				drop(worker_queue.front());
-				worker_queue.pop_front();
-				continue;
-			}
-			wait_time = m_cache_interval-base->age();
+	std::unique_lock wl(worker_lock);
+	while (running > 0) {
+		if (worker_queue.empty()) {
+			worker_signal.wait(wl);
+			continue;
+		}
+		auto id = worker_queue.front();
+		worker_queue.pop_front();
+		wl.unlock();
+		auto ok = refresh(id);
+		wl.lock();
+		m_refreshing.erase(id);
+		if (ok) {
+			m_retry.erase(id);
+			continue;
+		}
+		try {
+			auto &rt = m_retry[id];
+			auto wait = std::min(std::chrono::seconds(30 << std::min(rt.fails, 5U)),
+			            std::chrono::seconds(600));
+			++rt.fails;
+			rt.after = tp_now() + wait;
+		} catch (const std::bad_alloc &) {
+			mlog(LV_ERR, "E-1819: ENOMEM");
 		}
-		lock_guard.unlock();
-		worker_signal.wait_for(notify_guard, wait_time);
 	}
 }
 
@@ -189,42 +271,213 @@ bool ab_base::await_load() const
 bool ab_base::load()
 {
 	std::lock_guard lock(m_lock, std::adopt_lock);
-	std::vector<unsigned int> domain_ids;
+	return load_full() && finish_load();
+}
+
+/**
+ * @brief       Populate address book from given objects and unlock
+ *
+ * For users of the lookup structures that do not have a user database
+ * at hand, such as tests.
+ *
+ * @return      Whether loading was successful
+ */
+bool ab_base::load(std::vector<ab_domain> &&dl, std::vector<sql_user> &&ul)
+{
+	std::lock_guard lock(m_lock, std::adopt_lock);
+	domains = std::move(dl);
+	m_users = std::move(ul);
+	return finish_load();
+}
+
+/**
+ * @brief       Load address book as an update of @prev, and unlock
+ *
+ * Only asks the database for users changed since @prev was loaded, taking
+ * everything else over from @prev. Falls back to a full load when the
+ * user database does not track modifications, the set of domains changed,
+ * or after a number of consecutive delta loads (some attributes, e.g. of
+ * mlists and classes, are not covered by the modification tracking).
+ * The GUID is retained, so that handles issued for @prev remain valid.
+ *
+ * @return      Whether loading was successful
+ */
+bool ab_base::reload(const ab_base &prev)
+{
+	std::lock_guard lock(m_lock, std::adopt_lock);
+	m_guid = prev.m_guid;
+	if (prev.m_stamp != 0 && prev.m_deltas < 16 && load_delta(prev))
+		return finish_load();
+	domains.clear();
+	m_users.clear();
+	m_deltas = 0;
+	return load_full() && finish_load();
+}
+
+/**
+ * @brief       Get the IDs of the domains that make up this base
+ */
+bool ab_base::domain_ids(std::vector<unsigned int> &ids) const
+{
 	if (m_base_id <= 0)
-		domain_ids.emplace_back(-m_base_id);
-	else if (!mysql_adaptor_get_org_domains(m_base_id, domain_ids))
+		ids.emplace_back(-m_base_id);
+	else if (!mysql_adaptor_get_org_domains(m_base_id, ids))
 		return false;
-	if (domain_ids.size() > minid::MAXVAL) // cannot reference more nodes
-		domain_ids.resize(minid::MAXVAL);
-	std::unordered_map<unsigned int, unsigned int> domain_map;
-	domains.reserve(domain_ids.size());
-	sql_domain domain;
-	for (unsigned int domain_id : domain_ids) try {
-		if (!mysql_adaptor_get_domain_users(domain_id, m_users))
-			return false;
-		domain_map[domain_id] = uint32_t(domains.size());
+	if (ids.size() > minid::MAXVAL) // cannot reference more nodes
+		ids.resize(minid::MAXVAL);
+	return true;
+}
+
+bool ab_base::load_full()
+{
+	std::vector<unsigned int> dom_ids;
+	if (!domain_ids(dom_ids))
+		return false;
+	domains.reserve(dom_ids.size());
+	bool with_stamp = true;
+	time_t stamp = 0;
+	for (unsigned int domain_id : dom_ids) try {
+		/*
+		 * The delta query with since=0 returns all users and also
+		 * yields the database clock for the next (delta) load.
+		 */
+		time_t now = 0;
+		std::vector<unsigned int> ids;
+		if (with_stamp &&
+		    mysql_adaptor_get_domain_users_since(domain_id, 0, now, m_users, ids)) {
+			if (stamp == 0 || now < stamp)
+				stamp = now;
+		} else {
+			with_stamp = false;
+			if (!mysql_adaptor_get_domain_users(domain_id, m_users))
+				return false;
+		}
 		ab_domain &domain = domains.emplace_back();
 		domain.id = domain_id;
 		mysql_adaptor_get_domain_info(domain_id, domain.info);
 	} catch (std::exception &) {
 		return false;
 	}
+	m_stamp = with_stamp ? stamp : 0;
+	return true;
+}
+
+bool ab_base::load_delta(const ab_base &prev) try
+{
+	std::vector<unsigned int> dom_ids;
+	if (!domain_ids(dom_ids) || dom_ids.size() != prev.domains.size())
+		return false;
+	for (size_t i = 0; i < dom_ids.size(); ++i)
+		if (dom_ids[i] != prev.domains[i].id)
+			return false;
+	/*
+	 * Rows written shortly before prev was loaded may have been committed
+	 * only afterwards; re-read those as well.
+	 */
+	auto since = prev.m_stamp > 60 ? prev.m_stamp - 60 : 0;
+	std::vector<sql_user> changed;
+	std::unordered_set<unsigned int> present;
+	time_t stamp = 0;
+	domains.reserve(dom_ids.size());
+	for (unsigned int domain_id : dom_ids) {
+		time_t now = 0;
+		std::vector<unsigned int> ids;
+		if (!mysql_adaptor_get_domain_users_since(domain_id, since, now, changed, ids))
+			return false;
+		if (stamp == 0 || now < stamp)
+			stamp = now;
+		present.insert(ids.begin(), ids.end());
+		ab_domain &domain = domains.emplace_back();
+		domain.id = domain_id;
+		mysql_adaptor_get_domain_info(domain_id, domain.info);
+	}
+	std::unordered_set<unsigned int> changed_ids;
+	for (const auto &u : changed)
+		changed_ids.emplace(u.id);
+	m_users.reserve(present.size());
+	for (const auto &u : prev.m_users)
+		if (present.contains(u.id) && !changed_ids.contains(u.id))
+			m_users.push_back(u);
+	for (auto &u : changed)
+		m_users.push_back(std::move(u));
+	m_stamp = stamp;
+	m_deltas = prev.m_deltas + 1;
+	mlog(LV_DEBUG, "ab_tree: base %d: %zu changed, %zu removed", m_base_id,
+	     changed_ids.size(), prev.m_users.size() + changed_ids.size() > m_users.size() ?
+	     prev.m_users.size() + changed_ids.size() - m_users.size() : 0);
+	return true;
+} catch (const std::bad_alloc &) {
+	domains.clear();
+	m_users.clear();
+	return false;
+}
+
+/**
+ * @brief       Build the lookup structures over the loaded domains and users
+ */
+bool ab_base::finish_load()
+{
 	if (m_users.size() > minid::MAXVAL)
 		m_users.resize(minid::MAXVAL);
 	std::sort(m_users.begin(), m_users.end());
-	minid_idx_map.reserve(m_users.size() + domain_ids.size());
-	std::unordered_map<unsigned int, unsigned int> domainMap;
+	std::unordered_map<unsigned int, unsigned int> domain_map;
+	for (size_t i = 0; i < domains.size(); ++i)
+		domain_map[domains[i].id] = i;
+	minid_idx_map.reserve(m_users.size() + domains.size());
 	for (size_t i = 0; i < m_users.size(); ++i) {
 		const sql_user &u = m_users[i];
-		domains[domain_map[u.domain_id]].userref.emplace_back(minid(minid::address, u.id));
+		auto dom = domain_map.find(u.domain_id);
+		if (dom != domain_map.end())
+			domains[dom->second].userref.emplace_back(minid(minid::address, u.id));
 		minid_idx_map.emplace(minid(minid::address, u.id), i);
 	}
 	for (size_t i = 0; i < domains.size(); ++i)
 		minid_idx_map.emplace(minid(minid::domain, domains[i].id), i);
+	try {
+		build_index();
+	} catch (const std::bad_alloc &) {
+		mlog(LV_ERR, "E-1795: ENOMEM");
+		return false;
+	}
+	m_load_time = tp_now();
 	m_status = Status::LIVING;
 	return true;
 }
 
+/**
+ * @brief      Index everything that name resolution looks at
+ *
+ * Covers the fields inspected by NSPI ResolveNames/GetMatches(ANR) and
+ * zcore's resolvename, so that their candidates can be drawn from the
+ * index and only need to be confirmed.
+ */
+void ab_base::build_index()
+{
+	m_index.clear();
+	m_sortkey.clear();
+	m_sortkey.reserve(m_users.size());
+	uint32_t pos = 0;
+	for (const auto &d : domains)
+		m_index.add(pos++, d.info.name);
+	for (const auto &u : m_users) {
+		minid mid(minid::address, u.id);
+		m_index.add(pos, displayname(mid));
+		m_index.add(pos, u.username);
+		m_index.add(pos, znul(user_info(mid, userinfo::mail_address)));
+		for (const auto &a : u.aliases)
+			m_index.add(pos, a);
+		for (auto ui : {userinfo::nick_name, userinfo::job_title,
+		     userinfo::comment, userinfo::mobile_tel,
+		     userinfo::business_tel, userinfo::home_address})
+			m_index.add(pos, znul(user_info(mid, ui)));
+		++pos;
+		/* same key as sql_user::operator<=> */
+		auto it = u.propvals.find(PR_DISPLAY_NAME);
+		m_sortkey.emplace_back(name_index::fold(it != u.propvals.end() ?
+			it->second.c_str() : u.username.c_str()));
+	}
+}
+
 ///////////////////////////////////////////////////////////////////////////////
 // ab_base informational member functions
 
@@ -635,6 +888,55 @@ minid ab_base::resolve(const char* dn) const
 	return minid(minid::address, id);
 }
 
+/**
+ * @brief      Find nodes whose names or addresses may contain a string
+ *
+ * @param      needle    Search string
+ *
+ * @return     Candidate nodes in iteration order (a superset of the nodes
+ *             for which a case-insensitive substring test on the indexed
+ *             fields succeeds), or std::nullopt if @needle is too short
+ *             for the index and all nodes need to be considered.
+ */
+std::optional<std::vector<minid>> ab_base::lookup(const char *needle) const try
+{
+	auto pos = m_index.lookup(needle);
+	if (!pos.has_value())
+		return std::nullopt;
+	std::vector<minid> out;
+	out.reserve(pos->size());
+	for (auto p : *pos)
+		out.push_back(*(begin() + p));
+	return out;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-1796: ENOMEM");
+	return std::nullopt;
+}
+
+/**
+ * @brief      Find the first user whose display name sorts at or after @name
+ */
+ab_base::iterator ab_base::seek(const char *name) const
+{
+	auto key = name_index::fold(name);
+	auto it = std::lower_bound(m_sortkey.cbegin(), m_sortkey.cend(), key);
+	return ubegin() + (it - m_sortkey.cbegin());
+}
+
+/**
+ * @brief      Get the case-folded key by which users are sorted
+ *
+ * @return     Key, or an empty view if @mid is not a user
+ */
+std::string_view ab_base::sortkey(minid mid) const
+{
+	if (mid.type() != minid::address)
+		return {};
+	auto it = minid_idx_map.find(mid);
+	return it != minid_idx_map.end() && it->second < m_sortkey.size() ?
+	       std::string_view(m_sortkey[it->second]) : std::string_view();
+}
+
 /**
  * @brief      Get address book node type
  *
@@ -822,6 +1124,76 @@ size_t ab_base::iterator::pos() const
 	                         std::distance(m_base->m_users.cbegin(), std::get<1>(it)) + m_base->domains.size();
 }
 
+///////////////////////////////////////////////////////////////////////////////////////////////////
+// name_index member functions
+
+static inline uint32_t ni_gram(const char *p)
+{
+	return static_cast<uint8_t>(p[0]) | (static_cast<uint8_t>(p[1]) << 8) |
+	       (static_cast<uint8_t>(p[2]) << 16);
+}
+
+/**
+ * @brief      ASCII case folding, the same that strcasecmp/strcasestr apply
+ */
+std::string name_index::fold(std::string_view s)
+{
+	std::string out(s);
+	for (auto &c : out)
+		if (c >= 'A' && c <= 'Z')
+			c += 'a' - 'A';
+	return out;
+}
+
+/**
+ * @brief      Record that entry @pos contains @text
+ */
+void name_index::add(uint32_t pos, std::string_view text)
+{
+	if (text.size() < min_length)
+		return;
+	auto f = fold(text);
+	for (size_t i = 0; i + min_length <= f.size(); ++i) {
+		auto &list = m_grams[ni_gram(&f[i])];
+		if (list.empty() || list.back() != pos)
+			list.push_back(pos);
+	}
+}
+
+/**
+ * @brief      Entries that contain all trigrams of @needle
+ *
+ * @return     Sorted positions, or std::nullopt if @needle is shorter than
+ *             min_length
+ */
+std::optional<std::vector<uint32_t>> name_index::lookup(std::string_view needle) const
+{
+	if (needle.size() < min_length)
+		return std::nullopt;
+	auto f = fold(needle);
+	std::vector<const std::vector<uint32_t> *> lists;
+	for (size_t i = 0; i + min_length <= f.size(); ++i) {
+		auto it = m_grams.find(ni_gram(&f[i]));
+		if (it == m_grams.end())
+			return std::vector<uint32_t>{};
+		lists.push_back(&it->second);
+	}
+	std::sort(lists.begin(), lists.end(),
+		[](const auto *a, const auto *b) {
+			return a->size() != b->size() ? a->size() < b->size() :
+			       std::less<>()(a, b);
+		});
+	lists.erase(std::unique(lists.begin(), lists.end()), lists.end());
+	std::vector<uint32_t> out = *lists[0], tmp;
+	for (size_t i = 1; i < lists.size() && !out.empty(); ++i) {
+		tmp.clear();
+		std::set_intersection(out.cbegin(), out.cend(),
+			lists[i]->cbegin(), lists[i]->cend(), std::back_inserter(tmp));
+		std::swap(out, tmp);
+	}
+	return out;
+}
+
 ///////////////////////////////////////////////////////////////////////////////////////////////////
 // ab_node member functions
 
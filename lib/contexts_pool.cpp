@@ -2,14 +2,19 @@
 #ifdef HAVE_CONFIG_H
 #	include "config.h"
 #endif
+#include <algorithm>
+#include <atomic>
 #include <cerrno>
+#include <chrono>
 #include <csignal>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 #include <mutex>
 #include <pthread.h>
+#include <thread>
 #include <unistd.h>
+#include <vector>
 #ifdef HAVE_SYS_EPOLL_H
 #	include <sys/epoll.h>
 #endif
@@ -22,6 +27,7 @@
 #include <gromox/defs.h>
 #include <gromox/process.hpp>
 #include <gromox/threads_pool.hpp>
+#include <gromox/timer_wheel.hpp>
 #include <gromox/util.hpp>
 
 using namespace gromox;
@@ -46,6 +52,19 @@ struct evqueue {
 	errno_t del(SCHEDULE_CONTEXT *);
 	void reset();
 };
+
+/*
+ * Runnable contexts. A context is queued where it was last served, and each
+ * pool thread drains one queue first before stealing from the others.
+ */
+struct alignas(64) run_queue {
+	run_queue() { double_list_init(&list); }
+	~run_queue() { double_list_free(&list); }
+	NOMOVE(run_queue);
+
+	std::mutex lock;
+	DOUBLE_LIST list;
+};
 }
 
 static time_duration g_time_out;
@@ -57,6 +76,16 @@ static pthread_t g_thread_id;
 static gromox::atomic_bool g_notify_stop{true};
 static DOUBLE_LIST g_context_lists[static_cast<int>(sctx_status::_alloc_max)];
 static std::mutex g_context_locks[static_cast<int>(sctx_status::_alloc_max)];
+/*
+ * Timeouts of polling contexts, in one-second ticks. Protected by the
+ * polling lock.
+ */
+static timer_wheel g_poll_timers{1024};
+/* How soon an idling context gets to re-check its own condition */
+static constexpr auto IDLE_RECHECK = std::chrono::seconds(1);
+static std::vector<run_queue> g_run_queues;
+static unsigned int g_run_queue_num = 1;
+static std::atomic<unsigned int> g_turning_num;
 
 static int (*contexts_pool_get_context_socket)(const schedule_context *);
 static time_point (*contexts_pool_get_context_timestamp)(const schedule_context *);
@@ -151,6 +180,38 @@ errno_t evqueue::del(SCHEDULE_CONTEXT *ctx)
 #endif
 }
 
+/* Tick of @t, rounded up so that no timer fires early */
+static inline uint64_t ctxp_tick(time_point t)
+{
+	return std::chrono::ceil<std::chrono::seconds>(t.time_since_epoch()).count();
+}
+
+static void ctxp_timer_add(schedule_context *pcontext)
+{
+	pcontext->timer_node.pdata = pcontext;
+	g_poll_timers.add(&pcontext->timer_node, ctxp_tick(pcontext->deadline));
+}
+
+static void ctxp_timer_del(schedule_context *pcontext)
+{
+	g_poll_timers.remove(&pcontext->timer_node, ctxp_tick(pcontext->deadline));
+}
+
+/**
+ * Put @pcontext on its run queue. Returns the queue index, for the caller
+ * to pass to threads_pool_wakeup_queue() if a pool thread should be roused.
+ */
+static unsigned int ctxp_turn(schedule_context *pcontext)
+{
+	auto q = pcontext->run_queue % g_run_queue_num;
+	auto &rq = g_run_queues[q];
+	std::lock_guard hold(rq.lock);
+	pcontext->type = sctx_status::turning;
+	double_list_append_as_tail(&rq.list, &pcontext->node);
+	++g_turning_num;
+	return q;
+}
+
 static void context_init(SCHEDULE_CONTEXT *pcontext)
 {
 	if (NULL == pcontext) {
@@ -184,7 +245,9 @@ int contexts_pool_get_param(int type)
 	case CUR_SLEEPING_CONTEXTS:
 		return double_list_get_nodes_num(&g_context_lists[static_cast<int>(sctx_status::sleeping)]);
 	case CUR_SCHEDULING_CONTEXTS:
-		return double_list_get_nodes_num(&g_context_lists[static_cast<int>(sctx_status::turning)]);
+		return g_turning_num;
+	case RUN_QUEUE_NUM:
+		return g_run_queue_num;
 	default:
 		return -1;
 	}
@@ -210,21 +273,22 @@ static void *ctxp_thrwork(void *pparam)
 				continue;
 			}
 			double_list_remove(&g_context_lists[static_cast<int>(sctx_status::polling)], &pcontext->node);
+			ctxp_timer_del(pcontext);
 			pcontext->type = sctx_status::switching;
 			poll_hold.unlock();
-			contexts_pool_insert(pcontext, sctx_status::turning);
+			threads_pool_wakeup_queue(ctxp_turn(pcontext));
 		}
-		if (num == 1)
-			threads_pool_wakeup_thread();
-		else
-			threads_pool_wakeup_all_threads();
 	}
 	return nullptr;
 }
 
+/**
+ * Move timed-out polling contexts, and idling contexts that are due for a
+ * re-check, to the turning queue. Only the wheel slots that came due since
+ * the last pass are visited, not every polling context.
+ */
 static void *ctxp_scanwork(void *pparam)
 {
-	int num;
 	DOUBLE_LIST temp_list;
 	DOUBLE_LIST_NODE *pnode;
 	SCHEDULE_CONTEXT *pcontext;
@@ -233,49 +297,47 @@ static void *ctxp_scanwork(void *pparam)
 	while (!g_notify_stop) {
 		std::unique_lock poll_hold(g_context_locks[static_cast<int>(sctx_status::polling)]);
 		auto current_time = tp_now();
-		auto ptail = double_list_get_tail(&g_context_lists[static_cast<int>(sctx_status::polling)]);
-		while ((pnode = double_list_pop_front(&g_context_lists[static_cast<int>(sctx_status::polling)])) != nullptr) {
-			pcontext = (SCHEDULE_CONTEXT*)pnode->pdata;
-			if (!pcontext->b_waiting) {
-				pcontext->type = sctx_status::switching;
-				double_list_append_as_tail(&temp_list, pnode);
-				goto CHECK_TAIL;
-			}
-			if (current_time - contexts_pool_get_context_timestamp(pcontext) >= g_time_out) {
+		auto now_tick = ctxp_tick(current_time);
+		g_poll_timers.advance(now_tick, [&](DOUBLE_LIST_NODE *tnode) {
+			auto pcontext = static_cast<schedule_context *>(tnode->pdata);
+			if (ctxp_tick(pcontext->deadline) > now_tick)
+				/* due in a later revolution */
+				return false;
+			if (pcontext->b_waiting) {
+				/* the timestamp may have been refreshed meanwhile */
+				auto deadline = contexts_pool_get_context_timestamp(pcontext) + g_time_out;
+				if (current_time < deadline) {
+					pcontext->deadline = deadline;
+					ctxp_timer_add(pcontext);
+					return true;
+				}
 				if (g_poll_ctx.del(pcontext) != 0) {
 					mlog(LV_DEBUG, "contexts_pool: failed to remove event from epoll");
-				} else {
-					pcontext->b_waiting = FALSE;
-					pcontext->type = sctx_status::switching;
-					double_list_append_as_tail(&temp_list, pnode);
-					goto CHECK_TAIL;
+					pcontext->deadline = current_time + std::chrono::seconds(1);
+					ctxp_timer_add(pcontext);
+					return true;
 				}
+				pcontext->b_waiting = FALSE;
 			}
-			double_list_append_as_tail(&g_context_lists[static_cast<int>(sctx_status::polling)], pnode);
- CHECK_TAIL:
-			if (pnode == ptail)
-				break;
-		}
+			double_list_remove(&g_context_lists[static_cast<int>(sctx_status::polling)], &pcontext->node);
+			pcontext->type = sctx_status::switching;
+			double_list_append_as_tail(&temp_list, &pcontext->node);
+			return true;
+		});
 		poll_hold.unlock();
+		/* The idling list is in order of insertion, hence also of deadline */
 		std::unique_lock idle_hold(g_context_locks[static_cast<int>(sctx_status::idling)]);
-		while ((pnode = double_list_pop_front(&g_context_lists[static_cast<int>(sctx_status::idling)])) != nullptr) {
-			pcontext = (SCHEDULE_CONTEXT*)pnode->pdata;
+		while ((pnode = double_list_get_head(&g_context_lists[static_cast<int>(sctx_status::idling)])) != nullptr) {
+			pcontext = static_cast<schedule_context *>(pnode->pdata);
+			if (pcontext->deadline > current_time)
+				break;
+			double_list_remove(&g_context_lists[static_cast<int>(sctx_status::idling)], pnode);
 			pcontext->type = sctx_status::switching;
 			double_list_append_as_tail(&temp_list, pnode);
 		}
 		idle_hold.unlock();
-		num = 0;
-		std::unique_lock turn_hold(g_context_locks[static_cast<int>(sctx_status::turning)]);
-		while ((pnode = double_list_pop_front(&temp_list)) != nullptr) {
-			static_cast<schedule_context *>(pnode->pdata)->type = sctx_status::turning;
-			double_list_append_as_tail(&g_context_lists[static_cast<int>(sctx_status::turning)], pnode);
-			num ++;
-		}
-		turn_hold.unlock();
-		if (num == 1)
-			threads_pool_wakeup_thread();
-		else if (num > 1)
-			threads_pool_wakeup_all_threads();
+		while ((pnode = double_list_pop_front(&temp_list)) != nullptr)
+			threads_pool_wakeup_queue(ctxp_turn(static_cast<schedule_context *>(pnode->pdata)));
 		sleep(1);
 	}
 	double_list_free(&temp_list);
@@ -294,17 +356,28 @@ void contexts_pool_init(SCHEDULE_CONTEXT **pcontexts, unsigned int context_num,
 	contexts_pool_get_context_timestamp = get_timestamp;
 	g_contexts_per_thr = contexts_per_thr;
 	g_time_out = timeout;
+	/* No more queues than CPUs, or than pool threads there can be */
+	g_run_queue_num = std::clamp(std::thread::hardware_concurrency(), 1U, 64U);
+	if (contexts_per_thr > 0)
+		g_run_queue_num = std::clamp((context_num + contexts_per_thr - 1) / contexts_per_thr, 1U, g_run_queue_num);
 	for (auto i = static_cast<unsigned int>(sctx_status::begin); i < std::size(g_context_lists); ++i)
 		double_list_init(&g_context_lists[i]);
 	for (size_t i = 0; i < g_context_num; ++i) {
 		auto pcontext = g_context_ptr[i];
 		context_init(pcontext);
+		pcontext->run_queue = i % g_run_queue_num;
 		double_list_append_as_tail(&g_context_lists[static_cast<int>(sctx_status::free)], &pcontext->node);
 	}
 }
 
 int contexts_pool_run()
 {    
+	try {
+		g_run_queues = std::vector<run_queue>(g_run_queue_num);
+	} catch (const std::bad_alloc &) {
+		mlog(LV_ERR, "E-1761: ENOMEM");
+		return -1;
+	}
 	auto ret = g_poll_ctx.init(g_context_num);
 	if (ret != 0) {
 		mlog(LV_ERR, "contexts_pool: evqueue: %s", strerror(ret));
@@ -344,6 +417,9 @@ void contexts_pool_stop()
 	if (!pthread_equal(g_scan_id, {}))
 		pthread_join(g_scan_id, NULL);
 	g_poll_ctx.reset();
+	g_poll_timers.clear();
+	g_run_queues.clear();
+	g_turning_num = 0;
 	for (size_t i = 0; i < g_context_num; ++i)
 		context_free(g_context_ptr[i]);
 	for (auto i = static_cast<unsigned int>(sctx_status::begin); i < std::size(g_context_lists); ++i)
@@ -363,7 +439,9 @@ schedule_context *contexts_pool_get_context(sctx_status tpraw)
 {
 	const auto type = static_cast<unsigned int>(tpraw);
 	DOUBLE_LIST_NODE *pnode;
-	if (tpraw != sctx_status::free && tpraw != sctx_status::turning)
+	if (tpraw == sctx_status::turning)
+		return contexts_pool_get_turning(0);
+	if (tpraw != sctx_status::free)
 		return NULL;
 	std::lock_guard xhold(g_context_locks[type]);
 	pnode = double_list_pop_front(&g_context_lists[type]);
@@ -371,6 +449,35 @@ schedule_context *contexts_pool_get_context(sctx_status tpraw)
 	return pnode != nullptr ? static_cast<SCHEDULE_CONTEXT *>(pnode->pdata) : nullptr;
 }
 
+/**
+ * Take a runnable context, preferably from run queue @home. The other queues
+ * are only tried without blocking, so that stealing does not get in the
+ * way of their owners. The context then counts as belonging to @home.
+ */
+schedule_context *contexts_pool_get_turning(unsigned int home)
+{
+	if (g_turning_num == 0)
+		return nullptr;
+	home %= g_run_queue_num;
+	for (unsigned int i = 0; i < g_run_queue_num; ++i) {
+		auto &rq = g_run_queues[(home + i) % g_run_queue_num];
+		std::unique_lock hold(rq.lock, std::defer_lock);
+		if (i == 0)
+			hold.lock();
+		else if (!hold.try_lock())
+			continue;
+		auto pnode = double_list_pop_front(&rq.list);
+		if (pnode == nullptr)
+			continue;
+		--g_turning_num;
+		hold.unlock();
+		auto pcontext = static_cast<schedule_context *>(pnode->pdata);
+		pcontext->run_queue = home;
+		return pcontext;
+	}
+	return nullptr;
+}
+
 /**
  * Move back a context into the pool
  *	@param
@@ -394,6 +501,10 @@ void contexts_pool_insert(schedule_context *pcontext, sctx_status tpraw)
 		mlog(LV_DEBUG, "contexts_pool: cannot put context into queue of type %u", type);
 		return;
 	}
+	if (tpraw == sctx_status::turning) {
+		ctxp_turn(pcontext);
+		return;
+	}
 	
 	/* append the context at the tail of the corresponding list */
 	std::lock_guard xhold(g_context_locks[type]);
@@ -421,6 +532,13 @@ void contexts_pool_insert(schedule_context *pcontext, sctx_status tpraw)
 				         pcontext), SHUT_RDWR);
 			}
 		}
+		/* A context that did not make it into epoll is handed back on the next pass. */
+		pcontext->deadline = pcontext->b_waiting ?
+			contexts_pool_get_context_timestamp(pcontext) + g_time_out :
+			tp_now();
+		ctxp_timer_add(pcontext);
+	} else if (tpraw == sctx_status::idling) {
+		pcontext->deadline = tp_now() + IDLE_RECHECK;
 	} else if (tpraw == sctx_status::free && original_type == sctx_status::turning) {
 		if (pcontext->b_waiting)
 			/* socket was removed by "close()" function automatically,
@@ -438,8 +556,7 @@ void contexts_pool_signal(SCHEDULE_CONTEXT *pcontext)
 	double_list_remove(&g_context_lists[static_cast<int>(sctx_status::idling)], &pcontext->node);
 	pcontext->type = sctx_status::switching;
 	idle_hold.unlock();
-	contexts_pool_insert(pcontext, sctx_status::turning);
-	threads_pool_wakeup_thread();
+	threads_pool_wakeup_queue(ctxp_turn(pcontext));
 }
 
 /*
@@ -467,9 +584,10 @@ BOOL contexts_pool_wakeup_context(schedule_context *pcontext, sctx_status type)
 	double_list_remove(&g_context_lists[static_cast<int>(sctx_status::sleeping)], &pcontext->node);
 	sleep_hold.unlock();
 	/* put the context into waiting queue */
-	contexts_pool_insert(pcontext, type);
 	if (type == sctx_status::turning)
-		threads_pool_wakeup_thread();
+		threads_pool_wakeup_queue(ctxp_turn(pcontext));
+	else
+		contexts_pool_insert(pcontext, type);
 	return TRUE;
 }
 
@@ -485,11 +603,8 @@ void context_pool_activate_context(SCHEDULE_CONTEXT *pcontext)
 	if (pcontext->type != sctx_status::polling)
 		return;
 	double_list_remove(&g_context_lists[static_cast<int>(sctx_status::polling)], &pcontext->node);
+	ctxp_timer_del(pcontext);
 	pcontext->type = sctx_status::switching;
 	poll_hold.unlock();
-	std::unique_lock turn_hold(g_context_locks[static_cast<int>(sctx_status::turning)]);
-	pcontext->type = sctx_status::turning;
-	double_list_append_as_tail(&g_context_lists[static_cast<int>(sctx_status::turning)], &pcontext->node);
-	turn_hold.unlock();
-	threads_pool_wakeup_thread();
+	threads_pool_wakeup_queue(ctxp_turn(pcontext));
 }
@@ -423,8 +423,10 @@ static constexpr char tbl_alias_top[] =
 "CREATE TABLE `aliases` ("
 "  `aliasname` varchar(320) CHARACTER SET ascii NOT NULL,"
 "  `mainname` varchar(320) CHARACTER SET ascii NOT NULL,"
+"  `modified` timestamp NOT NULL DEFAULT CURRENT_TIMESTAMP ON UPDATE CURRENT_TIMESTAMP,"
 "  PRIMARY KEY (`aliasname`),"
 "  KEY `mainname` (`mainname`),"
+"  KEY `modified` (`modified`),"
 "  CONSTRAINT `aliases_ibfk_1` FOREIGN KEY (`mainname`) REFERENCES `users` (`username`) ON DELETE CASCADE ON UPDATE CASCADE"
 ") DEFAULT CHARSET=utf8mb4";
 
@@ -553,6 +555,7 @@ static constexpr char tbl_users_top[] =
 "  `externid` varbinary(64) DEFAULT NULL,"
 "  `sync_policy` text CHARACTER SET ascii DEFAULT NULL,"
 "  `chat_id` varchar(26) DEFAULT NULL,"
+"  `modified` timestamp NOT NULL DEFAULT CURRENT_TIMESTAMP ON UPDATE CURRENT_TIMESTAMP,"
 "  PRIMARY KEY (`id`),"
 "  UNIQUE KEY `username` (`username`),"
 "  UNIQUE KEY `domain_id_2` (`domain_id`,`username`),"
@@ -560,7 +563,8 @@ static constexpr char tbl_users_top[] =
 "  UNIQUE KEY `altname` (`altname`),"
 "  KEY `group_id` (`group_id`),"
 "  KEY `domain_id` (`domain_id`),"
-"  KEY `maildir` (`maildir`)"
+"  KEY `maildir` (`maildir`),"
+"  KEY `modified` (`modified`)"
 ") DEFAULT CHARSET=utf8mb4";
 
 static constexpr char tbl_uprops_top[] =
@@ -570,7 +574,9 @@ static constexpr char tbl_uprops_top[] =
 "  `order_id` int(10) unsigned DEFAULT 1,"
 "  `propval_bin` varbinary(4096) DEFAULT NULL,"
 "  `propval_str` varchar(4096) DEFAULT NULL,"
+"  `modified` timestamp NOT NULL DEFAULT CURRENT_TIMESTAMP ON UPDATE CURRENT_TIMESTAMP,"
 "  PRIMARY KEY (`user_id`,`proptag`,`order_id`),"
+"  KEY `modified` (`modified`),"
 "  CONSTRAINT `user_properties_ibfk_1` FOREIGN KEY (`user_id`) REFERENCES `users` (`id`) ON DELETE CASCADE ON UPDATE CASCADE"
 ") DEFAULT CHARSET=utf8mb4";
 
@@ -778,6 +784,19 @@ static constexpr tbl_upgradefn tbl_upgrade_list[] = {
 	{129, tbl_altnames_129},
 	{130, "INSERT INTO altnames (SELECT id AS user_id, altname, 0 AS magic FROM users WHERE altname IS NOT NULL)"},
 	{131, "UPDATE users SET altname=NULL"},
+	{132, "ALTER TABLE `users` ADD COLUMN `modified` timestamp NOT NULL DEFAULT CURRENT_TIMESTAMP ON UPDATE CURRENT_TIMESTAMP AFTER `chat_id`"},
+	{133, "ALTER TABLE `users` ADD INDEX `modified` (`modified`)"},
+	/*
+	 * n134..137: Track modifications of a user's properties and aliases,
+	 * so that address book reloads can ask for just the changed users.
+	 * (Deliberately not done with triggers on the users table: those
+	 * need extra privileges, and fail with error 1442 on statements
+	 * against users that cascade into these tables.)
+	 */
+	{134, "ALTER TABLE `user_properties` ADD COLUMN `modified` timestamp NOT NULL DEFAULT CURRENT_TIMESTAMP ON UPDATE CURRENT_TIMESTAMP"},
+	{135, "ALTER TABLE `user_properties` ADD INDEX `modified` (`modified`)"},
+	{136, "ALTER TABLE `aliases` ADD COLUMN `modified` timestamp NOT NULL DEFAULT CURRENT_TIMESTAMP ON UPDATE CURRENT_TIMESTAMP"},
+	{137, "ALTER TABLE `aliases` ADD INDEX `modified` (`modified`)"},
 	{0, nullptr},
 };
 
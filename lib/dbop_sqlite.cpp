@@ -518,6 +518,19 @@ static constexpr char tbl_midb_folders_3[] =
 "  sort_field INTEGER DEFAULT 0);"
 "CREATE INDEX parent_fid_index3 ON folders(parent_fid);";
 
+static constexpr char tbl_midb_folders_6[] =
+"CREATE TABLE folders ("
+"  folder_id INTEGER PRIMARY KEY,"
+"  parent_fid INTEGER NOT NULL,"
+"  commit_max INTEGER NOT NULL,"
+"  name TEXT COLLATE NOCASE UNIQUE,"
+"  uidnext INTEGER DEFAULT 0,"
+"  unsub INTEGER DEFAULT 0,"
+"  sort_field INTEGER DEFAULT 0,"
+"  highest_modseq INTEGER DEFAULT 1,"
+"  modseq_floor INTEGER DEFAULT 0);"
+"CREATE INDEX parent_fid_index3 ON folders(parent_fid);";
+
 static constexpr char tbl_midb_folders_move2_3[] =
 "INSERT INTO folders SELECT folder_id, parent_fid, commit_max, name, uidnext, unsub, sort_field FROM u0";
 
@@ -558,12 +571,119 @@ static constexpr char tbl_midb_msgs_0[] =
 "CREATE INDEX fid_rcpt_index ON messages(folder_id, rcpt);"
 "CREATE INDEX fid_size_index ON messages(folder_id, size);";
 
+static constexpr char tbl_midb_msgs_4[] =
+"CREATE TABLE messages ("
+"  message_id INTEGER PRIMARY KEY,"
+"  folder_id INTEGER NOT NULL,"
+"  mid_string TEXT NOT NULL UNIQUE,"
+"  idx INTEGER DEFAULT NULL,"
+"  mod_time INTEGER DEFAULT 0,"
+"  uid INTEGER NOT NULL,"
+"  unsent INTEGER DEFAULT 0,"
+"  recent INTEGER DEFAULT 1,"
+"  read INTEGER DEFAULT 0,"
+"  flagged INTEGER DEFAULT 0,"
+"  replied INTEGER DEFAULT 0,"
+"  forwarded INTEGER DEFAULT 0,"
+"  deleted INTEGER DEFAULT 0,"
+"  subject TEXT NOT NULL,"
+"  sender TEXT NOT NULL,"
+"  rcpt TEXT NOT NULL,"
+"  size INTEGER NOT NULL,"
+"  ext TEXT DEFAULT NULL," /* unused */
+"  received INTEGER NOT NULL,"
+"  modseq INTEGER DEFAULT 1,"
+"  FOREIGN KEY (folder_id)"
+"  	REFERENCES folders (folder_id)"
+"  	ON DELETE CASCADE"
+"  	ON UPDATE CASCADE);"
+"CREATE INDEX folder_id_index ON messages(folder_id);"
+"CREATE INDEX fid_idx_index ON messages(folder_id, idx);"
+"CREATE INDEX fid_recent_index ON messages(folder_id, recent);"
+"CREATE INDEX fid_read_index ON messages(folder_id, read);"
+"CREATE INDEX fid_received_index ON messages(folder_id, received);"
+"CREATE INDEX fid_uid_index ON messages(folder_id, uid);"
+"CREATE INDEX fid_flagged_index ON messages(folder_id, flagged);"
+"CREATE INDEX fid_subject_index ON messages(folder_id, subject);"
+"CREATE INDEX fid_from_index ON messages(folder_id, sender);"
+"CREATE INDEX fid_rcpt_index ON messages(folder_id, rcpt);"
+"CREATE INDEX fid_size_index ON messages(folder_id, size);"
+"CREATE INDEX fid_modseq_index ON messages(folder_id, modseq);";
+
 static constexpr char tbl_midb_mapping_0[] =
 "CREATE TABLE mapping ("
 "  message_id INTEGER PRIMARY KEY,"
 "  mid_string TEXT NOT NULL,"
 "  flag_string TEXT)";
 
+/*
+ * Per-folder modification sequence (RFC 7162). Maintained by triggers so
+ * that every code path which adds, reflags or removes a message
+ * participates without further ado; removals are remembered in
+ * `expunged` for QRESYNC.
+ */
+#define MIDB_EXPUNGED_4 \
+"CREATE TABLE expunged (" \
+"  folder_id INTEGER NOT NULL," \
+"  uid INTEGER NOT NULL," \
+"  modseq INTEGER NOT NULL," \
+"  FOREIGN KEY (folder_id)" \
+"  	REFERENCES folders (folder_id)" \
+"  	ON DELETE CASCADE" \
+"  	ON UPDATE CASCADE);" \
+"CREATE INDEX exp_fid_modseq_index ON expunged(folder_id, modseq);" \
+"CREATE TRIGGER msg_ins_modseq AFTER INSERT ON messages BEGIN" \
+"  UPDATE folders SET highest_modseq=highest_modseq+1 WHERE folder_id=NEW.folder_id;" \
+"  UPDATE messages SET modseq=(SELECT highest_modseq FROM folders" \
+"    WHERE folder_id=NEW.folder_id) WHERE message_id=NEW.message_id;" \
+"END;" \
+"CREATE TRIGGER msg_upd_modseq AFTER UPDATE OF" \
+"  unsent, read, flagged, replied, forwarded, deleted ON messages" \
+"  WHEN OLD.unsent IS NOT NEW.unsent OR OLD.read IS NOT NEW.read OR" \
+"  OLD.flagged IS NOT NEW.flagged OR OLD.replied IS NOT NEW.replied OR" \
+"  OLD.forwarded IS NOT NEW.forwarded OR OLD.deleted IS NOT NEW.deleted BEGIN" \
+"  UPDATE folders SET highest_modseq=highest_modseq+1 WHERE folder_id=NEW.folder_id;" \
+"  UPDATE messages SET modseq=(SELECT highest_modseq FROM folders" \
+"    WHERE folder_id=NEW.folder_id) WHERE message_id=NEW.message_id;" \
+"END;" \
+"CREATE TRIGGER msg_del_modseq AFTER DELETE ON messages BEGIN" \
+"  UPDATE folders SET highest_modseq=highest_modseq+1 WHERE folder_id=OLD.folder_id;" \
+"  INSERT INTO expunged (folder_id, uid, modseq) SELECT folder_id, OLD.uid," \
+"    highest_modseq FROM folders WHERE folder_id=OLD.folder_id;" \
+"END;"
+
+static constexpr char tbl_midb_expunged_4[] = MIDB_EXPUNGED_4;
+
+static constexpr char tbl_midb_modseq_4[] =
+"ALTER TABLE folders ADD COLUMN highest_modseq INTEGER DEFAULT 1;"
+"ALTER TABLE messages ADD COLUMN modseq INTEGER DEFAULT 1;"
+"CREATE INDEX fid_modseq_index ON messages(folder_id, modseq);"
+MIDB_EXPUNGED_4;
+
+/*
+ * IMAP ENVELOPE/BODY/BODYSTRUCTURE strings as rendered for one charset,
+ * so that FETCH need not rebuild them from the digest every time.
+ */
+static constexpr char tbl_midb_rendered_5[] =
+"CREATE TABLE rendered ("
+"  message_id INTEGER NOT NULL,"
+"  charset TEXT NOT NULL COLLATE NOCASE,"
+"  envelope TEXT NOT NULL,"
+"  body TEXT NOT NULL,"
+"  bodystructure TEXT NOT NULL,"
+"  PRIMARY KEY (message_id, charset),"
+"  FOREIGN KEY (message_id)"
+"  	REFERENCES messages (message_id)"
+"  	ON DELETE CASCADE"
+"  	ON UPDATE CASCADE)";
+
+/*
+ * `expunged` is trimmed by midb; P-SIMD requests for changes since a
+ * modseq below modseq_floor can no longer be answered incrementally.
+ */
+static constexpr char tbl_midb_modseq_floor_6[] =
+"ALTER TABLE folders ADD COLUMN modseq_floor INTEGER DEFAULT 0";
+
 static constexpr tbl_init tbl_midb_init_0[] = {
 	{"configurations", tbl_config_0},
 	{"folders", tbl_midb_folders_0},
@@ -574,9 +694,11 @@ static constexpr tbl_init tbl_midb_init_0[] = {
 
 static constexpr tbl_init tbl_midb_init_top[] = {
 	{"configurations", tbl_config_1},
-	{"folders", tbl_midb_folders_3},
-	{"messages", tbl_midb_msgs_0},
+	{"folders", tbl_midb_folders_6},
+	{"messages", tbl_midb_msgs_4},
 	{"mapping", tbl_midb_mapping_0},
+	{"expunged", tbl_midb_expunged_4},
+	{"rendered", tbl_midb_rendered_5},
 	TABLE_END,
 };
 
@@ -628,6 +750,9 @@ static constexpr tblite_upgradefn tbl_midb_upgrade_list[] = {
 	{1, nullptr, "configurations", tbl_config_1, tbl_config_move1},
 	{2, nullptr, "folders", tbl_midb_folders_2, tbl_midb_folders_move2_3},
 	{3, nullptr, "folders", tbl_midb_folders_3, tbl_midb_folders_move2_3},
+	{4, tbl_midb_modseq_4},
+	{5, tbl_midb_rendered_5},
+	{6, tbl_midb_modseq_floor_6},
 	TABLE_END,
 };
 
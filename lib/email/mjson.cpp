@@ -1,8 +1,10 @@
 // SPDX-License-Identifier: GPL-2.0-only WITH linking exception
 // SPDX-FileCopyrightText: 2020–2025 grommunio GmbH
 // This file is part of Gromox.
+#include <algorithm>
 #include <cerrno>
 #include <climits>
+#include <cstdint>
 #include <cstdio>
 #include <cstring>
 #include <fcntl.h>
@@ -61,38 +63,106 @@ static int mjson_rfc822_fetch_internal(mjson_io &, const MJSON *, const char *st
 
 bool mjson_io::exists(const std::string &path) const
 {
-	return m_cache.find(path) != m_cache.cend();
+	return m_cache.find(path) != m_cache.cend() ||
+	       m_ranged.find(path) != m_ranged.cend();
 }
 
 void mjson_io::place(const std::string &path, std::string &&content)
 {
+	m_ranged.erase(path);
 	m_cache[path] = std::move(content);
 }
 
-const std::string *mjson_io::get_full(const std::string &path) const
+void mjson_io::place_ranged(const std::string &path, range_fn &&fetch)
+{
+	if (m_cache.find(path) != m_cache.end())
+		return;
+	auto &f = m_ranged[path];
+	f = {};
+	f.fetch = std::move(fetch);
+}
+
+const std::string *mjson_io::get_full(const std::string &path)
 {
 	auto iter = m_cache.find(path);
-	return iter != m_cache.end() ? &iter->second : nullptr;
+	if (iter != m_cache.end())
+		return &iter->second;
+	auto rf = m_ranged.find(path);
+	if (rf == m_ranged.end())
+		return nullptr;
+	/* Someone needs the whole file after all; stop tracking extents. */
+	std::string content;
+	uint64_t size = 0;
+	do {
+		std::string chunk;
+		if (!rf->second.fetch(content.size(), UINT32_MAX, &size, &chunk))
+			return nullptr;
+		if (chunk.empty())
+			break;
+		content += std::move(chunk);
+	} while (content.size() < size);
+	m_ranged.erase(rf);
+	return &(m_cache[path] = std::move(content));
 }
 
-ssize_t mjson_io::get_size(const std::string &path) const
+ssize_t mjson_io::get_size(const std::string &path)
 {
-	auto str = get_full(path);
-	if (str == nullptr)
+	auto iter = m_cache.find(path);
+	if (iter != m_cache.end())
+		return std::min(iter->second.size(), static_cast<size_t>(SSIZE_MAX));
+	auto rf = m_ranged.find(path);
+	if (rf == m_ranged.end())
 		return -1;
-	if (str->size() >= SSIZE_MAX)
-		return SSIZE_MAX;
-	return str->size();
+	auto &f = rf->second;
+	if (f.size == UINT64_MAX) {
+		uint64_t size = 0;
+		std::string dummy;
+		if (!f.fetch(0, 0, &size, &dummy))
+			return -1;
+		f.size = size;
+	}
+	return std::min(f.size, static_cast<uint64_t>(SSIZE_MAX));
 }
 
 std::optional<std::string> mjson_io::get_substr(const std::string &path,
-    size_t of, size_t len) const
+    size_t of, size_t len)
 {
 	std::optional<std::string> r;
-	auto str = get_full(path);
-	if (str == nullptr || of > str->size())
+	auto iter = m_cache.find(path);
+	if (iter != m_cache.end()) {
+		auto &str = iter->second;
+		if (of > str.size())
+			return r;
+		return r.emplace(str.substr(of, len));
+	}
+	auto rf = m_ranged.find(path);
+	if (rf == m_ranged.end())
+		return r;
+	auto &f = rf->second;
+	if (f.size != UINT64_MAX) {
+		if (of > f.size)
+			return r;
+		len = std::min(static_cast<uint64_t>(len), f.size - of);
+	}
+	/* Covered by an extent from an earlier request? */
+	auto ext = f.extents.upper_bound(of);
+	if (ext != f.extents.begin()) {
+		--ext;
+		auto skip = of - ext->first;
+		auto have = ext->second.size();
+		if (skip <= have && (have - skip >= len ||
+		    ext->first + have == f.size))
+			return r.emplace(ext->second.substr(skip, len));
+	}
+	uint64_t size = 0;
+	std::string data;
+	if (!f.fetch(of, std::min(len, static_cast<size_t>(UINT32_MAX)), &size, &data))
+		return r;
+	f.size = size;
+	if (of > size)
 		return r;
-	return r.emplace(str->substr(of, len));
+	auto &e = f.extents[of] = std::move(data);
+	return r.emplace(e.substr(0, len));
 }
 
 bool MJSON_MIME::contains_none_type() const
@@ -3,17 +3,23 @@
 // This file is part of Gromox.
 #include <algorithm>
 #include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
 #include <csignal>
 #include <cstdio>
 #include <cstring>
 #include <list>
+#include <memory>
 #include <mutex>
 #include <netdb.h>
 #include <poll.h>
 #include <pthread.h>
 #include <unistd.h>
+#include <unordered_map>
 #include <vector>
 #include <libHX/endian.h>
+#include <libHX/io.h>
 #include <libHX/scope.hpp>
 #include <libHX/socket.h>
 #include <gromox/atomic.hpp>
@@ -33,6 +39,31 @@
 
 namespace gromox {
 
+/* A connection carrying many concurrent requests (exmdb_proto::mux) */
+struct mux_conn {
+	struct call {
+		std::condition_variable cv;
+		bool done = false;
+		exmdb_response code = exmdb_response::invalid;
+		std::unique_ptr<uint8_t[], stdlib_delete> buf;
+		uint32_t len = 0;
+	};
+
+	mux_conn(remote_svr *s, int fd) : psvr(s), sockd(fd) {}
+	NOMOVE(mux_conn);
+	~mux_conn();
+
+	remote_svr *psvr = nullptr;
+	int sockd = -1;
+	pthread_t reader_id{};
+	std::mutex wr_lock; /* serializes request frames */
+	std::mutex lock; /* protects pending, next_id, dead */
+	std::unordered_map<uint32_t, call *> pending;
+	uint32_t next_id = 0;
+	bool dead = false;
+	std::atomic<time_t> last_time{0};
+};
+
 std::optional<exmdb_client_remote> exmdb_client;
 
 static int mdcl_rpc_timeout = -1;
@@ -42,12 +73,22 @@ static std::list<agent_thread> mdcl_agent_list;
 static std::list<remote_svr> mdcl_server_list;
 static std::mutex mdcl_server_lock; /* he protecc mdcl_server_list+mdcl_agent_list */
 static atomic_bool mdcl_notify_stop;
-static unsigned int mdcl_conn_max, mdcl_threads_max;
+static unsigned int mdcl_conn_max, mdcl_threads_max, mdcl_multiplex;
 static pthread_t mdcl_scan_id;
 static void (*mdcl_build_env)(const remote_svr &);
 static void (*mdcl_free_env)();
 static void (*mdcl_event_proc)(const char *, BOOL, uint32_t, const DB_NOTIFY *);
 static char mdcl_remote_id[128];
+static thread_local exmdb_response mdcl_last_response = exmdb_response::success;
+
+mux_conn::~mux_conn()
+{
+	if (sockd >= 0) {
+		close(sockd);
+		if (psvr != nullptr)
+			--psvr->active_handles;
+	}
+}
 
 remote_conn::~remote_conn()
 {
@@ -79,6 +120,7 @@ void remote_conn_ref::reset(bool lost)
 }
 
 static constexpr cfg_directive exmdb_client_dflt[] = {
+	{"exmdb_client_multiplex", "0", CFG_BOOL},
 	{"exmdb_client_rpc_timeout", "0", CFG_TIME, "0"},
 	CFG_TABLE_END,
 };
@@ -96,6 +138,7 @@ exmdb_client_remote::exmdb_client_remote(unsigned int conn_max,
 			mdcl_rpc_timeout = -1;
 		if (mdcl_rpc_timeout > 0)
 			mdcl_rpc_timeout *= 1000;
+		mdcl_multiplex = cfg->get_ll("exmdb_client_multiplex");
 	}
 	setup_signal_defaults();
 	mdcl_notify_stop = true;
@@ -130,14 +173,23 @@ exmdb_client_remote::~exmdb_client_remote()
 			close(conn.sockd);
 			conn.sockd = -1;
 		}
+		if (srv.mux != nullptr) {
+			shutdown(srv.mux->sockd, SHUT_RDWR);
+			pthread_join(srv.mux->reader_id, nullptr);
+			srv.mux.reset();
+		}
 	}
 	mdcl_build_env = nullptr;
 	mdcl_free_env = nullptr;
 	mdcl_event_proc = nullptr;
 }
 
+/**
+ * @proto:	in: protocol to ask for; out: protocol the server agreed to
+ * 		(may be nullptr for classic)
+ */
 static int exmdb_client_connect_exmdb(remote_svr &srv, bool b_listen,
-    const char *prog_id)
+    const char *prog_id, exmdb_proto *proto = nullptr)
 {
 	int sockd = HX_inet_connect(srv.host.c_str(), srv.port, 0);
 	if (sockd < 0) {
@@ -158,6 +210,8 @@ static int exmdb_client_connect_exmdb(remote_svr &srv, bool b_listen,
 		rqc.prefix = deconst(srv.prefix.c_str());
 		rqc.remote_id = mdcl_remote_id;
 		rqc.b_private = srv.type == EXMDB_ITEM::EXMDB_PRIVATE ? TRUE : false;
+		if (proto != nullptr)
+			rqc.proto = *proto;
 	} else {
 		rql.call_id = exmdb_callid::listen_notification;
 		rql.remote_id = mdcl_remote_id;
@@ -183,6 +237,7 @@ static int exmdb_client_connect_exmdb(remote_svr &srv, bool b_listen,
 	    bin.pb == nullptr)
 		return -1;
 	auto response_code = static_cast<exmdb_response>(bin.pb[0]);
+	uint32_t granted = bin.cb == 9 ? le32p_to_cpu(&bin.pb[5]) : 0;
 	exmdb_rpc_free(bin.pb);
 	bin.pb = nullptr;
 	if (response_code != exmdb_response::success) {
@@ -190,11 +245,16 @@ static int exmdb_client_connect_exmdb(remote_svr &srv, bool b_listen,
 		       srv.host.c_str(), srv.port, srv.prefix.c_str(),
 		       exmdb_rpc_strerror(response_code));
 		return -1;
+	} else if (bin.cb == 9 && proto != nullptr &&
+	    granted == static_cast<uint32_t>(*proto)) {
+		/* Server acknowledged the requested protocol */
 	} else if (bin.cb != 5) {
 		mlog(LV_ERR, "exmdb_client: response format error "
 		       "during connect to [%s]:%hu/%s",
 		       srv.host.c_str(), srv.port, srv.prefix.c_str());
 		return -1;
+	} else if (proto != nullptr) {
+		*proto = exmdb_proto::classic;
 	}
 	cl_sock.release();
 	return sockd;
@@ -501,12 +561,200 @@ static remote_conn_ref exmdb_client_get_connection(const char *dir)
 	return fc;
 }
 
+static bool mux_read_full(int fd, void *buf, size_t len)
+{
+	return HXio_fullread(fd, buf, len) == static_cast<ssize_t>(len);
+}
+
+/**
+ * Receives response frames of a mux connection and hands them to the
+ * waiting callers. Also keeps the connection alive with pings.
+ */
+static void *mux_reader(void *arg)
+{
+	auto &m = *static_cast<mux_conn *>(arg);
+	while (!mdcl_notify_stop) {
+		struct pollfd pfd = {m.sockd, POLLIN | POLLPRI};
+		auto ret = poll(&pfd, 1, 1000);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0)
+			break;
+		if (ret == 0) {
+			if (time(nullptr) - m.last_time < SOCKET_TIMEOUT - 3)
+				continue;
+			auto ping_buff = cpu_to_le32(0);
+			std::lock_guard wr_hold(m.wr_lock);
+			if (HXio_fullwrite(m.sockd, &ping_buff, sizeof(ping_buff)) != sizeof(ping_buff))
+				break;
+			m.last_time = time(nullptr);
+			continue;
+		}
+		uint8_t hdr[9];
+		if (!mux_read_full(m.sockd, hdr, sizeof(hdr)))
+			break;
+		uint32_t len = le32p_to_cpu(&hdr[1]), reqid = le32p_to_cpu(&hdr[5]);
+		if (len < sizeof(uint32_t))
+			break;
+		len -= sizeof(uint32_t);
+		std::unique_ptr<uint8_t[], stdlib_delete> buf;
+		if (len > 0) {
+			buf.reset(static_cast<uint8_t *>(malloc(len)));
+			if (buf == nullptr || !mux_read_full(m.sockd, buf.get(), len))
+				break;
+		}
+		if (reqid == 0)
+			continue; /* ping response */
+		std::lock_guard hold(m.lock);
+		auto it = m.pending.find(reqid);
+		if (it == m.pending.end())
+			continue; /* caller gave up already */
+		auto &c = *it->second;
+		c.code = static_cast<exmdb_response>(hdr[0]);
+		c.buf  = std::move(buf);
+		c.len  = len;
+		c.done = true;
+		c.cv.notify_one();
+		m.pending.erase(it);
+	}
+	std::lock_guard hold(m.lock);
+	m.dead = true;
+	for (auto &[id, c] : m.pending) {
+		c->done = true;
+		c->cv.notify_one();
+	}
+	m.pending.clear();
+	return nullptr;
+}
+
+/**
+ * Obtain the shared mux connection for @dir. Returns nullptr if the server
+ * does not do mux; the caller should then use the classic path.
+ */
+static std::shared_ptr<mux_conn> exmdb_client_get_mux(const char *dir) try
+{
+	std::lock_guard sv_hold(mdcl_server_lock);
+	auto i = *dir == '\0' ? mdcl_server_list.begin() :
+	         std::find_if(mdcl_server_list.begin(), mdcl_server_list.end(),
+	         [&](const remote_svr &s) { return strncmp(dir, s.prefix.c_str(), s.prefix.size()) == 0; });
+	if (i == mdcl_server_list.end() || i->mux_refused)
+		return nullptr;
+	if (i->mux != nullptr) {
+		if (!i->mux->dead)
+			return i->mux;
+		pthread_join(i->mux->reader_id, nullptr);
+		i->mux.reset();
+	}
+	if (i->active_handles >= mdcl_conn_max)
+		return nullptr;
+	auto proto = exmdb_proto::mux;
+	auto sockd = exmdb_client_connect_exmdb(*i, false, "mdcl", &proto);
+	if (sockd < 0)
+		return nullptr;
+	++i->active_handles;
+	if (proto != exmdb_proto::mux) {
+		/* Older server; keep the socket as an ordinary connection. */
+		i->mux_refused = true;
+		i->conn_list.emplace_back(&*i);
+		auto &conn = i->conn_list.back();
+		conn.sockd = sockd;
+		conn.last_time = time(nullptr);
+		return nullptr;
+	}
+	auto m = std::make_shared<mux_conn>(&*i, sockd);
+	m->last_time = time(nullptr);
+	auto ret = pthread_create4(&m->reader_id, nullptr, mux_reader, m.get());
+	if (ret != 0) {
+		mlog(LV_ERR, "E-1715: pthread_create: %s", strerror(ret));
+		return nullptr;
+	}
+	pthread_setname_np(m->reader_id, "exmdbcl/mux");
+	i->mux = m;
+	if (mdcl_agent_list.size() < mdcl_threads_max)
+		launch_notify_listener(*i);
+	return m;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-1721: ENOMEM");
+	return nullptr;
+}
+
+static BOOL mux_do_rpc(mux_conn &m, const exreq *rq, const BINARY &bin,
+    exresp *rsp)
+{
+	mux_conn::call c;
+	uint32_t reqid;
+	{
+		std::lock_guard hold(m.lock);
+		if (m.dead)
+			return false;
+		do {
+			reqid = ++m.next_id;
+		} while (reqid == 0 || m.pending.contains(reqid));
+		m.pending.emplace(reqid, &c);
+	}
+	/* Classic framing plus reqid after the length field */
+	uint8_t hdr[8];
+	cpu_to_le32p(&hdr[0], bin.cb);
+	cpu_to_le32p(&hdr[4], reqid);
+	bool sent;
+	{
+		std::lock_guard wr_hold(m.wr_lock);
+		sent = exmdb_client_write_socket(m.sockd, {sizeof(hdr), {hdr}},
+		       SOCKET_TIMEOUT * 1000) &&
+		       exmdb_client_write_socket(m.sockd, {bin.cb - 4, {&bin.pb[4]}},
+		       SOCKET_TIMEOUT * 1000);
+		if (sent)
+			m.last_time = time(nullptr);
+		else
+			/* Stream is out of sync now; let mux_reader wind down */
+			shutdown(m.sockd, SHUT_RDWR);
+	}
+	std::unique_lock hold(m.lock);
+	if (sent && mdcl_rpc_timeout > 0)
+		c.cv.wait_for(hold, std::chrono::milliseconds(mdcl_rpc_timeout),
+			[&]() { return c.done; });
+	else if (sent)
+		c.cv.wait(hold, [&]() { return c.done; });
+	if (!c.done) {
+		m.pending.erase(reqid);
+		return false;
+	}
+	hold.unlock();
+	mdcl_last_response = c.code;
+	if (c.code != exmdb_response::success)
+		return false;
+	rsp->call_id = rq->call_id;
+	BINARY rb;
+	rb.cb = c.len;
+	rb.pb = c.buf.get();
+	return exmdb_ext_pull_response(&rb, rsp) == EXT_ERR_SUCCESS ? TRUE : false;
+}
+
+/**
+ * Status the server sent for this thread's last exmdb_client_do_rpc call.
+ * exmdb_response::invalid if no status was received at all (e.g. the
+ * connection failed).
+ */
+exmdb_response exmdb_client_last_response()
+{
+	return mdcl_last_response;
+}
+
 BOOL exmdb_client_do_rpc(const exreq *rq, exresp *rsp)
 {
 	BINARY bin;
 
+	mdcl_last_response = exmdb_response::invalid;
 	if (exmdb_ext_push_request(rq, &bin) != EXT_ERR_SUCCESS)
 		return false;
+	if (mdcl_multiplex) {
+		auto mux = exmdb_client_get_mux(rq->dir);
+		if (mux != nullptr) {
+			auto ret = mux_do_rpc(*mux, rq, bin, rsp);
+			free(bin.pb);
+			return ret;
+		}
+	}
 	auto conn = exmdb_client_get_connection(rq->dir);
 	if (conn == nullptr || !exmdb_client_write_socket(conn->sockd,
 	    bin, SOCKET_TIMEOUT * 1000)) {
@@ -521,6 +769,7 @@ BOOL exmdb_client_do_rpc(const exreq *rq, exresp *rsp)
 	if (bin.pb == nullptr)
 		return false;
 	if (bin.cb == 1) {
+		mdcl_last_response = static_cast<exmdb_response>(bin.pb[0]);
 		exmdb_rpc_free(bin.pb);
 		/* Connection is still good in principle. */
 		conn.reset();
@@ -536,6 +785,7 @@ BOOL exmdb_client_do_rpc(const exreq *rq, exresp *rsp)
 		return false;
 	}
 	conn.reset();
+	mdcl_last_response = static_cast<exmdb_response>(bin.pb[0]);
 	rsp->call_id = rq->call_id;
 	bin.cb -= 5;
 	bin.pb += 5;
@@ -37,14 +37,24 @@ static pack_result exmdb_pull(EXT_PULL &x, exreq_connect &d)
 {
 	TRY(x.g_str(&d.prefix));
 	TRY(x.g_str(&d.remote_id));
-	return x.g_bool(&d.b_private);
+	TRY(x.g_bool(&d.b_private));
+	d.proto = exmdb_proto::classic;
+	if (x.m_offset >= x.m_data_size)
+		return pack_result::ok;
+	uint32_t v;
+	TRY(x.g_uint32(&v));
+	d.proto = static_cast<exmdb_proto>(v);
+	return pack_result::ok;
 }
 
 static pack_result exmdb_push(EXT_PUSH &x, const exreq_connect &d)
 {
 	TRY(x.p_str(d.prefix));
 	TRY(x.p_str(d.remote_id));
-	return x.p_bool(d.b_private);
+	TRY(x.p_bool(d.b_private));
+	if (d.proto == exmdb_proto::classic)
+		return pack_result::ok;
+	return x.p_uint32(static_cast<uint32_t>(d.proto));
 }
 
 static pack_result exmdb_pull(EXT_PULL &x, exreq_listen_notification &d)
@@ -2276,6 +2286,22 @@ static pack_result exmdb_push(EXT_PUSH &x, const exreq_imapfile_write &d)
 	return x.p_bytes(d.data.data(), z);
 }
 
+static pack_result exmdb_pull(EXT_PULL &x, exreq_imapfile_read_range &d)
+{
+	TRY(x.g_str(&d.type));
+	TRY(x.g_str(&d.mid));
+	TRY(x.g_uint64(&d.offset));
+	return x.g_uint32(&d.length);
+}
+
+static pack_result exmdb_push(EXT_PUSH &x, const exreq_imapfile_read_range &d)
+{
+	TRY(x.p_str(d.type));
+	TRY(x.p_str(d.mid));
+	TRY(x.p_uint64(d.offset));
+	return x.p_uint32(d.length);
+}
+
 #define RQ_WITH_ARGS \
 	E(get_named_propids) \
 	E(get_named_propnames) \
@@ -2402,7 +2428,8 @@ static pack_result exmdb_push(EXT_PUSH &x, const exreq_imapfile_write &d)
 	E(write_message_v2) \
 	E(imapfile_read) \
 	E(imapfile_write) \
-	E(imapfile_delete)
+	E(imapfile_delete) \
+	E(imapfile_read_range)
 
 /**
  * This uses *& because we do not know which request type we are going to get
@@ -3701,6 +3728,25 @@ static pack_result exmdb_push(EXT_PUSH &x, const exresp_imapfile_read &d)
 	return x.p_bytes(d.data.data(), d.data.size());
 }
 
+static pack_result exmdb_pull(EXT_PULL &x, exresp_imapfile_read_range &d) try
+{
+	TRY(x.g_uint64(&d.size));
+	uint32_t z;
+	TRY(x.g_uint32(&z));
+	d.data.resize(z);
+	return x.g_bytes(d.data.data(), z);
+} catch (const std::bad_alloc &) {
+	return pack_result::alloc;
+}
+
+static pack_result exmdb_push(EXT_PUSH &x, const exresp_imapfile_read_range &d)
+{
+	TRY(x.p_uint64(d.size));
+	auto z = std::min(static_cast<size_t>(UINT32_MAX), d.data.size());
+	TRY(x.p_uint32(z));
+	return x.p_bytes(d.data.data(), z);
+}
+
 #define RSP_WITHOUT_ARGS \
 	E(ping_store) \
 	E(remove_store_properties) \
@@ -3836,7 +3882,8 @@ static pack_result exmdb_push(EXT_PUSH &x, const exresp_imapfile_read &d)
 	E(store_eid_to_user) \
 	E(autoreply_tsquery) \
 	E(write_message_v2) \
-	E(imapfile_read)
+	E(imapfile_read) \
+	E(imapfile_read_range)
 
 /* exmdb_callid::connect, exmdb_callid::listen_notification not included */
 /*
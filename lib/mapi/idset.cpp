@@ -113,6 +113,15 @@ bool idset::contains(uint64_t eid) const
 	return prepl_node->range_list.contains(value);
 }
 
+const repl_node::range_list_t *idset::get_ranges(uint16_t replid) const
+{
+	if (repl_type == idset::type::guid_packed)
+		return nullptr;
+	auto prepl_node = std::find_if(repl_list.begin(), repl_list.end(),
+	                  [&](const repl_node &n) { return n.replid == replid; });
+	return prepl_node != repl_list.end() ? &prepl_node->range_list : nullptr;
+}
+
 static std::unique_ptr<BINARY, mdel> idset_init_binary()
 {
 	std::unique_ptr<BINARY, mdel> pbin(gromox::me_alloc<BINARY>());
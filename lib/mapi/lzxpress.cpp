@@ -32,151 +32,207 @@
  * SUCH DAMAGE.
  *
  */
+#include <algorithm>
 #include <cstdint>
 #include <cstring>
+#include <memory>
+#include <new>
 #include <libHX/endian.h>
 #include <gromox/common_types.hpp>
 #include <gromox/defs.h>
 #include <gromox/lzxpress.hpp>
-#define WINDOWS_SIZE				0x20
 
-#define CLASSIC_MATCH_LENGTH		9	/* 3 + 6 */
+/*
+ * MS-XCA plain LZ77: match offsets are 13 bits (distance 1..8192), lengths
+ * are 3 + 3 bits, then a shared nibble, then a byte, then a 16-bit field.
+ */
+#define WINDOW_SIZE 0x2000
+#define MIN_MATCH_LENGTH 3
+#define MAX_MATCH_LENGTH (0xFFFF + MIN_MATCH_LENGTH)
+#define HASH_BITS 13
+
+namespace {
 
-#define MIDDLE_MATCH_LENGTH			24 /* 3 + 7 + 14 */
+struct lzx_level {
+	/* chain entries to inspect, and the length at which to stop looking */
+	unsigned int chain, nice;
+};
 
-#define MAX_MATCH_LENGTH			279  /* 254 + 15 + 7 + 3 */
+/**
+ * Bit-level output state. A 32-bit indicator word precedes every 32
+ * symbols; bits are consumed MSB first, 1 meaning "match".
+ */
+struct lzx_writer {
+	lzx_writer(uint8_t *o, uint32_t c) : out(o), cap(c) {}
+	/* Whether a symbol of @n bytes (and a new indicator word) still fits */
+	bool fits(uint32_t n) const { return cap - pos >= n + (indic_bit == 31 ? sizeof(uint32_t) : 0); }
+	uint32_t match_size(uint32_t length) const;
+	void flag(bool);
+	void literal(uint8_t c) { out[pos++] = c; flag(false); }
+	void match(uint32_t distance, uint32_t length);
+	uint32_t finish();
 
-#define MIN(a,b)					((a)<(b)?(a):(b))
+	uint8_t *out;
+	uint32_t cap, pos = sizeof(uint32_t), indic_pos = 0, indic = 0;
+	uint32_t indic_bit = 0, nibble_pos = 0;
+};
 
-uint32_t lzxpress_compress(const void *uncompressedv,
-    uint32_t uncompressed_size, void *compressedv)
+}
+
+static constexpr lzx_level lzx_levels[] = {
+	{0, 0}, {1, 16}, {2, 24}, {4, 32}, {8, 48}, {16, 64}, {32, 128},
+	{64, 258}, {128, 1024}, {256, MAX_MATCH_LENGTH},
+};
+
+void lzx_writer::flag(bool is_match)
 {
-	auto uncompressed = static_cast<const uint8_t *>(uncompressedv);
-	auto compressed   = static_cast<uint8_t *>(compressedv);
-	
-	if (uncompressed_size == 0)
-		return 0;
-	
-	uint32_t indic = 0, indic_bit = 0, length = 0;
-	uint32_t coding_pos = 0, compressed_pos = sizeof(uint32_t);
-	uint32_t byte_left = uncompressed_size, nibble_index = 0;
-	auto ptr_indic = compressed;
-	indic = cpu_to_le32(0);
-	memcpy(ptr_indic, &indic, sizeof(indic));
+	if (is_match)
+		indic |= 1U << (31 - indic_bit);
+	if (++indic_bit < 32)
+		return;
+	cpu_to_le32p(&out[indic_pos], indic);
 	indic = 0;
-	
-	do {
-		bool b_found = false;
-		uint32_t match_offset = 0;
-		uint32_t offset = coding_pos - MIN(WINDOWS_SIZE, coding_pos);
-		if (offset == 0)
-			offset ++;
-		while (offset < coding_pos) {
-			for (length = 0;
-				uncompressed[coding_pos + length]
-				== uncompressed[offset + length] &&
-				offset + length < coding_pos &&
-				length < MAX_MATCH_LENGTH &&
-				length < uncompressed_size - coding_pos - 1;
-				length ++);
-			if (length < 3) {
-				offset ++;
-				continue;
-			}
-			b_found = true;
-			match_offset = coding_pos - offset;
-			break;
+	indic_bit = 0;
+	indic_pos = pos;
+	pos += sizeof(uint32_t);
+}
+
+uint32_t lzx_writer::match_size(uint32_t length) const
+{
+	uint32_t rem = length - MIN_MATCH_LENGTH, n = sizeof(uint16_t);
+	if (rem < 7)
+		return n;
+	if (nibble_pos == 0)
+		++n;
+	rem -= 7;
+	if (rem < 15)
+		return n;
+	return n + (rem - 15 < 255 ? 1 : 1 + sizeof(uint16_t));
+}
+
+void lzx_writer::match(uint32_t distance, uint32_t length)
+{
+	uint32_t rem = length - MIN_MATCH_LENGTH;
+	cpu_to_le16p(&out[pos], ((distance - 1) << 3) | std::min(rem, 7U));
+	pos += sizeof(uint16_t);
+	if (rem >= 7) {
+		rem -= 7;
+		uint8_t nib = std::min(rem, 15U);
+		/* two consecutive long matches share one byte for their nibbles */
+		if (nibble_pos == 0) {
+			nibble_pos = pos;
+			out[pos++] = nib;
+		} else {
+			out[nibble_pos] |= nib << 4;
+			nibble_pos = 0;
 		}
-		
-		if (b_found) {
-			uint32_t metadata_size = 0;
-			auto pdest = &compressed[compressed_pos];
-			if (length <= CLASSIC_MATCH_LENGTH) {
-				/* classical meta-data */
-				uint16_t metadata = ((match_offset - 1) << 3) | (length - 3);
-				cpu_to_le16p(&pdest[metadata_size/sizeof(uint16_t)], metadata);
-				metadata_size += sizeof(uint16_t);
+		if (rem >= 15) {
+			rem -= 15;
+			if (rem < 255) {
+				out[pos++] = rem;
 			} else {
-				uint16_t metadata = ((match_offset - 1) << 3) | 7;
-				cpu_to_le16p(&pdest[metadata_size/sizeof(uint16_t)], metadata);
-				metadata_size += sizeof(uint16_t);
-				if (length <= MIDDLE_MATCH_LENGTH) {
-					/* shared byte */
-					if (0 == nibble_index) {
-						compressed[compressed_pos + metadata_size] =
-							(length - (3 + 7)) & 0xF;
-						metadata_size += sizeof(uint8_t);
-					} else {
-						compressed[nibble_index] &= 0xF;
-						compressed[nibble_index] |= (length - (3 + 7)) * 16;
-					}
-				} else if (length <= MAX_MATCH_LENGTH) {
-					/* shared byte */
-					if (0 == nibble_index) {
-						compressed[compressed_pos + metadata_size] = 15;
-						metadata_size += sizeof(uint8_t);
-					} else {
-						compressed[nibble_index] &= 0xF;
-						compressed[nibble_index] |= (15 * 16);
-					}
-					/* additional length */
-					compressed[compressed_pos + metadata_size] =
-						length - (3 + 7 + 15);
-					metadata_size += sizeof(uint8_t);
-				} else {
-					if (0 == nibble_index) {
-						compressed[compressed_pos + metadata_size] |= 15;
-						metadata_size += sizeof(uint8_t);
-					} else {
-						compressed[nibble_index] |= 15 << 4;
+				out[pos++] = 255;
+				cpu_to_le16p(&out[pos], length - MIN_MATCH_LENGTH);
+				pos += sizeof(uint16_t);
+			}
+		}
+	}
+	flag(true);
+}
+
+uint32_t lzx_writer::finish()
+{
+	/* end marker, cf. lzxpress_decompress */
+	indic |= 1U << (31 - indic_bit);
+	cpu_to_le32p(&out[indic_pos], indic);
+	return pos;
+}
+
+static inline uint32_t lzx_hash(const uint8_t *p)
+{
+	uint32_t v = p[0] | (p[1] << 8) | (p[2] << 16);
+	return (v * 2654435761U) >> (32 - HASH_BITS);
+}
+
+/**
+ * Greedy LZ77 over the full 8 KiB window, with candidates found through
+ * hash chains on 3-byte prefixes. @effort (0..LZXPRESS_EFFORT_MAX) bounds
+ * the chain walk; 0 emits literals only.
+ *
+ * Returns 0 if the result does not fit into @max_compressed_size bytes;
+ * @uncompressed_size + 4 * (@uncompressed_size / 32 + 2) always suffices.
+ */
+uint32_t lzxpress_compress(const void *uncompressedv,
+    uint32_t uncompressed_size, void *compressedv,
+    uint32_t max_compressed_size, unsigned int effort)
+{
+	auto in = static_cast<const uint8_t *>(uncompressedv);
+	lzx_writer w(static_cast<uint8_t *>(compressedv), max_compressed_size);
+	if (uncompressed_size == 0 || max_compressed_size < sizeof(uint32_t))
+		return 0;
+	const auto &lv = lzx_levels[std::min(effort, static_cast<unsigned int>(LZXPRESS_EFFORT_MAX))];
+	/*
+	 * head[] holds the most recent position+1 per hash (0: none), prev[]
+	 * the previous position+1 with the same hash, per window slot.
+	 */
+	std::unique_ptr<uint32_t[]> head, prev;
+	if (lv.chain > 0 && uncompressed_size > MIN_MATCH_LENGTH) {
+		head.reset(new(std::nothrow) uint32_t[1U << HASH_BITS]());
+		prev.reset(new(std::nothrow) uint32_t[WINDOW_SIZE]);
+		if (head == nullptr || prev == nullptr)
+			head.reset();
+	}
+	auto insert = [&](uint32_t p) {
+		auto h = lzx_hash(&in[p]);
+		prev[p & (WINDOW_SIZE - 1)] = head[h];
+		head[h] = p + 1;
+	};
+
+	uint32_t pos = 0;
+	while (pos < uncompressed_size) {
+		uint32_t best_len = 0, best_dist = 0;
+		if (head != nullptr && pos + MIN_MATCH_LENGTH <= uncompressed_size) {
+			uint32_t max_len = std::min(uncompressed_size - pos,
+			                   static_cast<uint32_t>(MAX_MATCH_LENGTH));
+			auto cand = head[lzx_hash(&in[pos])];
+			for (unsigned int depth = lv.chain; cand != 0 && depth > 0; --depth) {
+				uint32_t c = cand - 1;
+				if (pos - c > WINDOW_SIZE)
+					break;
+				if (in[c+best_len] == in[pos+best_len]) {
+					uint32_t len = 0;
+					while (len < max_len && in[c+len] == in[pos+len])
+						++len;
+					if (len > best_len) {
+						best_len  = len;
+						best_dist = pos - c;
+						if (len >= lv.nice || len == max_len)
+							break;
 					}
-					compressed[compressed_pos + metadata_size] = 255;
-					metadata_size += sizeof(uint8_t);
-					compressed[compressed_pos + metadata_size] =
-						(length - 3) & 0xFF;
-					compressed[compressed_pos + metadata_size + 1] =
-						((length - 3) >> 8) & 0xFF;
-					metadata_size += sizeof(uint16_t);
 				}
+				auto next = prev[c & (WINDOW_SIZE - 1)];
+				if (next >= cand)
+					break;
+				cand = next;
 			}
-			indic |= 1U << (32 - (indic_bit % 32 + 1));
-			if (length > CLASSIC_MATCH_LENGTH) {
-				if (nibble_index == 0)
-					nibble_index = compressed_pos + sizeof(uint16_t);
-				else
-					nibble_index = 0;
-			}
-			compressed_pos += metadata_size;
-			coding_pos += length;
-			byte_left -= length;
-		} else {
-			compressed[compressed_pos++] = uncompressed[coding_pos++];
-			byte_left --;
-		}
-		indic_bit ++;
-		if ((indic_bit - 1) % 32 > (indic_bit % 32)) {
-			cpu_to_le32p(ptr_indic, indic);
-			indic = 0;
-			ptr_indic = &compressed[compressed_pos];
-			compressed_pos += sizeof(uint32_t);
+			insert(pos);
 		}
-	} while (byte_left > 3);
-	
-	do {
-		compressed[compressed_pos++] = uncompressed[coding_pos++];
-		indic_bit ++;
-		if ((indic_bit - 1) % 32 > (indic_bit % 32)) {
-			cpu_to_le32p(ptr_indic, indic);
-			indic = 0;
-			ptr_indic = &compressed[compressed_pos];
-			compressed_pos += sizeof(uint32_t);
+		if (best_len < MIN_MATCH_LENGTH) {
+			if (!w.fits(1))
+				return 0;
+			w.literal(in[pos++]);
+			continue;
 		}
-	} while (coding_pos < uncompressed_size);
-	
-	indic |= 1U << (32 - (indic_bit % 32 + 1));
-	indic = cpu_to_le32(indic);
-	memcpy(ptr_indic, &indic, sizeof(indic));
-	return compressed_pos;
+		if (!w.fits(w.match_size(best_len)))
+			return 0;
+		w.match(best_dist, best_len);
+		auto end = pos + best_len;
+		auto ins_end = std::min(end, uncompressed_size - (MIN_MATCH_LENGTH - 1));
+		for (++pos; pos < ins_end; ++pos)
+			insert(pos);
+		pos = end;
+	}
+	return w.finish();
 }
 
 uint32_t lzxpress_decompress(const void *inputv, uint32_t input_size,
@@ -1,4 +1,5 @@
 // SPDX-License-Identifier: GPL-2.0-only WITH linking exception
+#include <algorithm>
 #include <atomic>
 #include <chrono>
 #include <condition_variable>
@@ -8,6 +9,7 @@
 #include <memory>
 #include <mutex>
 #include <unistd.h>
+#include <vector>
 #include <gromox/atomic.hpp>
 #include <gromox/common_types.hpp>
 #include <gromox/contexts_pool.hpp>
@@ -26,6 +28,9 @@ struct THR_DATA {
 	DOUBLE_LIST_NODE node;
 	BOOL notify_stop;
 	pthread_t id;
+	unsigned int home = 0; /* run queue drained by this thread first */
+	bool woken = false;
+	std::condition_variable waken_cond;
 };
 }
 
@@ -36,7 +41,10 @@ static std::atomic<unsigned int> g_threads_pool_cur_thr_num;
 static DOUBLE_LIST g_threads_data_list;
 static THREADS_EVENT_PROC g_threads_event_proc;
 static std::mutex g_threads_pool_data_lock, g_threads_pool_cond_mutex;
-static std::condition_variable g_threads_pool_waken_cond;
+/* Parked threads, by home run queue; protected by g_threads_pool_cond_mutex */
+static std::vector<std::vector<THR_DATA *>> g_idle_threads;
+static unsigned int g_idle_num;
+static std::atomic<unsigned int> g_next_home;
 
 static void *tpol_thrwork(void *);
 static void *tpol_scanwork(void *);
@@ -69,6 +77,10 @@ int threads_pool_run(const char *hint) try
 	int created_thr_num;
 	
 	/* list is protected by g_threads_pool_data_lock */
+	g_idle_threads.clear();
+	g_idle_threads.resize(std::max(contexts_pool_get_param(RUN_QUEUE_NUM), 1));
+	g_idle_num = 0;
+	g_next_home = 0;
 	g_notify_stop = false;
 	auto ret = pthread_create4(&g_scan_id, nullptr, tpol_scanwork, nullptr);
 	if (ret != 0) {
@@ -83,6 +95,7 @@ int threads_pool_run(const char *hint) try
 		pdata->node.pdata = pdata;
 		pdata->id = (pthread_t)-1;
 		pdata->notify_stop = FALSE;
+		pdata->home = g_next_home++ % g_idle_threads.size();
 		ret = pthread_create4(&pdata->id, nullptr, tpol_thrwork, pdata);
 		if (ret != 0) {
 			mlog(LV_ERR, "threads_pool: failed to create a pool thread: %s", strerror(ret));
@@ -124,9 +137,10 @@ void threads_pool_stop()
 		pthr = (THR_DATA*)pnode->pdata;
 		thr_id = pthr->id;
 		/* notify this thread to exit */
+		std::unique_lock tpc_hold(g_threads_pool_cond_mutex);
 		pthr->notify_stop = TRUE;
-		/* wake up all thread waiting on the event */
-		g_threads_pool_waken_cond.notify_all();
+		pthr->waken_cond.notify_one();
+		tpc_hold.unlock();
 		pthread_kill(thr_id, SIGALRM); /* may be in nanosleep */
 		pthread_join(thr_id, NULL);
 		if (b_should_exit)
@@ -136,6 +150,8 @@ void threads_pool_stop()
 	g_threads_pool_max_num = 0;
 	g_threads_pool_cur_thr_num = 0;
 	g_threads_event_proc = NULL;
+	g_idle_threads.clear();
+	g_idle_num = 0;
 }
 
 int threads_pool_get_param(int type)
@@ -152,6 +168,44 @@ int threads_pool_get_param(int type)
 	}
 }
 
+/* Caller holds g_threads_pool_cond_mutex */
+static void tpol_unpark(THR_DATA *pdata)
+{
+	auto &stk = g_idle_threads[pdata->home];
+	auto it = std::find(stk.begin(), stk.end(), pdata);
+	if (it == stk.end())
+		return;
+	stk.erase(it);
+	--g_idle_num;
+}
+
+/**
+ * Park the thread until a context is queued for it. The thread is listed as
+ * idle before the run queues are looked at once more, so that a context
+ * queued in between is either picked up here or followed by a wakeup.
+ */
+static schedule_context *tpol_park(THR_DATA *pdata)
+{
+	std::unique_lock tpc_hold(g_threads_pool_cond_mutex);
+	pdata->woken = false;
+	g_idle_threads[pdata->home].push_back(pdata);
+	++g_idle_num;
+	tpc_hold.unlock();
+	auto pcontext = contexts_pool_get_turning(pdata->home);
+	tpc_hold.lock();
+	if (pcontext == nullptr)
+		pdata->waken_cond.wait_for(tpc_hold, std::chrono::seconds(1),
+			[&]() { return pdata->woken || pdata->notify_stop; });
+	if (!pdata->woken) {
+		tpol_unpark(pdata);
+	} else if (pcontext != nullptr) {
+		/* Woken for a context while having found another; pass it on. */
+		tpc_hold.unlock();
+		threads_pool_wakeup_queue(pdata->home);
+	}
+	return pcontext;
+}
+
 static void *tpol_thrwork(void *pparam)
 {
 	THR_DATA *pdata;
@@ -167,7 +221,7 @@ static void *tpol_thrwork(void *pparam)
 	
 	cannot_served_times = 0;
 	while (!pdata->notify_stop) {
-		auto pcontext = contexts_pool_get_context(sctx_status::turning);
+		auto pcontext = contexts_pool_get_turning(pdata->home);
 		if (NULL == pcontext) {
 			if (MAX_TIMES_NOT_SERVED == cannot_served_times) {
 				std::unique_lock tpd_hold(g_threads_pool_data_lock);
@@ -193,9 +247,9 @@ static void *tpol_thrwork(void *pparam)
 				cannot_served_times ++;
 			}
 			/* wait context */
-			std::unique_lock tpc_hold(g_threads_pool_cond_mutex);
-			g_threads_pool_waken_cond.wait_for(tpc_hold, std::chrono::seconds(1));
-			continue;
+			pcontext = tpol_park(pdata);
+			if (pcontext == nullptr)
+				continue;
 		}
 		cannot_served_times = 0;
 		switch (threads_pool_process_func(pcontext)) {
@@ -234,18 +288,52 @@ static void *tpol_thrwork(void *pparam)
 	return NULL;
 }
 
-void threads_pool_wakeup_thread()
+/**
+ * A context was queued on @run_queue. Rouse one parked thread, preferably
+ * the one whose home queue that is; any other would steal the context.
+ * Nothing happens if all threads are busy, as they look at the queues
+ * again before they park.
+ */
+void threads_pool_wakeup_queue(unsigned int run_queue)
 {
 	if (g_notify_stop)
 		return;
-	g_threads_pool_waken_cond.notify_one();
+	std::lock_guard tpc_hold(g_threads_pool_cond_mutex);
+	if (g_idle_num == 0)
+		return;
+	auto nq = g_idle_threads.size();
+	for (size_t i = 0; i < nq; ++i) {
+		auto &stk = g_idle_threads[(run_queue + i) % nq];
+		if (stk.empty())
+			continue;
+		/* most recently parked, i.e. the cache-warmest */
+		auto pdata = stk.back();
+		stk.pop_back();
+		--g_idle_num;
+		pdata->woken = true;
+		pdata->waken_cond.notify_one();
+		return;
+	}
+}
+
+void threads_pool_wakeup_thread()
+{
+	threads_pool_wakeup_queue(0);
 }
 
 void threads_pool_wakeup_all_threads()
 {
 	if (g_notify_stop)
 		return;
-	g_threads_pool_waken_cond.notify_all();
+	std::lock_guard tpc_hold(g_threads_pool_cond_mutex);
+	for (auto &stk : g_idle_threads) {
+		for (auto pdata : stk) {
+			pdata->woken = true;
+			pdata->waken_cond.notify_one();
+		}
+		stk.clear();
+	}
+	g_idle_num = 0;
 }
 
 /**
@@ -275,6 +363,7 @@ static void *tpol_scanwork(void *pparam)
 		pdata->node.pdata = pdata;
 		pdata->id = (pthread_t)-1;
 		pdata->notify_stop = FALSE;
+		pdata->home = g_next_home++ % g_idle_threads.size();
 		auto ret = pthread_create4(&pdata->id, nullptr, tpol_thrwork, pdata);
 		if (ret != 0) {
 			mlog(LV_WARN, "W-1445: failed to increase pool threads: %s", strerror(ret));
@@ -9,6 +9,10 @@
  *  mail into file. after mail is saved, system will send a message to
  *  message queue to indicate there's a new mail arrived!
  */
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+#include <atomic>
 #include <cerrno>
 #include <csignal>
 #include <cstdio>
@@ -17,7 +21,9 @@
 #include <fcntl.h>
 #include <memory>
 #include <mutex>
+#include <poll.h>
 #include <pthread.h>
+#include <set>
 #include <string>
 #include <unistd.h>
 #include <unordered_map>
@@ -30,6 +36,9 @@
 #include <sys/msg.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#ifdef HAVE_SYS_INOTIFY_H
+#	include <sys/inotify.h>
+#endif
 #include <gromox/atomic.hpp>
 #include <gromox/fileio.h>
 #include <gromox/process.hpp>
@@ -37,7 +46,6 @@
 #include "delivery.hpp"
 #define TOKEN_MESSAGE_QUEUE		1
 #define BLOCK_SIZE				64*1024*2
-#define SLEEP_INTERVAL			50000
 
 using namespace std::string_literals;
 using namespace gromox;
@@ -49,6 +57,11 @@ struct MSG_BUFF {
 	int msg_content;
 };
 
+/* Sent by message_dequeue itself to interrupt a blocking msgrcv */
+enum {
+	MESSAGE_WAKE = 3,
+};
+
 }
 
 static std::string g_path, g_path_mess, g_path_save;
@@ -63,6 +76,15 @@ static std::mutex g_hash_mutex, g_used_mutex, g_free_mutex, g_mess_mutex;
 static pthread_t		g_thread_id;
 static gromox::atomic_bool g_notify_stop;
 static int				g_dequeued_num;
+/*
+ * Queue IDs that have been announced but not loaded yet, mostly for want of
+ * memory. Only touched by mdq_thrwork.
+ */
+static std::set<int> g_pending;
+static std::atomic<size_t> g_pending_num;
+static bool g_rescan;
+static int g_inotify_fd = -1;
+static int g_wake_pipe[2] = {-1, -1};
 
 static BOOL message_dequeue_check();
 static MESSAGE *message_dequeue_get_from_free(int message_option, size_t size);
@@ -70,7 +92,7 @@ static MESSAGE *message_dequeue_get_from_free(int message_option, size_t size);
 static void message_dequeue_put_to_free(MESSAGE *pmessage);
 
 static void message_dequeue_put_to_used(MESSAGE *pmessage);
-static void message_dequeue_load_from_mess(int mess);
+static errno_t message_dequeue_load_from_mess(int mess);
 static void message_dequeue_collect_resource();
 static void *mdq_thrwork(void *);
 
@@ -137,6 +159,69 @@ static void message_dequeue_collect_resource()
 {
 	g_message_ptr.reset();
 	g_mess_hash.clear();
+	g_pending.clear();
+	g_pending_num = 0;
+	for (auto &fd : g_wake_pipe) {
+		if (fd >= 0)
+			close(fd);
+		fd = -1;
+	}
+	if (g_inotify_fd >= 0) {
+		close(g_inotify_fd);
+		g_inotify_fd = -1;
+	}
+}
+
+/* Get mdq_thrwork out of its wait */
+static void message_dequeue_wakeup()
+{
+	if (g_wake_pipe[1] >= 0) {
+		char c = 0;
+		if (write(g_wake_pipe[1], &c, 1) < 0)
+			/* pipe full: a wakeup is pending anyway */;
+		return;
+	}
+	if (g_msg_id < 0)
+		return;
+	MSG_BUFF msg;
+	msg.msg_type = MESSAGE_WAKE;
+	msg.msg_content = 0;
+	msgsnd(g_msg_id, &msg, sizeof(uint32_t), IPC_NOWAIT);
+}
+
+/*
+ * With inotify, new files in mess/ are seen directly. The SysV message queue
+ * that smtp also signals on is then merely drained; otherwise, it is what
+ * mdq_thrwork blocks on.
+ */
+static int message_dequeue_setup_notify()
+{
+#ifdef HAVE_SYS_INOTIFY_H
+	g_inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (g_inotify_fd < 0) {
+		mlog(LV_WARN, "mdq: inotify_init: %s", strerror(errno));
+		return 0;
+	}
+	if (inotify_add_watch(g_inotify_fd, g_path_mess.c_str(),
+	    IN_ONLYDIR | IN_CLOSE_WRITE | IN_MOVED_TO) < 0) {
+		mlog(LV_WARN, "mdq: inotify_add_watch %s: %s",
+		        g_path_mess.c_str(), strerror(errno));
+		close(g_inotify_fd);
+		g_inotify_fd = -1;
+		return 0;
+	}
+	if (pipe(g_wake_pipe) != 0) {
+		mlog(LV_ERR, "mdq: pipe: %s", strerror(errno));
+		return -1;
+	}
+	for (auto fd : g_wake_pipe)
+		if (fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK) != 0 ||
+		    fcntl(fd, F_SETFD, FD_CLOEXEC) != 0) {
+			mlog(LV_ERR, "mdq: fcntl: %s", strerror(errno));
+			return -1;
+		}
+#endif
+	return 0;
 }
 
 int message_dequeue_run()
@@ -164,6 +249,10 @@ int message_dequeue_run()
 		mlog(LV_ERR, "mdq: msgget: %s", strerror(errno));
 		return -6;
 	}
+	if (message_dequeue_setup_notify() != 0) {
+		message_dequeue_collect_resource();
+		return -7;
+	}
 	g_message_units = g_max_memory/(BLOCK_SIZE/2);
 	g_message_ptr = std::make_unique<MESSAGE[]>(g_message_units);
 	g_free_list.reserve(g_message_units);
@@ -214,6 +303,9 @@ void message_dequeue_put(MESSAGE *pmessage) try
 	h.unlock();
 	message_dequeue_put_to_free(pmessage);
 	g_dequeued_num ++;
+	if (g_pending_num > 0)
+		/* memory for the next one has become available */
+		message_dequeue_wakeup();
 } catch (const std::bad_alloc &) {
 	mlog(LV_ERR, "mdq: MDQ-254");
 }
@@ -223,6 +315,7 @@ void message_dequeue_stop()
 	g_notify_stop = true;
 	if (!pthread_equal(g_thread_id, {})) {
 		pthread_kill(g_thread_id, SIGALRM);
+		message_dequeue_wakeup();
 		pthread_join(g_thread_id, NULL);
 	}
 	message_dequeue_collect_resource();
@@ -323,8 +416,11 @@ static void message_dequeue_put_to_used(MESSAGE *pmessage)
  *	get message from used list
  *	@param
  *		mess			mess ID
+ *	@return
+ *		0 if the ID is dealt with (loaded, already loaded, or not loadable),
+ *		or ENOMEM if it should be retried once memory has been released
  */
-static void message_dequeue_load_from_mess(int mess) try
+static errno_t message_dequeue_load_from_mess(int mess) try
 {
 	struct stat node_stat;
 
@@ -332,16 +428,22 @@ static void message_dequeue_load_from_mess(int mess) try
 	auto msg_iter = g_mess_hash.find(mess);
 	h.unlock();
 	if (msg_iter != g_mess_hash.end())
-		return;
+		return 0;
 	auto name = g_path_mess + "/"s + std::to_string(mess);
 	wrapfd fd = open(name.c_str(), O_RDONLY);
 	if (fd.get() < 0 || fstat(fd.get(), &node_stat) != 0 ||
-	    !S_ISREG(node_stat.st_mode))
-		return;
+	    !S_ISREG(node_stat.st_mode) || node_stat.st_size == 0)
+		return 0;
 	uint64_t size = ((node_stat.st_size - 1) / (64 * 1024) + 1) * 64 * 1024;
+	if (size > g_max_memory) {
+		mlog(LV_ERR, "E-1818: mess/%d (%llu bytes) is larger than "
+		        "delivery.cfg:dequeue_maximum_mem and will not be loaded",
+		        mess, static_cast<unsigned long long>(node_stat.st_size));
+		return 0;
+	}
 	auto pmessage = message_dequeue_get_from_free(MESSAGE_MESS, size);
 	if (NULL == pmessage) {
-		return;
+		return ENOMEM;
 	}
 	pmessage->message_data = mess;
 	std::unique_ptr<char[]> ptr;
@@ -349,18 +451,18 @@ static void message_dequeue_load_from_mess(int mess) try
 		ptr = std::make_unique<char[]>(size + 1);
 	} catch (const std::bad_alloc &) {
 		message_dequeue_put_to_free(pmessage);
-	        return;
+		return ENOMEM;
 	}
 	auto rdret = read(fd.get(), ptr.get(), node_stat.st_size);
 	if (rdret < 0 || rdret != node_stat.st_size) {
 		message_dequeue_put_to_free(pmessage);
-        return;
+		return 0;
 	}
 	ptr[rdret] = '\0';
 	/* check if it is an incomplete message */
 	if (le64p_to_cpu(ptr.get()) == 0) {
 		message_dequeue_put_to_free(pmessage);
-		return;	
+		return 0;
 	}
 	message_dequeue_retrieve_to_message(pmessage, std::move(ptr));
 	message_dequeue_put_to_used(pmessage);
@@ -371,65 +473,180 @@ static void message_dequeue_load_from_mess(int mess) try
 		        2 * g_message_units);
 	else
 		g_mess_hash.emplace(mess, pmessage);
+	return 0;
 } catch (const std::bad_alloc &) {
 	mlog(LV_ERR, "E-1940: ENOMEM");
-	return;
+	return ENOMEM;
 }
 
-static void *mdq_thrwork(void *arg)
+/*
+ * Load announced messages in queue order. Those which do not fit into the
+ * remaining memory stay pending (message_dequeue_put will wake us), but do
+ * not hold up smaller ones behind them.
+ */
+static void message_dequeue_load_pending()
 {
-	MSG_BUFF msg;
-    DIR *dirp;
-    struct dirent *direntp;
+	/*
+	 * Published before trying, so that a message_dequeue_put racing with
+	 * a failed load sees it and leaves a wakeup for the next wait.
+	 */
+	g_pending_num = g_pending.size();
+	auto it = g_pending.begin();
+	while (it != g_pending.end() && !g_notify_stop) {
+		if (message_dequeue_load_from_mess(*it) == ENOMEM)
+			++it;
+		else
+			it = g_pending.erase(it);
+	}
+	g_pending_num = g_pending.size();
+}
 
-	while ((dirp = opendir(g_path_mess.c_str())) == nullptr) {
-		mlog(LV_ERR, "mdq: failed to open directory %s: %s",
-		       g_path_mess.c_str(), strerror(errno));
-        sleep(1);
-    }
+static void message_dequeue_add_pending(int mess) try
+{
+	g_pending.insert(mess);
+	g_pending_num = g_pending.size();
+} catch (const std::bad_alloc &) {
+	/* find it later */
+	g_rescan = true;
+}
 
-	while (!g_notify_stop) {
-		if (msgrcv(g_msg_id, &msg, sizeof(uint32_t), 0, IPC_NOWAIT) != -1) {
-			switch(msg.msg_type) {
-			case MESSAGE_MESS:
-				message_dequeue_load_from_mess(msg.msg_content);
-				break;
-			default:
-				mlog(LV_ERR, "mdq: unknown message queue type %ld, "
-					"should be MESSAGE_MESS", msg.msg_type);
-			}
+/**
+ * Pick up all complete messages in mess/. This is only needed at startup
+ * and when notifications may have been lost.
+ */
+static void message_dequeue_rescan(DIR *dirp)
+{
+	struct dirent *direntp;
+
+	rewinddir(dirp);
+	while ((direntp = readdir(dirp)) != nullptr) {
+		if (strcmp(direntp->d_name, ".") == 0 ||
+		    strcmp(direntp->d_name, "..") == 0)
+			continue;
+		std::string file_name;
+		try {
+			file_name = g_path_mess + "/" + direntp->d_name;
+		} catch (const std::bad_alloc &) {
+			g_rescan = true;
 			continue;
 		}
-		usleep(SLEEP_INTERVAL);
-		if (g_free_list.size() != g_message_units)
+		wrapfd mess_fd = open(file_name.c_str(), O_RDONLY);
+		if (mess_fd.get() < 0)
 			continue;
-		/* clean up mess */
-		seekdir(dirp, 0);
-		while ((direntp = readdir(dirp)) != NULL) {
-        	if (0 == strcmp(direntp->d_name, ".") ||
-				0 == strcmp(direntp->d_name, "..")) {
-				continue;
-			}
-			if (g_current_mem == g_max_memory) {
-				break;
-			}
-			std::string file_name;
-			try {
-				file_name = g_path_mess + "/" + direntp->d_name;
-			} catch (const std::bad_alloc &) {
-				continue;
-			}
-			auto mess_fd = open(file_name.c_str(), O_RDONLY);
-			if (-1 == mess_fd) {
+		uint64_t size;
+		ssize_t len = read(mess_fd.get(), &size, sizeof(size));
+		if (len < 0 || len != sizeof(size) || size == 0)
+			continue;
+		message_dequeue_add_pending(strtol(direntp->d_name, nullptr, 0));
+	}
+}
+
+/* Collect queue IDs from the message queue; @block for the first one. */
+static void message_dequeue_drain_msgq(bool block)
+{
+	struct msqid_ds ds;
+	MSG_BUFF msg;
+
+	/*
+	 * smtp sends without waiting; if the queue is full, announcements
+	 * get lost and only a rescan would find those messages.
+	 */
+	if (msgctl(g_msg_id, IPC_STAT, &ds) == 0 &&
+	    ds.msg_qnum >= ds.msg_qbytes / sizeof(uint32_t))
+		g_rescan = true;
+	while (!g_notify_stop) {
+		if (msgrcv(g_msg_id, &msg, sizeof(uint32_t), 0,
+		    block ? 0 : IPC_NOWAIT) < 0)
+			break;
+		block = false;
+		switch (msg.msg_type) {
+		case MESSAGE_MESS:
+			message_dequeue_add_pending(msg.msg_content);
+			break;
+		case MESSAGE_WAKE:
+			break;
+		default:
+			mlog(LV_ERR, "mdq: unknown message queue type %ld, "
+				"should be MESSAGE_MESS", msg.msg_type);
+		}
+	}
+}
+
+#ifdef HAVE_SYS_INOTIFY_H
+static void message_dequeue_read_inotify()
+{
+	alignas(struct inotify_event) char buf[4096];
+	ssize_t len;
+
+	while ((len = read(g_inotify_fd, buf, sizeof(buf))) > 0) {
+		for (ssize_t pos = 0; pos < len; ) {
+			auto ev = reinterpret_cast<const struct inotify_event *>(&buf[pos]);
+			pos += sizeof(*ev) + ev->len;
+			if (ev->mask & IN_Q_OVERFLOW) {
+				g_rescan = true;
 				continue;
 			}
-			uint64_t size;
-			ssize_t len = read(mess_fd, &size, sizeof(size));
-			close(mess_fd);
-			if (len < 0 || len != sizeof(size) || size == 0)
+			if (ev->len == 0)
 				continue;
-			message_dequeue_load_from_mess(strtol(direntp->d_name, nullptr, 0));
+			char *end = nullptr;
+			auto mess = strtol(ev->name, &end, 10);
+			if (end != ev->name && *end == '\0' && mess > 0)
+				message_dequeue_add_pending(mess);
+		}
+	}
+}
+#endif
+
+/**
+ * Wait until there is something to do: a new message was announced, or
+ * memory for a pending one became available.
+ */
+static void message_dequeue_wait()
+{
+#ifdef HAVE_SYS_INOTIFY_H
+	if (g_inotify_fd >= 0) {
+		struct pollfd pfd[2]{};
+		pfd[0].fd = g_inotify_fd;
+		pfd[0].events = POLLIN;
+		pfd[1].fd = g_wake_pipe[0];
+		pfd[1].events = POLLIN;
+		if (poll(pfd, std::size(pfd), -1) <= 0)
+			return;
+		if (pfd[1].revents & POLLIN) {
+			char buf[64];
+			while (read(g_wake_pipe[0], buf, sizeof(buf)) > 0)
+				/* drain */;
+		}
+		if (pfd[0].revents & POLLIN)
+			message_dequeue_read_inotify();
+		message_dequeue_drain_msgq(false);
+		return;
+	}
+#endif
+	message_dequeue_drain_msgq(true);
+}
+
+static void *mdq_thrwork(void *arg)
+{
+	DIR *dirp;
+
+	while ((dirp = opendir(g_path_mess.c_str())) == nullptr) {
+		mlog(LV_ERR, "mdq: failed to open directory %s: %s",
+		       g_path_mess.c_str(), strerror(errno));
+		if (g_notify_stop)
+			return nullptr;
+		sleep(1);
+	}
+
+	/* Whatever was queued while we were not running */
+	g_rescan = true;
+	while (!g_notify_stop) {
+		if (g_rescan) {
+			g_rescan = false;
+			message_dequeue_rescan(dirp);
 		}
+		message_dequeue_load_pending();
+		message_dequeue_wait();
 	}
 	closedir(dirp);
 	return NULL;
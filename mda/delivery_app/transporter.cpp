@@ -2,6 +2,7 @@
 // SPDX-FileCopyrightText: 2021–2025 grommunio GmbH
 // This file is part of Gromox.
 #include <algorithm>
+#include <chrono>
 #include <condition_variable>
 #include <csignal>
 #include <cstdarg>
@@ -359,7 +360,9 @@ static void *dxp_thrwork(void *arg)
 			if (NULL == pcontext) {
 				cannot_served_times ++;
 				if (cannot_served_times < MAX_TIMES_NOT_SERVED) {
-					sleep(1);
+					/* message_dequeue signals when it has loaded a message */
+					std::unique_lock cm_hold(g_cond_mutex);
+					g_waken_cond.wait_for(cm_hold, std::chrono::seconds(1));
 				/* decrease threads pool */
 				} else {
 					std::unique_lock tl_hold(g_threads_list_mutex);
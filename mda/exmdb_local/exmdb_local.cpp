@@ -1,6 +1,7 @@
 // SPDX-License-Identifier: GPL-2.0-only WITH linking exception
 // SPDX-FileCopyrightText: 2021–2025 grommunio GmbH
 // This file is part of Gromox.
+#include <algorithm>
 #include <atomic>
 #include <cerrno>
 #include <climits>
@@ -9,16 +10,24 @@
 #include <cstdio>
 #include <cstring>
 #include <ctime>
+#include <deque>
 #include <fcntl.h>
+#include <future>
+#include <map>
 #include <memory>
+#include <mutex>
 #include <string>
+#include <system_error>
 #include <unistd.h>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 #include <libHX/string.h>
 #include <sys/stat.h>
 #include <gromox/bounce_gen.hpp>
 #include <gromox/config_file.hpp>
 #include <gromox/defs.h>
+#include <gromox/element_data.hpp>
 #include <gromox/exmdb_client.hpp>
 #include <gromox/exmdb_rpc.hpp>
 #include <gromox/fileio.h>
@@ -33,6 +42,8 @@
 #include <gromox/util.hpp>
 #include "exmdb_local.hpp"
 #define MAX_DIGLEN				256*1024
+/* Home server groups delivered to concurrently, per message */
+#define MAX_DELIVER_GROUPS		4
 
 using namespace gromox;
 DECLARE_HOOK_API(exmdb_local, );
@@ -45,6 +56,26 @@ static thread_local const char *g_storedir;
 static char g_default_charset[32];
 static std::atomic<int> g_sequence_id;
 
+/*
+ * State shared by the recipients of one message context, so that the work
+ * which does not depend on the mailbox is done only once.
+ */
+struct deliv_cache {
+	std::mutex lock;
+	int digest_result = 0; /* 0: not yet computed */
+	Json::Value digest;
+	/* A copy of the EML already placed in some mailbox, to link(2) from */
+	std::string eml_src;
+	/*
+	 * MAPI conversions per charset+timezone. Their named properties use
+	 * the private map below (propid 0x8000+index) and get rebased onto
+	 * each store's own propids on delivery.
+	 */
+	std::map<std::string, std::unique_ptr<message_content, mc_delete>> conv;
+	std::deque<PROPERTY_XNAME> names;
+	std::unordered_map<std::string, propid_t> rev;
+};
+
 static ec_error_t (*exmdb_local_rules_execute)(const char *, const char *, const char *, eid_t, eid_t, unsigned int flags);
 
 static int exmdb_local_sequence_ID()
@@ -77,16 +108,142 @@ int exmdb_local_run() try
 	return -3;
 }
 
-hook_result exmdb_local_hook(MESSAGE_CONTEXT *pcontext) try
+static void exmdb_local_dispose(MESSAGE_CONTEXT *pcontext,
+    const char *rcpt_buff, delivery_status status, bool &had_error)
 {
 	int cache_ID;
 	MESSAGE_CONTEXT *pbounce_context;
+
+	switch (status) {
+	case delivery_status::ok:
+		break;
+	case delivery_status::bounce_sent:
+		if (!pcontext->ctrl.need_bounce ||
+		    strcasecmp(pcontext->ctrl.from, ENVELOPE_FROM_NULL) == 0)
+			break;
+		pbounce_context = get_context();
+		if (NULL == pbounce_context) {
+			exmdb_local_log_info(pcontext->ctrl, rcpt_buff, LV_ERR,
+				"fail to get bounce context");
+			break;
+		}
+		if (!bounce_audit_check(rcpt_buff) ||
+		    !exml_bouncer_make(pcontext->ctrl.from,
+		    rcpt_buff, &pcontext->mail, time(nullptr),
+		    "BOUNCE_MAIL_DELIVERED", &pbounce_context->mail)) {
+			exmdb_local_log_info(pcontext->ctrl, rcpt_buff, LV_ERR,
+				"delivery_status::bounce_sent %s", rcpt_buff);
+			put_context(pbounce_context);
+			break;
+		}
+		pbounce_context->ctrl.need_bounce = FALSE;
+		gx_strlcpy(pbounce_context->ctrl.from, bounce_gen_postmaster(),
+			std::size(pbounce_context->ctrl.from));
+		pbounce_context->ctrl.rcpt.emplace_back(pcontext->ctrl.from);
+		enqueue_context(pbounce_context);
+		break;
+	case delivery_status::no_user:
+		if (!pcontext->ctrl.need_bounce ||
+		    strcasecmp(pcontext->ctrl.from, ENVELOPE_FROM_NULL) == 0)
+			break;
+		pbounce_context = get_context();
+		if (NULL == pbounce_context) {
+			exmdb_local_log_info(pcontext->ctrl, rcpt_buff, LV_ERR,
+				"fail to get bounce context");
+			break;
+		}
+		if (!bounce_audit_check(rcpt_buff) ||
+		    !exml_bouncer_make(pcontext->ctrl.from,
+		    rcpt_buff, &pcontext->mail, time(nullptr),
+		    "BOUNCE_NO_USER", &pbounce_context->mail)) {
+			exmdb_local_log_info(pcontext->ctrl, rcpt_buff, LV_ERR,
+				"No such user %s", rcpt_buff);
+			put_context(pbounce_context);
+			break;
+		}
+		pbounce_context->ctrl.need_bounce = FALSE;
+		gx_strlcpy(pbounce_context->ctrl.from, bounce_gen_postmaster(),
+			std::size(pbounce_context->ctrl.from));
+		pbounce_context->ctrl.rcpt.emplace_back(pcontext->ctrl.from);
+		enqueue_context(pbounce_context);
+		break;
+	case delivery_status::mailbox_full:
+		if (!pcontext->ctrl.need_bounce ||
+		    strcasecmp(pcontext->ctrl.from, ENVELOPE_FROM_NULL) == 0)
+			break;
+		pbounce_context = get_context();
+		if (NULL == pbounce_context) {
+			exmdb_local_log_info(pcontext->ctrl, rcpt_buff, LV_ERR,
+				"fail to get bounce context");
+			break;
+		}
+		if (!bounce_audit_check(rcpt_buff) ||
+		    !exml_bouncer_make(pcontext->ctrl.from,
+		    rcpt_buff, &pcontext->mail, time(nullptr),
+		    "BOUNCE_MAILBOX_FULL", &pbounce_context->mail)) {
+			put_context(pbounce_context);
+			break;
+		}
+		pbounce_context->ctrl.need_bounce = FALSE;
+		gx_strlcpy(pbounce_context->ctrl.from, bounce_gen_postmaster(),
+			std::size(pbounce_context->ctrl.from));
+		pbounce_context->ctrl.rcpt.emplace_back(pcontext->ctrl.from);
+		enqueue_context(pbounce_context);
+		break;
+	case delivery_status::perm_fail:
+		had_error = true;
+		if (!pcontext->ctrl.need_bounce ||
+		    strcasecmp(pcontext->ctrl.from, ENVELOPE_FROM_NULL) == 0)
+			break;
+		pbounce_context = get_context();
+		if (NULL == pbounce_context) {
+			exmdb_local_log_info(pcontext->ctrl, rcpt_buff, LV_ERR,
+				"fail to get bounce context");
+			break;
+		}
+		if (!bounce_audit_check(rcpt_buff) ||
+		    !exml_bouncer_make(pcontext->ctrl.from,
+		    rcpt_buff, &pcontext->mail, time(nullptr),
+		    "BOUNCE_OPERATION_ERROR", &pbounce_context->mail)) {
+			exmdb_local_log_info(pcontext->ctrl, rcpt_buff, LV_ERR,
+				"Unspecified error during delivery to %s", rcpt_buff);
+			put_context(pbounce_context);
+			break;
+		}
+		pbounce_context->ctrl.need_bounce = FALSE;
+		gx_strlcpy(pbounce_context->ctrl.from, bounce_gen_postmaster(),
+			std::size(pbounce_context->ctrl.from));
+		pbounce_context->ctrl.rcpt.emplace_back(pcontext->ctrl.from);
+		enqueue_context(pbounce_context);
+		break;
+	case delivery_status::temp_fail:
+		had_error = true;
+		cache_ID = cache_queue_put(pcontext, rcpt_buff, time(nullptr));
+		if (cache_ID >= 0) {
+			exmdb_local_log_info(pcontext->ctrl, rcpt_buff, LV_INFO,
+				"message is put into cache queue with cache ID %d and "
+				"wait to be delivered next time", cache_ID);
+			break;
+		}
+		exmdb_local_log_info(pcontext->ctrl, rcpt_buff, LV_ERR,
+			"failed to put message into cache queue");
+		break;
+	}
+}
+
+hook_result exmdb_local_hook(MESSAGE_CONTEXT *pcontext) try
+{
 	/*
 	 * For diagnostic purposes, don't modify/steal from ctrl->rcpt until
 	 * the replacement list is fully constructed.
 	 */
 	bool had_error = false;
 	std::vector<std::string> new_rcpts;
+	struct local_rcpt {
+		const char *addr;
+		delivery_status status = delivery_status::temp_fail;
+	};
+	std::vector<local_rcpt> lrcpt;
 	for (const auto &rcpt : pcontext->ctrl.rcpt) {
 		auto rcpt_buff = rcpt.c_str();
 		auto pdomain = strchr(rcpt_buff, '@');
@@ -102,123 +259,55 @@ hook_result exmdb_local_hook(MESSAGE_CONTEXT *pcontext) try
 			new_rcpts.emplace_back(rcpt);
 			continue;
 		}
-		switch (exmdb_local_deliverquota(pcontext, rcpt_buff)) {
-		case delivery_status::ok:
-			break;
-		case delivery_status::bounce_sent:
-			if (!pcontext->ctrl.need_bounce ||
-			    strcasecmp(pcontext->ctrl.from, ENVELOPE_FROM_NULL) == 0)
-				break;
-			pbounce_context = get_context();
-			if (NULL == pbounce_context) {
-				exmdb_local_log_info(pcontext->ctrl, rcpt_buff, LV_ERR,
-					"fail to get bounce context");
-				break;
-			}
-			if (!bounce_audit_check(rcpt_buff) ||
-			    !exml_bouncer_make(pcontext->ctrl.from,
-			    rcpt_buff, &pcontext->mail, time(nullptr),
-			    "BOUNCE_MAIL_DELIVERED", &pbounce_context->mail)) {
-				exmdb_local_log_info(pcontext->ctrl, rcpt_buff, LV_ERR,
-					"delivery_status::bounce_sent %s", rcpt_buff);
-				put_context(pbounce_context);
-				break;
-			}
-			pbounce_context->ctrl.need_bounce = FALSE;
-			gx_strlcpy(pbounce_context->ctrl.from, bounce_gen_postmaster(),
-				std::size(pbounce_context->ctrl.from));
-			pbounce_context->ctrl.rcpt.emplace_back(pcontext->ctrl.from);
-			enqueue_context(pbounce_context);
-			break;
-		case delivery_status::no_user:
-			if (!pcontext->ctrl.need_bounce ||
-			    strcasecmp(pcontext->ctrl.from, ENVELOPE_FROM_NULL) == 0)
-				break;
-			pbounce_context = get_context();
-			if (NULL == pbounce_context) {
-				exmdb_local_log_info(pcontext->ctrl, rcpt_buff, LV_ERR,
-					"fail to get bounce context");
-				break;
-			}
-			if (!bounce_audit_check(rcpt_buff) ||
-			    !exml_bouncer_make(pcontext->ctrl.from,
-			    rcpt_buff, &pcontext->mail, time(nullptr),
-			    "BOUNCE_NO_USER", &pbounce_context->mail)) {
-				exmdb_local_log_info(pcontext->ctrl, rcpt_buff, LV_ERR,
-					"No such user %s", rcpt_buff);
-				put_context(pbounce_context);
-				break;
-			}
-			pbounce_context->ctrl.need_bounce = FALSE;
-			gx_strlcpy(pbounce_context->ctrl.from, bounce_gen_postmaster(),
-				std::size(pbounce_context->ctrl.from));
-			pbounce_context->ctrl.rcpt.emplace_back(pcontext->ctrl.from);
-			enqueue_context(pbounce_context);
-			break;
-		case delivery_status::mailbox_full:
-			if (!pcontext->ctrl.need_bounce ||
-			    strcasecmp(pcontext->ctrl.from, ENVELOPE_FROM_NULL) == 0)
-				break;
-			pbounce_context = get_context();
-			if (NULL == pbounce_context) {
-				exmdb_local_log_info(pcontext->ctrl, rcpt_buff, LV_ERR,
-					"fail to get bounce context");
-				break;
-			}
-			if (!bounce_audit_check(rcpt_buff) ||
-			    !exml_bouncer_make(pcontext->ctrl.from,
-			    rcpt_buff, &pcontext->mail, time(nullptr),
-			    "BOUNCE_MAILBOX_FULL", &pbounce_context->mail)) {
-				put_context(pbounce_context);
-				break;
-			}
-			pbounce_context->ctrl.need_bounce = FALSE;
-			gx_strlcpy(pbounce_context->ctrl.from, bounce_gen_postmaster(),
-				std::size(pbounce_context->ctrl.from));
-			pbounce_context->ctrl.rcpt.emplace_back(pcontext->ctrl.from);
-			enqueue_context(pbounce_context);
-			break;
-		case delivery_status::perm_fail:
-			had_error = true;
-			if (!pcontext->ctrl.need_bounce ||
-			    strcasecmp(pcontext->ctrl.from, ENVELOPE_FROM_NULL) == 0)
-				break;
-			pbounce_context = get_context();
-			if (NULL == pbounce_context) {
-				exmdb_local_log_info(pcontext->ctrl, rcpt_buff, LV_ERR,
-					"fail to get bounce context");
-				break;
-			}
-			if (!bounce_audit_check(rcpt_buff) ||
-			    !exml_bouncer_make(pcontext->ctrl.from,
-			    rcpt_buff, &pcontext->mail, time(nullptr),
-			    "BOUNCE_OPERATION_ERROR", &pbounce_context->mail)) {
-				exmdb_local_log_info(pcontext->ctrl, rcpt_buff, LV_ERR,
-					"Unspecified error during delivery to %s", rcpt_buff);
-				put_context(pbounce_context);
-				break;
+		lrcpt.push_back({rcpt_buff});
+	}
+	if (lrcpt.size() == 1) {
+		lrcpt[0].status = exmdb_local_deliverquota(pcontext, lrcpt[0].addr);
+		g_alloc_ctx.clear();
+	} else if (lrcpt.size() > 1) {
+		/*
+		 * Convert once, deliver many. Recipients are grouped by their
+		 * home server, and up to MAX_DELIVER_GROUPS groups are worked
+		 * on concurrently.
+		 */
+		deliv_cache dc;
+		std::map<std::string, std::vector<size_t>> groups;
+		for (size_t i = 0; i < lrcpt.size(); ++i) {
+			std::pair<std::string, std::string> hs;
+			if (mysql_adaptor_get_homeserver(lrcpt[i].addr, true, hs) != 0)
+				hs.first.clear();
+			groups[std::move(hs.first)].push_back(i);
+		}
+		auto deliver_group = [&](const std::vector<size_t> &grp) {
+			for (auto i : grp) {
+				lrcpt[i].status = exmdb_local_deliverquota(pcontext,
+				                  lrcpt[i].addr, &dc);
+				g_alloc_ctx.clear();
 			}
-			pbounce_context->ctrl.need_bounce = FALSE;
-			gx_strlcpy(pbounce_context->ctrl.from, bounce_gen_postmaster(),
-				std::size(pbounce_context->ctrl.from));
-			pbounce_context->ctrl.rcpt.emplace_back(pcontext->ctrl.from);
-			enqueue_context(pbounce_context);
-			break;
-		case delivery_status::temp_fail:
-			had_error = true;
-			cache_ID = cache_queue_put(pcontext, rcpt_buff, time(nullptr));
-			if (cache_ID >= 0) {
-				exmdb_local_log_info(pcontext->ctrl, rcpt_buff, LV_INFO,
-					"message is put into cache queue with cache ID %d and "
-					"wait to be delivered next time", cache_ID);
+		};
+		std::vector<const std::vector<size_t> *> pending;
+		for (const auto &g : groups)
+			pending.push_back(&g.second);
+		std::atomic<size_t> next_grp{0};
+		auto worker = [&]() {
+			for (size_t k; (k = next_grp++) < pending.size(); )
+				deliver_group(*pending[k]);
+		};
+		std::vector<std::future<void>> jobs;
+		auto nthr = std::min(pending.size(), static_cast<size_t>(MAX_DELIVER_GROUPS));
+		for (size_t t = 1; t < nthr; ++t) {
+			try {
+				jobs.push_back(std::async(std::launch::async, worker));
+			} catch (const std::system_error &) {
 				break;
 			}
-			exmdb_local_log_info(pcontext->ctrl, rcpt_buff, LV_ERR,
-				"failed to put message into cache queue");
-			break;
 		}
-		g_alloc_ctx.clear();
+		worker();
+		for (auto &j : jobs)
+			j.get();
 	}
+	for (const auto &r : lrcpt)
+		exmdb_local_dispose(pcontext, r.addr, r.status, had_error);
 	if (had_error)
 		return hook_result::proc_error;
 	if (new_rcpts.empty())
@@ -242,6 +331,147 @@ static BOOL exmdb_local_get_propids(const PROPNAME_ARRAY *ppropnames,
 	       ppropnames, ppropids);
 }
 
+static BOOL dc_get_propids(deliv_cache &dc, const PROPNAME_ARRAY *names,
+    PROPID_ARRAY *ids) try
+{
+	ids->resize(names->count);
+	for (size_t i = 0; i < names->count; ++i) {
+		PROPERTY_XNAME xn(names->ppropname[i]);
+		std::string key(reinterpret_cast<const char *>(&xn.guid), sizeof(xn.guid));
+		if (xn.kind == MNID_ID)
+			key += "L" + std::to_string(xn.lid);
+		else
+			key += "N" + xn.name;
+		auto iter = dc.rev.find(key);
+		if (iter != dc.rev.end()) {
+			(*ids)[i] = iter->second;
+			continue;
+		}
+		if (dc.names.size() >= 0x7FFF) {
+			(*ids)[i] = 0;
+			continue;
+		}
+		propid_t id = 0x8000 + dc.names.size();
+		dc.names.push_back(std::move(xn));
+		dc.rev.emplace(std::move(key), id);
+		(*ids)[i] = id;
+	}
+	return TRUE;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-1802: ENOMEM");
+	return false;
+}
+
+static void dc_collect(const TPROPVAL_ARRAY &props, std::vector<propid_t> &used)
+{
+	for (size_t i = 0; i < props.count; ++i)
+		if (is_nameprop_id(PROP_ID(props.ppropval[i].proptag)))
+			used.push_back(PROP_ID(props.ppropval[i].proptag));
+}
+
+static void dc_collect(const message_content &mc, std::vector<propid_t> &used)
+{
+	dc_collect(mc.proplist, used);
+	if (mc.children.prcpts != nullptr)
+		for (const auto &rcpt : *mc.children.prcpts)
+			dc_collect(rcpt, used);
+	if (mc.children.pattachments != nullptr)
+		for (const auto &at : *mc.children.pattachments) {
+			dc_collect(at.proplist, used);
+			if (at.pembedded != nullptr)
+				dc_collect(*at.pembedded, used);
+		}
+}
+
+static void dc_apply(TPROPVAL_ARRAY &props,
+    const std::unordered_map<propid_t, propid_t> &xl)
+{
+	std::vector<uint32_t> drop;
+	for (size_t i = 0; i < props.count; ++i) {
+		auto &tag = props.ppropval[i].proptag;
+		if (!is_nameprop_id(PROP_ID(tag)))
+			continue;
+		auto iter = xl.find(PROP_ID(tag));
+		if (iter == xl.end() || iter->second == 0)
+			drop.push_back(tag);
+		else
+			tag = PROP_TAG(PROP_TYPE(tag), iter->second);
+	}
+	for (auto tag : drop)
+		props.erase(tag);
+}
+
+static void dc_apply(message_content &mc,
+    const std::unordered_map<propid_t, propid_t> &xl)
+{
+	dc_apply(mc.proplist, xl);
+	if (mc.children.prcpts != nullptr)
+		for (auto &rcpt : *mc.children.prcpts)
+			dc_apply(rcpt, xl);
+	if (mc.children.pattachments != nullptr)
+		for (auto &at : *mc.children.pattachments) {
+			dc_apply(at.proplist, xl);
+			if (at.pembedded != nullptr)
+				dc_apply(*at.pembedded, xl);
+		}
+}
+
+/**
+ * Obtain the MAPI form of the mail for one mailbox. With a @dc, the
+ * conversion is shared across recipients with the same charset and
+ * timezone, and only the named propids are translated for @dir.
+ */
+static std::unique_ptr<message_content, mc_delete>
+exmdb_local_convert(deliv_cache *dc, const char *charset, const char *tmzone,
+    const MAIL *pmail, const char *dir)
+{
+	std::unique_ptr<message_content, mc_delete> pmsg;
+	if (dc == nullptr) {
+		g_storedir = dir;
+		pmsg.reset(oxcmail_import(charset, tmzone, pmail,
+			exmdb_local_alloc, exmdb_local_get_propids));
+		g_storedir = nullptr;
+		return pmsg;
+	}
+	std::vector<propid_t> used;
+	std::vector<PROPERTY_NAME> pn;
+	{
+		std::lock_guard lk(dc->lock);
+		auto key = std::string(charset) + "\n" + tmzone;
+		auto iter = dc->conv.find(key);
+		if (iter == dc->conv.end()) {
+			std::unique_ptr<message_content, mc_delete> ct(oxcmail_import(charset,
+				tmzone, pmail, exmdb_local_alloc,
+				[dc](const PROPNAME_ARRAY *n, PROPID_ARRAY *i) {
+					return dc_get_propids(*dc, n, i);
+				}));
+			iter = dc->conv.emplace(std::move(key), std::move(ct)).first;
+		}
+		if (iter->second == nullptr)
+			return nullptr;
+		pmsg.reset(iter->second->dup());
+		if (pmsg == nullptr)
+			return nullptr;
+		dc_collect(*pmsg, used);
+		std::sort(used.begin(), used.end());
+		used.erase(std::unique(used.begin(), used.end()), used.end());
+		for (auto id : used)
+			pn.push_back(static_cast<PROPERTY_NAME>(dc->names[id - 0x8000]));
+	}
+	if (used.empty())
+		return pmsg;
+	PROPNAME_ARRAY pna = {static_cast<uint16_t>(pn.size()), pn.data()};
+	PROPID_ARRAY ids;
+	if (!exmdb_client_remote::get_named_propids(dir, true, &pna, &ids) ||
+	    ids.size() != used.size())
+		return nullptr;
+	std::unordered_map<propid_t, propid_t> xl;
+	for (size_t i = 0; i < used.size(); ++i)
+		xl.emplace(used[i], ids[i]);
+	dc_apply(*pmsg, xl);
+	return pmsg;
+}
+
 static void lq_report(unsigned int qid, unsigned long long mid, const char *txt,
     const message_content *ct)
 {
@@ -255,12 +485,12 @@ static void lq_report(unsigned int qid, unsigned long long mid, const char *txt,
 }
 
 delivery_status exmdb_local_deliverquota(MESSAGE_CONTEXT *pcontext,
-    const char *address) try
+    const char *address, deliv_cache *dc) try
 {
 	size_t mess_len;
 	int sequence_ID;
 	uint64_t nt_time;
-	char tmzone[64], hostname[UDOM_SIZE];
+	char hostname[UDOM_SIZE];
 	uint32_t tmp_int32;
 	uint32_t suppress_mask = 0;
 	BOOL b_bounce_delivered = false;
@@ -279,8 +509,9 @@ delivery_status exmdb_local_deliverquota(MESSAGE_CONTEXT *pcontext,
 	auto charset = lang_to_charset(mres.lang.c_str());
 	if (*znul(charset) == '\0')
 		charset = g_default_charset;
-	if (*znul(tmzone) == '\0')
-		strcpy(tmzone, GROMOX_FALLBACK_TIMEZONE);
+	auto tmzone = mres.timezone.c_str();
+	if (*tmzone == '\0')
+		tmzone = GROMOX_FALLBACK_TIMEZONE;
 	
 	auto pmail = &pcontext->mail;
 	sequence_ID = exmdb_local_sequence_ID();
@@ -294,32 +525,56 @@ delivery_status exmdb_local_deliverquota(MESSAGE_CONTEXT *pcontext,
 	auto mid_string = std::to_string(time(nullptr)) + "." +
 	                  std::to_string(sequence_ID) + "." + hostname;
 	auto eml_path = mres.maildir + "/eml/" + mid_string;
-	wrapfd fd = open(eml_path.c_str(), O_CREAT | O_RDWR | O_TRUNC, FMODE_PRIVATE);
-	if (fd.get() < 0) {
-		auto se = errno;
-		exmdb_local_log_info(pcontext->ctrl, address, LV_ERR,
-			"open WR %s: %s", eml_path.c_str(), strerror(se));
-		errno = se;
-		return delivery_status::temp_fail;
+	std::string eml_src;
+	if (dc != nullptr) {
+		std::lock_guard lk(dc->lock);
+		eml_src = dc->eml_src;
 	}
-	
-	auto syserr = pmail->to_fd(fd.get());
-	if (syserr != 0) {
-		fd.close_rd();
-		if (remove(eml_path.c_str()) < 0 && errno != ENOENT)
-			mlog(LV_WARN, "W-1386: remove %s: %s",
-			        eml_path.c_str(), strerror(errno));
-		exmdb_local_log_info(pcontext->ctrl, address, LV_ERR,
-			"%s: pmail->to_fd failed: %s",
-			eml_path.c_str(), strerror(syserr));
-		return delivery_status::temp_fail;
+	/*
+	 * Mailboxes on the same filesystem can share one copy of the EML;
+	 * otherwise (EXDEV, EMLINK, ...), write it out again.
+	 */
+	if (eml_src.empty() || link(eml_src.c_str(), eml_path.c_str()) != 0) {
+		wrapfd fd = open(eml_path.c_str(), O_CREAT | O_RDWR | O_TRUNC, FMODE_PRIVATE);
+		if (fd.get() < 0) {
+			auto se = errno;
+			exmdb_local_log_info(pcontext->ctrl, address, LV_ERR,
+				"open WR %s: %s", eml_path.c_str(), strerror(se));
+			errno = se;
+			return delivery_status::temp_fail;
+		}
+		auto syserr = pmail->to_fd(fd.get());
+		if (syserr != 0) {
+			fd.close_rd();
+			if (remove(eml_path.c_str()) < 0 && errno != ENOENT)
+				mlog(LV_WARN, "W-1386: remove %s: %s",
+				        eml_path.c_str(), strerror(errno));
+			exmdb_local_log_info(pcontext->ctrl, address, LV_ERR,
+				"%s: pmail->to_fd failed: %s",
+				eml_path.c_str(), strerror(syserr));
+			return delivery_status::temp_fail;
+		}
+		auto ret = fd.close_wr();
+		if (ret < 0)
+			mlog(LV_ERR, "E-1120: close %s: %s", eml_path.c_str(), strerror(ret));
+		if (dc != nullptr) {
+			std::lock_guard lk(dc->lock);
+			dc->eml_src = eml_path;
+		}
 	}
-	auto ret = fd.close_wr();
-	if (ret < 0)
-		mlog(LV_ERR, "E-1120: close %s: %s", eml_path.c_str(), strerror(ret));
 
 	Json::Value digest;
-	auto result = pmail->make_digest(&mess_len, digest);
+	int result;
+	if (dc == nullptr) {
+		result = pmail->make_digest(&mess_len, digest);
+	} else {
+		std::lock_guard lk(dc->lock);
+		if (dc->digest_result == 0)
+			dc->digest_result = pmail->make_digest(&mess_len, dc->digest);
+		result = dc->digest_result;
+		if (result > 0)
+			digest = dc->digest;
+	}
 	if (result <= 0) {
 		if (remove(eml_path.c_str()) < 0 && errno != ENOENT)
 			mlog(LV_WARN, "W-1387: remove %s: %s",
@@ -330,10 +585,7 @@ delivery_status exmdb_local_deliverquota(MESSAGE_CONTEXT *pcontext,
 	}
 	digest["file"] = std::move(mid_string);
 	auto djson = json_to_str(digest);
-	g_storedir = mres.maildir.c_str();
-	auto pmsg = oxcmail_import(charset, tmzone, pmail, exmdb_local_alloc,
-	            exmdb_local_get_propids);
-	g_storedir = nullptr;
+	auto pmsg = exmdb_local_convert(dc, charset, tmzone, pmail, home_dir);
 	if (NULL == pmsg) {
 		if (remove(eml_path.c_str()) < 0 && errno != ENOENT)
 			mlog(LV_WARN, "W-1388: remove %s: %s",
@@ -342,7 +594,7 @@ delivery_status exmdb_local_deliverquota(MESSAGE_CONTEXT *pcontext,
 			"to convert rfc5322 into MAPI message object");
 		return delivery_status::perm_fail;
 	}
-	lq_report(pcontext->ctrl.queue_ID, 0, "before_delivery", pmsg);
+	lq_report(pcontext->ctrl.queue_ID, 0, "before_delivery", pmsg.get());
 
 	nt_time = rop_util_current_nttime();
 	if (pmsg->proplist.set(PR_MESSAGE_DELIVERY_TIME, &nt_time) != 0)
@@ -361,7 +613,7 @@ delivery_status exmdb_local_deliverquota(MESSAGE_CONTEXT *pcontext,
 		flags = 0;
 	if (!exmdb_client_remote::deliver_message(home_dir,
 	    pcontext->ctrl.from, address, CP_ACP, flags,
-	    pmsg, djson.c_str(), &folder_id, &message_id, &r32))
+	    pmsg.get(), djson.c_str(), &folder_id, &message_id, &r32))
 		return delivery_status::perm_fail;
 
 	auto dm_status = static_cast<deliver_message_result>(r32);
@@ -385,7 +637,7 @@ delivery_status exmdb_local_deliverquota(MESSAGE_CONTEXT *pcontext,
 			lq_report(pcontext->ctrl.queue_ID, rop_util_get_gc_value(message_id),
 				"after_delivery", rbct);
 	}
-	message_content_free(pmsg);
+	pmsg.reset();
 	switch (dm_status) {
 	case deliver_message_result::result_ok:
 		exmdb_local_log_info(pcontext->ctrl, address, LV_DEBUG,
@@ -8,6 +8,7 @@ enum class delivery_status {
 };
 
 struct MAIL;
+struct deliv_cache;
 
 extern void auto_response_reply(const char *user_home, const char *from, const char *rcpt);
 
@@ -25,7 +26,7 @@ extern int cache_queue_put(MESSAGE_CONTEXT *, const char *rcpt, time_t orig_time
 extern void exmdb_local_init(const char *org_name, const char *default_charset);
 extern int exmdb_local_run();
 extern gromox::hook_result exmdb_local_hook(MESSAGE_CONTEXT *);
-extern delivery_status exmdb_local_deliverquota(MESSAGE_CONTEXT *pcontext, const char *address);
+extern delivery_status exmdb_local_deliverquota(MESSAGE_CONTEXT *pcontext, const char *address, deliv_cache * = nullptr);
 extern void exmdb_local_log_info(const CONTROL_INFO &, const char *rcpt, int level, const char *format, ...);
 
 extern unsigned int autoreply_silence_window;
@@ -17,6 +17,8 @@
 #include <memory>
 #include <string>
 #include <unistd.h>
+#include <unordered_map>
+#include <unordered_set>
 #include <utility>
 #include <vector>
 #include <fmt/core.h>
@@ -237,6 +239,20 @@ static bool iseq_contains(const imap_seq_list &list,
 	return i->lo <= num && num <= i->hi && num <= max_uid;
 }
 
+/* Render @list in sequence-set syntax, e.g. "1:3,7" */
+std::string iseq_to_str(const imap_seq_list &list)
+{
+	std::string s;
+	for (const auto &r : list) {
+		if (!s.empty())
+			s += ',';
+		s += std::to_string(r.lo);
+		if (r.hi != r.lo)
+			s += ":" + std::to_string(r.hi);
+	}
+	return s;
+}
+
 static std::string quote_encode(const char *u7)
 {
 	std::unique_ptr<char[], stdlib_delete> q(HX_strquote(u7, HXQUOTE_DQUOTE, nullptr));
@@ -248,6 +264,31 @@ static std::string quote_encode(const std::string &u7)
 	return quote_encode(u7.c_str());
 }
 
+/**
+ * Parse an RFC 7162 command modifier like "(CHANGEDSINCE 12 VANISHED)".
+ * @vanished may be nullptr if that keyword is not permitted.
+ */
+static bool icp_parse_modseq_mod(char *arg, const char *name,
+    uint64_t *value, bool *vanished)
+{
+	char *tmp_argv[4];
+	auto len = strlen(arg);
+	if (len < 2 || arg[0] != '(' || arg[len-1] != ')')
+		return false;
+	auto tmp_argc = parse_imap_args(arg + 1, len - 2, tmp_argv, std::size(tmp_argv));
+	if (tmp_argc < 2 || strcasecmp(tmp_argv[0], name) != 0 ||
+	    !HX_isdigit(tmp_argv[1][0]))
+		return false;
+	*value = strtoull(tmp_argv[1], nullptr, 10);
+	if (tmp_argc == 2)
+		return true;
+	if (tmp_argc != 3 || vanished == nullptr ||
+	    strcasecmp(tmp_argv[2], "VANISHED") != 0)
+		return false;
+	*vanished = true;
+	return true;
+}
+
 static BOOL icp_parse_fetch_args(mdi_list &plist,
     BOOL *pb_detail, BOOL *pb_data, char *string, char **argv, int argc) try
 {
@@ -280,6 +321,7 @@ static BOOL icp_parse_fetch_args(mdi_list &plist,
 			0 == strcasecmp(argv[i], "ENVELOPE") ||
 			0 == strcasecmp(argv[i], "FLAGS") ||
 			0 == strcasecmp(argv[i], "INTERNALDATE") ||
+			0 == strcasecmp(argv[i], "MODSEQ") ||
 			0 == strcasecmp(argv[i], "RFC822") ||
 			0 == strcasecmp(argv[i], "RFC822.HEADER") ||
 			0 == strcasecmp(argv[i], "RFC822.SIZE") ||
@@ -483,6 +525,57 @@ static void icp_convert_flags_string(int flag_bits, char *flags_string)
 	flags_string[len + 1] = '\0';
 }
 
+/**
+ * Read part of a message's eml file. When the exmdb server does not know the
+ * ranged call, this is remembered for the connection, and the eml is read
+ * once in full and kept in @ctx until a request reaches its end.
+ */
+bool icp_eml_read_range(imap_context &ctx, const std::string &mid,
+    uint64_t of, uint32_t len, uint64_t *size, std::string *data) try
+{
+	if (!ctx.eml_norange) {
+		if (exmdb_client->imapfile_read_range(ctx.maildir, "eml", mid,
+		    of, len, size, data))
+			return true;
+		if (exmdb_client_last_response() != exmdb_response::pull_error)
+			return false;
+		ctx.eml_norange = true;
+	}
+	if (ctx.eml_whole_mid != mid) {
+		ctx.eml_whole_mid.clear();
+		ctx.eml_whole.clear();
+		if (!exmdb_client->imapfile_read(ctx.maildir, "eml", mid, &ctx.eml_whole))
+			return false;
+		ctx.eml_whole_mid = mid;
+	}
+	auto &all = ctx.eml_whole;
+	*size = all.size();
+	if (of < all.size())
+		*data = all.substr(of, len);
+	else
+		data->clear();
+	if (of + len >= all.size()) {
+		ctx.eml_whole_mid.clear();
+		ctx.eml_whole = {};
+	}
+	return true;
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-1785: ENOMEM");
+	return false;
+}
+
+/* Let @ctx.io_actor pull pieces of @mid's eml file as they are needed. */
+static void icp_eml_attach(imap_context &ctx, const std::string &eml_path,
+    const char *mid)
+{
+	if (ctx.io_actor.exists(eml_path))
+		return;
+	ctx.io_actor.place_ranged(eml_path, [&ctx, m = std::string(mid)](uint64_t of,
+	    uint32_t len, uint64_t *size, std::string *data) {
+		return icp_eml_read_range(ctx, m, of, len, size, data);
+	});
+}
+
 static int icp_match_field(mjson_io &io, const char *cmd_tag,
     const char *file_path, size_t offset, size_t length, BOOL b_not,
     const char *tags, size_t offset1, ssize_t length1, std::string &value) try
@@ -673,12 +766,7 @@ static int pstruct_else(imap_context &ctx, MJSON *pjson,
 	std::string eml_path;
 	if (storage_path == nullptr) {
 		eml_path = ctx.maildir + "/eml/"s + pjson->get_mail_filename();
-		if (!ctx.io_actor.exists(eml_path)) {
-			std::string content;
-			if (exmdb_client->imapfile_read(ctx.maildir, "eml",
-			    pjson->get_mail_filename(), &content))
-				ctx.io_actor.place(eml_path, std::move(content));
-		}
+		icp_eml_attach(ctx, eml_path, pjson->get_mail_filename());
 	} else {
 		eml_path = ctx.maildir + "/tmp/imap.rfc822/"s + storage_path + "/" + pjson->get_mail_filename();
 	}
@@ -719,6 +807,31 @@ static int icp_print_structure(imap_context &ctx, MJSON *pjson,
 	return -1;
 }
 
+/*
+ * P-DTLU. When @items needs BODY/BODYSTRUCTURE/ENVELOPE, midb is asked to
+ * include them pre-rendered for the session charset. An older midb rejects
+ * the extra argument, in which case the listing is requested plainly.
+ */
+static int icp_fetch_detail(imap_context &ctx, const imap_seq_list &list,
+    const mdi_list &items, XARRAY &xarray, int *errnum)
+{
+	bool want = *ctx.defcharset != '\0' &&
+	            std::any_of(items.cbegin(), items.cend(), [](const std::string &e) {
+		return strcasecmp(e.c_str(), "BODY") == 0 ||
+		       strcasecmp(e.c_str(), "BODYSTRUCTURE") == 0 ||
+		       strcasecmp(e.c_str(), "ENVELOPE") == 0;
+	});
+	if (want) {
+		auto ssr = midb_agent::fetch_detail_uid(ctx.maildir,
+		           ctx.selected_folder, list, &xarray, errnum,
+		           ctx.defcharset);
+		if (ssr != MIDB_RESULT_ERROR || *errnum != MIDB_E_PARAMETER_ERROR)
+			return ssr;
+	}
+	return midb_agent::fetch_detail_uid(ctx.maildir, ctx.selected_folder,
+	       list, &xarray, errnum);
+}
+
 static int icp_process_fetch_item(imap_context &ctx,
     BOOL b_data, MITEM *pitem, int item_id, mdi_list &pitem_list) try
 {
@@ -727,7 +840,22 @@ static int icp_process_fetch_item(imap_context &ctx,
 	MJSON mjson;
 	std::string buf;
 	
-	if (pitem->flag_bits & FLAG_LOADED) {
+	/* Strings pre-rendered by midb (P-DTLU with charset) */
+	const Json::Value *rendered = nullptr;
+	if ((pitem->flag_bits & FLAG_LOADED) && pitem->digest.isMember("imap")) {
+		auto &r = pitem->digest["imap"];
+		if (r.isObject() && strcasecmp(r.get("charset", "").asString().c_str(),
+		    ctx.defcharset) == 0)
+			rendered = &r;
+	}
+	bool need_mjson = rendered == nullptr ||
+	                  std::any_of(pitem_list.cbegin(), pitem_list.cend(), [](const std::string &e) {
+		for (auto kw : {"BODY", "BODYSTRUCTURE", "ENVELOPE", "FLAGS", "UID", "MODSEQ"})
+			if (strcasecmp(e.c_str(), kw) == 0)
+				return false;
+		return true;
+	});
+	if ((pitem->flag_bits & FLAG_LOADED) && need_mjson) {
 		auto eml_path = std::string(pcontext->maildir) + "/eml";
 		if (!mjson.load_from_json(pitem->digest)) {
 			mlog(LV_ERR, "E-1921: load_from_json %s/%s oopsied", ctx.maildir, ctx.mid.c_str());
@@ -738,12 +866,7 @@ static int icp_process_fetch_item(imap_context &ctx,
 	auto deferred_eml_load = [&]() {
 		if (!(pitem->flag_bits & FLAG_LOADED))
 			return;
-		auto eml_file = mjson.path + "/"s + pitem->mid;
-		if (!ctx.io_actor.exists(eml_file)) {
-			std::string content;
-			if (exmdb_client->imapfile_read(ctx.maildir, "eml", pitem->mid, &content))
-				ctx.io_actor.place(eml_file, std::move(content));
-		}
+		icp_eml_attach(ctx, mjson.path + "/"s + pitem->mid, pitem->mid.c_str());
 	};
 
 	BOOL b_first = FALSE;
@@ -756,7 +879,9 @@ static int icp_process_fetch_item(imap_context &ctx,
 		auto kw = kwss.data();
 		if (strcasecmp(kw, "BODY") == 0) {
 			buf += "BODY ";
-			if (mjson.has_rfc822_part()) {
+			if (rendered != nullptr) {
+				buf += (*rendered)["body"].asString();
+			} else if (mjson.has_rfc822_part()) {
 				deferred_eml_load();
 				auto rfc_path = std::string(pcontext->maildir) + "/tmp/imap.rfc822";
 				if (rfc_path.size() <= 0 ||
@@ -780,7 +905,9 @@ static int icp_process_fetch_item(imap_context &ctx,
 			}
 		} else if (strcasecmp(kw, "BODYSTRUCTURE") == 0) {
 			buf += "BODYSTRUCTURE ";
-			if (mjson.has_rfc822_part()) {
+			if (rendered != nullptr) {
+				buf += (*rendered)["bodystructure"].asString();
+			} else if (mjson.has_rfc822_part()) {
 				deferred_eml_load();
 				auto rfc_path = std::string(pcontext->maildir) + "/tmp/imap.rfc822";
 				if (rfc_path.size() <= 0 ||
@@ -805,8 +932,9 @@ static int icp_process_fetch_item(imap_context &ctx,
 		} else if (strcasecmp(kw, "ENVELOPE") == 0) {
 			buf += "ENVELOPE ";
 			std::string b2;
-			auto len = mjson.fetch_envelope(pcontext->defcharset, b2);
-			if (len == -1)
+			if (rendered != nullptr)
+				buf += (*rendered)["envelope"].asString();
+			else if (mjson.fetch_envelope(pcontext->defcharset, b2) == -1)
 				buf += "NIL";
 			else
 				buf += std::move(b2);
@@ -870,6 +998,8 @@ static int icp_process_fetch_item(imap_context &ctx,
 		} else if (strcasecmp(kw, "UID") == 0) {
 			buf += "UID ";
 			buf += std::to_string(pitem->uid);
+		} else if (strcasecmp(kw, "MODSEQ") == 0) {
+			buf += "MODSEQ (" + std::to_string(pitem->modseq) + ")";
 		} else if (strncasecmp(kw, "BODY[", 5) == 0 ||
 		    strncasecmp(kw, "BODY.PEEK[", 10) == 0) {
 			auto pbody = strchr(kw, '[');
@@ -1172,7 +1302,7 @@ int icp_capability(int argc, char **argv, imap_context &ctx) try
 	if (pcontext->proto_stat == iproto_stat::select)
 		imap_parser_echo_modify(pcontext, NULL);
 	/* IMAP_CODE_2170001: OK CAPABILITY completed */
-	char ext_str[128];
+	char ext_str[256];
 	capability_list(ext_str, std::size(ext_str), pcontext);
 	auto buf = fmt::format("* CAPABILITY {}\r\n{} {}",
 	           ext_str, argv[0], resource_get_imap_code(1701, 1));
@@ -1348,7 +1478,7 @@ static int icp_password2(int argc, char **argv, imap_context &ctx) try
 		std::size(pcontext->defcharset));
 	pcontext->proto_stat = iproto_stat::auth;
 	imap_parser_log_info(pcontext, LV_DEBUG, "LOGIN ok");
-	char caps[128];
+	char caps[256];
 	capability_list(caps, std::size(caps), pcontext);
 	auto buf = fmt::format("{} OK [CAPABILITY {}] Logged in\r\n",
 		   tag_or_bug(pcontext->tag_string), caps);
@@ -1466,13 +1596,137 @@ static int m2icode(int r, int e)
 }
 
 /**
- * Get a listing of all mails in the folder to build the uid<->seqid mapping.
+ * midb_agent::fetch_changed_uid, except that when midb has already pruned the
+ * expunge records needed to go back to @since, the entire folder is listed
+ * instead and *@pruned is set. @vanished is empty in that case; the caller
+ * has to find the expunged UIDs by what is missing from @xa.
+ */
+static int icp_fetch_changed(const char *maildir, const std::string &folder,
+    uint64_t since, XARRAY &xa, std::vector<uint32_t> &vanished,
+    uint64_t &highest, bool *pruned, int &errnum)
+{
+	*pruned = false;
+	auto ssr = midb_agent::fetch_changed_uid(maildir, folder, since,
+	           &xa, &vanished, &highest, &errnum);
+	if (since == 0 || ssr != MIDB_RESULT_ERROR ||
+	    errnum != MIDB_E_MODSEQ_PRUNED)
+		return ssr;
+	*pruned = true;
+	xa.clear();
+	vanished.clear();
+	return midb_agent::fetch_changed_uid(maildir, folder, 0,
+	       &xa, &vanished, &highest, &errnum);
+}
+
+/**
+ * The UIDs within @filter and below @uidnext which are not part of the full
+ * (UID-ordered) folder listing @xa.
+ */
+static imap_seq_list icp_missing_uids(const XARRAY &xa,
+    const imap_seq_list &filter, uint32_t uidnext)
+{
+	imap_seq_list gaps, gone;
+	/* Appending in ascending order keeps the range_sets well-formed */
+	uint32_t next = 1;
+	for (const auto &m : xa.m_vec) {
+		uint32_t uid = m.uid;
+		if (uid > next)
+			gaps.vec().emplace_back(next, uid - 1);
+		next = uid + 1;
+	}
+	if (uidnext > next)
+		gaps.vec().emplace_back(next, uidnext - 1);
+	auto f = filter.cbegin();
+	for (auto g = gaps.cbegin(); g != gaps.cend() && f != filter.cend(); ) {
+		auto lo = std::max(g->lo, f->lo), hi = std::min(g->hi, f->hi);
+		if (lo <= hi)
+			gone.vec().emplace_back(lo, hi);
+		if (g->hi < f->hi)
+			++g;
+		else
+			++f;
+	}
+	return gone;
+}
+
+/**
+ * Fold the result of a P-SIMD delta query into the listing. Expunged mails
+ * only disappear (and shift sequence numbers) when @fresh_numbers is set;
+ * otherwise the modseq is held back so they are seen again next time.
+ */
+void content_array::merge_changes(XARRAY &&xa,
+    const std::vector<uint32_t> &vanished, bool fresh_numbers, uint64_t modseq)
+{
+	bool held_back = false;
+	if (fresh_numbers && vanished.size() > 0) {
+		std::unordered_set<uint32_t> gone(vanished.cbegin(), vanished.cend());
+		auto n = std::erase_if(m_vec,
+		         [&](const MITEM &m) { return gone.contains(m.uid); });
+		if (n > 0) {
+			m_hash.clear();
+			for (size_t i = 0; i < m_vec.size(); ++i) {
+				m_vec[i].id = i + 1;
+				m_hash.emplace(m_vec[i].uid, i);
+			}
+		}
+	} else {
+		held_back = std::any_of(vanished.cbegin(), vanished.cend(),
+		            [&](uint32_t uid) { return get_itemx(uid) != nullptr; });
+	}
+	for (auto &chg : xa.m_vec) {
+		auto known = get_itemx(chg.uid);
+		if (known != nullptr) {
+			known->flag_bits = chg.flag_bits;
+			known->modseq = chg.modseq;
+			continue;
+		}
+		auto uid = chg.uid;
+		if (append(std::move(chg), uid) == 0)
+			m_vec.back().id = m_vec.size();
+	}
+	if (!held_back)
+		highest_modseq = modseq;
+}
+
+/**
+ * Build/update the uid<->seqid mapping. Once midb has handed out a modseq
+ * for the folder, only changes since then are transferred; without one
+ * (older midb or database schema), a full listing is used every time.
  */
 int content_array::refresh(imap_context &ctx, const std::string &folder,
     bool fresh_numbers)
 {
 	XARRAY xa;
 	int errnum = 0;
+	if (highest_modseq != 0 || fresh_numbers) {
+		std::vector<uint32_t> vanished;
+		uint64_t modseq = 0;
+		bool pruned = false;
+		auto ssr = icp_fetch_changed(ctx.maildir, folder, highest_modseq,
+		           xa, vanished, modseq, &pruned, errnum);
+		if (ssr != MIDB_RESULT_ERROR || errnum != MIDB_E_UNKNOWN_COMMAND) {
+			auto ret = m2icode(ssr, errnum);
+			if (ret != 0)
+				return ret;
+			if (pruned)
+				for (const auto &m : m_vec)
+					if (xa.get_itemx(m.uid) == nullptr)
+						vanished.push_back(m.uid);
+			if (highest_modseq == 0) {
+				for (size_t i = 0; i < xa.m_vec.size(); ++i)
+					xa.m_vec[i].id = i + 1;
+				*this = std::move(xa);
+				highest_modseq = modseq;
+			} else {
+				merge_changes(std::move(xa), vanished, fresh_numbers, modseq);
+			}
+			goto stats;
+		}
+		xa.clear();
+		highest_modseq = 0;
+	}
+
+	{
 	imap_seq_list all_seq;
 	all_seq.insert(1, SEQ_STAR);
 	auto ssr = midb_agent::fetch_simple_uid(ctx.maildir, folder,
@@ -1480,6 +1734,7 @@ int content_array::refresh(imap_context &ctx, const std::string &folder,
 	auto ret = m2icode(ssr, errnum);
 	if (ret != 0)
 		return ret;
+	}
 
 	if (fresh_numbers) {
 		for (size_t i = 0; i < xa.m_vec.size(); ++i)
@@ -1496,6 +1751,7 @@ int content_array::refresh(imap_context &ctx, const std::string &folder,
 			++start;
 		}
 	}
+ stats:
 	n_recent = std::count_if(m_vec.cbegin(), m_vec.cend(),
 	           [](const MITEM &m) { return m.flag_bits & FLAG_RECENT; });
 	auto iter = std::find_if(m_vec.cbegin(), m_vec.cend(),
@@ -1521,12 +1777,49 @@ static int icp_selex(int argc, char **argv, imap_context &ctx, bool readonly) tr
 		pcontext->selected_folder.clear();
 	}
 	
+	/* RFC 7162 §3.1.8, §3.2.5 select parameters */
+	bool qresync = false;
+	uint32_t qr_uidvalid = 0;
+	uint64_t qr_modseq = 0;
+	imap_seq_list qr_known;
+	if (argc > 3) {
+		char *tmp_argv[4], *qr_argv[4];
+		auto len = strlen(argv[3]);
+		if (len < 2 || argv[3][0] != '(' || argv[3][len-1] != ')')
+			return 1800;
+		auto tmp_argc = parse_imap_args(argv[3] + 1, len - 2,
+		                tmp_argv, std::size(tmp_argv));
+		if (tmp_argc == 1 && strcasecmp(tmp_argv[0], "CONDSTORE") == 0) {
+			pcontext->b_condstore = true;
+		} else if (tmp_argc == 2 && pcontext->b_qresync &&
+		    strcasecmp(tmp_argv[0], "QRESYNC") == 0) {
+			len = strlen(tmp_argv[1]);
+			if (len < 2 || tmp_argv[1][0] != '(' || tmp_argv[1][len-1] != ')')
+				return 1800;
+			auto qr_argc = parse_imap_args(tmp_argv[1] + 1, len - 2,
+			               qr_argv, std::size(qr_argv));
+			if (qr_argc < 2 || !HX_isdigit(qr_argv[0][0]) ||
+			    !HX_isdigit(qr_argv[1][0]))
+				return 1800;
+			qr_uidvalid = strtoul(qr_argv[0], nullptr, 10);
+			qr_modseq = strtoull(qr_argv[1], nullptr, 10);
+			/* The seq-match-data hint (qr_argv[3]) is not needed. */
+			if (qr_argc > 2 && parse_imap_seq(qr_known, qr_argv[2]) != 0)
+				return 1800;
+			qresync = true;
+		} else {
+			return 1800;
+		}
+	}
+
 	uint32_t uidvalid = 0, uidnext = 0;
 	auto ssr = midb_agent::summary_folder(pcontext->maildir, sys_name,
-	           nullptr, nullptr, nullptr, &uidvalid, &uidnext, &errnum);
+	           nullptr, nullptr, nullptr, &uidvalid, &uidnext,
+	           nullptr, &errnum);
 	auto ret = m2icode(ssr, errnum);
 	if (ret != 0)
 		return ret;
+	pcontext->contents.highest_modseq = 0;
 	ret = pcontext->contents.refresh(*pcontext, sys_name, true);
 	if (ret != 0)
 		return ret;
@@ -1552,6 +1845,43 @@ static int icp_selex(int argc, char **argv, imap_context &ctx, bool readonly) tr
 	auto s_command  = readonly ? "EXAMINE" : "SELECT";
 	buf += fmt::format("* OK [UIDVALIDITY {}] UIDs valid\r\n"
 	       "* OK [UIDNEXT {}] predicted next UID\r\n", uidvalid, uidnext);
+	auto &contents = pcontext->contents;
+	if (contents.highest_modseq != 0)
+		buf += fmt::format("* OK [HIGHESTMODSEQ {}] modseqs valid\r\n",
+		       contents.highest_modseq);
+	else
+		buf += "* OK [NOMODSEQ] no modseqs for this mailbox\r\n";
+	if (qresync && qr_uidvalid == uidvalid && contents.highest_modseq != 0) {
+		XARRAY xa;
+		std::vector<uint32_t> vanished;
+		uint64_t hm = 0;
+		bool pruned = false;
+		ssr = icp_fetch_changed(pcontext->maildir, sys_name, qr_modseq,
+		      xa, vanished, hm, &pruned, errnum);
+		ret = m2icode(ssr, errnum);
+		if (ret != 0)
+			return ret;
+		imap_seq_list gone;
+		if (pruned) {
+			imap_seq_list all;
+			all.insert(1, SEQ_STAR);
+			gone = icp_missing_uids(xa, qr_known.size() > 0 ? qr_known : all, uidnext);
+		}
+		for (auto uid : vanished)
+			if (qr_known.size() == 0 || qr_known.contains(uid))
+				gone.insert(uid);
+		if (gone.size() > 0)
+			buf += "* VANISHED (EARLIER) " + iseq_to_str(gone) + "\r\n";
+		for (const auto &chg : xa.m_vec) {
+			auto ct_item = contents.get_itemx(chg.uid);
+			if (ct_item == nullptr)
+				continue;
+			char flags_string[128];
+			icp_convert_flags_string(chg.flag_bits, flags_string);
+			buf += fmt::format("* {} FETCH (UID {} FLAGS {} MODSEQ ({}))\r\n",
+			       ct_item->id, chg.uid, flags_string, chg.modseq);
+		}
+	}
 	if (g_rfc9051_enable)
 		buf += fmt::format("* LIST () \"/\" {}\r\n", quote_encode(argv[2]));
 	buf += fmt::format("{} OK [{}] {} completed\r\n",
@@ -1572,6 +1902,33 @@ int icp_examine(int argc, char **argv, imap_context &ctx)
 	return icp_selex(argc, argv, ctx, true);
 }
 
+/* RFC 5161 */
+int icp_enable(int argc, char **argv, imap_context &ctx) try
+{
+	if (!ctx.is_authed())
+		return 1804;
+	if (argc < 3)
+		return 1800;
+	std::string buf = "* ENABLED";
+	for (int i = 2; i < argc; ++i) {
+		if (strcasecmp(argv[i], "CONDSTORE") == 0) {
+			if (!ctx.b_condstore)
+				buf += " CONDSTORE";
+			ctx.b_condstore = true;
+		} else if (strcasecmp(argv[i], "QRESYNC") == 0) {
+			if (!ctx.b_qresync)
+				buf += " QRESYNC";
+			/* QRESYNC implies CONDSTORE (RFC 7162 §3.2.3) */
+			ctx.b_condstore = ctx.b_qresync = true;
+		}
+	}
+	buf += fmt::format("\r\n{} OK ENABLE completed\r\n", argv[0]);
+	imap_parser_safe_write(&ctx, buf.c_str(), buf.size());
+	return DISPATCH_CONTINUE;
+} catch (const std::bad_alloc &) {
+	return 1915;
+}
+
 int icp_create(int argc, char **argv, imap_context &ctx)
 {
 	auto pcontext = &ctx;
@@ -1947,8 +2304,10 @@ int icp_status(int argc, char **argv, imap_context &ctx) try
 
 	size_t exists = 0, recent = 0, unseen = 0;
 	uint32_t uidvalid = 0, uidnext = 0;
+	uint64_t highest_modseq = 0;
 	auto ssr = midb_agent::summary_folder(pcontext->maildir, sys_name,
-	           &exists, &recent, &unseen, &uidvalid, &uidnext, &errnum);
+	           &exists, &recent, &unseen, &uidvalid, &uidnext,
+	           &highest_modseq, &errnum);
 	auto ret = m2icode(ssr, errnum);
 	if (ret != 0)
 		return ret;
@@ -1970,6 +2329,10 @@ int icp_status(int argc, char **argv, imap_context &ctx) try
 			buf += fmt::format("UIDVALIDITY {}", uidvalid);
 		else if (strcasecmp(temp_argv[i], "UNSEEN") == 0)
 			buf += fmt::format("UNSEEN {}", unseen);
+		else if (strcasecmp(temp_argv[i], "HIGHESTMODSEQ") == 0) {
+			buf += fmt::format("HIGHESTMODSEQ {}", highest_modseq);
+			pcontext->b_condstore = true;
+		}
 		else
 			return 1800;
 	}
@@ -2069,7 +2432,7 @@ int icp_append(int argc, char **argv, imap_context &ctx) try
 		uint32_t uidvalid = 0;
 		if (midb_agent::summary_folder(pcontext->maildir,
 		    sys_name, nullptr, nullptr, nullptr, &uidvalid, nullptr,
-		    &errnum) == MIDB_RESULT_OK &&
+		    nullptr, &errnum) == MIDB_RESULT_OK &&
 		    midb_agent::get_uid(pcontext->maildir, sys_name,
 		    mid_string.c_str(), &uid) == MIDB_RESULT_OK) {
 			buf = fmt::format("{} {} [APPENDUID {} {}] {}",
@@ -2203,7 +2566,7 @@ static int icp_append_end2(int argc, char **argv, imap_context &ctx) try
 		unsigned int uid = 0;
 		if (midb_agent::summary_folder(pcontext->maildir,
 		    sys_name, nullptr, nullptr, nullptr, &uidvalid,
-		    nullptr, &errnum) == MIDB_RESULT_OK &&
+		    nullptr, nullptr, &errnum) == MIDB_RESULT_OK &&
 		    midb_agent::get_uid(pcontext->maildir, sys_name,
 		    cmid.c_str(), &uid) == MIDB_RESULT_OK) {
 			buf = fmt::format("{} {} [APPENDUID {} {}] {}",
@@ -2328,6 +2691,31 @@ int icp_unselect(int argc, char **argv, imap_context &ctx)
 	return 1718;
 }
 
+/**
+ * RFC 7162 §3.1.5: if the criteria used MODSEQ, report the highest modseq
+ * among the matches. @result is the bare list of seqids or UIDs.
+ */
+static void icp_search_modseq(imap_context &ctx, int argc, char **argv,
+    std::string &result, bool by_uid)
+{
+	if (std::none_of(&argv[0], &argv[argc],
+	    [](const char *a) { return strcasecmp(a, "MODSEQ") == 0; }))
+		return;
+	ctx.b_condstore = true;
+	uint64_t max = 0;
+	for (const auto &num : gx_split(result, ' ')) {
+		if (num.empty())
+			continue;
+		auto n = strtoul(num.c_str(), nullptr, 10);
+		auto item = by_uid ? ctx.contents.get_itemx(n) :
+		            ctx.contents.get_item(n - 1);
+		if (item != nullptr && item->modseq > max)
+			max = item->modseq;
+	}
+	if (max != 0)
+		result += " (MODSEQ " + std::to_string(max) + ")";
+}
+
 int icp_search(int argc, char **argv, imap_context &ctx)
 {
 	auto pcontext = &ctx;
@@ -2341,10 +2729,11 @@ int icp_search(int argc, char **argv, imap_context &ctx)
 	auto ssr = midb_agent::search(pcontext->maildir,
 	           pcontext->selected_folder, pcontext->defcharset,
 	            argc - 2, &argv[2], buff, &errnum);
-	buff.insert(0, "* SEARCH ");
 	auto result = m2icode(ssr, errnum);
 	if (result != 0)
 		return result;
+	icp_search_modseq(*pcontext, argc - 2, &argv[2], buff, false);
+	buff.insert(0, "* SEARCH ");
 	buff.append("\r\n");
 	pcontext->stream.clear();
 	if (pcontext->stream.write(buff.c_str(), buff.size()) != STREAM_WRITE_OK)
@@ -2413,6 +2802,75 @@ static int fetch_trivial_uid(imap_context &ctx, const imap_seq_list &range_list,
 	return MIDB_LOCAL_ENOMEM;
 }
 
+/**
+ * Collect the modseqs of all messages changed after @since. If @vanish_filter
+ * is given, a VANISHED (EARLIER) response for the expunged UIDs within it is
+ * written to ctx.stream (RFC 7162 §3.2.6).
+ */
+static int icp_changedsince(imap_context &ctx, uint64_t since,
+    const imap_seq_list *vanish_filter,
+    std::unordered_map<uint32_t, uint64_t> &changed) try
+{
+	XARRAY xa;
+	std::vector<uint32_t> vanished;
+	uint64_t highest = 0;
+	int errnum = 0;
+	bool pruned = false;
+	auto ssr = icp_fetch_changed(ctx.maildir, ctx.selected_folder, since,
+	           xa, vanished, highest, &pruned, errnum);
+	auto ret = m2icode(ssr, errnum);
+	if (ret != 0)
+		return ret;
+	for (const auto &m : xa.m_vec)
+		changed.emplace(m.uid, m.modseq);
+	if (vanish_filter == nullptr)
+		return 0;
+	imap_seq_list gone;
+	if (pruned) {
+		uint32_t uidnext = 0;
+		ssr = midb_agent::summary_folder(ctx.maildir, ctx.selected_folder,
+		      nullptr, nullptr, nullptr, nullptr, &uidnext, nullptr, &errnum);
+		ret = m2icode(ssr, errnum);
+		if (ret != 0)
+			return ret;
+		gone = icp_missing_uids(xa, *vanish_filter, uidnext);
+	}
+	for (auto uid : vanished)
+		if (vanish_filter->contains(uid))
+			gone.insert(uid);
+	if (gone.size() == 0)
+		return 0;
+	auto buf = "* VANISHED (EARLIER) " + iseq_to_str(gone) + "\r\n";
+	if (ctx.stream.write(buf.c_str(), buf.size()) != STREAM_WRITE_OK)
+		return 1922;
+	return 0;
+} catch (const std::bad_alloc &) {
+	return 1915;
+}
+
+/**
+ * Parse the FETCH modifier list at @arg, if any, and set up @list_data
+ * accordingly. Returns false on syntax error.
+ */
+static bool icp_fetch_modifiers(imap_context &ctx, char *arg, bool uid_cmd,
+    mdi_list &list_data, bool *have_cs, uint64_t *changedsince,
+    bool *want_vanished)
+{
+	if (arg != nullptr) {
+		if (!icp_parse_modseq_mod(arg, "CHANGEDSINCE", changedsince,
+		    uid_cmd && ctx.b_qresync ? want_vanished : nullptr))
+			return false;
+		*have_cs = true;
+	}
+	bool want_modseq = std::any_of(list_data.cbegin(), list_data.cend(),
+	                   [](const std::string &e) { return strcasecmp(e.c_str(), "MODSEQ") == 0; });
+	if (*have_cs && !want_modseq)
+		list_data.emplace_back("MODSEQ");
+	if (*have_cs || want_modseq)
+		ctx.b_condstore = true;
+	return true;
+}
+
 int icp_fetch(int argc, char **argv, imap_context &ctx)
 {
 	auto pcontext = &ctx;
@@ -2430,15 +2888,25 @@ int icp_fetch(int argc, char **argv, imap_context &ctx)
 	if (!icp_parse_fetch_args(list_data, &b_detail,
 	    &b_data, argv[3], tmp_argv, std::size(tmp_argv)))
 		return 1800;
+	bool have_cs = false, want_vanished = false;
+	uint64_t changedsince = 0;
+	if (!icp_fetch_modifiers(*pcontext, argc > 4 ? argv[4] : nullptr,
+	    false, list_data, &have_cs, &changedsince, &want_vanished))
+		return 1800;
 	XARRAY xarray;
 	auto ssr = b_detail ?
-	           midb_agent::fetch_detail_uid(pcontext->maildir,
-	           pcontext->selected_folder, list_uid, &xarray, &errnum) :
+	           icp_fetch_detail(*pcontext, list_uid, list_data, xarray, &errnum) :
 	           fetch_trivial_uid(*pcontext, list_uid, xarray);
 	auto result = m2icode(ssr, errnum);
 	if (result != 0)
 		return result;
 	pcontext->stream.clear();
+	std::unordered_map<uint32_t, uint64_t> changed;
+	if (have_cs) {
+		result = icp_changedsince(*pcontext, changedsince, nullptr, changed);
+		if (result != 0)
+			return result;
+	}
 	num = xarray.get_capacity();
 	imrpc_build_env();
 	auto cl_0 = HX::make_scope_exit(imrpc_free_env);
@@ -2451,6 +2919,14 @@ int icp_fetch(int argc, char **argv, imap_context &ctx)
 		auto ct_item = pcontext->contents.get_itemx(pitem->uid);
 		if (ct_item == nullptr)
 			continue;
+		if (have_cs) {
+			auto it = changed.find(pitem->uid);
+			if (it == changed.end())
+				continue;
+			pitem->modseq = it->second;
+		} else {
+			pitem->modseq = ct_item->modseq;
+		}
 		result = icp_process_fetch_item(ctx, b_data,
 		         pitem, ct_item->id, list_data);
 		if (result != 0)
@@ -2483,7 +2959,92 @@ static bool store_flagkeyword(const char *str)
 	return false;
 }
 
-int icp_store(int argc, char **argv, imap_context &ctx)
+/**
+ * With CONDSTORE enabled, STORE answers with FETCH responses that carry the
+ * new modseq (RFC 7162 §3.1.3). icp_store_flags was run in silent mode for
+ * @stored (uids); emit the responses here instead.
+ */
+static int icp_store_echo(imap_context &ctx, uint64_t since,
+    const std::vector<uint32_t> &stored, bool with_flags, bool with_uid) try
+{
+	XARRAY xa;
+	std::vector<uint32_t> vanished;
+	uint64_t highest = 0;
+	int errnum = 0;
+	bool pruned = false;
+	auto ssr = icp_fetch_changed(ctx.maildir, ctx.selected_folder, since,
+	           xa, vanished, highest, &pruned, errnum);
+	auto ret = m2icode(ssr, errnum);
+	if (ret != 0)
+		return ret;
+	std::string buf;
+	for (auto uid : stored) {
+		auto chg = xa.get_itemx(uid);
+		auto ct_item = ctx.contents.get_itemx(uid);
+		if (chg == nullptr || ct_item == nullptr)
+			continue;
+		buf += fmt::format("* {} FETCH (", ct_item->id);
+		if (with_flags) {
+			char flags_string[128];
+			icp_convert_flags_string(chg->flag_bits, flags_string);
+			buf += "FLAGS "s + flags_string + " ";
+		}
+		if (with_uid)
+			buf += fmt::format("UID {} ", uid);
+		buf += fmt::format("MODSEQ ({}))\r\n", chg->modseq);
+	}
+	if (!buf.empty())
+		imap_parser_safe_write(&ctx, buf.c_str(), buf.size());
+	return 0;
+} catch (const std::bad_alloc &) {
+	return 1915;
+}
+
+/**
+ * STORE with UNCHANGEDSINCE. midb compares the modseqs and changes the flags
+ * in one step, so no other session can get in between (RFC 7162 §3.1.3).
+ * Messages that failed the comparison go to @modified (as UIDs with @uid_cmd,
+ * else as sequence numbers), the others to @stored (as UIDs).
+ */
+static int icp_store_unchanged(imap_context &ctx, XARRAY &xarray,
+    const char *cmd, unsigned int flag_bits, uint64_t unchangedsince,
+    bool uid_cmd, imap_seq_list &modified, std::vector<uint32_t> &stored) try
+{
+	std::vector<std::string> mids;
+	size_t num = xarray.get_capacity();
+	for (size_t i = 0; i < num; ++i) {
+		auto pitem = xarray.get_item(i);
+		if (ctx.contents.get_itemx(pitem->uid) != nullptr)
+			mids.push_back(pitem->mid);
+	}
+	char op = *cmd == '+' || *cmd == '-' ? *cmd : '=';
+	std::vector<uint32_t> failed;
+	int errnum = 0;
+	auto ssr = midb_agent::store_flags_unchanged(ctx.maildir,
+	           ctx.selected_folder, mids, op, flag_bits, unchangedsince,
+	           failed, &errnum);
+	auto ret = m2icode(ssr, errnum);
+	if (ret != 0)
+		return ret;
+	std::sort(failed.begin(), failed.end());
+	for (size_t i = 0; i < num; ++i) {
+		auto pitem = xarray.get_item(i);
+		auto ct_item = ctx.contents.get_itemx(pitem->uid);
+		if (ct_item == nullptr)
+			continue;
+		if (std::binary_search(failed.begin(), failed.end(), pitem->uid)) {
+			modified.insert(uid_cmd ? pitem->uid : ct_item->id);
+			continue;
+		}
+		imap_parser_bcast_flags(ctx, pitem->uid);
+		stored.push_back(pitem->uid);
+	}
+	return 0;
+} catch (const std::bad_alloc &) {
+	return 1915;
+}
+
+int icp_store(int argc, char **argv, imap_context &ctx) try
 {
 	auto pcontext = &ctx;
 	int errnum, i;
@@ -2494,17 +3055,30 @@ int icp_store(int argc, char **argv, imap_context &ctx)
 
 	if (pcontext->proto_stat != iproto_stat::select)
 		return 1805;
-	if (argc < 5 || parse_imap_seqx(*pcontext, argv[2], list_uid) != 0 ||
-	    !store_flagkeyword(argv[3]))
+	if (argc < 5 || parse_imap_seqx(*pcontext, argv[2], list_uid) != 0)
 		return 1800;
-	if ('(' == argv[4][0] && ')' == argv[4][strlen(argv[4]) - 1]) {
-		temp_argc = parse_imap_args(argv[4] + 1, strlen(argv[4]) - 2,
+	/* RFC 7162 §3.1.3 */
+	bool have_ucs = false;
+	uint64_t unchangedsince = 0;
+	int kw = 3;
+	if (argv[kw][0] == '(') {
+		if (!icp_parse_modseq_mod(argv[kw], "UNCHANGEDSINCE",
+		    &unchangedsince, nullptr))
+			return 1800;
+		have_ucs = true;
+		++kw;
+	}
+	if (argc < kw + 2 || !store_flagkeyword(argv[kw]))
+		return 1800;
+	auto flag_arg = argv[kw+1];
+	if ('(' == flag_arg[0] && ')' == flag_arg[strlen(flag_arg) - 1]) {
+		temp_argc = parse_imap_args(flag_arg + 1, strlen(flag_arg) - 2,
 		            temp_argv, std::size(temp_argv));
 		if (temp_argc == -1)
 			return 1800;
 	} else {
 		temp_argc = 1;
-		temp_argv[0] = argv[4];
+		temp_argv[0] = flag_arg;
 	}
 	if (pcontext->b_readonly)
 		return 1806;
@@ -2531,18 +3105,49 @@ int icp_store(int argc, char **argv, imap_context &ctx)
 	auto result = m2icode(ssr, errnum);
 	if (result != 0)
 		return result;
-	int num = xarray.get_capacity();
-	for (i=0; i<num; i++) {
-		auto pitem = xarray.get_item(i);
-		auto ct_item = pcontext->contents.get_itemx(pitem->uid);
-		if (ct_item == nullptr)
-			continue;
-		icp_store_flags(argv[3], pitem->mid,
-			ct_item->id, 0, flag_bits, ctx);
-		imap_parser_bcast_flags(*pcontext, pitem->uid);
+	if (have_ucs)
+		pcontext->b_condstore = true;
+	/* Without modseqs in the folder, plain STORE responses it is */
+	auto since = pcontext->contents.highest_modseq;
+	bool condstore = pcontext->b_condstore && since != 0;
+	std::string cmd = argv[kw];
+	bool silent = cmd.size() > 7 && strcasecmp(&cmd[cmd.size()-7], ".SILENT") == 0;
+	if (condstore && !silent)
+		cmd += ".SILENT";
+	imap_seq_list modified;
+	std::vector<uint32_t> stored;
+	if (have_ucs) {
+		result = icp_store_unchanged(*pcontext, xarray, cmd.c_str(),
+		         flag_bits, unchangedsince, false, modified, stored);
+		if (result != 0)
+			return result;
+	} else {
+		int num = xarray.get_capacity();
+		for (i = 0; i < num; ++i) {
+			auto pitem = xarray.get_item(i);
+			auto ct_item = pcontext->contents.get_itemx(pitem->uid);
+			if (ct_item == nullptr)
+				continue;
+			icp_store_flags(cmd.c_str(), pitem->mid,
+				ct_item->id, 0, flag_bits, ctx);
+			imap_parser_bcast_flags(*pcontext, pitem->uid);
+			stored.push_back(pitem->uid);
+		}
+	}
+	if (condstore) {
+		result = icp_store_echo(*pcontext, since, stored, !silent, false);
+		if (result != 0)
+			return result;
 	}
 	imap_parser_echo_modify(pcontext, NULL);
-	return 1721;
+	if (modified.size() == 0)
+		return 1721;
+	auto buf = fmt::format("{} OK [MODIFIED {}] conditional STORE failed for some messages\r\n",
+	           argv[0], iseq_to_str(modified));
+	imap_parser_safe_write(pcontext, buf.c_str(), buf.size());
+	return DISPATCH_CONTINUE;
+} catch (const std::bad_alloc &) {
+	return 1915;
 }
 
 int icp_copy(int argc, char **argv, imap_context &ctx) try
@@ -2571,7 +3176,7 @@ int icp_copy(int argc, char **argv, imap_context &ctx) try
 	uint32_t uidvalidity = 0;
 	if (midb_agent::summary_folder(pcontext->maildir,
 	    sys_name, nullptr, nullptr, nullptr, &uidvalidity, nullptr,
-	    &errnum) != MIDB_RESULT_OK)
+	    nullptr, &errnum) != MIDB_RESULT_OK)
 		uidvalidity = 0;
 	b_copied = TRUE;
 	b_first = FALSE;
@@ -2661,10 +3266,11 @@ int icp_uid_search(int argc, char **argv, imap_context &ctx) try
 	auto ssr = midb_agent::search_uid(pcontext->maildir,
 	           pcontext->selected_folder, pcontext->defcharset,
 	           argc - 3, &argv[3], buff, &errnum);
-	buff.insert(0, "* SEARCH ");
 	auto ret = m2icode(ssr, errnum);
 	if (ret != 0)
 		return ret;
+	icp_search_modseq(*pcontext, argc - 3, &argv[3], buff, true);
+	buff.insert(0, "* SEARCH ");
 	buff.append("\r\n");
 	pcontext->stream.clear();
 	if (pcontext->stream.write(buff.c_str(), buff.size()) != STREAM_WRITE_OK)
@@ -2704,16 +3310,27 @@ int icp_uid_fetch(int argc, char **argv, imap_context &ctx) try
 	if (std::none_of(list_data.cbegin(), list_data.cend(),
 	    [](const std::string &e) { return strcasecmp(e.c_str(), "UID") == 0; }))
 		list_data.emplace_back("UID");
+	bool have_cs = false, want_vanished = false;
+	uint64_t changedsince = 0;
+	if (!icp_fetch_modifiers(*pcontext, argc > 5 ? argv[5] : nullptr,
+	    true, list_data, &have_cs, &changedsince, &want_vanished))
+		return 1800;
 	XARRAY xarray;
 	auto ssr = b_detail ?
-	           midb_agent::fetch_detail_uid(pcontext->maildir,
-	           pcontext->selected_folder, list_seq, &xarray, &errnum) :
+	           icp_fetch_detail(*pcontext, list_seq, list_data, xarray, &errnum) :
 	           midb_agent::fetch_simple_uid(pcontext->maildir,
 	           pcontext->selected_folder, list_seq, &xarray, &errnum);
 	auto ret = m2icode(ssr, errnum);
 	if (ret != 0)
 		return ret;
 	pcontext->stream.clear();
+	std::unordered_map<uint32_t, uint64_t> changed;
+	if (have_cs) {
+		ret = icp_changedsince(*pcontext, changedsince,
+		      want_vanished ? &list_seq : nullptr, changed);
+		if (ret != 0)
+			return ret;
+	}
 	num = xarray.get_capacity();
 	imrpc_build_env();
 	auto cl_0 = HX::make_scope_exit(imrpc_free_env);
@@ -2722,6 +3339,14 @@ int icp_uid_fetch(int argc, char **argv, imap_context &ctx) try
 		auto ct_item = pcontext->contents.get_itemx(pitem->uid);
 		if (ct_item == nullptr)
 			continue;
+		if (have_cs) {
+			auto it = changed.find(pitem->uid);
+			if (it == changed.end())
+				continue;
+			pitem->modseq = it->second;
+		} else {
+			pitem->modseq = ct_item->modseq;
+		}
 		ret = icp_process_fetch_item(ctx, b_data,
 		      pitem, ct_item->id, list_data);
 		if (ret != 0)
@@ -2746,7 +3371,7 @@ int icp_uid_fetch(int argc, char **argv, imap_context &ctx) try
 	return 1918;
 }
 
-int icp_uid_store(int argc, char **argv, imap_context &ctx)
+int icp_uid_store(int argc, char **argv, imap_context &ctx) try
 {
 	auto pcontext = &ctx;
 	int errnum, i, flag_bits, temp_argc;
@@ -2755,17 +3380,30 @@ int icp_uid_store(int argc, char **argv, imap_context &ctx)
 
 	if (pcontext->proto_stat != iproto_stat::select)
 		return 1805;
-	if (argc < 6 || parse_imap_seq(list_seq, argv[3]) != 0 ||
-	    !store_flagkeyword(argv[4]))
+	if (argc < 6 || parse_imap_seq(list_seq, argv[3]) != 0)
 		return 1800;
-	if ('(' == argv[5][0] && ')' == argv[5][strlen(argv[5]) - 1]) {
-		temp_argc = parse_imap_args(argv[5] + 1, strlen(argv[5]) - 2,
+	/* RFC 7162 §3.1.3 */
+	bool have_ucs = false;
+	uint64_t unchangedsince = 0;
+	int kw = 4;
+	if (argv[kw][0] == '(') {
+		if (!icp_parse_modseq_mod(argv[kw], "UNCHANGEDSINCE",
+		    &unchangedsince, nullptr))
+			return 1800;
+		have_ucs = true;
+		++kw;
+	}
+	if (argc < kw + 2 || !store_flagkeyword(argv[kw]))
+		return 1800;
+	auto flag_arg = argv[kw+1];
+	if ('(' == flag_arg[0] && ')' == flag_arg[strlen(flag_arg) - 1]) {
+		temp_argc = parse_imap_args(flag_arg + 1, strlen(flag_arg) - 2,
 		            temp_argv, std::size(temp_argv));
 		if (temp_argc == -1)
 			return 1800;
 	} else {
 		temp_argc = 1;
-		temp_argv[0] = argv[5];
+		temp_argv[0] = flag_arg;
 	}
 	if (pcontext->b_readonly)
 		return 1806;
@@ -2792,18 +3430,49 @@ int icp_uid_store(int argc, char **argv, imap_context &ctx)
 	auto ret = m2icode(ssr, errnum);
 	if (ret != 0)
 		return ret;
-	int num = xarray.get_capacity();
-	for (i=0; i<num; i++) {
-		auto pitem = xarray.get_item(i);
-		auto ct_item = pcontext->contents.get_itemx(pitem->uid);
-		if (ct_item == nullptr)
-			continue;
-		icp_store_flags(argv[4], pitem->mid,
-			ct_item->id, pitem->uid, flag_bits, ctx);
-		imap_parser_bcast_flags(*pcontext, pitem->uid);
+	if (have_ucs)
+		pcontext->b_condstore = true;
+	/* Without modseqs in the folder, plain STORE responses it is */
+	auto since = pcontext->contents.highest_modseq;
+	bool condstore = pcontext->b_condstore && since != 0;
+	std::string cmd = argv[kw];
+	bool silent = cmd.size() > 7 && strcasecmp(&cmd[cmd.size()-7], ".SILENT") == 0;
+	if (condstore && !silent)
+		cmd += ".SILENT";
+	imap_seq_list modified;
+	std::vector<uint32_t> stored;
+	if (have_ucs) {
+		ret = icp_store_unchanged(*pcontext, xarray, cmd.c_str(),
+		      flag_bits, unchangedsince, true, modified, stored);
+		if (ret != 0)
+			return ret;
+	} else {
+		int num = xarray.get_capacity();
+		for (i = 0; i < num; ++i) {
+			auto pitem = xarray.get_item(i);
+			auto ct_item = pcontext->contents.get_itemx(pitem->uid);
+			if (ct_item == nullptr)
+				continue;
+			icp_store_flags(cmd.c_str(), pitem->mid,
+				ct_item->id, pitem->uid, flag_bits, ctx);
+			imap_parser_bcast_flags(*pcontext, pitem->uid);
+			stored.push_back(pitem->uid);
+		}
+	}
+	if (condstore) {
+		ret = icp_store_echo(*pcontext, since, stored, !silent, true);
+		if (ret != 0)
+			return ret;
 	}
 	imap_parser_echo_modify(pcontext, NULL);
-	return 1724;
+	if (modified.size() == 0)
+		return 1724;
+	auto buf = fmt::format("{} OK [MODIFIED {}] conditional STORE failed for some messages\r\n",
+	           argv[0], iseq_to_str(modified));
+	imap_parser_safe_write(pcontext, buf.c_str(), buf.size());
+	return DISPATCH_CONTINUE;
+} catch (const std::bad_alloc &) {
+	return 1915;
 }
 
 int icp_uid_copy(int argc, char **argv, imap_context &ctx) try
@@ -2832,7 +3501,7 @@ int icp_uid_copy(int argc, char **argv, imap_context &ctx) try
 	uint32_t uidvalidity = 0;
 	if (midb_agent::summary_folder(pcontext->maildir,
 	    sys_name, nullptr, nullptr, nullptr, &uidvalidity,
-	    nullptr, &errnum) != MIDB_RESULT_OK)
+	    nullptr, nullptr, &errnum) != MIDB_RESULT_OK)
 		uidvalidity = 0;
 	b_copied = TRUE;
 	b_first = FALSE;
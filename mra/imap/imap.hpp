@@ -76,6 +76,11 @@ struct content_array final : public XARRAY {
 	int refresh(imap_context &, const std::string &folder, bool with_expunges = false);
 	inline size_t n_exists() const { return m_vec.size(); }
 	unsigned int n_recent = 0, firstunseen = -1;
+	/* modseq the listing is current to; 0 if midb has none (NOMODSEQ) */
+	uint64_t highest_modseq = 0;
+
+	private:
+	void merge_changes(XARRAY &&, const std::vector<uint32_t> &vanished, bool with_expunges, uint64_t modseq);
 };
 
 /**
@@ -107,7 +112,14 @@ struct imap_context final : public schedule_context {
 	content_array contents;
 	std::string wrdat_backing;
 	const std::string *wrdat_content = nullptr;
+	/* When set, wrdat_backing is a window into this eml, streamed from exmdb */
+	std::string wrdat_mid;
+	uint64_t wrdat_fpos = 0;
+	/* exmdb lacks imapfile_read_range; whole eml of eml_whole_mid kept instead */
+	bool eml_norange = false;
+	std::string eml_whole_mid, eml_whole;
 	BOOL b_readonly = false; /* is selected folder read only, this is for the examine command */
+	bool b_condstore = false, b_qresync = false; /* RFC 7162 state, session-wide */
 	std::atomic<unsigned int> async_change_mask{0};
 	/*
 	 * Because one mail can get repeatedly re-flagged, f_flags is modeled
@@ -160,6 +172,7 @@ extern int icp_username(int argc, char **argv, imap_context &);
 extern int icp_password(int argc, char **argv, imap_context &);
 extern int icp_login(int argc, char **argv, imap_context &);
 extern int icp_idle(int argc, char **argv, imap_context &);
+extern int icp_enable(int argc, char **argv, imap_context &);
 extern int icp_select(int argc, char **argv, imap_context &);
 extern int icp_examine(int argc, char **argv, imap_context &);
 extern int icp_create(int argc, char **argv, imap_context &);
@@ -188,8 +201,10 @@ extern int icp_uid_store(int argc, char **argv, imap_context &);
 extern int icp_uid_copy(int argc, char **argv, imap_context &);
 extern int icp_uid_expunge(int argc, char **argv, imap_context &);
 extern int icp_dval(int argc, char **argv, imap_context &, unsigned int res);
+extern bool icp_eml_read_range(imap_context &, const std::string &mid, uint64_t of, uint32_t len, uint64_t *size, std::string *data);
 
 extern char *capability_list(char *, size_t, imap_context *);
+extern std::string iseq_to_str(const gromox::imap_seq_list &);
 
 extern int resource_run();
 extern void resource_stop();
@@ -234,7 +234,7 @@ static void *imls_thrwork(void *arg)
 			continue;
 		}
 		if (!use_tls) {
-			char caps[128];
+			char caps[256];
 			capability_list(caps, std::size(caps), ctx);
 			if (HXio_fullwrite(conn.sockd, "* OK [CAPABILITY ", 17) < 0 ||
 			    HXio_fullwrite(conn.sockd, caps, strlen(caps)) < 0 ||
@@ -322,7 +322,7 @@ static void listener_stop_accept()
 
 char *capability_list(char *dst, size_t z, imap_context *ctx)
 {
-	gx_strlcpy(dst, "IMAP4rev1 XLIST SPECIAL-USE UNSELECT UIDPLUS IDLE AUTH=LOGIN LITERAL+ LITERAL-", z);
+	gx_strlcpy(dst, "IMAP4rev1 XLIST SPECIAL-USE UNSELECT UIDPLUS IDLE AUTH=LOGIN LITERAL+ LITERAL- ENABLE CONDSTORE QRESYNC", z);
 	bool offer_tls = g_support_tls;
 	if (ctx != nullptr) {
 		if (ctx->connection.ssl != nullptr || ctx->is_authed())
@@ -50,6 +50,8 @@
 #define SCAN_INTERVAL			3600
 
 #define SELECT_INTERVAL			20*60
+/* Streamed literals are pulled from exmdb in pieces of this size */
+#define WRDAT_CHUNK				(1024 * 1024)
 
 using namespace std::string_literals;
 using namespace gromox;
@@ -305,7 +307,7 @@ static tproc_status ps_stat_stls(imap_context &ctx)
 	if (SSL_accept(pcontext->connection.ssl) != -1) {
 		pcontext->sched_stat = isched_stat::rdcmd;
 		if (pcontext->connection.server_port == g_listener_ssl_port) {
-			char caps[128];
+			char caps[256];
 			capability_list(caps, std::size(caps), pcontext);
 			SSL_write(pcontext->connection.ssl, "* OK [CAPABILITY ", 17);
 			SSL_write(pcontext->connection.ssl, caps, strlen(caps));
@@ -757,6 +759,31 @@ static tproc_status ps_stat_appending(imap_context &ctx)
 	return tproc_status::cmd_processing;
 }
 
+/*
+ * Number of bytes of the current literal that are in memory at wrdat_offset.
+ * For streamed eml files, the next piece is fetched once the window is used
+ * up. Returns 0 on failure.
+ */
+static size_t imap_parser_wrdat_window(imap_context &ctx) try
+{
+	if (ctx.wrdat_offset < ctx.wrdat_content->size() || ctx.wrdat_mid.empty())
+		return ctx.wrdat_content->size() - ctx.wrdat_offset;
+	imrpc_build_env();
+	auto cl_0 = HX::make_scope_exit(imrpc_free_env);
+	uint64_t size = 0;
+	ctx.wrdat_backing.clear();
+	ctx.wrdat_offset = 0;
+	if (!icp_eml_read_range(ctx, ctx.wrdat_mid, ctx.wrdat_fpos,
+	    std::min(ctx.literal_len - ctx.current_len, WRDAT_CHUNK),
+	    &size, &ctx.wrdat_backing))
+		return 0;
+	ctx.wrdat_fpos += ctx.wrdat_backing.size();
+	return ctx.wrdat_backing.size();
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-1786: ENOMEM");
+	return 0;
+}
+
 static tproc_status ps_stat_wrdat(imap_context &ctx)
 {
 	auto pcontext = &ctx;
@@ -808,9 +835,17 @@ static tproc_status ps_stat_wrdat(imap_context &ctx)
 		}
 		return tproc_status::cont;
 	}
-	auto len = pcontext->literal_len - pcontext->current_len;
+	size_t len = pcontext->literal_len - pcontext->current_len;
 	if (len > 64 * 1024)
 		len = 64 * 1024;
+	auto avail = imap_parser_wrdat_window(ctx);
+	if (avail == 0) {
+		/* IMAP_CODE_2180008: internal error, fail to retrieve from stream object */
+		size_t string_length = 0;
+		auto imap_reply_str = resource_get_imap_code(1808, 1, &string_length);
+		return ps_end_processing(pcontext, imap_reply_str, string_length);
+	}
+	len = std::min(len, avail);
 	memcpy(ctx.write_buff, &ctx.wrdat_content->operator[](ctx.wrdat_offset), len);
 	ctx.wrdat_offset += len;
 	pcontext->current_len += len;
@@ -982,16 +1017,28 @@ static int imap_parser_wrdat_retrieve(imap_context &ctx)
 				*ptr1 = '\0';
 				ctx.wrdat_backing = {};
 				ctx.wrdat_content = nullptr;
+				ctx.wrdat_mid.clear();
+				size_t want = strtoul(&ptr1[1], nullptr, 0);
+				uint64_t fpos = strtoul(&ptr[1], nullptr, 0), fsize = 0;
 				try {
 					auto eml_path = ctx.maildir + "/eml/"s + (last_line + 8);
-					ctx.wrdat_content = ctx.io_actor.get_full(eml_path);
-					if (ctx.wrdat_content == nullptr) {
-						ctx.wrdat_backing = {};
+					auto it = ctx.io_actor.m_cache.find(eml_path);
+					if (ctx.io_actor.valid(it)) {
+						ctx.wrdat_content = &it->second;
+						ctx.wrdat_offset = fpos;
+						fsize = it->second.size();
+					} else {
+						/* Stream the literal from exmdb piece by piece */
 						imrpc_build_env();
 						auto cl_0 = HX::make_scope_exit(imrpc_free_env);
-						if (exmdb_client->imapfile_read(ctx.maildir, "eml",
-						    &last_line[8], &ctx.wrdat_backing))
+						if (icp_eml_read_range(ctx, &last_line[8], fpos,
+						    std::min(want, static_cast<size_t>(WRDAT_CHUNK)), &fsize,
+						    &ctx.wrdat_backing)) {
 							ctx.wrdat_content = &ctx.wrdat_backing;
+							ctx.wrdat_mid = &last_line[8];
+							ctx.wrdat_offset = 0;
+							ctx.wrdat_fpos = fpos + ctx.wrdat_backing.size();
+						}
 					}
 				} catch (const std::bad_alloc &) {
 					mlog(LV_ERR, "E-1466: ENOMEM");
@@ -1000,20 +1047,20 @@ static int imap_parser_wrdat_retrieve(imap_context &ctx)
 					strcpy(&pcontext->write_buff[pcontext->write_length], "NIL");
 					pcontext->write_length += 3;
 				} else {
-					ctx.wrdat_offset = strtoul(&ptr[1], nullptr, 0);
-					if (ctx.wrdat_offset > ctx.wrdat_content->size()) {
+					if (fpos > fsize) {
 						mlog(LV_ERR, "E-1758");
 						ctx.wrdat_backing = {};
 						ctx.wrdat_content = nullptr;
 						return IMAP_RETRIEVE_ERROR;
 					}
-					ctx.literal_len = std::min(static_cast<size_t>(strtoul(&ptr1[1], nullptr, 0)),
-					                  ctx.wrdat_content->size() - ctx.wrdat_offset);
+					ctx.literal_len = std::min(static_cast<uint64_t>(want), fsize - fpos);
 					pcontext->current_len = 0;
 					pcontext->write_length += sprintf(&pcontext->write_buff[pcontext->write_length], "{%u}\r\n", pcontext->literal_len);
 					len = MAX_LINE_LENGTH - pcontext->write_length;
 					if (len > pcontext->literal_len)
 						len = pcontext->literal_len;
+					if (static_cast<size_t>(len) > ctx.wrdat_content->size() - ctx.wrdat_offset)
+						len = ctx.wrdat_content->size() - ctx.wrdat_offset;
 					memcpy(&ctx.write_buff[ctx.write_length], &ctx.wrdat_content->operator[](ctx.wrdat_offset), len);
 					ctx.wrdat_offset += len;
 					pcontext->current_len += len;
@@ -1037,6 +1084,7 @@ static int imap_parser_wrdat_retrieve(imap_context &ctx)
 				*ptr1 = '\0';
 				ctx.wrdat_backing = {};
 				ctx.wrdat_content = nullptr;
+				ctx.wrdat_mid.clear();
 				try {
 					auto eml_path = pcontext->maildir + "/tmp/imap.rfc822/"s + (last_line + 10);
 					ctx.wrdat_content = ctx.io_actor.get_full(eml_path);
@@ -1242,6 +1290,21 @@ void imap_parser_event_expunge(const char *user, const char *folder, unsigned in
 static void imap_parser_echo_expunges(imap_context &ctx, STREAM *stream,
     const std::vector<unsigned int> &exp_list) try
 {
+	if (ctx.b_qresync) {
+		/* RFC 7162 §3.2.10: VANISHED replaces EXPUNGE */
+		imap_seq_list uids;
+		for (auto uid : exp_list)
+			if (ctx.contents.get_itemx(uid) != nullptr)
+				uids.insert(uid);
+		if (uids.size() == 0)
+			return;
+		auto buf = "* VANISHED " + iseq_to_str(uids) + "\r\n";
+		if (stream == nullptr)
+			ctx.connection.write(buf.c_str(), buf.size());
+		else
+			stream->write(buf.c_str(), buf.size());
+		return;
+	}
 	std::vector<unsigned int> seqid_list;
 	for (auto uid : exp_list) {
 		auto item = ctx.contents.get_itemx(uid);
@@ -1298,8 +1361,10 @@ void imap_parser_echo_modify(imap_context *pcontext, STREAM *pstream)
 		auto item = pcontext->contents.get_itemx(uid);
 		if (item == nullptr)
 			continue;
-		unsigned int flag_bits = 0;
-		if (midb_agent::get_flags(pcontext->maildir,
+		/* With modseqs, refresh() has already picked up the new flags */
+		unsigned int flag_bits = item->flag_bits;
+		if (pcontext->contents.highest_modseq == 0 &&
+		    midb_agent::get_flags(pcontext->maildir,
 		    pcontext->selected_folder, item->mid, &flag_bits,
 		    &err) != MIDB_RESULT_OK)
 			continue;
@@ -1338,7 +1403,14 @@ void imap_parser_echo_modify(imap_context *pcontext, STREAM *pstream)
 				buff[outlen++] = ' ';
 			outlen += gx_snprintf(&buff[outlen], std::size(buff) - outlen, "\\Draft");
 		}
-		outlen += gx_snprintf(&buff[outlen], std::size(buff) - outlen, "))\r\n");
+		outlen += gx_snprintf(&buff[outlen], std::size(buff) - outlen, ")");
+		if (pcontext->b_qresync)
+			outlen += gx_snprintf(&buff[outlen], std::size(buff) - outlen,
+			          " UID %d", item->uid);
+		if (pcontext->b_condstore && item->modseq != 0)
+			outlen += gx_snprintf(&buff[outlen], std::size(buff) - outlen,
+			          " MODSEQ (%llu)", static_cast<unsigned long long>(item->modseq));
+		outlen += gx_snprintf(&buff[outlen], std::size(buff) - outlen, ")\r\n");
 		if (pstream == nullptr)
 			pcontext->connection.write(buff, outlen);
 		else if (pstream->write(buff, outlen) != STREAM_WRITE_OK)
@@ -1365,6 +1437,7 @@ static int imap_parser_dispatch_cmd2(int argc, char **argv,
 		{"COPY", icp_copy},
 		{"CREATE", icp_create},
 		{"DELETE", icp_delete},
+		{"ENABLE", icp_enable},
 		{"EXAMINE", icp_examine},
 		{"EXPUNGE", icp_expunge},
 		{"FETCH", icp_fetch},
@@ -1461,6 +1534,9 @@ static void imap_parser_context_clear(imap_context *pcontext)
 	pcontext->sched_stat = isched_stat::none;
 	ctx.wrdat_backing = {};
 	ctx.wrdat_content = nullptr;
+	ctx.eml_norange = false;
+	ctx.eml_whole_mid.clear();
+	ctx.eml_whole = {};
 	pcontext->mid.clear();
 	pcontext->write_buff = nullptr;
 	pcontext->write_length = 0;
@@ -1468,6 +1544,9 @@ static void imap_parser_context_clear(imap_context *pcontext)
 	pcontext->selected_time = 0;
 	pcontext->selected_folder.clear();
 	pcontext->b_readonly = false;
+	pcontext->b_condstore = pcontext->b_qresync = false;
+	pcontext->contents.clear();
+	pcontext->contents.highest_modseq = 0;
 	pcontext->tag_string[0] = '\0';
 	pcontext->command_len = 0;
 	pcontext->command_buffer[0] = '\0';
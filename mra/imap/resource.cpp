@@ -157,6 +157,7 @@ static constexpr std::pair<unsigned int, const char *> g_default_code_table[] =
 	{2000 | MIDB_E_SSGETID, "User unresolvable"},
 	{2000 | MIDB_E_ACCESS_DENIED, "Access denied"},
 	{2000 | MIDB_E_NOTPERMITTED, "Operation not permitted"},
+	{2000 | MIDB_E_MODSEQ_PRUNED, "midb: expunge records for that modseq no longer available"},
 };
 
 static std::unordered_map<unsigned int, std::string> g_def_code_table;
@@ -636,11 +636,12 @@ int get_uid(const char *path, const std::string &folder,
 
 int summary_folder(const char *path, const std::string &folder, size_t *pexists,
     size_t *precent, size_t *punseen, uint32_t *puidvalid, uint32_t *puidnext,
-    int *perrno)
+    uint64_t *phighest_modseq, int *perrno)
 {
 	char buff[1024];
 	size_t exists, recent, unseen;
 	unsigned long uidvalid, uidnext;
+	unsigned long long highest_modseq = 0;
 
 	auto pback = get_connection(path);
 	if (pback == nullptr)
@@ -658,8 +659,9 @@ int summary_folder(const char *path, const std::string &folder, size_t *pexists,
 		return MIDB_RDWR_ERROR;
 	}
 
-	if (sscanf(buff, "TRUE %zu %zu %zu %lu %lu", &exists,
-	    &recent, &unseen, &uidvalid, &uidnext) != 5) {
+	/* highestmodseq is only sent by midb with schema EM-4 */
+	if (sscanf(buff, "TRUE %zu %zu %zu %lu %lu %llu", &exists,
+	    &recent, &unseen, &uidvalid, &uidnext, &highest_modseq) < 5) {
 		*perrno = -1;
 		pback.reset();
 		return MIDB_RESULT_ERROR;
@@ -674,6 +676,8 @@ int summary_folder(const char *path, const std::string &folder, size_t *pexists,
 		*puidvalid = uidvalid;
 	if (puidnext != nullptr)
 		*puidnext = uidnext;
+	if (phighest_modseq != nullptr)
+		*phighest_modseq = highest_modseq;
 	pback.reset();
 	return MIDB_RESULT_OK;
 }
@@ -1391,8 +1395,129 @@ int fetch_simple_uid(const char *path, const std::string &folder,
 	return MIDB_E_NO_MEMORY;
 }
 
+/**
+ * Retrieve the messages changed since @modseq (all messages if @modseq is 0)
+ * into @pxarray, and the UIDs of messages expunged since then into
+ * @vanished. Errors with MIDB_RESULT_ERROR/MIDB_E_UNKNOWN_COMMAND if midb
+ * cannot provide modification sequences for the store.
+ */
+int fetch_changed_uid(const char *path, const std::string &folder,
+    uint64_t modseq, XARRAY *pxarray, std::vector<uint32_t> *vanished,
+    uint64_t *phighest_modseq, int *perrno) try
+{
+	char temp_line[1024];
+	struct pollfd pfd_read;
+
+	auto pback = get_connection(path);
+	if (pback == nullptr)
+		return MIDB_NO_SERVER;
+	auto EH = HX::make_scope_exit([=]() {
+		pxarray->clear();
+		if (vanished != nullptr)
+			vanished->clear();
+	});
+	auto buff = fmt::format("P-SIMD {} {} {}\r\n", path, folder, modseq);
+	auto wrret = write(pback->sockd, buff.c_str(), buff.size());
+	if (wrret < 0 || static_cast<size_t>(wrret) != buff.size())
+		return MIDB_RDWR_ERROR;
+
+	buff.resize(256 * 1024);
+	int count = 0, lines = -1;
+	size_t offset = 0, last_pos = 0, line_pos = 0;
+	BOOL b_format_error = false;
+	while (true) {
+		pfd_read.fd = pback->sockd;
+		pfd_read.events = POLLIN|POLLPRI;
+		if (poll(&pfd_read, 1, SOCKET_TIMEOUT_MS) != 1)
+			return MIDB_RDWR_ERROR;
+		auto read_len = read(pback->sockd, &buff[offset], buff.size() - offset);
+		if (read_len <= 0)
+			return MIDB_RDWR_ERROR;
+		offset += read_len;
+		buff[offset] = '\0';
+
+		if (-1 == lines) {
+			for (size_t i = 0; i < offset - 1 && i < 64; ++i) {
+				if (buff[i] != '\r' || buff[i+1] != '\n')
+					continue;
+				if (strncmp(buff.c_str(), "TRUE ", 5) == 0) {
+					char *end = nullptr;
+					lines = strtol(&buff[5], &end, 0);
+					if (lines < 0)
+						return MIDB_RDWR_ERROR;
+					*phighest_modseq = strtoull(end, nullptr, 0);
+					last_pos = i + 2;
+					line_pos = 0;
+					break;
+				} else if (strncmp(buff.c_str(), "FALSE ", 6) == 0) {
+					pback.reset();
+					*perrno = strtol(&buff[6], nullptr, 0);
+					return MIDB_RESULT_ERROR;
+				}
+			}
+			if (-1 == lines) {
+				if (offset > 1024)
+					return MIDB_RDWR_ERROR;
+				continue;
+			}
+		}
+
+		for (size_t i = last_pos; i < offset; ++i) {
+			if ('\r' == buff[i] && i < offset - 1 && '\n' == buff[i + 1]) {
+				count ++;
+			} else if ('\n' == buff[i] && '\r' == buff[i - 1]) {
+				temp_line[line_pos] = '\0';
+				auto parts = gx_split(temp_line, ' ');
+				if (parts.size() == 2 && parts[0] == "V") {
+					if (vanished != nullptr)
+						vanished->push_back(strtoul(parts[1].c_str(), nullptr, 0));
+				} else if (parts.size() == 6 && parts[0] == "-") {
+					MITEM mitem;
+					mitem.mid = std::move(parts[1]);
+					mitem.uid = strtol(parts[2].c_str(), nullptr, 0);
+					mitem.flag_bits = s_to_flagbits(parts[3]);
+					mitem.modseq = strtoull(parts[5].c_str(), nullptr, 0);
+					auto mitem_uid = mitem.uid;
+					pxarray->append(std::move(mitem), mitem_uid);
+				} else {
+					b_format_error = TRUE;
+				}
+				line_pos = 0;
+			} else if (buff[i] != '\r' || i != offset - 1) {
+				temp_line[line_pos++] = buff[i];
+				if (line_pos >= std::size(temp_line))
+					return MIDB_RDWR_ERROR;
+			}
+		}
+
+		if (count >= lines) {
+			pback.reset();
+			if (b_format_error) {
+				*perrno = -1;
+				return MIDB_RESULT_ERROR;
+			}
+			EH.release();
+			return MIDB_RESULT_OK;
+		}
+		last_pos = buff[offset-1] == '\r' ? offset - 1 : offset;
+		if (offset >= buff.size()) {
+			if ('\r' != buff[offset - 1]) {
+				offset = 0;
+			} else {
+				buff[0] = '\r';
+				offset = 1;
+			}
+			last_pos = 0;
+		}
+	}
+} catch (const std::bad_alloc &) {
+	mlog(LV_ERR, "E-1788: ENOMEM");
+	return MIDB_E_NO_MEMORY;
+}
+
 int fetch_detail_uid(const char *path, const std::string &folder,
-    const imap_seq_list &list, XARRAY *pxarray, int *perrno) try
+    const imap_seq_list &list, XARRAY *pxarray, int *perrno,
+    const char *charset) try
 {
 	char *pspace;
 	char temp_line[257*1024];
@@ -1409,7 +1534,9 @@ int fetch_detail_uid(const char *path, const std::string &folder,
 	
 	for (const auto &seq : list) {
 		auto pseq = &seq;
-		auto cbuf = fmt::format("P-DTLU {} {} {} {}\r\n", path, folder, pseq->lo, pseq->hi);
+		auto cbuf = charset != nullptr ?
+		            fmt::format("P-DTLU {} {} {} {} {}\r\n", path, folder, pseq->lo, pseq->hi, charset) :
+		            fmt::format("P-DTLU {} {} {} {}\r\n", path, folder, pseq->lo, pseq->hi);
 		auto wrret = write(pback->sockd, cbuf.c_str(), cbuf.size());
 		if (wrret < 0 || static_cast<size_t>(wrret) != cbuf.size())
 			return MIDB_RDWR_ERROR;
@@ -1599,6 +1726,54 @@ int unset_flags(const char *path, const std::string &folder,
 	return MIDB_RDWR_ERROR;
 }
 	
+/**
+ * Conditional STORE: change the flags of those of @mids whose modseq is not
+ * above @unchangedsince, atomically per message on the midb side. @op is
+ * '=', '+' or '-'. The UIDs of the messages that were modified since are
+ * returned in @failed.
+ */
+int store_flags_unchanged(const char *path, const std::string &folder,
+    const std::vector<std::string> &mids, char op, unsigned int flag_bits,
+    uint64_t unchangedsince, std::vector<uint32_t> &failed, int *perrno) try
+{
+	if (mids.empty())
+		return MIDB_RESULT_OK;
+	auto pback = get_connection(path);
+	if (pback == nullptr)
+		return MIDB_NO_SERVER;
+	auto head = fmt::format("P-CSFL {} {} {} {} ({})", path, folder,
+	            unchangedsince, op, flagbits_to_s(flag_bits));
+	std::string buff;
+	size_t i = 0;
+	while (i < mids.size()) {
+		buff = head;
+		for (; i < mids.size() && buff.size() <= 64 * 1024; ++i) {
+			buff += ' ';
+			buff += mids[i];
+		}
+		buff += "\r\n";
+		auto length = buff.size();
+		buff.resize(std::max(length, static_cast<size_t>(128 * 1024)));
+		auto ret = rw_command(pback->sockd, buff.data(), length, buff.size());
+		if (ret != 0)
+			return ret;
+		if (strncmp(buff.c_str(), "FALSE ", 6) == 0) {
+			pback.reset();
+			*perrno = strtol(&buff[6], nullptr, 0);
+			return MIDB_RESULT_ERROR;
+		} else if (strncmp(buff.c_str(), "TRUE", 4) != 0) {
+			return MIDB_RDWR_ERROR;
+		}
+		for (auto &&uid : gx_split(&buff[4], ' '))
+			if (!uid.empty())
+				failed.push_back(strtoul(uid.c_str(), nullptr, 0));
+	}
+	pback.reset();
+	return MIDB_RESULT_OK;
+} catch (const std::bad_alloc &) {
+	return MIDB_LOCAL_ENOMEM;
+}
+
 int get_flags(const char *path, const std::string &folder,
     const std::string &mid_string, unsigned int *pflag_bits, int *perrno)
 {
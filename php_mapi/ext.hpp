@@ -64,6 +64,8 @@ extern void palloc_tls_free();
 extern void ext_pack_free(void *);
 extern pack_result rpc_ext_push_request(const zcreq *, BINARY *);
 extern pack_result rpc_ext_pull_response(const BINARY *, zcresp *);
+extern pack_result rpc_ext_push_batch(size_t n, const zcreq *const *, BINARY *);
+extern pack_result rpc_ext_pull_batch(const BINARY *, size_t n, const zcreq *const *, zcresp *const *, zend_bool *ok);
 
 template<typename T> T *st_malloc() { return static_cast<T *>(emalloc(sizeof(T))); }
 template<typename T> T *sta_malloc(size_t elem) { return static_cast<T *>(emalloc(sizeof(T) * elem)); }
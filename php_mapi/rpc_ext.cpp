@@ -1,5 +1,6 @@
 // SPDX-License-Identifier: GPL-2.0-only WITH linking exception
 #include <cstdint>
+#include <new>
 #include <gromox/defs.h>
 #include <gromox/zcore_rpc.hpp>
 #include "ext.hpp"
@@ -1125,6 +1126,28 @@ static pack_result zrpc_push(PUSH_CTX &x, const zcreq_linkmessage &d)
 	return pack_result::ok;
 }
 
+static pack_result zrpc_push(PUSH_CTX &x, const zcreq_batch &d)
+{
+	TRY(x.p_uint32(d.reqs.size()));
+	for (const auto &b : d.reqs)
+		TRY(x.p_bin_ex(b));
+	return pack_result::ok;
+}
+
+static pack_result zrpc_pull(PULL_CTX &x, zcresp_batch &d) try
+{
+	uint32_t count;
+	TRY(x.g_uint32(&count));
+	for (uint32_t i = 0; i < count; ++i) {
+		BINARY b;
+		TRY(x.g_bin_ex(&b));
+		d.resps.push_back(b);
+	}
+	return pack_result::ok;
+} catch (const std::bad_alloc &) {
+	return pack_result::alloc;
+}
+
 pack_result rpc_ext_push_request(const zcreq *prequest, BINARY *pbin_out)
 {
 	PUSH_CTX push_ctx;
@@ -1224,6 +1247,7 @@ pack_result rpc_ext_push_request(const zcreq *prequest, BINARY *pbin_out)
 	E(logon_token)
 	E(getuserfreebusy)
 	E(getuserfreebusyical)
+	E(batch)
 #undef E
 	default:
 		return pack_result::bad_switch;
@@ -1338,8 +1362,70 @@ pack_result rpc_ext_pull_response(const BINARY *pbin_in, zcresp *presponse)
 	E(logon_token)
 	E(getuserfreebusy)
 	E(getuserfreebusyical)
+	E(batch)
 #undef E
 	default:
 		return pack_result::bad_switch;
 	}
 }
+
+/**
+ * Encode @n requests as one zcore_callid::batch request. The element frames
+ * lose their own length prefix; the batch frame has one.
+ */
+pack_result rpc_ext_push_batch(size_t n, const zcreq *const *reqs,
+    BINARY *pbin_out) try
+{
+	zcreq_batch q{};
+	q.call_id = zcore_callid::batch;
+	q.reqs.reserve(n);
+	auto cl_0 = [&]() {
+		for (auto &b : q.reqs)
+			ext_pack_free(b.pb - sizeof(uint32_t));
+	};
+	for (size_t i = 0; i < n; ++i) {
+		BINARY b;
+		auto ret = rpc_ext_push_request(reqs[i], &b);
+		if (ret != pack_result::ok) {
+			cl_0();
+			return ret;
+		}
+		b.pb += sizeof(uint32_t);
+		b.cb -= sizeof(uint32_t);
+		q.reqs.push_back(b);
+	}
+	auto ret = rpc_ext_push_request(&q, pbin_out);
+	cl_0();
+	return ret;
+} catch (const std::bad_alloc &) {
+	return pack_result::alloc;
+}
+
+/**
+ * Decode the body of a batch response (status byte and length already
+ * stripped) into @resps. @ok[i] tells whether @resps[i] was filled.
+ */
+pack_result rpc_ext_pull_batch(const BINARY *pbin_in, size_t n,
+    const zcreq *const *reqs, zcresp *const *resps, zend_bool *ok)
+{
+	zcresp_batch r{};
+	r.call_id = zcore_callid::batch;
+	auto ret = rpc_ext_pull_response(pbin_in, &r);
+	if (ret != pack_result::ok)
+		return ret;
+	if (r.result != ecSuccess || r.resps.size() != n)
+		return pack_result::format;
+	for (size_t i = 0; i < n; ++i) {
+		ok[i] = 0;
+		auto &e = r.resps[i];
+		if (e.cb < 5 ||
+		    static_cast<zcore_response>(e.pb[0]) != zcore_response::success)
+			continue;
+		resps[i]->call_id = reqs[i]->call_id;
+		BINARY sub;
+		sub.cb = e.cb - 5;
+		sub.pb = e.pb + 5;
+		ok[i] = rpc_ext_pull_response(&sub, resps[i]) == pack_result::ok;
+	}
+	return pack_result::ok;
+}
@@ -2,6 +2,7 @@
 // SPDX-FileCopyrightText: 2021–2025 grommunio GmbH
 // This file is part of Gromox.
 #include "php.h"
+#include <algorithm>
 #include <cerrno>
 #include <cstddef>
 #include <cstdint>
@@ -12,10 +13,13 @@
 #include <libHX/endian.h>
 #include <libHX/string.h>
 #include <netinet/in.h>
+#include <new>
+#include <poll.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/un.h>
+#include <unistd.h>
 #include <gromox/paths.h>
 #include <gromox/zcore_client.hpp>
 #include <gromox/zcore_rpc.hpp>
@@ -43,6 +47,16 @@ static int zclient_connect()
 	return sockd;
 }
 
+/*
+ * One connection per process is kept and reused. zcore leaves it open after
+ * a response; if it went away in the meantime (idle timeout, restart, or an
+ * older zcore closing after every call), a fresh connection is made. A
+ * request is only ever sent again if it could not be sent in full the first
+ * time, since zcore may already have executed a complete one.
+ */
+static thread_local int g_zc_fd = -1;
+static thread_local pid_t g_zc_pid;
+
 static zend_bool zclient_read_socket(int sockd, BINARY &pbin)
 {
 	int read_len;
@@ -73,6 +87,9 @@ static zend_bool zclient_read_socket(int sockd, BINARY &pbin)
 	while (1) {
 		read_len = read(sockd, pbin.pb + offset, pbin.cb - offset);
 		if (read_len <= 0) {
+			ext_pack_free(pbin.pb);
+			pbin.pb = nullptr;
+			pbin.cb = 0;
 			return 0;
 		}
 		offset += read_len;
@@ -83,12 +100,13 @@ static zend_bool zclient_read_socket(int sockd, BINARY &pbin)
 
 static zend_bool zclient_write_socket(int sockd, const BINARY &pbin)
 {
-	int written_len;
+	ssize_t written_len;
 	uint32_t offset;
 	
 	offset = 0;
 	while (1) {
-		written_len = write(sockd, pbin.pb + offset, pbin.cb - offset);
+		/* The peer may have hung up; that must not kill the process. */
+		written_len = send(sockd, pbin.pb + offset, pbin.cb - offset, MSG_NOSIGNAL);
 		if (written_len <= 0) {
 			return 0;
 		}
@@ -98,30 +116,83 @@ static zend_bool zclient_write_socket(int sockd, const BINARY &pbin)
 	}
 }
 
-zend_bool zclient_do_rpc(const zcreq *prequest, zcresp *presponse)
+static void zclient_disconnect()
 {
-	BINARY tmp_bin;
-	
-	if (rpc_ext_push_request(prequest, &tmp_bin) != pack_result::ok)
-		return 0;
-	auto sockd = zclient_connect();
-	if (sockd < 0) {
-		ext_pack_free(tmp_bin.pb);
-		return 0;
-	}
-	if (!zclient_write_socket(sockd, tmp_bin)) {
-		ext_pack_free(tmp_bin.pb);
+	if (g_zc_fd >= 0)
+		close(g_zc_fd);
+	g_zc_fd = -1;
+}
+
+/* An idle connection has nothing to read; if it does, it is EOF. */
+static bool zclient_idle_ok(int sockd)
+{
+	struct pollfd pfd = {sockd, POLLIN, 0};
+	return poll(&pfd, 1, 0) == 0;
+}
+
+/**
+ * Send one frame and receive the reply. With @reuse=false, a private
+ * connection is used; notifdequeue needs that, since zcore hands its
+ * socket over to the notification machinery.
+ */
+static zend_bool zclient_exchange(const BINARY &req, BINARY &resp, bool reuse)
+{
+	if (!reuse) {
+		auto sockd = zclient_connect();
+		if (sockd < 0)
+			return 0;
+		auto ret = zclient_write_socket(sockd, req) &&
+		           zclient_read_socket(sockd, resp);
 		close(sockd);
-		return 0;
+		return ret;
 	}
-	ext_pack_free(tmp_bin.pb);
-	if (!zclient_read_socket(sockd, tmp_bin)) {
-		close(sockd);
+	if (g_zc_fd >= 0 && g_zc_pid != getpid()) {
+		/* inherited across fork; leave it to the parent */
+		close(g_zc_fd);
+		g_zc_fd = -1;
+	}
+	if (g_zc_fd >= 0 && !zclient_idle_ok(g_zc_fd))
+		zclient_disconnect();
+	for (unsigned int attempt = 0; attempt < 2; ++attempt) {
+		bool fresh = g_zc_fd < 0;
+		if (fresh) {
+			g_zc_fd = zclient_connect();
+			if (g_zc_fd < 0)
+				return 0;
+			g_zc_pid = getpid();
+		}
+		if (!zclient_write_socket(g_zc_fd, req)) {
+			/* zcore cannot have acted on a partial request */
+			zclient_disconnect();
+			if (fresh)
+				return 0;
+			continue;
+		}
+		/* A complete request may have been executed; never resend it. */
+		if (zclient_read_socket(g_zc_fd, resp))
+			return 1;
+		zclient_disconnect();
 		return 0;
 	}
-	close(sockd);
+	return 0;
+}
+
+zend_bool zclient_do_rpc(const zcreq *prequest, zcresp *presponse)
+{
+	BINARY req_bin, tmp_bin{};
+	
+	if (rpc_ext_push_request(prequest, &req_bin) != pack_result::ok)
+		return 0;
+	auto ok = zclient_exchange(req_bin, tmp_bin,
+	          prequest->call_id != zcore_callid::notifdequeue);
+	ext_pack_free(req_bin.pb);
+	if (!ok)
+		return 0;
 	if (tmp_bin.cb < 5 ||
 	    static_cast<zcore_response>(tmp_bin.pb[0]) != zcore_response::success) {
+		/* zcore closes the connection after errors */
+		if (prequest->call_id != zcore_callid::notifdequeue)
+			zclient_disconnect();
 		if (NULL != tmp_bin.pb) {
 			ext_pack_free(tmp_bin.pb);
 		}
@@ -138,6 +209,37 @@ zend_bool zclient_do_rpc(const zcreq *prequest, zcresp *presponse)
 	return 1;
 }
 
+/**
+ * Issue @n calls in one round trip. @ok[i] tells whether @resps[i] was
+ * filled; the return value is false only if the batch as a whole failed.
+ * notifdequeue cannot be part of a batch.
+ */
+zend_bool zclient_do_batch(size_t n, const zcreq *const *reqs,
+    zcresp *const *resps, zend_bool *ok)
+{
+	std::fill_n(ok, n, 0);
+	BINARY req_bin, tmp_bin{};
+	if (rpc_ext_push_batch(n, reqs, &req_bin) != pack_result::ok)
+		return 0;
+	auto xok = zclient_exchange(req_bin, tmp_bin, true);
+	ext_pack_free(req_bin.pb);
+	if (!xok)
+		return 0;
+	if (tmp_bin.cb < 5 ||
+	    static_cast<zcore_response>(tmp_bin.pb[0]) != zcore_response::success) {
+		zclient_disconnect();
+		if (tmp_bin.pb != nullptr)
+			ext_pack_free(tmp_bin.pb);
+		return 0;
+	}
+	BINARY body;
+	body.cb = tmp_bin.cb - 5;
+	body.pb = tmp_bin.pb + 5;
+	auto ret = rpc_ext_pull_batch(&body, n, reqs, resps, ok);
+	ext_pack_free(tmp_bin.pb);
+	return ret == pack_result::ok;
+}
+
 ec_error_t zclient_setpropval(GUID hsession, uint32_t hobject,
     gromox::proptag_t proptag, const void *pvalue)
 {
@@ -0,0 +1,140 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// SPDX-FileCopyrightText: 2025 grommunio GmbH
+// This file is part of Gromox.
+/*
+ * Measure name resolution latency against GAL size: the former linear
+ * strcasestr scan over every entry's names and addresses versus
+ * ab_base::lookup (followed by the same strcasestr confirmation on the
+ * candidates only). The address book is populated without a database.
+ */
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <unistd.h>
+#include <vector>
+#include <gromox/ab_tree.hpp>
+#include <gromox/mapitags.hpp>
+#include <gromox/mysql_adaptor.hpp>
+
+using namespace gromox;
+using namespace gromox::ab_tree;
+using clk = std::chrono::steady_clock;
+
+namespace {
+
+static const char *const first_names[] = {
+	"Anna", "Bernd", "Carla", "Dieter", "Elif", "Frank", "Gudrun",
+	"Hannes", "Ines", "Jakob", "Katrin", "Lukas", "Maria", "Nils",
+	"Olga", "Peter", "Rita", "Stefan", "Tanja", "Uwe", "Vera", "Wolf",
+};
+static const char *const last_names[] = {
+	"Bauer", "Fischer", "Hoffmann", "Koch", "Lang", "Meier", "Neumann",
+	"Richter", "Schmidt", "Schulz", "Wagner", "Weber", "Wolf", "Zimmer",
+};
+static const char *const titles[] = {
+	"Accounting", "Engineer", "Sales", "Support", "Consultant", "Intern",
+};
+
+}
+
+static bool scan_match(const ab_base &base, minid mid, const char *s)
+{
+	if (strcasestr(base.displayname(mid).c_str(), s) != nullptr)
+		return true;
+	for (auto ui : {userinfo::mail_address, userinfo::job_title, userinfo::business_tel})
+		if (strcasestr(znul(base.user_info(mid, ui)), s) != nullptr)
+			return true;
+	for (const auto &a : base.aliases(mid))
+		if (strcasestr(a.c_str(), s) != nullptr)
+			return true;
+	return false;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int queries = 200, max_size = 64000;
+	int c;
+	while ((c = getopt(argc, argv, "n:q:")) >= 0) {
+		if (c == 'n')
+			max_size = strtoul(optarg, nullptr, 0);
+		else if (c == 'q')
+			queries = strtoul(optarg, nullptr, 0);
+		else {
+			fprintf(stderr, "Usage: %s [-n max_entries] [-q queries]\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if (queries == 0)
+		return EXIT_FAILURE;
+	printf("%8s  %12s  %12s  %10s\n", "entries", "scan µs/q", "index µs/q", "cand/q");
+	for (unsigned int size = 1000; size <= max_size; size *= 2) {
+		std::mt19937 rng(1);
+		std::vector<ab_domain> dl(1);
+		dl[0].id = 1;
+		dl[0].info.name = "example.com";
+		std::vector<sql_user> ul(size);
+		std::vector<std::string> names(size);
+		for (unsigned int i = 0; i < size; ++i) {
+			auto &u = ul[i];
+			auto fn = first_names[rng() % std::size(first_names)];
+			auto ln = last_names[rng() % std::size(last_names)];
+			u.id = i + 1;
+			u.domain_id = 1;
+			u.addr_status = 0;
+			u.username = std::string(fn) + "." + ln + std::to_string(i) + "@example.com";
+			u.aliases.push_back(std::string(1, fn[0]) + ln + std::to_string(i) + "@example.org");
+			names[i] = std::string(fn) + " " + ln + " " + std::to_string(i);
+			u.propvals[PR_DISPLAY_NAME] = names[i];
+			u.propvals[PR_TITLE] = titles[rng() % std::size(titles)];
+			u.propvals[PR_PRIMARY_TELEPHONE_NUMBER] = "+49 89 " + std::to_string(1000000 + rng() % 9000000);
+		}
+		/* what a user typically types into the To: line */
+		std::vector<std::string> q;
+		for (unsigned int i = 0; i < queries; ++i) {
+			unsigned int k = rng() % size;
+			q.push_back(i % 2 == 0 ? ul[k].username :
+			            names[k].substr(0, names[k].find(' ', names[k].find(' ') + 1)));
+		}
+		ab_base base(-1);
+		if (!base.load(std::move(dl), std::move(ul))) {
+			fprintf(stderr, "ab_base::load failed\n");
+			return EXIT_FAILURE;
+		}
+
+		size_t hits_scan = 0, hits_idx = 0, cands = 0;
+		auto t0 = clk::now();
+		for (const auto &s : q)
+			for (auto it = base.ubegin(); it != base.uend(); ++it)
+				if (scan_match(base, *it, s.c_str()))
+					++hits_scan;
+		auto t1 = clk::now();
+		for (const auto &s : q) {
+			auto cand = base.lookup(s.c_str());
+			if (!cand.has_value()) {
+				for (auto it = base.ubegin(); it != base.uend(); ++it)
+					if (scan_match(base, *it, s.c_str()))
+						++hits_idx;
+				continue;
+			}
+			cands += cand->size();
+			for (auto mid : *cand)
+				if (mid.type() == minid::address &&
+				    scan_match(base, mid, s.c_str()))
+					++hits_idx;
+		}
+		auto t2 = clk::now();
+		auto us = [&](clk::duration d) {
+			return std::chrono::duration<double, std::micro>(d).count() / queries;
+		};
+		printf("%8u  %12.1f  %12.1f  %10.1f\n", size, us(t1 - t0),
+		       us(t2 - t1), static_cast<double>(cands) / queries);
+		if (hits_scan != hits_idx) {
+			fprintf(stderr, "Result mismatch (%zu vs %zu)\n", hits_scan, hits_idx);
+			return EXIT_FAILURE;
+		}
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,100 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// SPDX-FileCopyrightText: 2025 grommunio GmbH
+// This file is part of Gromox.
+/*
+ * Check ab_base::lookup (the trigram name index used by NSPI and zcore
+ * name resolution) against a plain strcasestr scan on a small address
+ * book that includes non-ASCII names.
+ */
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <gromox/ab_tree.hpp>
+#include <gromox/mapitags.hpp>
+#include <gromox/mysql_adaptor.hpp>
+#include <gromox/util.hpp>
+
+using namespace gromox;
+using namespace gromox::ab_tree;
+
+#define CHECK(x) do { \
+		if (!(x)) { \
+			fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #x); \
+			return EXIT_FAILURE; \
+		} \
+	} while (false)
+
+static sql_user mkuser(unsigned int id, const char *user, const char *name,
+    const char *alias = nullptr)
+{
+	sql_user u;
+	u.id = id;
+	u.domain_id = 1;
+	u.addr_status = 0;
+	u.username = user;
+	u.propvals[PR_DISPLAY_NAME] = name;
+	if (alias != nullptr)
+		u.aliases.emplace_back(alias);
+	return u;
+}
+
+static bool scan_match(const ab_base &base, minid mid, const char *s)
+{
+	if (strcasestr(base.displayname(mid).c_str(), s) != nullptr ||
+	    strcasestr(znul(base.user_info(mid, userinfo::mail_address)), s) != nullptr)
+		return true;
+	for (const auto &a : base.aliases(mid))
+		if (strcasestr(a.c_str(), s) != nullptr)
+			return true;
+	return false;
+}
+
+/* Every user the scan finds must be among the index candidates */
+static bool covers(const ab_base &base, const char *s)
+{
+	auto cand = base.lookup(s);
+	if (!cand.has_value())
+		return true;
+	for (auto it = base.ubegin(); it != base.uend(); ++it)
+		if (scan_match(base, *it, s) &&
+		    std::find(cand->cbegin(), cand->cend(), *it) == cand->cend())
+			return false;
+	return true;
+}
+
+int main()
+{
+	std::vector<ab_domain> dl(1);
+	dl[0].id = 1;
+	dl[0].info.name = "example.com";
+	std::vector<sql_user> ul;
+	ul.push_back(mkuser(1, "anna.bauer@example.com", "Anna Bauer", "ab@example.org"));
+	ul.push_back(mkuser(2, "juergen@example.com", "J\xc3\xbcrgen Gr\xc3\xb6\xc3\x9f"));
+	ul.push_back(mkuser(3, "peter@example.com", "Peter Koch"));
+	ab_base base(-1);
+	CHECK(base.load(std::move(dl), std::move(ul)));
+
+	for (auto s : {"anna", "BAUER", "ab@ex", "example", "peter koch",
+	     "J\xc3\xbcrgen", "GR\xc3\xb6\xc3\x9f", "r\xc3\xbc", "zzzz"})
+		CHECK(covers(base, s));
+
+	/* Too short for trigrams: caller has to scan */
+	CHECK(!base.lookup("an").has_value());
+
+	auto c = base.lookup("J\xc3\xbcrg");
+	CHECK(c.has_value() && c->size() == 1);
+	CHECK(minid((*c)[0]).value() == 2);
+
+	/*
+	 * The same name in cp1252 does not match the UTF-8 index; this is
+	 * why nsp_interface_match_cand does not use the index for
+	 * non-ASCII PR_ANR_A values.
+	 */
+	c = base.lookup("J\xfcrg");
+	CHECK(c.has_value() && c->empty());
+	CHECK(!str_isascii("J\xfcrg"));
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,106 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// SPDX-FileCopyrightText: 2025 grommunio GmbH
+// This file is part of Gromox.
+/*
+ * Exercise the content file pool (exch/exmdb/cidpool.cpp) in a scratch
+ * directory: publishing a store's content file, linking it into a second
+ * store, refusing non-SHA3 objects, and the stat/gc walk.
+ */
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <libHX/io.h>
+#include <libHX/scope.hpp>
+#include "exch/exmdb/cidpool.hpp"
+
+#define CHECK(x) do { \
+		if (!(x)) { \
+			fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #x); \
+			return EXIT_FAILURE; \
+		} \
+	} while (false)
+
+static constexpr char cid_s[] = "S-ab/cdef0123456789";
+static constexpr char cid_y[] = "Y-ab/cdef0123456789";
+
+static bool put_file(const std::string &path, const char *data)
+{
+	auto dir = path.substr(0, path.rfind('/'));
+	if (HX_mkdir(dir.c_str(), 0700) < 0)
+		return false;
+	auto fp = fopen(path.c_str(), "w");
+	if (fp == nullptr)
+		return false;
+	fputs(data, fp);
+	return fclose(fp) == 0;
+}
+
+static nlink_t nlinks(const std::string &path)
+{
+	struct stat sb;
+	return stat(path.c_str(), &sb) == 0 ? sb.st_nlink : 0;
+}
+
+static int t_pool(const std::string &top)
+{
+	auto pool = top + "/pool", st1 = top + "/u1/cid/", st2 = top + "/u2/cid/";
+	CHECK(HX_mkdir(pool.c_str(), 0700) >= 0);
+
+	CHECK(cidpool_eligible(cid_s));
+	CHECK(!cidpool_eligible(cid_y));
+	CHECK(!cidpool_eligible("S-"));
+
+	/* Nothing pooled yet; store 1 writes its own copy and publishes it */
+	CHECK(!cidpool_take(pool, cid_s, st1 + cid_s));
+	CHECK(put_file(st1 + cid_s, "content"));
+	cidpool_give(pool, cid_s, st1 + cid_s);
+	CHECK(nlinks(pool + "/" + cid_s) == 2);
+
+	/* Store 2 gets the same object by link */
+	CHECK(HX_mkdir((st2 + "S-ab").c_str(), 0700) >= 0);
+	CHECK(cidpool_take(pool, cid_s, st2 + cid_s));
+	CHECK(nlinks(pool + "/" + cid_s) == 3);
+
+	/* Y- objects never enter or leave the pool */
+	CHECK(put_file(st1 + cid_y, "mine"));
+	cidpool_give(pool, cid_y, st1 + cid_y);
+	CHECK(nlinks(pool + "/" + cid_y) == 0);
+	CHECK(put_file(pool + "/" + cid_y, "planted"));
+	CHECK(HX_mkdir((st2 + "Y-ab").c_str(), 0700) >= 0);
+	CHECK(!cidpool_take(pool, cid_y, st2 + cid_y));
+	CHECK(nlinks(st2 + cid_y) == 0);
+
+	cidpool_stat st;
+	CHECK(cidpool_walk(pool, false, false, st) == 0);
+	CHECK(st.objects == 1 && st.refs == 2 && st.orphans == 1);
+	CHECK(st.stored == 7 && st.logical == 14);
+
+	/* Stores drop their references; gc reclaims, dry run does not */
+	CHECK(unlink((st1 + cid_s).c_str()) == 0);
+	CHECK(unlink((st2 + cid_s).c_str()) == 0);
+	st = {};
+	CHECK(cidpool_walk(pool, true, true, st) == 0);
+	CHECK(st.objects == 0 && st.orphans == 2 && st.reclaimed == 0);
+	CHECK(nlinks(pool + "/" + cid_s) == 1);
+	st = {};
+	CHECK(cidpool_walk(pool, true, false, st) == 0);
+	CHECK(st.reclaimed == 2);
+	CHECK(nlinks(pool + "/" + cid_s) == 0);
+
+	/* A reclaimed object is simply not available anymore */
+	CHECK(!cidpool_take(pool, cid_s, st2 + cid_s));
+	return EXIT_SUCCESS;
+}
+
+int main()
+{
+	char top[] = "/tmp/cidpool-XXXXXX";
+	if (mkdtemp(top) == nullptr) {
+		perror("mkdtemp");
+		return EXIT_FAILURE;
+	}
+	auto cl_0 = HX::make_scope_exit([&]() { HX_rrmdir(top); });
+	return t_pool(top);
+}
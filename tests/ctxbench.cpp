@@ -0,0 +1,123 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// SPDX-FileCopyrightText: 2025 grommunio GmbH
+// This file is part of Gromox.
+/*
+ * Compare the cost of finding timed-out polling contexts: the former
+ * contexts_pool scan (walk the whole polling list every second) versus the
+ * timer wheel it uses now, on a synthetic population of contexts.
+ */
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <random>
+#include <unistd.h>
+#include <vector>
+#include <gromox/double_list.hpp>
+#include <gromox/timer_wheel.hpp>
+
+using namespace gromox;
+
+namespace {
+struct fake_ctx {
+	DOUBLE_LIST_NODE node{}, timer_node{};
+	uint64_t stamp = 0, deadline = 0;
+	bool polling = true;
+};
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int count = 100000, timeout = 180, ticks = 600, active = 1000;
+	int c;
+	while ((c = getopt(argc, argv, "a:n:s:t:")) >= 0) {
+		if (c == 'a')
+			active = strtoul(optarg, nullptr, 0);
+		else if (c == 'n')
+			count = strtoul(optarg, nullptr, 0);
+		else if (c == 's')
+			ticks = strtoul(optarg, nullptr, 0);
+		else if (c == 't')
+			timeout = strtoul(optarg, nullptr, 0);
+		else {
+			fprintf(stderr, "Usage: %s [-a active_per_tick] [-n contexts] [-s seconds] [-t timeout]\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if (count == 0 || timeout == 0)
+		return EXIT_FAILURE;
+	std::mt19937 rng(1);
+	std::vector<fake_ctx> ctx(count);
+	DOUBLE_LIST poll_list;
+	double_list_init(&poll_list);
+	timer_wheel wheel(1024);
+	for (auto &x : ctx) {
+		x.node.pdata = x.timer_node.pdata = &x;
+		/* spread out the last activity over one timeout period */
+		x.stamp = rng() % timeout;
+		x.deadline = x.stamp + timeout;
+		double_list_append_as_tail(&poll_list, &x.node);
+		wheel.add(&x.timer_node, x.deadline);
+	}
+
+	using clk = std::chrono::steady_clock;
+	clk::duration t_list{}, t_wheel{};
+	size_t exp_list = 0, exp_wheel = 0, visit_list = 0, visit_wheel = 0;
+	for (uint64_t now = timeout; now < timeout + ticks; ++now) {
+		/* Some contexts see I/O and re-enter polling with a fresh stamp */
+		for (unsigned int i = 0; i < active; ++i) {
+			auto &x = ctx[rng() % count];
+			if (!x.polling)
+				continue;
+			wheel.remove(&x.timer_node, x.deadline);
+			x.stamp = now;
+			x.deadline = now + timeout;
+			wheel.add(&x.timer_node, x.deadline);
+		}
+
+		/* Old: inspect every polling context */
+		auto t0 = clk::now();
+		auto ptail = double_list_get_tail(&poll_list);
+		DOUBLE_LIST_NODE *pnode;
+		while ((pnode = double_list_pop_front(&poll_list)) != nullptr) {
+			auto &x = *static_cast<fake_ctx *>(pnode->pdata);
+			++visit_list;
+			if (now - x.stamp >= timeout)
+				++exp_list;
+			else
+				double_list_append_as_tail(&poll_list, pnode);
+			if (pnode == ptail)
+				break;
+		}
+		auto t1 = clk::now();
+
+		/* New: only the slot that came due */
+		wheel.advance(now, [&](DOUBLE_LIST_NODE *tnode) {
+			auto &x = *static_cast<fake_ctx *>(tnode->pdata);
+			++visit_wheel;
+			if (x.deadline > now)
+				return false;
+			x.polling = false;
+			++exp_wheel;
+			return true;
+		});
+		auto t2 = clk::now();
+		t_list += t1 - t0;
+		t_wheel += t2 - t1;
+	}
+
+	auto us = [&](clk::duration d) {
+		return std::chrono::duration<double, std::micro>(d).count() / ticks;
+	};
+	printf("%u contexts, timeout %us, %u refreshed per tick, %u ticks\n",
+	       count, timeout, active, ticks);
+	printf("list scan:   %8.1f µs/tick, %zu visits, %zu expired\n",
+	       us(t_list), visit_list, exp_list);
+	printf("timer wheel: %8.1f µs/tick, %zu visits, %zu expired\n",
+	       us(t_wheel), visit_wheel, exp_wheel);
+	if (exp_list != exp_wheel) {
+		fprintf(stderr, "Result mismatch\n");
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
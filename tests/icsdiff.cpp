@@ -0,0 +1,283 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// SPDX-FileCopyrightText: 2025 grommunio GmbH
+// This file is part of Gromox.
+/*
+ * Compare ics_content_diff (exch/exmdb/ics_diff.cpp) with the former
+ * get_content_sync algorithm, which staged the folder contents in a
+ * scratch SQLite database, on randomized folders and client idsets.
+ */
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <random>
+#include <set>
+#include <sqlite3.h>
+#include <vector>
+#include <libHX/scope.hpp>
+#include <gromox/database.h>
+#include <gromox/mapi_types.hpp>
+#include <gromox/rop_util.hpp>
+#include "exch/exmdb/ics_diff.hpp"
+
+using namespace gromox;
+
+namespace {
+
+struct fake_msg {
+	uint64_t mid, cn, size, read_cn, dtime, mtime;
+	bool fai, read, in_folder;
+};
+
+}
+
+static std::mt19937 rng(1234);
+
+static unsigned int rnd(unsigned int n) { return rng() % n; }
+
+/* The algorithm of get_content_sync before ics_diff.cpp */
+static bool reference(const std::vector<fake_msg> &msgs, const idset &given,
+    const idset *pseen, const idset *pseen_fai, const idset *pread,
+    bool b_ordered, ics_diff_result &r)
+{
+	sqlite3 *psqlite;
+	if (sqlite3_open_v2(":memory:", &psqlite,
+	    SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, nullptr) != SQLITE_OK)
+		return false;
+	auto cl_0 = HX::make_scope_exit([&]() { sqlite3_close(psqlite); });
+	if (gx_sql_exec(psqlite, "CREATE TABLE existence (message_id INTEGER PRIMARY KEY)") != SQLITE_OK ||
+	    gx_sql_exec(psqlite, "CREATE TABLE reads (message_id INTEGER PRIMARY KEY, read_state INTEGER)") != SQLITE_OK ||
+	    gx_sql_exec(psqlite, "CREATE TABLE changes (message_id INTEGER PRIMARY KEY, delivery_time INTEGER, mod_time INTEGER)") != SQLITE_OK)
+		return false;
+	auto stm_exist = gx_sql_prep(psqlite, "INSERT INTO existence VALUES (?)");
+	auto stm_reads = gx_sql_prep(psqlite, "INSERT INTO reads VALUES (?, ?)");
+	auto stm_chg   = gx_sql_prep(psqlite, "INSERT INTO changes VALUES (?, ?, ?)");
+	uint64_t last_cn = 0, last_readcn = 0;
+	/* the old loop had no particular order */
+	for (auto it = msgs.rbegin(); it != msgs.rend(); ++it) {
+		auto &m = *it;
+		if (!m.in_folder)
+			continue;
+		if (pseen == nullptr && pseen_fai == nullptr)
+			continue;
+		else if (pseen != nullptr && pseen_fai == nullptr && m.fai)
+			continue;
+		else if (pseen == nullptr && pseen_fai != nullptr && !m.fai)
+			continue;
+		sqlite3_reset(stm_exist);
+		sqlite3_bind_int64(stm_exist, 1, m.mid);
+		if (stm_exist.step() != SQLITE_DONE)
+			return false;
+		last_cn = std::max(last_cn, m.cn);
+		last_readcn = std::max(last_readcn, m.read_cn);
+		auto msg_eid = rop_util_make_eid_ex(1, m.mid);
+		auto chg_eid = rop_util_make_eid_ex(1, m.cn);
+		if (m.fai) {
+			if (given.contains(msg_eid) && pseen_fai->contains(chg_eid))
+				continue;
+		} else if (given.contains(msg_eid) && pseen->contains(chg_eid)) {
+			if (pread == nullptr)
+				continue;
+			if (m.read_cn == 0 || pread->contains(rop_util_make_eid_ex(1, m.read_cn)))
+				continue;
+			sqlite3_reset(stm_reads);
+			sqlite3_bind_int64(stm_reads, 1, m.mid);
+			sqlite3_bind_int64(stm_reads, 2, m.read);
+			if (stm_reads.step() != SQLITE_DONE)
+				return false;
+			continue;
+		}
+		if (m.fai) {
+			++r.fai_count;
+			r.fai_total += m.size;
+		} else {
+			++r.normal_count;
+			r.normal_total += m.size;
+		}
+		sqlite3_reset(stm_chg);
+		sqlite3_bind_int64(stm_chg, 1, m.mid);
+		sqlite3_bind_int64(stm_chg, 2, b_ordered ? m.dtime : 0);
+		sqlite3_bind_int64(stm_chg, 3, b_ordered ? m.mtime : 0);
+		if (stm_chg.step() != SQLITE_DONE)
+			return false;
+	}
+	if (last_cn != 0)
+		r.last_cn = rop_util_make_eid_ex(1, last_cn);
+	if (last_readcn != 0)
+		r.last_readcn = rop_util_make_eid_ex(1, last_readcn);
+
+	auto stm = gx_sql_prep(psqlite, b_ordered ?
+	           "SELECT message_id FROM changes ORDER BY delivery_time DESC, mod_time DESC" :
+	           "SELECT message_id FROM changes");
+	while (stm.step() == SQLITE_ROW) {
+		auto eid = rop_util_make_eid_ex(1, sqlite3_column_int64(stm, 0));
+		r.chg.push_back(eid);
+		if (given.contains(eid))
+			r.updated.push_back(eid);
+	}
+
+	for (const auto &node : given.get_repl_list()) {
+		if (node.replid <= 1)
+			continue;
+		for (const auto &range : node.range_list)
+			for (auto v = range.lo; v <= range.hi; ++v)
+				r.deleted.push_back(rop_util_make_eid_ex(node.replid, v));
+	}
+	stm = gx_sql_prep(psqlite, "SELECT message_id FROM existence WHERE message_id=?");
+	if (auto rl = given.get_ranges(1); rl != nullptr) {
+		for (const auto &range : *rl) {
+			for (auto v = range.lo; v <= range.hi; ++v) {
+				sqlite3_reset(stm);
+				sqlite3_bind_int64(stm, 1, v);
+				if (stm.step() == SQLITE_ROW)
+					continue;
+				bool anywhere = std::any_of(msgs.begin(), msgs.end(),
+				                [&](const fake_msg &m) { return m.mid == v; });
+				(anywhere ? r.nolonger : r.deleted).push_back(rop_util_make_eid_ex(1, v));
+			}
+		}
+	}
+
+	stm = gx_sql_prep(psqlite, "SELECT message_id FROM existence ORDER BY message_id DESC");
+	while (stm.step() == SQLITE_ROW)
+		r.given.push_back(rop_util_make_eid_ex(1, sqlite3_column_int64(stm, 0)));
+	if (pread != nullptr) {
+		stm = gx_sql_prep(psqlite, "SELECT message_id, read_state FROM reads");
+		while (stm.step() == SQLITE_ROW)
+			(sqlite3_column_int64(stm, 1) == 0 ? r.unread : r.read).push_back(
+				rop_util_make_eid_ex(1, sqlite3_column_int64(stm, 0)));
+	}
+	return true;
+}
+
+/* Same input handling as get_content_sync */
+static bool current(const std::vector<fake_msg> &msgs, const idset &given,
+    const idset *pseen, const idset *pseen_fai, const idset *pread,
+    bool b_ordered, ics_diff_result &r)
+{
+	auto find = [&](uint64_t mid) {
+		return std::find_if(msgs.begin(), msgs.end(), [&](const fake_msg &m) { return m.mid == mid; });
+	};
+	ics_diff_source src;
+	for (const auto &m : msgs) {
+		if (!m.in_folder || (m.fai ? pseen_fai : pseen) == nullptr)
+			continue;
+		src.rows.push_back({m.mid, m.cn, m.size, m.read_cn, m.fai});
+	}
+	src.read_state = [&](uint64_t mid, bool &rd) {
+		rd = find(mid)->read;
+		return true;
+	};
+	src.sort_times = [&](uint64_t mid, uint64_t &dt, uint64_t &mt) {
+		auto it = find(mid);
+		dt = it->dtime;
+		mt = it->mtime;
+		return true;
+	};
+	src.mids_in_range = [&](uint64_t lo, uint64_t hi, std::vector<uint64_t> &out) {
+		for (const auto &m : msgs)
+			if (m.mid >= lo && m.mid <= hi)
+				out.push_back(m.mid);
+		return true;
+	};
+	return ics_content_diff(src, given, pseen, pseen_fai, pread, b_ordered, r);
+}
+
+static std::unique_ptr<idset> random_set(const std::vector<uint64_t> &pool,
+    unsigned int pct, unsigned int max)
+{
+	auto s = idset::create(idset::type::id_loose);
+	for (auto v : pool)
+		if (rnd(100) < pct)
+			s->append(rop_util_make_eid_ex(1, v));
+	/* values the server does not know (anymore) */
+	for (unsigned int i = rnd(4); i > 0; --i) {
+		auto lo = 1 + rnd(max);
+		s->append_range(1, lo, lo + rnd(20));
+	}
+	return s;
+}
+
+static bool same(const ics_diff_result &a, const ics_diff_result &b)
+{
+	return a.fai_count == b.fai_count && a.normal_count == b.normal_count &&
+	       a.fai_total == b.fai_total && a.normal_total == b.normal_total &&
+	       a.last_cn == b.last_cn && a.last_readcn == b.last_readcn &&
+	       a.chg == b.chg && a.updated == b.updated && a.given == b.given &&
+	       a.deleted == b.deleted && a.nolonger == b.nolonger &&
+	       a.read == b.read && a.unread == b.unread;
+}
+
+static void dump(const char *name, const ics_diff_result &r)
+{
+	fprintf(stderr, "%s: fai=%u/%llu normal=%u/%llu lastcn=%llx lastread=%llx "
+	        "chg=%zu upd=%zu given=%zu del=%zu nolonger=%zu read=%zu unread=%zu\n",
+	        name, r.fai_count, static_cast<unsigned long long>(r.fai_total),
+	        r.normal_count, static_cast<unsigned long long>(r.normal_total),
+	        static_cast<unsigned long long>(r.last_cn),
+	        static_cast<unsigned long long>(r.last_readcn),
+	        r.chg.size(), r.updated.size(), r.given.size(), r.deleted.size(),
+	        r.nolonger.size(), r.read.size(), r.unread.size());
+}
+
+int main()
+{
+	for (unsigned int iter = 0; iter < 2000; ++iter) {
+		unsigned int nmsg = iter < 10 ? iter : rnd(300);
+		unsigned int max_id = nmsg * 2 + 10;
+		std::set<uint64_t> mids, cns, mtimes;
+		while (mids.size() < nmsg)
+			mids.insert(1 + rnd(max_id));
+		while (cns.size() < nmsg)
+			cns.insert(1 + rnd(max_id * 2));
+		while (mtimes.size() < nmsg)
+			mtimes.insert(rng());
+		std::vector<uint64_t> cnv(cns.begin(), cns.end()), mtv(mtimes.begin(), mtimes.end());
+		std::shuffle(cnv.begin(), cnv.end(), rng);
+		std::shuffle(mtv.begin(), mtv.end(), rng);
+		std::vector<fake_msg> msgs;
+		std::vector<uint64_t> all_mids, all_cns, all_rcns;
+		unsigned int i = 0;
+		for (auto mid : mids) {
+			fake_msg m{};
+			m.mid = mid;
+			m.cn = cnv[i];
+			m.size = 100 + rnd(100000);
+			m.read_cn = rnd(4) == 0 ? 0 : 1 + rnd(max_id * 2);
+			m.dtime = rnd(3) == 0 ? 0 : rnd(10);
+			m.mtime = mtv[i];
+			m.fai = rnd(5) == 0;
+			m.read = rnd(2);
+			m.in_folder = rnd(8) != 0;
+			msgs.push_back(m);
+			all_mids.push_back(m.mid);
+			all_cns.push_back(m.cn);
+			all_rcns.push_back(m.read_cn);
+			++i;
+		}
+		auto given = random_set(all_mids, rnd(101), max_id);
+		if (rnd(10) == 0)
+			given->append_range(2, 1, 1 + rnd(5));
+		auto seen = random_set(all_cns, rnd(101), max_id * 2);
+		auto seen_fai = random_set(all_cns, rnd(101), max_id * 2);
+		auto read = random_set(all_rcns, rnd(101), max_id * 2);
+		auto pseen = rnd(8) != 0 ? seen.get() : nullptr;
+		auto pseen_fai = rnd(8) != 0 ? seen_fai.get() : nullptr;
+		auto pread = rnd(4) != 0 ? read.get() : nullptr;
+		bool ordered = rnd(2);
+		ics_diff_result a, b;
+		if (!reference(msgs, *given, pseen, pseen_fai, pread, ordered, a) ||
+		    !current(msgs, *given, pseen, pseen_fai, pread, ordered, b)) {
+			fprintf(stderr, "iteration %u: computation failed\n", iter);
+			return EXIT_FAILURE;
+		}
+		if (!same(a, b)) {
+			fprintf(stderr, "iteration %u: results differ (ordered=%u)\n", iter, ordered);
+			dump("reference", a);
+			dump("current", b);
+			return EXIT_FAILURE;
+		}
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,160 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// SPDX-FileCopyrightText: 2025 grommunio GmbH
+// This file is part of Gromox.
+/*
+ * Exercise gromox::sharded_lru, the cache behind mysql_adaptor's lookups:
+ * expiry of positive and negative entries, LRU eviction, invalidation and
+ * the hit/miss counters; followed by a concurrent smoke run.
+ */
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <thread>
+#include <vector>
+#include <gromox/lru_cache.hpp>
+
+using namespace gromox;
+using namespace std::chrono_literals;
+
+#define CHECK(x) do { \
+		if (!(x)) { \
+			fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #x); \
+			return EXIT_FAILURE; \
+		} \
+	} while (false)
+
+static int t_basic()
+{
+	sharded_lru<std::string, int> c(1);
+	auto t0 = tp_now();
+	int v = 0;
+	CHECK(c.get("a", v, t0) == cache_result::miss);
+	/* disabled until configured */
+	c.put("a", 1, t0);
+	CHECK(c.get("a", v, t0) == cache_result::miss);
+
+	c.configure(3, 60s, 10s);
+	c.put("a", 1, t0);
+	c.put_negative("nx", t0);
+	CHECK(c.get("a", v, t0 + 59s) == cache_result::hit && v == 1);
+	CHECK(c.get("nx", v, t0 + 9s) == cache_result::negative);
+	CHECK(c.get("nx", v, t0 + 10s) == cache_result::miss);
+	CHECK(c.get("a", v, t0 + 60s) == cache_result::miss);
+
+	/* overwrite refreshes value and expiry */
+	c.put("a", 1, t0);
+	c.put("a", 2, t0 + 30s);
+	CHECK(c.get("a", v, t0 + 80s) == cache_result::hit && v == 2);
+
+	auto st = c.get_stats();
+	CHECK(st.hits == 2 && st.neg_hits == 1 && st.misses == 4);
+	CHECK(st.entries == 1);
+	return EXIT_SUCCESS;
+}
+
+static int t_evict()
+{
+	sharded_lru<std::string, int> c(1);
+	auto t0 = tp_now();
+	int v = 0;
+	c.configure(3, 60s, 60s);
+	c.put("a", 1, t0);
+	c.put("b", 2, t0);
+	c.put("c", 3, t0);
+	/* touch a, so that b is the least recently used one */
+	CHECK(c.get("a", v, t0) == cache_result::hit);
+	c.put_negative("d", t0);
+	CHECK(c.get("b", v, t0) == cache_result::miss);
+	CHECK(c.get("a", v, t0) == cache_result::hit);
+	CHECK(c.get("c", v, t0) == cache_result::hit);
+	CHECK(c.get("d", v, t0) == cache_result::negative);
+	CHECK(c.get_stats().entries == 3);
+	return EXIT_SUCCESS;
+}
+
+static int t_invalidate()
+{
+	sharded_lru<std::string, int> c(4);
+	auto t0 = tp_now();
+	int v = 0;
+	c.configure(100, 60s, 60s);
+	for (int i = 0; i < 20; ++i)
+		c.put(std::to_string(i), i, t0);
+	c.put_negative("x", t0);
+	c.erase("3");
+	CHECK(c.get("3", v, t0) == cache_result::miss);
+	/* drop odd values and all negative entries */
+	c.erase_if([](const std::string &, const int *p) { return p == nullptr || *p % 2 != 0; });
+	CHECK(c.get("x", v, t0) == cache_result::miss);
+	CHECK(c.get("5", v, t0) == cache_result::miss);
+	CHECK(c.get("4", v, t0) == cache_result::hit && v == 4);
+	CHECK(c.get_stats().entries == 10);
+	/* reconfiguring starts over */
+	c.configure(100, 60s, 0s);
+	CHECK(c.get_stats().entries == 0);
+	c.put_negative("x", t0);
+	CHECK(c.get("x", v, t0) == cache_result::miss);
+	c.clear();
+	return EXIT_SUCCESS;
+}
+
+/* A lookup that started before an invalidation must not repopulate */
+static int t_generation()
+{
+	sharded_lru<std::string, int> c(4);
+	c.configure(100, 60s, 60s);
+	int v = 0;
+	auto gen = c.generation();
+	c.erase("a");
+	c.put(gen, "a", 1);
+	CHECK(c.get("a", v) == cache_result::miss);
+	c.put_negative(gen, "b");
+	CHECK(c.get("b", v) == cache_result::miss);
+	gen = c.generation();
+	c.put(gen, "a", 2);
+	CHECK(c.get("a", v) == cache_result::hit && v == 2);
+	c.clear();
+	c.put(gen, "a", 3);
+	CHECK(c.get("a", v) == cache_result::miss);
+	return EXIT_SUCCESS;
+}
+
+static int t_threads()
+{
+	sharded_lru<unsigned int, unsigned int> c;
+	c.configure(1000, 60s, 60s);
+	std::atomic<bool> bad{false};
+	std::vector<std::thread> thr;
+	for (unsigned int t = 0; t < 8; ++t)
+		thr.emplace_back([&, t]() {
+			for (unsigned int i = 0; i < 100000; ++i) {
+				unsigned int k = (i * 7919 + t) % 3000, v = 0;
+				auto r = c.get(k, v);
+				if (r == cache_result::hit && v != k * 2)
+					bad = true;
+				else if (r == cache_result::miss && k % 5 == 0)
+					c.put_negative(k);
+				else if (r == cache_result::miss)
+					c.put(k, k * 2);
+				if (i % 10000 == 0)
+					c.erase_if([](unsigned int key, const unsigned int *) { return key % 64 == 0; });
+			}
+		});
+	for (auto &t : thr)
+		t.join();
+	CHECK(!bad);
+	auto st = c.get_stats();
+	CHECK(st.entries <= 1000 + 16);
+	CHECK(st.hits + st.neg_hits + st.misses == 800000);
+	return EXIT_SUCCESS;
+}
+
+int main()
+{
+	for (auto f : {t_basic, t_evict, t_invalidate, t_generation, t_threads})
+		if (f() != EXIT_SUCCESS)
+			return EXIT_FAILURE;
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,222 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// SPDX-FileCopyrightText: 2025 grommunio GmbH
+// This file is part of Gromox.
+/*
+ * Compression ratio and throughput of lzxpress_compress at every effort
+ * level, over synthetic ROP response buffers of the kind emsmdb sends with
+ * RHE_FLAG_COMPRESSED: a QueryRows result for a message table, a
+ * GetPropertiesSpecific result for a batch of folders, and a FastTransfer
+ * download chunk with UTF-16 body text. Every output is decompressed and
+ * compared to the input.
+ */
+#include <cctype>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <string>
+#include <unistd.h>
+#include <vector>
+#include <gromox/lzxpress.hpp>
+
+namespace {
+
+struct rop_buf {
+	void u8(uint8_t v) { b.push_back(v); }
+	void u16(uint16_t v) { u8(v); u8(v >> 8); }
+	void u32(uint32_t v) { u16(v); u16(v >> 16); }
+	void u64(uint64_t v) { u32(v); u32(v >> 32); }
+	void wstr(const std::string &s) {
+		for (auto c : s)
+			u16(static_cast<uint8_t>(c));
+		u16(0);
+	}
+	void bytes(const void *p, size_t z) {
+		auto q = static_cast<const uint8_t *>(p);
+		b.insert(b.end(), q, q + z);
+	}
+
+	std::vector<uint8_t> b;
+};
+
+}
+
+static constexpr size_t ROP_BUF_SIZE = 0x8000;
+static constexpr const char *words[] = {
+	"meeting", "project", "report", "update", "invoice", "status", "review",
+	"quarterly", "budget", "draft", "re:", "fwd:", "team", "schedule",
+	"customer", "release", "notes", "the", "for", "and", "with", "please",
+};
+static constexpr const char *names[] = {
+	"Alice Miller", "Bob Schmidt", "Carol Weber", "Dave Fischer",
+	"Eve Wagner", "Frank Becker", "Grace Hoffmann", "Heidi Koch",
+};
+
+static std::string phrase(std::mt19937 &rng, unsigned int n)
+{
+	std::string s;
+	for (unsigned int i = 0; i < n; ++i) {
+		if (i > 0)
+			s += ' ';
+		s += words[rng() % std::size(words)];
+	}
+	return s;
+}
+
+static void entryid(rop_buf &o, std::mt19937 &rng)
+{
+	static constexpr uint8_t store_guid[16] = {0x1f, 0x8a, 0x3d, 0x6e, 0x77, 0x10, 0x4c, 0x9b, 0xa2, 0x55, 0x0e, 0x41, 0xc3, 0x28, 0x90, 0x5d};
+	o.u16(70);
+	o.u32(0);
+	o.bytes(store_guid, sizeof(store_guid));
+	o.u16(7);
+	o.bytes(store_guid, sizeof(store_guid));
+	o.u64(static_cast<uint64_t>(rng() & 0xffff) << 16);
+	o.bytes(store_guid, sizeof(store_guid));
+	o.u64(static_cast<uint64_t>(rng()) << 16);
+}
+
+/* RopQueryRows on a contents table with a typical Outlook column set */
+static std::vector<uint8_t> gen_queryrows(std::mt19937 &rng)
+{
+	rop_buf o;
+	o.u8(0x15);
+	o.u8(1);
+	o.u32(0);
+	o.u8(1);
+	auto cnt_pos = o.b.size();
+	o.u16(0);
+	uint64_t mtime = 0x1db0a1c2d3e4f50ULL;
+	uint16_t rows = 0;
+	while (o.b.size() < ROP_BUF_SIZE - 512) {
+		o.u8(0);
+		o.u64((static_cast<uint64_t>(0x200000 + rows) << 16) | 1);
+		o.wstr(phrase(rng, 2 + rng() % 6));
+		auto from = names[rng() % std::size(names)];
+		o.wstr(from);
+		std::string smtp = from;
+		for (auto &c : smtp)
+			c = c == ' ' ? '.' : tolower(c);
+		o.wstr(smtp + "@example.com");
+		mtime -= rng() % 100000000;
+		o.u64(mtime);
+		o.u64(mtime + rng() % 1000);
+		o.u32(2000 + rng() % 50000);
+		o.u32(rng() % 4 == 0 ? 0 : 1);
+		o.u32(0x10 | (rng() % 2));
+		o.wstr("IPM.Note");
+		entryid(o, rng);
+		++rows;
+	}
+	o.b[cnt_pos] = rows;
+	o.b[cnt_pos+1] = rows >> 8;
+	return std::move(o.b);
+}
+
+/* A sequence of RopGetPropertiesSpecific responses, one per folder */
+static std::vector<uint8_t> gen_getprops(std::mt19937 &rng)
+{
+	rop_buf o;
+	static constexpr const char *folders[] = {
+		"Inbox", "Sent Items", "Deleted Items", "Drafts", "Calendar",
+		"Contacts", "Journal", "Notes", "Tasks", "Junk E-mail", "Outbox",
+	};
+	unsigned int i = 0;
+	while (o.b.size() < ROP_BUF_SIZE - 512) {
+		o.u8(0x07);
+		o.u8(i % 8);
+		o.u32(0);
+		o.u8(0);
+		o.wstr(i < std::size(folders) ? folders[i] : phrase(rng, 1 + rng() % 2));
+		o.u32(rng() % 5000);
+		o.u32(rng() % 50);
+		o.u8(rng() % 2);
+		o.wstr("IPF.Note");
+		o.u64((static_cast<uint64_t>(0x100 + i) << 16) | 1);
+		entryid(o, rng);
+		o.u32(0x0a); /* PR_ATTR_HIDDEN etc. as error values */
+		o.u32(0x8004010f);
+		++i;
+	}
+	return std::move(o.b);
+}
+
+/* RopFastTransferSourceGetBuffer: message markers, properties, body text */
+static std::vector<uint8_t> gen_fxstream(std::mt19937 &rng)
+{
+	rop_buf o;
+	o.u8(0x4e);
+	o.u8(2);
+	o.u32(0);
+	o.u16(0);
+	o.u16(0);
+	o.u16(0);
+	while (o.b.size() < ROP_BUF_SIZE - 2048) {
+		o.u32(0x400c0003); /* StartMessage */
+		o.u32(0x0037001f);
+		auto subj = phrase(rng, 3 + rng() % 5);
+		o.u32(subj.size() * 2 + 2);
+		o.wstr(subj);
+		o.u32(0x1000001f);
+		std::string body;
+		for (unsigned int l = 0, lines = 3 + rng() % 10; l < lines; ++l)
+			body += phrase(rng, 4 + rng() % 12) + ".\r\n";
+		body += "\r\n-- \r\n" + std::string(names[rng() % std::size(names)]) + "\r\n";
+		o.u32(body.size() * 2 + 2);
+		o.wstr(body);
+		o.u32(0x0e060040);
+		o.u64(0x1db0a1c2d3e4f50ULL + rng());
+		o.u32(0x40090003); /* EndMessage */
+	}
+	return std::move(o.b);
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int rounds = 200;
+	int c;
+	while ((c = getopt(argc, argv, "n:")) >= 0) {
+		if (c == 'n')
+			rounds = strtoul(optarg, nullptr, 0);
+		else {
+			fprintf(stderr, "Usage: %s [-n rounds]\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	std::mt19937 rng(4711);
+	struct { const char *name; std::vector<uint8_t> data; } inputs[] = {
+		{"queryrows", gen_queryrows(rng)},
+		{"getprops", gen_getprops(rng)},
+		{"fxstream", gen_fxstream(rng)},
+	};
+	printf("%-10s %6s %7s %7s %7s %10s %10s\n", "buffer", "effort",
+	       "in", "out", "ratio", "comp MB/s", "dec MB/s");
+	for (const auto &in : inputs) {
+		auto isize = in.data.size();
+		std::vector<uint8_t> out(isize + 4 * (isize / 32 + 2)), dec(isize);
+		for (unsigned int effort = 0; effort <= LZXPRESS_EFFORT_MAX; ++effort) {
+			uint32_t osize = 0;
+			auto t0 = std::chrono::steady_clock::now();
+			for (unsigned int r = 0; r < rounds; ++r)
+				osize = lzxpress_compress(in.data.data(), isize, out.data(), out.size(), effort);
+			auto t1 = std::chrono::steady_clock::now();
+			uint32_t dsize = 0;
+			for (unsigned int r = 0; r < rounds; ++r)
+				dsize = lzxpress_decompress(out.data(), osize, dec.data(), isize);
+			auto t2 = std::chrono::steady_clock::now();
+			if (dsize != isize || memcmp(dec.data(), in.data.data(), isize) != 0) {
+				fprintf(stderr, "%s: round trip failed at effort %u\n", in.name, effort);
+				return EXIT_FAILURE;
+			}
+			double mb = static_cast<double>(isize) * rounds / 1048576;
+			double tc = std::chrono::duration<double>(t1 - t0).count();
+			double td = std::chrono::duration<double>(t2 - t1).count();
+			printf("%-10s %6u %7zu %7u %7.2f %10.1f %10.1f\n", in.name,
+			       effort, isize, osize, static_cast<double>(isize) / osize,
+			       mb / tc, mb / td);
+		}
+	}
+	return EXIT_SUCCESS;
+}
@@ -44,7 +44,7 @@ int main(int argc, char **argv)
 				return EXIT_FAILURE;
 			}
 #endif
-			auto complen = lzxpress_compress(b1, std::size(b1), b2);
+			auto complen = lzxpress_compress(b1, std::size(b1), b2, std::size(b2));
 			auto ucomplen = lzxpress_decompress(b2, complen, outbuf, std::size(outbuf));
 			if (ucomplen != std::size(b1)) {
 				fprintf(stderr, "Failed input (%zu):\n", ++z);
@@ -65,7 +65,7 @@ int main(int argc, char **argv)
 	uint32_t ret = decompress ?
 	               lzxpress_decompress(slurp_data.get(), slurp_len,
 	               outbuf, std::size(outbuf)) :
-	               lzxpress_compress(slurp_data.get(), slurp_len, outbuf);
+	               lzxpress_compress(slurp_data.get(), slurp_len, outbuf, std::size(outbuf));
 	if (ret == 0) {
 		fprintf(stderr, "Something went wrong\n");
 		return EXIT_FAILURE;
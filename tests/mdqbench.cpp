@@ -0,0 +1,253 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// SPDX-FileCopyrightText: 2025 grommunio GmbH
+// This file is part of Gromox.
+/*
+ * Measure the latency of handing a freshly written queue file from the
+ * enqueuer (smtp) to a delivery worker. The former scheme (delivery polls
+ * the SysV message queue every 50 ms; idle workers sleep 1 s) is modeled
+ * here; the current one is mda/delivery_app/message_dequeue.cpp itself, fed
+ * with files in the format smtp writes.
+ */
+#ifdef HAVE_CONFIG_H
+#	include "config.h"
+#endif
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <fcntl.h>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <unistd.h>
+#include <vector>
+#include <sys/ipc.h>
+#include <sys/msg.h>
+#include <sys/stat.h>
+#include <gromox/process.hpp>
+#include "mda/delivery_app/delivery.hpp"
+
+namespace {
+
+using clk = std::chrono::steady_clock;
+
+struct msgbuf_id {
+	long type;
+	int id;
+};
+
+struct bench {
+	std::string dir;
+	int msgq = -1;
+	unsigned int count = 0, gap_ms = 100;
+	std::vector<clk::time_point> t_enq;
+	std::vector<double> lat_ms;
+
+	void enqueue(const std::string &mess_dir);
+	void report(const char *name);
+	int run_model();
+	int run_mdq();
+};
+
+}
+
+/* Woken by message_dequeue.cpp, which normally talks to transporter.cpp */
+static std::mutex g_tp_lock;
+static std::condition_variable g_tp_cond;
+static unsigned int g_tp_wakeups;
+
+void transporter_wakeup_one_thread()
+{
+	std::lock_guard lk(g_tp_lock);
+	++g_tp_wakeups;
+	g_tp_cond.notify_one();
+}
+
+/*
+ * Write @count queue files like smtp does (length, mail, flush ID, bound
+ * type, a reserved word, envelope sender and recipients), each followed by
+ * an announcement on the message queue. IDs start at 1.
+ */
+void bench::enqueue(const std::string &mess_dir)
+{
+	static constexpr char mail[] = "Subject: x\r\n\r\nbody\r\n";
+	static constexpr char envl[] = "a@example.com\0b@example.com\0";
+	std::string buf(sizeof(size_t), '\0');
+	size_t mlen = sizeof(mail) - 1;
+	memcpy(buf.data(), &mlen, sizeof(mlen));
+	buf.append(mail, mlen);
+	uint32_t words[3]{1, 0, 0};
+	buf.append(reinterpret_cast<const char *>(words), sizeof(words));
+	buf.append(envl, sizeof(envl));
+	buf.append(4096 - std::min<size_t>(buf.size(), 4096), '\0');
+
+	std::mt19937 rng(1);
+	for (unsigned int i = 1; i <= count; ++i) {
+		auto path = mess_dir + "/" + std::to_string(i);
+		t_enq[i] = clk::now();
+		auto fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0600);
+		if (fd < 0 || write(fd, buf.data(), buf.size()) != static_cast<ssize_t>(buf.size())) {
+			perror(path.c_str());
+			exit(EXIT_FAILURE);
+		}
+		close(fd);
+		msgbuf_id m{MESSAGE_MESS, static_cast<int>(i)};
+		msgsnd(msgq, &m, sizeof(int), IPC_NOWAIT);
+		/* irregular arrivals, so as not to phase-lock with the pollers */
+		usleep(rng() % (2 * gap_ms * 1000 + 1));
+	}
+}
+
+void bench::report(const char *name)
+{
+	std::sort(lat_ms.begin(), lat_ms.end());
+	double sum = 0;
+	for (auto x : lat_ms)
+		sum += x;
+	printf("%-38s avg %8.3f ms  p50 %8.3f ms  p99 %8.3f ms  max %8.3f ms\n",
+	       name, sum / lat_ms.size(), lat_ms[lat_ms.size() / 2],
+	       lat_ms[lat_ms.size() * 99 / 100], lat_ms.back());
+}
+
+/* The former scheme, which is no longer in the tree */
+int bench::run_model()
+{
+	auto mess_dir = dir + "/model";
+	if (mkdir(mess_dir.c_str(), 0700) != 0) {
+		perror(mess_dir.c_str());
+		return EXIT_FAILURE;
+	}
+	msgq = msgget(IPC_PRIVATE, IPC_CREAT | 0600);
+	if (msgq < 0) {
+		perror("msgget");
+		return EXIT_FAILURE;
+	}
+	t_enq.assign(count + 1, {});
+	lat_ms.clear();
+	std::mutex lock;
+	std::deque<int> used;
+	std::atomic<bool> stop{false};
+
+	std::thread dequeuer([&]() {
+		while (!stop) {
+			msgbuf_id m;
+			if (msgrcv(msgq, &m, sizeof(int), 0, IPC_NOWAIT) < 0) {
+				usleep(50000);
+				continue;
+			}
+			std::lock_guard lk(lock);
+			used.push_back(m.id);
+		}
+	});
+	std::thread worker([&]() {
+		std::unique_lock lk(lock);
+		while (lat_ms.size() < count) {
+			if (used.empty()) {
+				lk.unlock();
+				sleep(1);
+				lk.lock();
+				continue;
+			}
+			auto id = used.front();
+			used.pop_front();
+			lat_ms.push_back(std::chrono::duration<double, std::milli>(clk::now() - t_enq[id]).count());
+		}
+	});
+	enqueue(mess_dir);
+	worker.join();
+	stop = true;
+	dequeuer.join();
+	msgctl(msgq, IPC_RMID, nullptr);
+	for (unsigned int i = 1; i <= count; ++i)
+		unlink((mess_dir + "/" + std::to_string(i)).c_str());
+	rmdir(mess_dir.c_str());
+	report("msgq poll 50ms + worker sleep(1):");
+	return EXIT_SUCCESS;
+}
+
+/* The real thing */
+int bench::run_mdq()
+{
+	for (auto sub : {"/mess", "/save"})
+		if (mkdir((dir + sub).c_str(), 0700) != 0) {
+			perror(sub);
+			return EXIT_FAILURE;
+		}
+	message_dequeue_init(dir.c_str(), 64 << 20);
+	if (message_dequeue_run() != 0) {
+		fprintf(stderr, "message_dequeue_run failed\n");
+		return EXIT_FAILURE;
+	}
+	auto key = ftok((dir + "/token.ipc").c_str(), 1);
+	msgq = msgget(key, 0);
+	if (msgq < 0) {
+		perror("msgget");
+		message_dequeue_stop();
+		return EXIT_FAILURE;
+	}
+	t_enq.assign(count + 1, {});
+	lat_ms.clear();
+	std::thread worker([&]() {
+		while (lat_ms.size() < count) {
+			std::unique_lock lk(g_tp_lock);
+			g_tp_cond.wait(lk, []() { return g_tp_wakeups > 0; });
+			g_tp_wakeups = 0;
+			lk.unlock();
+			MESSAGE *m;
+			while ((m = message_dequeue_get()) != nullptr) {
+				auto now = clk::now();
+				auto id = m->message_data;
+				if (id > 0 && static_cast<unsigned int>(id) <= count)
+					lat_ms.push_back(std::chrono::duration<double, std::milli>(now - t_enq[id]).count());
+				message_dequeue_put(m);
+			}
+		}
+	});
+	enqueue(dir + "/mess");
+	worker.join();
+	message_dequeue_stop();
+	msgctl(msgq, IPC_RMID, nullptr);
+	rmdir((dir + "/mess").c_str());
+	rmdir((dir + "/save").c_str());
+	unlink((dir + "/token.ipc").c_str());
+	report("message_dequeue.cpp:");
+	return EXIT_SUCCESS;
+}
+
+int main(int argc, char **argv)
+{
+	bench b;
+	b.count = 50;
+	int c;
+	while ((c = getopt(argc, argv, "g:n:")) >= 0) {
+		if (c == 'g')
+			b.gap_ms = strtoul(optarg, nullptr, 0);
+		else if (c == 'n')
+			b.count = strtoul(optarg, nullptr, 0);
+		else {
+			fprintf(stderr, "Usage: %s [-g mean_gap_ms] [-n messages]\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if (b.count == 0)
+		return EXIT_FAILURE;
+	/* message_dequeue_stop interrupts its thread with SIGALRM */
+	gromox::setup_signal_defaults();
+	char tmpl[] = "/tmp/mdqbench.XXXXXX";
+	if (mkdtemp(tmpl) == nullptr) {
+		perror("mkdtemp");
+		return EXIT_FAILURE;
+	}
+	b.dir = tmpl;
+	printf("%u messages, mean inter-arrival %u ms\n", b.count, b.gap_ms);
+	auto ret = b.run_model();
+	if (ret == EXIT_SUCCESS)
+		ret = b.run_mdq();
+	rmdir(tmpl);
+	return ret;
+}
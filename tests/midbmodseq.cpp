@@ -0,0 +1,117 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// SPDX-FileCopyrightText: 2025 grommunio GmbH
+// This file is part of Gromox.
+/*
+ * Modseq bookkeeping of a midb.sqlite3 (schema EM-4/EM-6): the triggers that
+ * advance highest_modseq and record expunges, and the P-SIMD vanished
+ * query together with pruning of the expunge records.
+ */
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <sqlite3.h>
+#include <gromox/database.h>
+#include <gromox/dbop.h>
+#include <gromox/midb.hpp>
+#include "exch/midb/modseq.hpp"
+
+using namespace gromox;
+
+#define CHECK(x) do { \
+		if (!(x)) { \
+			fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #x); \
+			return EXIT_FAILURE; \
+		} \
+	} while (false)
+
+static uint64_t q_uint(sqlite3 *db, const std::string &q)
+{
+	auto stm = gx_sql_prep(db, q.c_str());
+	return stm != nullptr && stm.step() == SQLITE_ROW ? stm.col_uint64(0) : UINT64_MAX;
+}
+
+static bool add_msg(sqlite3 *db, uint64_t fid, unsigned int uid)
+{
+	auto q = "INSERT INTO messages (message_id, folder_id, mid_string, uid, "
+	         "subject, sender, rcpt, size, received) VALUES (" +
+	         std::to_string(fid * 100000 + uid) + "," + std::to_string(fid) +
+	         ",'m" + std::to_string(fid) + "." + std::to_string(uid) + "'," +
+	         std::to_string(uid) + ",'','','',1,0)";
+	return gx_sql_exec(db, q.c_str()) == SQLITE_OK;
+}
+
+static bool del_msg(sqlite3 *db, uint64_t fid, unsigned int uid)
+{
+	auto q = "DELETE FROM messages WHERE message_id=" +
+	         std::to_string(fid * 100000 + uid);
+	return gx_sql_exec(db, q.c_str()) == SQLITE_OK;
+}
+
+int main()
+{
+	sqlite3 *db = nullptr;
+	CHECK(sqlite3_open_v2(":memory:", &db, SQLITE_OPEN_READWRITE |
+	      SQLITE_OPEN_CREATE, nullptr) == SQLITE_OK);
+	CHECK(dbop_sqlite_create(db, sqlite_kind::midb, 0) == 0);
+	CHECK(gx_sql_exec(db, "PRAGMA foreign_keys=ON") == SQLITE_OK);
+	CHECK(gx_sql_exec(db, "INSERT INTO folders (folder_id, parent_fid, "
+	      "commit_max, name) VALUES (1,0,0,'INBOX'),(2,0,0,'Other')") == SQLITE_OK);
+	CHECK(q_uint(db, "SELECT highest_modseq FROM folders WHERE folder_id=1") == 1);
+
+	/* insert, reflag, delete each advance the folder's modseq */
+	for (unsigned int uid = 1; uid <= 10; ++uid)
+		CHECK(add_msg(db, 1, uid));
+	CHECK(add_msg(db, 2, 1));
+	CHECK(q_uint(db, "SELECT highest_modseq FROM folders WHERE folder_id=1") == 11);
+	CHECK(q_uint(db, "SELECT highest_modseq FROM folders WHERE folder_id=2") == 2);
+	CHECK(q_uint(db, "SELECT modseq FROM messages WHERE message_id=100003") == 4);
+	CHECK(gx_sql_exec(db, "UPDATE messages SET read=1 WHERE message_id=100003") == SQLITE_OK);
+	CHECK(q_uint(db, "SELECT modseq FROM messages WHERE message_id=100003") == 12);
+	CHECK(gx_sql_exec(db, "UPDATE messages SET read=1 WHERE message_id=100003") == SQLITE_OK);
+	CHECK(q_uint(db, "SELECT highest_modseq FROM folders WHERE folder_id=1") == 12);
+	for (unsigned int uid = 1; uid <= 8; ++uid)
+		CHECK(del_msg(db, 1, uid));
+	CHECK(q_uint(db, "SELECT highest_modseq FROM folders WHERE folder_id=1") == 20);
+	CHECK(q_uint(db, "SELECT COUNT(*) FROM expunged WHERE folder_id=1") == 8);
+
+	/* uid n was expunged at modseq 12+n */
+	std::vector<uint32_t> v;
+	CHECK(me_modseq_vanished(db, 1, 0, true, v) == 0 && v.empty());
+	CHECK(me_modseq_vanished(db, 1, 15, true, v) == 0);
+	CHECK((v == std::vector<uint32_t>{4, 5, 6, 7, 8}));
+	v.clear();
+	CHECK(me_modseq_vanished(db, 2, 1, true, v) == 0 && v.empty());
+
+	/* keep 3 records: uids 6..8 (modseq 18..20) survive, floor is 17 */
+	CHECK(me_modseq_prune(db, 3) == 0);
+	CHECK(q_uint(db, "SELECT COUNT(*) FROM expunged WHERE folder_id=1") == 3);
+	CHECK(q_uint(db, "SELECT modseq_floor FROM folders WHERE folder_id=1") == 17);
+	CHECK(q_uint(db, "SELECT modseq_floor FROM folders WHERE folder_id=2") == 0);
+	CHECK(me_modseq_vanished(db, 1, 16, true, v) == MIDB_E_MODSEQ_PRUNED);
+	CHECK(me_modseq_vanished(db, 1, 17, true, v) == 0);
+	CHECK((v == std::vector<uint32_t>{6, 7, 8}));
+	v.clear();
+	CHECK(me_modseq_vanished(db, 1, 19, true, v) == 0);
+	CHECK((v == std::vector<uint32_t>{8}));
+	v.clear();
+	/* schema EM-4/5 databases have no floor to check */
+	CHECK(me_modseq_vanished(db, 1, 1, false, v) == 0 && v.size() == 3);
+
+	/* nothing to do below the limit; the floor never goes down */
+	CHECK(me_modseq_prune(db, 3) == 0);
+	CHECK(q_uint(db, "SELECT modseq_floor FROM folders WHERE folder_id=1") == 17);
+	CHECK(me_modseq_prune(db, 0) == 0);
+	CHECK(q_uint(db, "SELECT COUNT(*) FROM expunged WHERE folder_id=1") == 0);
+	CHECK(q_uint(db, "SELECT modseq_floor FROM folders WHERE folder_id=1") == 20);
+	CHECK(me_modseq_vanished(db, 1, 20, true, v) == 0);
+
+	/* deleting the folder drops its records */
+	CHECK(del_msg(db, 1, 9));
+	CHECK(gx_sql_exec(db, "DELETE FROM folders WHERE folder_id=1") == SQLITE_OK);
+	CHECK(q_uint(db, "SELECT COUNT(*) FROM expunged") == 0);
+	CHECK(me_modseq_vanished(db, 1, 20, true, v) == MIDB_E_NO_FOLDER);
+	sqlite3_close(db);
+	return EXIT_SUCCESS;
+}
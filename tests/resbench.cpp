@@ -0,0 +1,155 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// SPDX-FileCopyrightText: 2025 grommunio GmbH
+// This file is part of Gromox.
+/*
+ * Compare the per-message restriction evaluator (cu_eval_msg_restriction)
+ * with the block evaluator (msg_restriction_plan) on a synthetic store.
+ */
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <unistd.h>
+#include <vector>
+#include <sqlite3.h>
+#include <libHX/scope.hpp>
+#include <gromox/database.h>
+#include <gromox/exmdb_common_util.hpp>
+#include <gromox/exmdb_server.hpp>
+#include <gromox/mapidefs.h>
+#include <gromox/mapitags.hpp>
+
+using namespace gromox;
+/* Normally provided by exch/exmdb/main.cpp and folder.cpp */
+DECLARE_SVC_API(exmdb, );
+unsigned int g_dbg_synth_content;
+unsigned int exmdb_pf_read_per_user = 1, exmdb_pf_read_states = 2;
+
+static bool populate(sqlite3 *db, unsigned int count)
+{
+	if (gx_sql_exec(db, "CREATE TABLE messages (message_id INTEGER PRIMARY KEY,"
+	    " parent_fid INTEGER, is_associated INTEGER, message_size INTEGER NOT NULL);"
+	    "CREATE TABLE message_properties (message_id INTEGER NOT NULL,"
+	    " proptag INTEGER NOT NULL, propval BLOB NOT NULL);"
+	    "CREATE UNIQUE INDEX message_property_index ON message_properties(message_id, proptag);") != SQLITE_OK)
+		return false;
+	auto xact = gx_sql_begin(db, txn_mode::write);
+	auto s1 = gx_sql_prep(db, "INSERT INTO messages VALUES (?,9,0,?)");
+	auto s2 = gx_sql_prep(db, "INSERT INTO message_properties VALUES (?,?,?)");
+	if (s1 == nullptr || s2 == nullptr)
+		return false;
+	static const char *const names[] = {"Alice Example", "Bob Example", "Carol Example", "Dave Example"};
+	for (uint64_t mid = 1; mid <= count; ++mid) {
+		s1.bind_int64(1, mid);
+		s1.bind_int64(2, 1000 + mid % 50000);
+		if (s1.step() != SQLITE_DONE)
+			return false;
+		s1.reset();
+		auto put = [&](proptag_t tag, uint64_t v) {
+			s2.bind_int64(1, mid);
+			s2.bind_int64(2, tag);
+			s2.bind_int64(3, v);
+			auto ret = s2.step();
+			s2.reset();
+			return ret == SQLITE_DONE;
+		};
+		if (!put(PR_IMPORTANCE, mid % 3) ||
+		    !put(PR_FLAG_STATUS, mid % 7 == 0 ? 2 : 0) ||
+		    !put(PR_MESSAGE_DELIVERY_TIME, 130000000000000000ULL + mid * 10000000ULL))
+			return false;
+		s2.bind_int64(1, mid);
+		s2.bind_int64(2, PR_SENDER_NAME);
+		s2.bind_text(3, names[mid % std::size(names)]);
+		if (s2.step() != SQLITE_DONE)
+			return false;
+		s2.reset();
+	}
+	return xact.commit() == SQLITE_OK;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int count = 20000, block = 100;
+	int c;
+	while ((c = getopt(argc, argv, "b:n:")) >= 0) {
+		if (c == 'b')
+			block = strtoul(optarg, nullptr, 0);
+		else if (c == 'n')
+			count = strtoul(optarg, nullptr, 0);
+		else {
+			fprintf(stderr, "Usage: %s [-b blocksize] [-n messages]\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+	if (block == 0)
+		block = 1;
+	sqlite3 *db = nullptr;
+	if (sqlite3_open_v2(":memory:", &db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE, nullptr) != SQLITE_OK)
+		return EXIT_FAILURE;
+	auto cl_0 = HX::make_scope_exit([&]() { sqlite3_close(db); });
+	if (!populate(db, count)) {
+		fprintf(stderr, "populate: %s\n", sqlite3_errmsg(db));
+		return EXIT_FAILURE;
+	}
+
+	/*
+	 * (importance == 2 && (sender ~ "alice" || flag_status & 2)) ||
+	 * (delivery_time > X && message_size > 25000)
+	 */
+	uint32_t v_imp = 2, v_size = 25000;
+	uint64_t v_time = 130000000000000000ULL + count * 5000000ULL;
+	char v_name[] = "alice";
+	RESTRICTION_PROPERTY r_imp{RELOP_EQ, PR_IMPORTANCE, {PR_IMPORTANCE, &v_imp}};
+	RESTRICTION_CONTENT r_name{FL_SUBSTRING | FL_IGNORECASE, PR_SENDER_NAME, {PR_SENDER_NAME, v_name}};
+	RESTRICTION_BITMASK r_flag{BMR_NEZ, PR_FLAG_STATUS, 2};
+	RESTRICTION_PROPERTY r_time{RELOP_GT, PR_MESSAGE_DELIVERY_TIME, {PR_MESSAGE_DELIVERY_TIME, &v_time}};
+	RESTRICTION_PROPERTY r_size{RELOP_GT, PR_MESSAGE_SIZE, {PR_MESSAGE_SIZE, &v_size}};
+	RESTRICTION or1_sub[] = {{RES_CONTENT, {&r_name}}, {RES_BITMASK, {&r_flag}}};
+	SOrRestriction or1{std::size(or1_sub), or1_sub};
+	RESTRICTION and1_sub[] = {{RES_PROPERTY, {&r_imp}}, {RES_OR, {&or1}}};
+	SAndRestriction and1{std::size(and1_sub), and1_sub};
+	RESTRICTION and2_sub[] = {{RES_PROPERTY, {&r_time}}, {RES_PROPERTY, {&r_size}}};
+	SAndRestriction and2{std::size(and2_sub), and2_sub};
+	RESTRICTION top_sub[] = {{RES_AND, {&and1}}, {RES_AND, {&and2}}};
+	SOrRestriction top_or{std::size(top_sub), top_sub};
+	RESTRICTION top{RES_OR, {&top_or}};
+
+	exmdb_server::build_env(EM_PRIVATE, "/nonexistent");
+	auto cl_1 = HX::make_scope_exit(exmdb_server::free_env);
+	auto xact = gx_sql_begin(db, txn_mode::read);
+
+	auto t0 = std::chrono::steady_clock::now();
+	size_t hits_a = 0;
+	for (uint64_t mid = 1; mid <= count; ++mid)
+		if (cu_eval_msg_restriction(db, CP_UTF8, mid, &top))
+			++hits_a;
+	auto t1 = std::chrono::steady_clock::now();
+
+	msg_restriction_plan plan(&top);
+	std::vector<uint64_t> mids;
+	size_t hits_b = 0;
+	for (uint64_t mid = 1; mid <= count; ) {
+		mids.clear();
+		for (unsigned int i = 0; i < block && mid <= count; ++i)
+			mids.push_back(mid++);
+		if (!plan.filter(db, CP_UTF8, mids)) {
+			fprintf(stderr, "plan.filter failed\n");
+			return EXIT_FAILURE;
+		}
+		hits_b += mids.size();
+	}
+	auto t2 = std::chrono::steady_clock::now();
+
+	auto d_a = std::chrono::duration<double>(t1 - t0).count();
+	auto d_b = std::chrono::duration<double>(t2 - t1).count();
+	printf("%u messages, block size %u, %zu bulk-loaded columns\n",
+	       count, block, plan.column_count());
+	printf("per-message: %zu hits, %.3f s (%.0f msg/s)\n", hits_a, d_a, count / d_a);
+	printf("block plan:  %zu hits, %.3f s (%.0f msg/s)\n", hits_b, d_b, count / d_b);
+	if (hits_a != hits_b) {
+		fprintf(stderr, "Result mismatch\n");
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
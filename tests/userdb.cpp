@@ -1,6 +1,7 @@
 // SPDX-License-Identifier: AGPL-3.0-or-later
 // SPDX-FileCopyrightText: 2024 grommunio GmbH
 // This file is part of Gromox.
+#include <cerrno>
 #include <cstdio>
 #include <cstdlib>
 #include <libHX/option.h>
@@ -173,6 +174,36 @@ static int t_public()
 }
 #undef E
 
+/* Repeat lookups; with cache_size>0, the second round should be served from the caches */
+static int t_cache()
+{
+	for (int round = 0; round < 2; ++round) {
+		if (g_username != nullptr) {
+			sql_meta_result mres;
+			mysql_adaptor_meta(g_username, WANTPRIV_METAONLY, mres);
+			unsigned int uid = 0;
+			mysql_adaptor_get_user_ids(g_username, &uid, nullptr, nullptr);
+			if (uid != mres.user_id)
+				printf("cache: round %d: user_ids/meta mismatch %u/%u\n",
+				       round, uid, mres.user_id);
+		}
+		if (g_domain != nullptr)
+			mysql_adaptor_domain_list_query(g_domain);
+		sql_meta_result nx;
+		if (mysql_adaptor_meta("nonexistent@invalid.invalid", WANTPRIV_METAONLY, nx) != ENOENT)
+			printf("cache: round %d: nonexistent user found\n", round);
+	}
+	std::map<std::string, sql_cache_stats> st;
+	mysql_adaptor_cache_stats(st);
+	for (const auto &[name, c] : st)
+		printf("cache %-17s: %llu hits, %llu negative hits, %llu misses, %zu entries\n",
+		       name.c_str(), static_cast<unsigned long long>(c.hits),
+		       static_cast<unsigned long long>(c.neg_hits),
+		       static_cast<unsigned long long>(c.misses), c.entries);
+	mysql_adaptor_cache_invalidate(nullptr);
+	return 0;
+}
+
 int main(int argc, char **argv)
 {
 	if (HX_getopt5(g_options_table, argv, &argc, &argv,
@@ -192,5 +223,7 @@ int main(int argc, char **argv)
 		return EXIT_FAILURE;
 	if (g_domain != nullptr && t_public() != 0)
 		return EXIT_FAILURE;
+	if (t_cache() != 0)
+		return EXIT_FAILURE;
 	return EXIT_SUCCESS;
 }
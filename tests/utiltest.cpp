@@ -236,6 +236,11 @@ static int t_id9()
 	assert(!s.contains(99));
 	assert(s.contains(100));
 	assert(s.contains(INT_MAX));
+	/* a range that swallows several existing ones */
+	s.insert(40, 70);
+	assert(s.size() == 2);
+	assert(s.front().lo == 40 && s.front().hi == 70);
+	assert(!s.contains(71));
 	return EXIT_SUCCESS;
 }
 
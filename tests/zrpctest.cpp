@@ -0,0 +1,179 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// SPDX-FileCopyrightText: 2025 grommunio GmbH
+// This file is part of Gromox.
+/*
+ * Round-trip a zcore_callid::batch call through both ends: php-mapi's
+ * rpc_ext_push_batch builds the request, zcore's rpc_ext takes it apart
+ * like rpc_parser does and packs the element and batch responses, and
+ * rpc_ext_pull_batch hands the elements back like zclient_do_batch.
+ */
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <memory>
+#include <vector>
+#include <gromox/ext_buffer.hpp>
+#include <gromox/mapierr.hpp>
+#include <gromox/zcore_rpc.hpp>
+#include "exch/zcore/rpc_ext.hpp"
+#include "php_mapi/ext.hpp"
+
+#define CHECK(x) do { \
+		if (!(x)) { \
+			fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #x); \
+			return EXIT_FAILURE; \
+		} \
+	} while (false)
+
+static std::vector<std::unique_ptr<char[]>> g_mem;
+
+/* zcore side */
+void *common_util_alloc(size_t z)
+{
+	g_mem.emplace_back(std::make_unique<char[]>(z));
+	return g_mem.back().get();
+}
+
+/*
+ * php-mapi side: stand-ins for php_mapi/ext_pack.cpp, which needs the PHP
+ * allocator. Like the original, pulled data lives until the end.
+ */
+static std::vector<void *> g_allocs;
+
+void *ext_pack_alloc(size_t z)
+{
+	auto p = calloc(1, z);
+	if (p != nullptr)
+		g_allocs.push_back(p);
+	return p;
+}
+
+static void *ext_pack_realloc(void *p, size_t z)
+{
+	std::erase(g_allocs, p);
+	auto q = realloc(p, z);
+	if (q != nullptr)
+		g_allocs.push_back(q);
+	return q;
+}
+
+void ext_pack_free(void *p)
+{
+	std::erase(g_allocs, p);
+	free(p);
+}
+
+const EXT_BUFFER_MGT ext_buffer_mgt = {ext_pack_alloc, ext_pack_realloc, ext_pack_free};
+pack_result PULL_CTX::g_perm_set(PERMISSION_SET *) { return pack_result::failure; }
+pack_result PULL_CTX::g_state_a(STATE_ARRAY *) { return pack_result::failure; }
+pack_result PULL_CTX::g_znotif_a(ZNOTIFICATION_ARRAY *) { return pack_result::failure; }
+pack_result PUSH_CTX::p_perm_set(const PERMISSION_SET *) { return pack_result::failure; }
+pack_result PUSH_CTX::p_rule_data(const RULE_DATA *) { return pack_result::failure; }
+pack_result PUSH_CTX::p_rule_list(const RULE_LIST *) { return pack_result::failure; }
+pack_result PUSH_CTX::p_state_a(const STATE_ARRAY *) { return pack_result::failure; }
+
+static constexpr GUID ses = {0x11223344, 0x5566, 0x7788, {0x99, 0xaa}, {1, 2, 3, 4, 5, 6}};
+
+static int t_batch()
+{
+	/* Client side: what zclient_do_batch sends */
+	zcreq_uinfo q1{};
+	q1.call_id  = zcore_callid::uinfo;
+	q1.username = const_cast<char *>("user@example.com");
+	zcreq_getrowcount q2{};
+	q2.call_id  = zcore_callid::getrowcount;
+	q2.hsession = ses;
+	q2.htable   = 7;
+	zcreq_checksession q3{};
+	q3.call_id  = zcore_callid::checksession;
+	q3.hsession = ses;
+	const zcreq *reqs[] = {&q1, &q2, &q3};
+	BINARY frame;
+	CHECK(rpc_ext_push_batch(3, reqs, &frame) == pack_result::ok);
+
+	/* Server side: rpc_parser reads the length, then pulls the rest */
+	CHECK(frame.cb >= 4);
+	uint32_t len = frame.pb[0] | (frame.pb[1] << 8) | (frame.pb[2] << 16) | (frame.pb[3] << 24);
+	CHECK(len == frame.cb - 4);
+	BINARY body;
+	body.cb = frame.cb - 4;
+	body.pb = frame.pb + 4;
+	std::unique_ptr<zcreq> req;
+	CHECK(rpc_ext_pull_request(&body, req) == pack_result::ok);
+	CHECK(req->call_id == zcore_callid::batch);
+	auto &bq = *static_cast<const zcreq_batch *>(req.get());
+	CHECK(bq.reqs.size() == 3);
+	std::unique_ptr<zcreq> sub;
+	CHECK(rpc_ext_pull_request(&bq.reqs[0], sub) == pack_result::ok);
+	CHECK(sub->call_id == zcore_callid::uinfo);
+	CHECK(strcmp(static_cast<const zcreq_uinfo *>(sub.get())->username, "user@example.com") == 0);
+	CHECK(rpc_ext_pull_request(&bq.reqs[1], sub) == pack_result::ok);
+	CHECK(sub->call_id == zcore_callid::getrowcount);
+	auto &grc = *static_cast<const zcreq_getrowcount *>(sub.get());
+	CHECK(grc.hsession == ses && grc.htable == 7);
+	CHECK(rpc_ext_pull_request(&bq.reqs[2], sub) == pack_result::ok);
+	CHECK(sub->call_id == zcore_callid::checksession);
+	ext_pack_free(frame.pb);
+
+	/* Server side: element responses (the last one failed), then the batch */
+	zcresp_uinfo r1{};
+	r1.call_id = zcore_callid::uinfo;
+	r1.result  = ecSuccess;
+	r1.pdisplay_name = const_cast<char *>("User");
+	r1.px500dn = const_cast<char *>("/o=x");
+	r1.privilege_bits = 0x5;
+	zcresp_getrowcount r2{};
+	r2.call_id = zcore_callid::getrowcount;
+	r2.result  = ecSuccess;
+	r2.count   = 42;
+	BINARY o1, o2;
+	CHECK(rpc_ext_push_response(&r1, &o1) == pack_result::ok);
+	CHECK(rpc_ext_push_response(&r2, &o2) == pack_result::ok);
+	uint8_t err = static_cast<uint8_t>(zcore_response::pull_error);
+	BINARY o3;
+	o3.cb = 1;
+	o3.pb = &err;
+	zcresp_batch rb{};
+	rb.call_id = zcore_callid::batch;
+	rb.result  = ecSuccess;
+	rb.resps   = {o1, o2, o3};
+	BINARY out;
+	CHECK(rpc_ext_push_response(&rb, &out) == pack_result::ok);
+	free(o1.pb);
+	free(o2.pb);
+
+	/* Client side: status byte and length, then the elements */
+	CHECK(out.cb >= 5 && out.pb[0] == static_cast<uint8_t>(zcore_response::success));
+	len = out.pb[1] | (out.pb[2] << 8) | (out.pb[3] << 16) | (out.pb[4] << 24);
+	CHECK(len == out.cb - 5);
+	body.cb = out.cb - 5;
+	body.pb = out.pb + 5;
+	zcresp_uinfo p1{};
+	zcresp_getrowcount p2{};
+	zcresp_checksession p3{};
+	zcresp *resps[] = {&p1, &p2, &p3};
+	zend_bool ok[3]{};
+	CHECK(rpc_ext_pull_batch(&body, 3, reqs, resps, ok) == pack_result::ok);
+	CHECK(ok[0] && ok[1] && !ok[2]);
+	CHECK(p1.call_id == zcore_callid::uinfo && p1.result == ecSuccess);
+	CHECK(p1.entryid.cb == 0);
+	CHECK(strcmp(p1.pdisplay_name, "User") == 0);
+	CHECK(strcmp(p1.px500dn, "/o=x") == 0);
+	CHECK(p1.privilege_bits == 0x5);
+	CHECK(p2.call_id == zcore_callid::getrowcount && p2.count == 42);
+
+	/* A short batch response is refused as a whole */
+	CHECK(rpc_ext_pull_batch(&body, 2, reqs, resps, ok) != pack_result::ok);
+	free(out.pb);
+	return EXIT_SUCCESS;
+}
+
+int main()
+{
+	auto ret = t_batch();
+	for (auto p : g_allocs)
+		free(p);
+	return ret;
+}
@@ -0,0 +1,68 @@
+// SPDX-License-Identifier: AGPL-3.0-or-later
+// SPDX-FileCopyrightText: 2025 grommunio GmbH
+// This file is part of Gromox.
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <libHX/option.h>
+#include <libHX/scope.hpp>
+#include <libHX/string.h>
+#include <gromox/util.hpp>
+#include "exch/exmdb/cidpool.hpp"
+
+using namespace gromox;
+
+static constexpr int MB = 1048576;
+static unsigned int g_dry_run;
+static constexpr HXoption g_options_table[] = {
+	{nullptr, 'n', HXTYPE_NONE, &g_dry_run, nullptr, nullptr, 0, "Dry run (gc: only report)"},
+	HXOPT_AUTOHELP,
+	HXOPT_TABLEEND,
+};
+
+static double ratio(double a, double b) { return b == 0 ? NAN : a / b; }
+static double ratio_sav(double a, double b) { return a == 0 ? NAN : 100 - b * 100 / a; }
+
+static void stat_dump(const cidpool_stat &s)
+{
+	printf("%-30s  %10llu\n", "Objects in use", s.objects);
+	printf("%-30s  %10llu\n", "References from stores", s.refs);
+	printf("%-30s  %10llu MB\n", "Size as seen by stores", s.logical / MB);
+	printf("%-30s  %10llu MB  (%llu MB allocated)\n", "Size in pool",
+		s.stored / MB, s.stored_pad / MB);
+	printf("%-30s  %10.3f x\n", "Dedup ratio", ratio(s.logical, s.stored));
+	printf("%-30s  %10.1f %%\n", "Dedup savings", ratio_sav(s.logical, s.stored));
+	printf("%-30s  %10llu  (%llu MB allocated)\n", "Orphaned objects",
+		s.orphans, s.orphan_size / MB);
+}
+
+int main(int argc, char **argv)
+{
+	setvbuf(stdout, nullptr, _IOLBF, 0);
+	if (HX_getopt5(g_options_table, argv, &argc, &argv,
+	    HXOPT_USAGEONERR) != HXOPT_ERR_SUCCESS)
+		return EXIT_FAILURE;
+	auto cl_0 = HX::make_scope_exit([=]() { HX_zvecfree(argv); });
+	if (argc != 3) {
+		fprintf(stderr, "Usage: gromox-cidpool [-n] {stat|gc} POOLDIR\n");
+		return EXIT_FAILURE;
+	}
+	bool gc;
+	if (strcmp(argv[1], "stat") == 0) {
+		gc = false;
+	} else if (strcmp(argv[1], "gc") == 0) {
+		gc = true;
+	} else {
+		fprintf(stderr, "Unknown command \"%s\"\n", argv[1]);
+		return EXIT_FAILURE;
+	}
+	cidpool_stat st;
+	if (cidpool_walk(argv[2], gc, g_dry_run, st) != 0)
+		return EXIT_FAILURE;
+	stat_dump(st);
+	if (gc && !g_dry_run)
+		printf("%-30s  %10llu\n", "Reclaimed", st.reclaimed);
+	return EXIT_SUCCESS;
+}